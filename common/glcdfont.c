@@ -16,12 +16,11 @@ BSD license, check license.txt for more information
 All text above, and the splash screen below must be included in any redistribution
 *********************************************************************/
 
-#ifndef FONT5X7_H
-#define FONT5X7_H
+#include "glcdfont.h"
 
 // Standard ASCII 5x7 font
 
-static const unsigned char font[] = {
+const unsigned char font[] = {
         0x00, 0x00, 0x00, 0x00, 0x00,
 	0x40, 0x00, 0x40, 0x00, 0x40,
 	0x3E, 0x6B, 0x4F, 0x6B, 0x3E,
@@ -278,4 +277,3 @@ static const unsigned char font[] = {
 	0x00, 0x3C, 0x3C, 0x3C, 0x3C,
 	0x00, 0x00, 0x00, 0x00, 0x00
 };
-#endif // FONT5X7_H
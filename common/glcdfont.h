@@ -0,0 +1,29 @@
+/*********************************************************************
+This is a library for our Monochrome OLEDs based on SSD1306 drivers
+
+  Pick one up today in the adafruit shop!
+  ------> http://www.adafruit.com/category/63_98
+
+These displays use SPI to communicate, 4 or 5 pins are required to
+interface
+
+Adafruit invests time and resources providing this open source code,
+please support Adafruit and open-source hardware by purchasing
+products from Adafruit!
+
+Written by Limor Fried/Ladyada  for Adafruit Industries.
+BSD license, check license.txt for more information
+All text above, and the splash screen below must be included in any redistribution
+*********************************************************************/
+
+#ifndef FONT5X7_H
+#define FONT5X7_H
+
+// Standard ASCII 5x7 font, 5 columns of 8 pixels per character (least
+// significant bit on top). Shared with the STM32 for the glyph jobs, see
+// nsec_job.h.
+#define GLCDFONT_COLUMNS 5
+
+extern const unsigned char font[];
+
+#endif // FONT5X7_H
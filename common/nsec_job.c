@@ -0,0 +1,210 @@
+//
+//  nsec_job.c
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#include "nsec_job.h"
+#include "glcdfont.h"
+
+#include <string.h>
+
+static int16_t nsec_job_inflate(const uint8_t * input, uint8_t length, uint8_t * output) {
+    uint16_t in = 0;
+    uint16_t out = 0;
+    while(in < length) {
+        uint8_t token = input[in++];
+        if(token < 0x80) {
+            uint16_t count = token + 1;
+            if(in + count > length || out + count > NSEC_JOB_MAX_OUTPUT) {
+                return NSEC_JOB_FAILED;
+            }
+            memcpy(output + out, input + in, count);
+            in += count;
+            out += count;
+        }
+        else {
+            if(in >= length) {
+                return NSEC_JOB_FAILED;
+            }
+            uint16_t count = ((token >> 4) & 0x07) + 3;
+            uint16_t distance = ((token & 0x0F) << 8 | input[in++]) + 1;
+            if(distance > out || out + count > NSEC_JOB_MAX_OUTPUT) {
+                return NSEC_JOB_FAILED;
+            }
+            // One byte at a time, a copy may overlap what it writes
+            for(uint16_t i = 0; i < count; i++, out++) {
+                output[out] = output[out - distance];
+            }
+        }
+    }
+    return out;
+}
+
+static int16_t nsec_job_layout(const uint8_t * input, uint8_t length, uint8_t * output) {
+    if(length < 1 || input[0] == 0) {
+        return NSEC_JOB_FAILED;
+    }
+    uint8_t width = input[0];
+    const uint8_t * text = input + 1;
+    uint8_t text_length = length - 1;
+    int16_t lines = 0;
+    uint8_t start = 0;
+    while(start < text_length) {
+        if(text[start] == ' ') {
+            start++;
+            continue;
+        }
+        output[lines++] = start;
+        uint8_t end = start;
+        uint8_t last_space = start;
+        while(end < text_length && end - start < width && text[end] != '\n') {
+            if(text[end] == ' ') {
+                last_space = end;
+            }
+            end++;
+        }
+        if(end < text_length && text[end] == '\n') {
+            start = end + 1;
+        }
+        else if(end < text_length && text[end] != ' ' && last_space > start) {
+            // The word does not fit, it starts the next line
+            start = last_space + 1;
+        }
+        else {
+            start = end;
+        }
+    }
+    return lines;
+}
+
+static uint8_t nsec_job_reverse_bits(uint8_t byte) {
+    byte = (byte & 0xF0) >> 4 | (byte & 0x0F) << 4;
+    byte = (byte & 0xCC) >> 2 | (byte & 0x33) << 2;
+    return (byte & 0xAA) >> 1 | (byte & 0x55) << 1;
+}
+
+static int16_t nsec_job_glyphs(const uint8_t * input, uint8_t length, uint8_t * output) {
+    if(length < 1 || (length - 1) * NSEC_JOB_GLYPH_COLUMNS > NSEC_JOB_MAX_OUTPUT) {
+        return NSEC_JOB_FAILED;
+    }
+    bool rotated = input[0] & NSEC_JOB_GLYPHS_ROTATED;
+    int16_t size = (length - 1) * NSEC_JOB_GLYPH_COLUMNS;
+    for(uint8_t i = 1; i < length; i++) {
+        const uint8_t * glyph = font + input[i] * GLCDFONT_COLUMNS;
+        for(uint8_t column = 0; column < NSEC_JOB_GLYPH_COLUMNS; column++) {
+            uint8_t byte = column < GLCDFONT_COLUMNS ? glyph[column] : 0;
+            int16_t index = (i - 1) * NSEC_JOB_GLYPH_COLUMNS + column;
+            if(rotated) {
+                output[size - 1 - index] = nsec_job_reverse_bits(byte);
+            }
+            else {
+                output[index] = byte;
+            }
+        }
+    }
+    return size;
+}
+
+static int16_t nsec_job_delta(const uint8_t * input, uint8_t length, uint8_t * output) {
+    if(length % 2 != 0) {
+        return NSEC_JOB_FAILED;
+    }
+    uint8_t count = length / 2;
+    const uint8_t * shown = input;
+    const uint8_t * wanted = input + count;
+    int16_t size = 0;
+    for(uint8_t column = 0; column < count; column++) {
+        if(shown[column] == wanted[column]) {
+            continue;
+        }
+        if(size > 0 && column - (output[size - 2] + output[size - 1]) < NSEC_JOB_DELTA_MERGE_GAP) {
+            output[size - 1] = column + 1 - output[size - 2];
+        }
+        else {
+            output[size++] = column;
+            output[size++] = 1;
+        }
+    }
+    return size;
+}
+
+int16_t nsec_job_run(uint8_t type, const uint8_t * input, uint8_t length, uint8_t * output) {
+    if(length > NSEC_JOB_MAX_INPUT) {
+        return NSEC_JOB_FAILED;
+    }
+    switch (type) {
+        case NSEC_JOB_INFLATE:
+            return nsec_job_inflate(input, length, output);
+        case NSEC_JOB_LAYOUT:
+            return nsec_job_layout(input, length, output);
+        case NSEC_JOB_GLYPHS:
+            return nsec_job_glyphs(input, length, output);
+        case NSEC_JOB_DELTA:
+            return nsec_job_delta(input, length, output);
+        default:
+            return NSEC_JOB_FAILED;
+    }
+}
+
+static uint8_t nsec_job_message_size(const nsec_job_message_t * message) {
+    return NSEC_JOB_HEADER_SIZE + message->data[0];
+}
+
+void nsec_job_message_set(nsec_job_message_t * message, uint8_t id, uint8_t kind, uint16_t extra,
+                          const uint8_t * body, uint8_t length) {
+    message->id = id;
+    message->length = 0;
+    message->data[0] = length;
+    message->data[1] = kind;
+    message->data[2] = extra >> 8;
+    message->data[3] = extra & 0xFF;
+    memcpy(message->data + NSEC_JOB_HEADER_SIZE, body, length);
+}
+
+bool nsec_job_message_sent(const nsec_job_message_t * message) {
+    return message->length >= nsec_job_message_size(message);
+}
+
+uint8_t nsec_job_message_next(nsec_job_message_t * message, uint8_t * record, uint8_t space) {
+    if(nsec_job_message_sent(message) || space <= NSEC_JOB_RECORD_HEADER_SIZE) {
+        return 0;
+    }
+    uint8_t count = nsec_job_message_size(message) - message->length;
+    if(count > space - NSEC_JOB_RECORD_HEADER_SIZE) {
+        count = space - NSEC_JOB_RECORD_HEADER_SIZE;
+    }
+    if(count > NSEC_JOB_CHUNK_SIZE) {
+        count = NSEC_JOB_CHUNK_SIZE;
+    }
+    record[0] = message->id;
+    record[1] = message->length;
+    memcpy(record + NSEC_JOB_RECORD_HEADER_SIZE, message->data + message->length, count);
+    message->length += count;
+    return NSEC_JOB_RECORD_HEADER_SIZE + count;
+}
+
+bool nsec_job_message_receive(nsec_job_message_t * message, const uint8_t * record, uint8_t length) {
+    if(length <= NSEC_JOB_RECORD_HEADER_SIZE) {
+        return false;
+    }
+    uint8_t id = record[0];
+    uint8_t offset = record[1];
+    uint8_t count = length - NSEC_JOB_RECORD_HEADER_SIZE;
+    if(offset == 0) {
+        message->id = id;
+        message->length = 0;
+    }
+    else if(id != message->id || offset != message->length) {
+        return false;
+    }
+    if(message->length + count > sizeof(message->data)) {
+        message->length = 0;
+        return false;
+    }
+    memcpy(message->data + message->length, record + NSEC_JOB_RECORD_HEADER_SIZE, count);
+    message->length += count;
+    return message->length >= NSEC_JOB_HEADER_SIZE && message->data[0] <= NSEC_JOB_MAX_INPUT &&
+           message->length == nsec_job_message_size(message);
+}
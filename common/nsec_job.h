@@ -0,0 +1,89 @@
+//
+//  nsec_job.h
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#ifndef nsec_job_h
+#define nsec_job_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nsec_link.h"
+
+// Work the nRF can do itself or hand to the STM32, both run the same code.
+// The nRF times both ways and picks the faster one, see nsec_offload.h.
+//
+// A job goes over the link in NSEC_LINK_RECORD_JOB records, its result
+// comes back in NSEC_LINK_RECORD_JOB_RESULT records. Each record is the job
+// id, the offset in the message, then up to NSEC_JOB_CHUNK_SIZE bytes of
+// it. A message is a header (length of what follows it, type or status,
+// 16 bits), then the input or the output:
+//
+//   job     length, type, 0 (16 bits), input
+//   result  length, status, time the STM32 took in microseconds (16 bits,
+//           big endian), output
+
+enum nsec_job_type {
+    // Text compressed as below, to at most NSEC_JOB_MAX_OUTPUT bytes. Each
+    // token is a byte:
+    //   0x00 to 0x7F  token + 1 bytes follow, copied as they are
+    //   0x80 to 0xFF  ((token >> 4) & 0x07) + 3 bytes copied from
+    //                 ((token & 0x0F) << 8 | next byte) + 1 bytes back
+    NSEC_JOB_INFLATE    = 1,
+    // Input: width in characters, then the text. Output: the offset in the
+    // text of each line, words wrapped, longer ones cut. A newline ends a
+    // line, spaces at the start of a line are skipped.
+    NSEC_JOB_LAYOUT     = 2,
+    // Input: NSEC_JOB_GLYPHS_ flags, then the text. Output: the columns of
+    // the characters as the display takes them, one byte per column of a
+    // page, 6 columns per character.
+    NSEC_JOB_GLYPHS     = 3,
+    // Input: a span of a page as shown, then as it should be (same length).
+    // Output: column and count of each run of columns that changed, runs
+    // closer than NSEC_JOB_DELTA_MERGE_GAP merged.
+    NSEC_JOB_DELTA      = 4,
+};
+
+#define NSEC_JOB_TYPE_COUNT         5   // Including the unused 0
+#define NSEC_JOB_MAX_INPUT          128
+#define NSEC_JOB_MAX_OUTPUT         128
+#define NSEC_JOB_FAILED             (-1)
+
+#define NSEC_JOB_GLYPHS_ROTATED     (1 << 0) // Turned 180 degrees, columns and bits in reverse
+#define NSEC_JOB_GLYPH_COLUMNS      6
+#define NSEC_JOB_DELTA_MERGE_GAP    4
+
+#define NSEC_JOB_STATUS_OK          0
+#define NSEC_JOB_STATUS_FAILED      1   // Bad input or unknown type
+
+#define NSEC_JOB_HEADER_SIZE        4
+#define NSEC_JOB_MAX_MESSAGE        (NSEC_JOB_HEADER_SIZE + NSEC_JOB_MAX_INPUT)
+#define NSEC_JOB_RECORD_HEADER_SIZE 2
+#define NSEC_JOB_CHUNK_SIZE         (NSEC_LINK_MAX_PAYLOAD - NSEC_LINK_RECORD_HEADER_SIZE - NSEC_JOB_RECORD_HEADER_SIZE)
+
+// A job or a result, sent or received a record at a time
+typedef struct {
+    uint8_t id;
+    uint8_t length;             // Sent or received so far
+    uint8_t data[NSEC_JOB_MAX_MESSAGE];
+} nsec_job_message_t;
+
+// Returns the output length, NSEC_JOB_FAILED for bad input or an unknown
+// type. The output has room for NSEC_JOB_MAX_OUTPUT bytes.
+int16_t nsec_job_run(uint8_t type, const uint8_t * input, uint8_t length, uint8_t * output);
+
+// Header and body, ready to send from the start
+void nsec_job_message_set(nsec_job_message_t * message, uint8_t id, uint8_t kind, uint16_t extra,
+                          const uint8_t * body, uint8_t length);
+bool nsec_job_message_sent(const nsec_job_message_t * message);
+// Writes the next record of the message, returns its length, 0 when the
+// message is sent or when space is too short
+uint8_t nsec_job_message_next(nsec_job_message_t * message, uint8_t * record, uint8_t space);
+// Adds a record to the message, true once it is complete. A record of
+// another message starting replaces it, one out of place is dropped.
+bool nsec_job_message_receive(nsec_job_message_t * message, const uint8_t * record, uint8_t length);
+
+#endif /* nsec_job_h */
@@ -0,0 +1,165 @@
+//
+//  nsec_link.c
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#include "nsec_link.h"
+
+#include <string.h>
+
+uint16_t nsec_link_crc16(const uint8_t * data, uint16_t length) {
+    uint16_t crc = 0xFFFF;
+    for(uint16_t i = 0; i < length; i++) {
+        crc ^= (uint16_t) data[i] << 8;
+        for(uint8_t bit = 0; bit < 8; bit++) {
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+
+void nsec_link_init(nsec_link_t * link) {
+    memset(link, 0, sizeof(*link));
+}
+
+bool nsec_link_add_record(nsec_link_t * link, uint8_t type, const void * data, uint8_t length) {
+    if(link->tx_in_flight ||
+       link->tx_length + NSEC_LINK_RECORD_HEADER_SIZE + length > NSEC_LINK_MAX_PAYLOAD) {
+        return false;
+    }
+    uint8_t * record = &link->tx_payload[link->tx_length];
+    record[0] = type;
+    record[1] = length;
+    memcpy(record + NSEC_LINK_RECORD_HEADER_SIZE, data, length);
+    link->tx_length += NSEC_LINK_RECORD_HEADER_SIZE + length;
+    return true;
+}
+
+uint8_t nsec_link_record_space(const nsec_link_t * link) {
+    uint8_t used = link->tx_length + NSEC_LINK_RECORD_HEADER_SIZE;
+    if(link->tx_in_flight || used >= NSEC_LINK_MAX_PAYLOAD) {
+        return 0;
+    }
+    return NSEC_LINK_MAX_PAYLOAD - used;
+}
+
+static uint8_t nsec_link_write_frame(nsec_link_t * link, uint8_t * frame, uint8_t seq,
+                                     const uint8_t * payload, uint8_t length, bool more) {
+    frame[0] = NSEC_LINK_SOF;
+    frame[1] = length;
+    frame[2] = seq;
+    frame[3] = link->rx_seq;
+    frame[4] = (link->rx_valid ? NSEC_LINK_FLAG_ACK_VALID : 0) |
+               (more || link->tx_in_flight ? NSEC_LINK_FLAG_PENDING : 0) |
+               (link->hold ? NSEC_LINK_FLAG_HOLD : 0) |
+               (link->rx_any ? 0 : NSEC_LINK_FLAG_RESET);
+    memcpy(frame + NSEC_LINK_HEADER_SIZE, payload, length);
+    uint16_t crc = nsec_link_crc16(frame + 1, NSEC_LINK_HEADER_SIZE - 1 + length);
+    frame[NSEC_LINK_HEADER_SIZE + length] = crc >> 8;
+    frame[NSEC_LINK_HEADER_SIZE + length + 1] = crc & 0xFF;
+    memset(frame + NSEC_LINK_HEADER_SIZE + length + NSEC_LINK_CRC_SIZE, 0,
+           NSEC_LINK_MAX_PAYLOAD - length);
+    link->ack_owed = false;
+    return length;
+}
+
+uint8_t nsec_link_build(nsec_link_t * link, uint8_t * frame, bool more) {
+    if(link->tx_in_flight && link->tx_exchanges >= 2) {
+        if(link->tx_retries >= NSEC_LINK_MAX_RETRIES) {
+            link->tx_in_flight = false;
+            link->tx_length = 0;
+            link->stats.frames_dropped++;
+        }
+        else {
+            link->tx_retries++;
+            link->tx_exchanges = 0;
+            link->stats.retransmits++;
+            return nsec_link_write_frame(link, frame, link->tx_seq, link->tx_payload, link->tx_length, more);
+        }
+    }
+    if(!link->tx_in_flight && link->tx_length > 0) {
+        link->tx_seq = link->tx_next_seq;
+        link->tx_next_seq = link->tx_seq == 0xFF ? 1 : link->tx_seq + 1;
+        link->tx_in_flight = true;
+        link->tx_retries = 0;
+        link->tx_exchanges = 0;
+        link->stats.frames_sent++;
+        return nsec_link_write_frame(link, frame, link->tx_seq, link->tx_payload, link->tx_length, more);
+    }
+    // Nothing new, or waiting for the ack: an empty frame carries our ack
+    return nsec_link_write_frame(link, frame, link->tx_seq, NULL, 0, more);
+}
+
+static void nsec_link_dispatch(const uint8_t * payload, uint8_t length, nsec_link_record_handler_t handler) {
+    uint8_t offset = 0;
+    while(offset + NSEC_LINK_RECORD_HEADER_SIZE <= length) {
+        uint8_t type = payload[offset];
+        uint8_t record_length = payload[offset + 1];
+        offset += NSEC_LINK_RECORD_HEADER_SIZE;
+        if(offset + record_length > length) {
+            return;
+        }
+        handler(type, payload + offset, record_length);
+        offset += record_length;
+    }
+}
+
+bool nsec_link_receive(nsec_link_t * link, const uint8_t * frame, nsec_link_record_handler_t handler) {
+    if(link->tx_in_flight && link->tx_exchanges < UINT8_MAX) {
+        link->tx_exchanges++;
+    }
+
+    uint8_t length = frame[1];
+    if(frame[0] != NSEC_LINK_SOF || length > NSEC_LINK_MAX_PAYLOAD) {
+        link->stats.bad_frames++;
+        return false;
+    }
+    uint16_t crc = frame[NSEC_LINK_HEADER_SIZE + length] << 8 | frame[NSEC_LINK_HEADER_SIZE + length + 1];
+    if(crc != nsec_link_crc16(frame + 1, NSEC_LINK_HEADER_SIZE - 1 + length)) {
+        link->stats.bad_frames++;
+        return false;
+    }
+
+    uint8_t seq = frame[2];
+    uint8_t ack = frame[3];
+    if((frame[4] & NSEC_LINK_FLAG_RESET) && !(link->peer_flags & NSEC_LINK_FLAG_RESET)) {
+        // The peer reset, whatever it sent before is gone
+        link->rx_valid = false;
+    }
+    link->rx_any = true;
+    link->peer_flags = frame[4];
+    if(link->tx_in_flight && (link->peer_flags & NSEC_LINK_FLAG_ACK_VALID) && ack == link->tx_seq) {
+        link->tx_in_flight = false;
+        link->tx_length = 0;
+    }
+
+    if(length == 0) {
+        return true;
+    }
+    link->ack_owed = true;
+    // A reset sends sequence 0 first, the regular sequence skips it
+    if(link->rx_valid && seq == link->rx_seq) {
+        link->stats.duplicates++;
+        return true;
+    }
+    link->rx_valid = true;
+    link->rx_seq = seq;
+    link->stats.frames_received++;
+    nsec_link_dispatch(frame + NSEC_LINK_HEADER_SIZE, length, handler);
+    return true;
+}
+
+bool nsec_link_wants_exchange(const nsec_link_t * link) {
+    return link->tx_in_flight || link->tx_length > 0 || link->ack_owed ||
+           (link->peer_flags & NSEC_LINK_FLAG_PENDING);
+}
+
+void nsec_link_set_hold(nsec_link_t * link, bool hold) {
+    link->hold = hold;
+}
+
+bool nsec_link_peer_holds(const nsec_link_t * link) {
+    return (link->peer_flags & NSEC_LINK_FLAG_HOLD) != 0;
+}
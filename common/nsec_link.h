@@ -0,0 +1,122 @@
+//
+//  nsec_link.h
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#ifndef nsec_link_h
+#define nsec_link_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Frames exchanged on the SPI link between the STM32 (master) and the nRF
+// (slave). Every transfer is one frame each way, always NSEC_LINK_FRAME_SIZE
+// bytes on the wire:
+//
+//   SOF | length | sequence | ack | flags | payload (length bytes) | CRC16
+//
+// The payload is a batch of records, each one a type, a length and its data.
+// The CRC (CCITT, big endian) covers everything from the length to the end
+// of the payload, the rest of the frame is padding.
+//
+// A frame with a payload is sent again until the other side acks its
+// sequence number. Since both directions move in the same transfer, the ack
+// for a frame is only seen two transfers later; the frame in between is
+// an empty one. Sequence 0 is only used by the first frame after a reset.
+// Frames carry NSEC_LINK_FLAG_RESET until their sender has received one: a
+// peer that starts sending it again has reset, its sequence starts over and
+// its next frame is not taken for a duplicate of the one before the reset.
+
+#define NSEC_LINK_FRAME_SIZE          32
+#define NSEC_LINK_SOF                 0xA5
+#define NSEC_LINK_HEADER_SIZE         5
+#define NSEC_LINK_CRC_SIZE            2
+#define NSEC_LINK_MAX_PAYLOAD         (NSEC_LINK_FRAME_SIZE - NSEC_LINK_HEADER_SIZE - NSEC_LINK_CRC_SIZE)
+#define NSEC_LINK_RECORD_HEADER_SIZE  2
+#define NSEC_LINK_MAX_RETRIES         3
+
+#define NSEC_LINK_FLAG_ACK_VALID      (1 << 0) // The sender has accepted a frame since its reset
+#define NSEC_LINK_FLAG_PENDING        (1 << 1) // The sender has more to send, or waits for an ack
+#define NSEC_LINK_FLAG_HOLD           (1 << 2) // The sender is short of room, bulk records should wait
+#define NSEC_LINK_FLAG_RESET          (1 << 3) // The sender has received nothing since its reset
+
+enum nsec_link_record {
+    // STM32 -> nRF: age in microseconds (16 bits), touch event, touch button
+    NSEC_LINK_RECORD_TOUCH              = 0x01,
+    // STM32 -> nRF: display stream bytes from the host (see display_stream.h)
+    NSEC_LINK_RECORD_DISPLAY_DATA       = 0x02,
+    // STM32 -> nRF: content bundle bytes from the host (see nsec_provision.h),
+    // an empty one starts a new session
+    NSEC_LINK_RECORD_PROVISION_DATA     = 0x03,
+    // STM32 -> nRF: part of the result of a job (see nsec_job.h)
+    NSEC_LINK_RECORD_JOB_RESULT         = 0x04,
+    // nRF -> STM32: touch channel, threshold in percent, debounce samples
+    NSEC_LINK_RECORD_TOUCH_CONFIG       = 0x10,
+    // nRF -> STM32: touch channel, NSEC_LINK_ALL_CHANNELS for all of them
+    NSEC_LINK_RECORD_TOUCH_RECALIBRATE  = 0x11,
+    // nRF -> STM32: bytes for the USB serial port
+    NSEC_LINK_RECORD_USB_DATA           = 0x12,
+    // nRF -> STM32: display stream counters, see NSEC_LINK_DISPLAY_STATS_SIZE
+    NSEC_LINK_RECORD_DISPLAY_STATS      = 0x13,
+    // nRF -> STM32: part of a job to run (see nsec_job.h)
+    NSEC_LINK_RECORD_JOB                = 0x14,
+};
+
+#define NSEC_LINK_TOUCH_RECORD_SIZE   4
+// 0xFFFF is left for an unknown age
+#define NSEC_LINK_TOUCH_AGE_MAX       0xFFFE
+#define NSEC_LINK_ALL_CHANNELS        0xFF
+// Frames shown (32 bits), frames dropped (32 bits), decode errors (16 bits),
+// frames per second times 10 (16 bits), all big endian
+#define NSEC_LINK_DISPLAY_STATS_SIZE  12
+
+typedef struct {
+    uint32_t frames_sent;       // With a payload, retransmits not included
+    uint32_t frames_received;   // With a payload, duplicates not included
+    uint32_t retransmits;
+    uint32_t frames_dropped;    // Not acked after NSEC_LINK_MAX_RETRIES retransmits
+    uint32_t bad_frames;        // Wrong start, length or CRC
+    uint32_t duplicates;        // Received again, the ack got lost
+} nsec_link_stats_t;
+
+typedef struct {
+    uint8_t tx_payload[NSEC_LINK_MAX_PAYLOAD];
+    uint8_t tx_length;
+    uint8_t tx_seq;             // Of the frame in flight
+    uint8_t tx_next_seq;
+    bool tx_in_flight;          // The payload is locked until acked or dropped
+    uint8_t tx_retries;
+    uint8_t tx_exchanges;       // Frames received since it was last sent
+    bool rx_valid;
+    uint8_t rx_seq;             // Last frame accepted
+    bool rx_any;                // A frame was received since the reset
+    bool ack_owed;              // A payload was received since the last frame built
+    bool hold;                  // Ask the other side to hold its bulk records
+    uint8_t peer_flags;
+    nsec_link_stats_t stats;
+} nsec_link_t;
+
+typedef void (*nsec_link_record_handler_t)(uint8_t type, const uint8_t * data, uint8_t length);
+
+void nsec_link_init(nsec_link_t * link);
+// Fails when a frame is in flight or when the record does not fit in it
+bool nsec_link_add_record(nsec_link_t * link, uint8_t type, const void * data, uint8_t length);
+// Data bytes a record added now can hold, 0 when none can be added
+uint8_t nsec_link_record_space(const nsec_link_t * link);
+// Writes the next NSEC_LINK_FRAME_SIZE bytes to send, more tells the other
+// side there is still something queued. Returns the payload length.
+uint8_t nsec_link_build(nsec_link_t * link, uint8_t * frame, bool more);
+// Handles a frame received, the records of a new payload go to the handler.
+// Returns false for a bad frame.
+bool nsec_link_receive(nsec_link_t * link, const uint8_t * frame, nsec_link_record_handler_t handler);
+// Something to send or an ack to give, or the other side has
+bool nsec_link_wants_exchange(const nsec_link_t * link);
+// Sent with every frame built from now on
+void nsec_link_set_hold(nsec_link_t * link, bool hold);
+// As of the last frame received
+bool nsec_link_peer_holds(const nsec_link_t * link);
+uint16_t nsec_link_crc16(const uint8_t * data, uint16_t length);
+
+#endif /* nsec_link_h */
@@ -11,7 +11,6 @@
 #include "ble/nsec_ble.h"
 #include "ssd1306.h"
 #include "controls.h"
-#include "app_glue.h"
 
 #include <string.h>
 #include <stdbool.h>
@@ -19,11 +18,7 @@
 #include <nrf_soc.h>
 #include <app_timer.h>
 
-#include "images/beer_icon_bitmap.c"
-#include "images/socal_icon_bitmap.c"
-#include "images/poo_icon_bitmap.c"
-#include "images/animal_1_bitmap.c"
-#include "images/nsec_logo_tiny_bitmap.c"
+#include "images/animal_scene.c"
 #include "images/cat_eye_bitmap.c"
 #include "images/cat_eye_closed_bitmap.c"
 #include "images/cat_eye_dead_bitmap.c"
@@ -56,7 +51,7 @@ static void animal_ble_callback(nsec_ble_service_handle service, uint16_t char_u
 static void animal_ui_draw_caca(uint8_t x, uint8_t y);
 static void animal_ui_draw_name(void);
 static void animal_ui_redraw_all(void);
-static void animal_button_handler(button_t button);
+static bool animal_button_handler(button_t button);
 
 const uint8_t animal_ble_uuid[16] = { 0x58, 0x8E, 0xBB, 0x09, 0x04, 0xE2, 0x49, 0x69, 0xB3, 0x36, 0x7C, 0xE7, 0xF6, 0xFE, 0xB3, 0x77 };
 enum {
@@ -68,13 +63,22 @@ enum {
     ANIMAL_CHAR_UUID_IS_UNLOCKED,
     ANIMAL_CHAR_UUID_IS_DEAD,
 };
-
-static bool _is_showing = false;
+// Order of the characteristics in the service
+enum {
+    ANIMAL_CHAR_NAME,
+    ANIMAL_CHAR_SEC_TO_BEER_DEATH,
+    ANIMAL_CHAR_SEC_TO_SOCIAL_DEATH,
+    ANIMAL_CHAR_CACA_COUNT,
+    ANIMAL_CHAR_UNLOCK_KEY,
+    ANIMAL_CHAR_IS_UNLOCKED,
+    ANIMAL_CHAR_IS_DEAD,
+    ANIMAL_CHAR_COUNT,
+};
 
 const char animal_unlock_password[] = "L33t h4x0r k3y";
 
-#define UPDATE_BLE_CHARACTERISTIC(uuid, field) \
-    nsec_ble_set_charateristic_value(animal_ble_handle, uuid, &field, sizeof(field))
+#define UPDATE_BLE_CHARACTERISTIC(index, field) \
+    nsec_ble_set_charateristic_value_at(animal_ble_handle, index, &field, sizeof(field))
 
 #define DRAW_BITMAP(x, y, image) \
     gfx_drawBitmapBg(x, y, image ## _bitmap, image ## _bitmap_width, image ## _bitmap_height, WHITE, BLACK);
@@ -96,32 +100,32 @@ void animal_init(void) {
     animal_state_reset();
     app_timer_create(&animal_timer, APP_TIMER_MODE_REPEATED, animal_each_second);
     app_timer_start(animal_timer, APP_TIMER_TICKS(1000, 0), &animal_state);
-    nsec_ble_characteristic_t c[] = {
-        {
+    nsec_ble_characteristic_t c[ANIMAL_CHAR_COUNT] = {
+        [ANIMAL_CHAR_NAME] = {
             .char_uuid = ANIMAL_CHAR_UUID_NAME,
-            .permissions = NSEC_BLE_CHARACT_PERM_RW,
+            .permissions = NSEC_BLE_CHARACT_PERM_RW | NSEC_BLE_CHARACT_PERM_WRITE_NO_RESPONSE,
             .on_write = animal_ble_callback,
-        }, {
+        }, [ANIMAL_CHAR_SEC_TO_BEER_DEATH] = {
             .char_uuid = ANIMAL_CHAR_UUID_SEC_TO_BEER_DEATH,
-            .permissions = NSEC_BLE_CHARACT_PERM_RW,
+            .permissions = NSEC_BLE_CHARACT_PERM_RW | NSEC_BLE_CHARACT_PERM_WRITE_NO_RESPONSE,
             .on_write = animal_ble_callback,
-        }, {
+        }, [ANIMAL_CHAR_SEC_TO_SOCIAL_DEATH] = {
             .char_uuid = ANIMAL_CHAR_UUID_SEC_TO_SOCIAL_DEATH,
-            .permissions = NSEC_BLE_CHARACT_PERM_RW,
+            .permissions = NSEC_BLE_CHARACT_PERM_RW | NSEC_BLE_CHARACT_PERM_WRITE_NO_RESPONSE,
             .on_write = animal_ble_callback,
-        }, {
+        }, [ANIMAL_CHAR_CACA_COUNT] = {
             .char_uuid = ANIMAL_CHAR_UUID_CACA_COUNT,
             .permissions = NSEC_BLE_CHARACT_PERM_READ,
             .on_write = animal_ble_callback,
-        }, {
+        }, [ANIMAL_CHAR_UNLOCK_KEY] = {
             .char_uuid = ANIMAL_CHAR_UUID_UNLOCK_KEY,
-            .permissions = NSEC_BLE_CHARACT_PERM_RW,
+            .permissions = NSEC_BLE_CHARACT_PERM_RW | NSEC_BLE_CHARACT_PERM_WRITE_NO_RESPONSE,
             .on_write = animal_ble_callback,
-        }, {
+        }, [ANIMAL_CHAR_IS_UNLOCKED] = {
             .char_uuid = ANIMAL_CHAR_UUID_IS_UNLOCKED,
             .permissions = NSEC_BLE_CHARACT_PERM_READ,
             .on_write = animal_ble_callback,
-        }, {
+        }, [ANIMAL_CHAR_IS_DEAD] = {
             .char_uuid = ANIMAL_CHAR_UUID_IS_DEAD,
             .permissions = NSEC_BLE_CHARACT_PERM_READ,
             .on_write = animal_ble_callback,
@@ -133,11 +137,10 @@ void animal_init(void) {
     };
     memcpy(srv.uuid, animal_ble_uuid, sizeof(srv.uuid));
     nsec_ble_register_vendor_service(&srv, &animal_ble_handle);
-    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_UUID_NAME, animal_state.name);
-    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_UUID_CACA_COUNT, animal_state.caca_count);
-    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_UUID_IS_DEAD, animal_state.is_dead);
-    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_UUID_IS_UNLOCKED, animal_state.unlocked);
-    nsec_controls_add_handler(animal_button_handler);
+    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_NAME, animal_state.name);
+    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_CACA_COUNT, animal_state.caca_count);
+    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_IS_DEAD, animal_state.is_dead);
+    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_IS_UNLOCKED, animal_state.unlocked);
 }
 
 static void animal_each_second(void * context) {
@@ -145,9 +148,9 @@ static void animal_each_second(void * context) {
         return;
     }
     animal_state.sec_to_beer_death -= 1;
-    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_UUID_SEC_TO_BEER_DEATH, animal_state.sec_to_beer_death);
+    UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_SEC_TO_BEER_DEATH, animal_state.sec_to_beer_death);
     //animal_state.sec_to_social_death -= 1;
-    //UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_UUID_SEC_TO_SOCIAL_DEATH, animal_state.sec_to_social_death);
+    //UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_SEC_TO_SOCIAL_DEATH, animal_state.sec_to_social_death);
     animal_state.sec_to_next_caca -= 1;
     animal_state.sec_lived += 1;
 
@@ -161,7 +164,7 @@ static void animal_each_second(void * context) {
                             animal_state.caca_locations[animal_state.caca_count].y);
         animal_state.caca_count += 1;
 
-        UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_UUID_CACA_COUNT, animal_state.caca_count);
+        UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_CACA_COUNT, animal_state.caca_count);
         animal_state.sec_to_next_caca = 60 * 60 * 2;
     }
 
@@ -179,11 +182,11 @@ static void animal_ble_callback(nsec_ble_service_handle service, uint16_t char_u
         case ANIMAL_CHAR_UUID_UNLOCK_KEY: {
             if (strncmp((char*) content, animal_unlock_password, MIN(content_length, strlen(animal_unlock_password))) == 0) {
                 animal_state.unlocked = 1;
-                UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_UUID_IS_UNLOCKED, animal_state.unlocked);
+                UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_IS_UNLOCKED, animal_state.unlocked);
             }
             else {
                 animal_state.unlocked = 0;
-                UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_UUID_IS_UNLOCKED, animal_state.unlocked);
+                UPDATE_BLE_CHARACTERISTIC(ANIMAL_CHAR_IS_UNLOCKED, animal_state.unlocked);
             }
         }
             break;
@@ -207,13 +210,13 @@ static void animal_ble_callback(nsec_ble_service_handle service, uint16_t char_u
     }
 }
 
-void animal_show(void) {
-    _is_showing = true;
-    animal_ui_redraw_all();
-}
+const nsec_screen_t animal_screen = {
+    .draw = animal_ui_redraw_all,
+    .on_button = animal_button_handler,
+};
 
 static void animal_ui_update(void) {
-    if(!_is_showing) {
+    if(!nsec_nav_is_showing(&animal_screen)) {
         return;
     }
     int16_t bar_width = (13 * animal_state.sec_to_beer_death) / (60 * 60 * 12);
@@ -261,37 +264,19 @@ static void animal_ui_update(void) {
 }
 
 static void animal_ui_draw_caca(uint8_t x, uint8_t y) {
-    if(!_is_showing) {
+    if(!nsec_nav_is_showing(&animal_screen)) {
         return;
     }
     gfx_drawBitmap(x, y, poo_bitmap, poo_bitmap_width, poo_bitmap_height, WHITE);
     gfx_drawBitmap(x, y + 10, poo_inside_bitmap, poo_inside_bitmap_width, poo_inside_bitmap_height, BLACK);
 }
 
-static void animal_ui_draw_empty_progress_bar(uint16_t x, uint16_t y) {
-    gfx_drawRect(x, y, 15, 3, BLACK);
-    gfx_drawFastHLine(x + 1, y    , 13, WHITE);
-    gfx_drawFastHLine(x + 1, y + 2, 13, WHITE);
-    gfx_drawFastVLine(x,      y + 1, 1, WHITE);
-    gfx_drawFastVLine(x + 14, y + 1, 1, WHITE);
-}
-
-void animal_ui_redraw_all(void) {
-    if(!_is_showing) {
+static void animal_ui_redraw_all(void) {
+    if(!nsec_nav_is_showing(&animal_screen)) {
         return;
     }
-    gfx_fillRect(0, 8, 128, 56, BLACK);
-    gfx_drawFastHLine(0, 42, 128, WHITE);
-    animal_ui_draw_empty_progress_bar(73, 12);
-    animal_ui_draw_empty_progress_bar(102, 12);
-    //animal_ui_draw_empty_progress_bar(87, 20);
-
-    DRAW_BITMAP(66, 10, beer_icon);
-    //DRAW_BITMAP(95, 11, socal_icon);
-    //DRAW_BITMAP(80, 17, poo_icon);
-    DRAW_BITMAP(95, 11, poo_icon);
-    DRAW_BITMAP(12, 14, animal_1);
-    DRAW_BITMAP(111, 34, nsec_logo_tiny);
+    // Line, empty bars, icons and cat body, see images/animal.scene
+    gfx_blitRows(animal_scene_y, animal_scene_height, animal_scene);
 
     animal_ui_draw_name();
     for(int i = 0; i < animal_state.caca_count; i++) {
@@ -302,7 +287,7 @@ void animal_ui_redraw_all(void) {
 }
 
 static void animal_ui_draw_name(void) {
-    if(!_is_showing) {
+    if(!nsec_nav_is_showing(&animal_screen)) {
         return;
     }
     gfx_fillRect(10, 56, 6*16, 8, BLACK);
@@ -311,31 +296,21 @@ static void animal_ui_draw_name(void) {
     gfx_puts(animal_state.name);
 }
 
-static void animal_button_handler(button_t button) {
-    if(!_is_showing) {
-        return;
-    }
+static bool animal_button_handler(button_t button) {
     switch (button) {
-        case BUTTON_UP:
-            break;
-        case BUTTON_LEFT:
-            break;
-        case BUTTON_DOWN:
-            break;
         case BUTTON_RIGHT:
         case BUTTON_ENTER:
             if(animal_state.caca_count > 0 && !animal_state.is_dead) {
                 animal_state.caca_count--;
                 animal_ui_redraw_all();
             }
-            break;
+            return true;
+
         case BUTTON_BACK:
-            _is_showing = false;
-            show_main_menu();
-            break;
+            // The navigator brings back the main menu
+            return false;
 
         default:
-            break;
+            return true;
     }
 }
-
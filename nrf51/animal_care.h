@@ -9,8 +9,11 @@
 #ifndef animal_care_h
 #define animal_care_h
 
+#include "navigator.h"
+
+extern const nsec_screen_t animal_screen;
+
 void animal_init(void);
-void animal_show(void);
 void animal_state_reset(void);
 
 
@@ -1,14 +0,0 @@
-//
-//  app_glue.h
-//  nsec16
-//
-//  Created by Marc-Etienne M.Léveillé on 2016-05-18.
-//
-//
-
-#ifndef app_glue_h
-#define app_glue_h
-
-void show_main_menu(void);
-
-#endif /* app_glue_h */
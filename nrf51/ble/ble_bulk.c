@@ -0,0 +1,382 @@
+//
+//  ble_bulk.c
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#include "nsec_ble_internal.h"
+#include <app_util_platform.h>
+#include <app_scheduler.h>
+
+#include "../nsec_provision.h"
+
+// Packets written by the phone, [length][packet], from the BLE events to
+// the scheduler. Power of two, holds a window of DATA. A length of 0 is a
+// disconnection, there is always room left for one.
+#define NSEC_BLE_BULK_RING_SIZE     (256)
+#define NSEC_BLE_BULK_RING_MASK     (NSEC_BLE_BULK_RING_SIZE - 1)
+#define NSEC_BLE_BULK_REPLY_SIZE    (10)
+#define NSEC_BLE_BULK_WINDOW_BYTES  (NSEC_BLE_BULK_WINDOW * NSEC_BLE_BULK_CHUNK_SIZE)
+
+enum {
+    NSEC_BLE_BULK_CHAR_RX,
+    NSEC_BLE_BULK_CHAR_TX,
+    NSEC_BLE_BULK_CHAR_COUNT,
+};
+
+typedef enum {
+    NSEC_BLE_BULK_IDLE,
+    NSEC_BLE_BULK_PUSHING,
+    NSEC_BLE_BULK_PULLING,
+} nsec_ble_bulk_mode_t;
+
+static const uint8_t _nsec_ble_bulk_uuid[16] = { 0x3C, 0x1F, 0x52, 0xA7, 0x8E, 0x04, 0x4B, 0x61, 0x9D, 0x2A, 0x65, 0x10, 0x42, 0x00, 0xB3, 0x77 };
+
+static nsec_ble_service_handle _nsec_ble_bulk_service = NULL;
+static const nsec_ble_bulk_blob_t * _nsec_ble_bulk_blobs = NULL;
+static uint8_t _nsec_ble_bulk_blob_count = 0;
+
+// Single producer (BLE events) and single consumer (scheduler)
+static uint8_t _nsec_ble_bulk_ring[NSEC_BLE_BULK_RING_SIZE];
+static volatile uint16_t _nsec_ble_bulk_ring_head = 0; // Written by the BLE events only
+static volatile uint16_t _nsec_ble_bulk_ring_tail = 0; // Written by the scheduler only
+static volatile uint8_t _nsec_ble_bulk_scheduled = 0;
+
+static struct {
+    nsec_ble_bulk_mode_t mode;
+    const nsec_ble_bulk_blob_t * blob;
+    const uint8_t * data;   // Pulled
+    uint32_t size;
+    uint32_t crc;           // Of the whole blob
+    uint32_t running_crc;   // Pushed so far
+    uint32_t offset;        // Next to receive or to send
+    uint32_t acked;         // Last ACK, sent or received
+    uint8_t nacked;         // An ACK went back for the current gap
+} _nsec_ble_bulk_transfer;
+
+// Only the last one counts, sent before any DATA
+static struct {
+    uint8_t pending;
+    uint8_t length;
+    uint8_t data[NSEC_BLE_BULK_REPLY_SIZE];
+} _nsec_ble_bulk_reply;
+
+static uint32_t _nsec_ble_bulk_get32(const uint8_t * data) {
+    return (uint32_t) data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+}
+
+static void _nsec_ble_bulk_put32(uint8_t * data, uint32_t value) {
+    data[0] = value >> 24;
+    data[1] = value >> 16;
+    data[2] = value >> 8;
+    data[3] = value;
+}
+
+static void _nsec_ble_bulk_reply_ready(uint8_t status, uint32_t size, uint32_t crc) {
+    _nsec_ble_bulk_reply.data[0] = NSEC_BLE_BULK_READY;
+    _nsec_ble_bulk_reply.data[1] = status;
+    _nsec_ble_bulk_put32(&_nsec_ble_bulk_reply.data[2], size);
+    _nsec_ble_bulk_put32(&_nsec_ble_bulk_reply.data[6], crc);
+    _nsec_ble_bulk_reply.length = 10;
+    _nsec_ble_bulk_reply.pending = 1;
+}
+
+static void _nsec_ble_bulk_reply_ack(uint32_t offset) {
+    _nsec_ble_bulk_reply.data[0] = NSEC_BLE_BULK_ACK_OUT;
+    _nsec_ble_bulk_put32(&_nsec_ble_bulk_reply.data[1], offset);
+    _nsec_ble_bulk_reply.length = 5;
+    _nsec_ble_bulk_reply.pending = 1;
+    _nsec_ble_bulk_transfer.acked = offset;
+}
+
+static void _nsec_ble_bulk_reply_done(uint8_t status) {
+    _nsec_ble_bulk_reply.data[0] = NSEC_BLE_BULK_DONE;
+    _nsec_ble_bulk_reply.data[1] = status;
+    _nsec_ble_bulk_reply.length = 2;
+    _nsec_ble_bulk_reply.pending = 1;
+}
+
+static const nsec_ble_bulk_blob_t * _nsec_ble_bulk_find(uint8_t id) {
+    for(int i = 0; i < _nsec_ble_bulk_blob_count; i++) {
+        if(_nsec_ble_bulk_blobs[i].id == id) {
+            return &_nsec_ble_bulk_blobs[i];
+        }
+    }
+    return NULL;
+}
+
+static void _nsec_ble_bulk_stop(bool complete) {
+    if(_nsec_ble_bulk_transfer.mode == NSEC_BLE_BULK_PUSHING) {
+        _nsec_ble_bulk_transfer.blob->push_end(complete);
+    }
+    _nsec_ble_bulk_transfer.mode = NSEC_BLE_BULK_IDLE;
+}
+
+static void _nsec_ble_bulk_push(const uint8_t * packet) {
+    _nsec_ble_bulk_stop(false);
+    const nsec_ble_bulk_blob_t * blob = _nsec_ble_bulk_find(packet[1]);
+    uint32_t size = _nsec_ble_bulk_get32(&packet[2]);
+    if(blob == NULL) {
+        _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_UNKNOWN_BLOB);
+        return;
+    }
+    if(size == 0 || size > NSEC_BLE_BULK_MAX_SIZE) {
+        _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_BAD_SIZE);
+        return;
+    }
+    if(blob->push_begin == NULL || !blob->push_begin(size)) {
+        _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_REFUSED);
+        return;
+    }
+    _nsec_ble_bulk_transfer.mode = NSEC_BLE_BULK_PUSHING;
+    _nsec_ble_bulk_transfer.blob = blob;
+    _nsec_ble_bulk_transfer.size = size;
+    _nsec_ble_bulk_transfer.crc = _nsec_ble_bulk_get32(&packet[6]);
+    _nsec_ble_bulk_transfer.running_crc = 0;
+    _nsec_ble_bulk_transfer.offset = 0;
+    _nsec_ble_bulk_transfer.acked = 0;
+    _nsec_ble_bulk_transfer.nacked = 0;
+    _nsec_ble_bulk_reply_ready(NSEC_BLE_BULK_STATUS_OK, size, _nsec_ble_bulk_transfer.crc);
+}
+
+static void _nsec_ble_bulk_pull(const uint8_t * packet) {
+    _nsec_ble_bulk_stop(false);
+    const nsec_ble_bulk_blob_t * blob = _nsec_ble_bulk_find(packet[1]);
+    uint32_t offset = _nsec_ble_bulk_get32(&packet[2]);
+    uint32_t size = 0;
+    uint32_t crc = 0;
+    if(blob == NULL) {
+        _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_UNKNOWN_BLOB);
+        return;
+    }
+    const uint8_t * data = blob->pull != NULL ? blob->pull(&size, &crc) : NULL;
+    if(data == NULL) {
+        _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_REFUSED);
+        return;
+    }
+    if(size > NSEC_BLE_BULK_MAX_SIZE) {
+        _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_BAD_SIZE);
+        return;
+    }
+    if(offset > size) {
+        _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_BAD_OFFSET);
+        return;
+    }
+    _nsec_ble_bulk_transfer.mode = NSEC_BLE_BULK_PULLING;
+    _nsec_ble_bulk_transfer.blob = blob;
+    _nsec_ble_bulk_transfer.data = data;
+    _nsec_ble_bulk_transfer.size = size;
+    _nsec_ble_bulk_transfer.crc = crc;
+    _nsec_ble_bulk_transfer.offset = offset;
+    _nsec_ble_bulk_transfer.acked = offset;
+    _nsec_ble_bulk_reply_ready(NSEC_BLE_BULK_STATUS_OK, size, crc);
+}
+
+static void _nsec_ble_bulk_data(const uint8_t * packet, uint8_t length) {
+    uint32_t offset = (uint32_t) packet[1] << 16 | packet[2] << 8 | packet[3];
+    const uint8_t * data = &packet[NSEC_BLE_BULK_DATA_HEADER_SIZE];
+    uint8_t count = length - NSEC_BLE_BULK_DATA_HEADER_SIZE;
+
+    if(offset != _nsec_ble_bulk_transfer.offset) {
+        // Behind is a resend, already here. Ahead, some went missing: the
+        // phone goes back to what we have.
+        if(offset > _nsec_ble_bulk_transfer.offset && !_nsec_ble_bulk_transfer.nacked) {
+            _nsec_ble_bulk_transfer.nacked = 1;
+            _nsec_ble_bulk_reply_ack(_nsec_ble_bulk_transfer.offset);
+        }
+        return;
+    }
+    if(_nsec_ble_bulk_transfer.size - offset < count) {
+        _nsec_ble_bulk_stop(false);
+        _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_BAD_OFFSET);
+        return;
+    }
+
+    _nsec_ble_bulk_transfer.running_crc = nsec_provision_crc32(_nsec_ble_bulk_transfer.running_crc, data, count);
+    _nsec_ble_bulk_transfer.blob->push_data(offset, data, count);
+    _nsec_ble_bulk_transfer.offset += count;
+    _nsec_ble_bulk_transfer.nacked = 0;
+
+    if(_nsec_ble_bulk_transfer.offset == _nsec_ble_bulk_transfer.size) {
+        bool complete = _nsec_ble_bulk_transfer.running_crc == _nsec_ble_bulk_transfer.crc;
+        _nsec_ble_bulk_stop(complete);
+        _nsec_ble_bulk_reply_done(complete ? NSEC_BLE_BULK_STATUS_OK : NSEC_BLE_BULK_STATUS_BAD_CRC);
+    }
+    else if(_nsec_ble_bulk_transfer.offset - _nsec_ble_bulk_transfer.acked >= NSEC_BLE_BULK_WINDOW_BYTES / 2) {
+        _nsec_ble_bulk_reply_ack(_nsec_ble_bulk_transfer.offset);
+    }
+}
+
+static void _nsec_ble_bulk_ack(const uint8_t * packet) {
+    uint32_t offset = _nsec_ble_bulk_get32(&packet[1]);
+    if(offset < _nsec_ble_bulk_transfer.acked || offset > _nsec_ble_bulk_transfer.offset) {
+        return;
+    }
+    _nsec_ble_bulk_transfer.acked = offset;
+    if(offset == _nsec_ble_bulk_transfer.size) {
+        _nsec_ble_bulk_stop(true);
+        _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_OK);
+    }
+}
+
+static void _nsec_ble_bulk_process(const uint8_t * packet, uint8_t length) {
+    switch (packet[0]) {
+        case NSEC_BLE_BULK_PUSH:
+            if(length == 10) {
+                _nsec_ble_bulk_push(packet);
+            }
+            break;
+
+        case NSEC_BLE_BULK_PULL:
+            if(length == 6) {
+                _nsec_ble_bulk_pull(packet);
+            }
+            break;
+
+        case NSEC_BLE_BULK_DATA:
+            if(_nsec_ble_bulk_transfer.mode == NSEC_BLE_BULK_PUSHING && length > NSEC_BLE_BULK_DATA_HEADER_SIZE) {
+                _nsec_ble_bulk_data(packet, length);
+            }
+            break;
+
+        case NSEC_BLE_BULK_ACK:
+            if(_nsec_ble_bulk_transfer.mode == NSEC_BLE_BULK_PULLING && length == 5) {
+                _nsec_ble_bulk_ack(packet);
+            }
+            break;
+
+        case NSEC_BLE_BULK_ABORT:
+            if(_nsec_ble_bulk_transfer.mode != NSEC_BLE_BULK_IDLE) {
+                _nsec_ble_bulk_stop(false);
+                _nsec_ble_bulk_reply_done(NSEC_BLE_BULK_STATUS_ABORTED);
+            }
+            break;
+    }
+}
+
+// Fills every buffer the stack has, several packets go out in a connection
+// event. Stops at the first one refused, BLE_EVT_TX_COMPLETE comes back.
+static void _nsec_ble_bulk_send(void) {
+    if(_nsec_ble_bulk_reply.pending) {
+        if(nsec_ble_notify_charateristic_at(_nsec_ble_bulk_service, NSEC_BLE_BULK_CHAR_TX,
+                                            _nsec_ble_bulk_reply.data, _nsec_ble_bulk_reply.length) != 0) {
+            return;
+        }
+        _nsec_ble_bulk_reply.pending = 0;
+    }
+    while(_nsec_ble_bulk_transfer.mode == NSEC_BLE_BULK_PULLING &&
+          _nsec_ble_bulk_transfer.offset < _nsec_ble_bulk_transfer.size &&
+          _nsec_ble_bulk_transfer.offset - _nsec_ble_bulk_transfer.acked < NSEC_BLE_BULK_WINDOW_BYTES) {
+        uint32_t offset = _nsec_ble_bulk_transfer.offset;
+        uint8_t count = NSEC_BLE_BULK_CHUNK_SIZE;
+        if(_nsec_ble_bulk_transfer.size - offset < count) {
+            count = _nsec_ble_bulk_transfer.size - offset;
+        }
+        uint8_t packet[NSEC_BLE_NOTIFY_MAX_LENGTH] = { NSEC_BLE_BULK_DATA_OUT, offset >> 16, offset >> 8, offset };
+        memcpy(&packet[NSEC_BLE_BULK_DATA_HEADER_SIZE], &_nsec_ble_bulk_transfer.data[offset], count);
+        if(nsec_ble_notify_charateristic_at(_nsec_ble_bulk_service, NSEC_BLE_BULK_CHAR_TX,
+                                            packet, NSEC_BLE_BULK_DATA_HEADER_SIZE + count) != 0) {
+            return;
+        }
+        _nsec_ble_bulk_transfer.offset += count;
+    }
+}
+
+static void _nsec_ble_bulk_pump(void * data, uint16_t size) {
+    _nsec_ble_bulk_scheduled = 0;
+    while(_nsec_ble_bulk_ring_tail != _nsec_ble_bulk_ring_head) {
+        uint16_t tail = _nsec_ble_bulk_ring_tail;
+        uint8_t length = _nsec_ble_bulk_ring[tail & NSEC_BLE_BULK_RING_MASK];
+        uint8_t packet[NSEC_BLE_NOTIFY_MAX_LENGTH];
+        for(int i = 0; i < length; i++) {
+            packet[i] = _nsec_ble_bulk_ring[(tail + 1 + i) & NSEC_BLE_BULK_RING_MASK];
+        }
+        _nsec_ble_bulk_ring_tail = tail + 1 + length;
+        if(length == 0) {
+            // Disconnected, nothing left to say
+            _nsec_ble_bulk_stop(false);
+            _nsec_ble_bulk_reply.pending = 0;
+        }
+        else {
+            _nsec_ble_bulk_process(packet, length);
+        }
+    }
+    _nsec_ble_bulk_send();
+}
+
+static void _nsec_ble_bulk_schedule(void) {
+    if(!_nsec_ble_bulk_scheduled) {
+        _nsec_ble_bulk_scheduled = 1;
+        if(app_sched_event_put(NULL, 0, _nsec_ble_bulk_pump) != NRF_SUCCESS) {
+            // Scheduler queue full, the next packet or TX_COMPLETE will try again
+            _nsec_ble_bulk_scheduled = 0;
+        }
+    }
+}
+
+// Called from the BLE events. A packet that does not fit is dropped, the
+// phone sees a gap or no reply.
+static void _nsec_ble_bulk_ring_put(const uint8_t * packet, uint8_t length) {
+    uint16_t head = _nsec_ble_bulk_ring_head;
+    uint16_t room = NSEC_BLE_BULK_RING_SIZE - (uint16_t) (head - _nsec_ble_bulk_ring_tail);
+    uint16_t needed = 1 + length + (length > 0 ? 1 : 0);
+    if(room < needed) {
+        return;
+    }
+    _nsec_ble_bulk_ring[head & NSEC_BLE_BULK_RING_MASK] = length;
+    for(int i = 0; i < length; i++) {
+        _nsec_ble_bulk_ring[(head + 1 + i) & NSEC_BLE_BULK_RING_MASK] = packet[i];
+    }
+    _nsec_ble_bulk_ring_head = head + 1 + length;
+    _nsec_ble_bulk_schedule();
+}
+
+static void _nsec_ble_bulk_on_write(nsec_ble_service_handle service, uint16_t char_uuid, uint8_t * content, size_t content_length) {
+    if(char_uuid == NSEC_BLE_BULK_UUID_RX && content_length > 0 && content_length <= NSEC_BLE_NOTIFY_MAX_LENGTH) {
+        _nsec_ble_bulk_ring_put(content, content_length);
+    }
+}
+
+static void _nsec_ble_bulk_evt_handler(ble_evt_t * p_ble_evt) {
+    switch (p_ble_evt->header.evt_id) {
+        case BLE_GAP_EVT_DISCONNECTED:
+            _nsec_ble_bulk_ring_put(NULL, 0);
+            break;
+
+        case BLE_EVT_TX_COMPLETE:
+            _nsec_ble_bulk_schedule();
+            break;
+    }
+}
+
+void nsec_ble_bulk_add(const nsec_ble_bulk_blob_t * blobs, uint8_t count) {
+    nsec_ble_characteristic_t c[NSEC_BLE_BULK_CHAR_COUNT] = {
+        [NSEC_BLE_BULK_CHAR_RX] = {
+            .char_uuid = NSEC_BLE_BULK_UUID_RX,
+            .permissions = NSEC_BLE_CHARACT_PERM_WRITE | NSEC_BLE_CHARACT_PERM_WRITE_NO_RESPONSE,
+            .max_length = NSEC_BLE_NOTIFY_MAX_LENGTH,
+            .on_write = _nsec_ble_bulk_on_write,
+        }, [NSEC_BLE_BULK_CHAR_TX] = {
+            .char_uuid = NSEC_BLE_BULK_UUID_TX,
+            .permissions = NSEC_BLE_CHARACT_PERM_READ,
+            .max_length = NSEC_BLE_NOTIFY_MAX_LENGTH,
+            .on_write = _nsec_ble_bulk_on_write,
+        },
+    };
+    nsec_ble_service_t srv = {
+        .characteristics_count = sizeof(c) / sizeof(c[0]),
+        .characteristics = c,
+    };
+    memcpy(srv.uuid, _nsec_ble_bulk_uuid, sizeof(srv.uuid));
+
+    _nsec_ble_bulk_blobs = blobs;
+    _nsec_ble_bulk_blob_count = count;
+    memset(&_nsec_ble_bulk_transfer, 0, sizeof(_nsec_ble_bulk_transfer));
+    memset(&_nsec_ble_bulk_reply, 0, sizeof(_nsec_ble_bulk_reply));
+    if(nsec_ble_register_vendor_service(&srv, &_nsec_ble_bulk_service) != 0) {
+        _nsec_ble_bulk_service = NULL;
+        return;
+    }
+    nsec_ble_register_evt_handler(_nsec_ble_bulk_evt_handler);
+}
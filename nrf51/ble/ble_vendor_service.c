@@ -7,11 +7,15 @@
 //
 
 #include "nsec_ble_internal.h"
+#include <app_util_platform.h>
+#include <app_scheduler.h>
 
 struct nsec_ble_service_handle_s {
     uint8_t is_used;
     uint16_t sd_ble_handle;
     ble_uuid_t uuid;
+    uint8_t first_characteristic; // In _nsec_ble_vendor_services_characteristics
+    uint8_t characteristics_count;
 };
 
 typedef struct {
@@ -19,10 +23,31 @@ typedef struct {
     nsec_ble_service_handle service;
     uint8_t index;
     ble_gatts_char_handles_t sd_ble_handle;
+    uint16_t value_length;      // Last set, what a notification sends
+    uint8_t notify_enabled;     // By the central, through the CCCD
+    uint8_t notify_queued;
 } nsec_ble_characteristic_list_item_t;
 
 static struct nsec_ble_service_handle_s _nsec_ble_vendor_services[NSEC_BLE_LIMIT_MAX_VENDOR_SERVICE_COUNT];
+static uint8_t _nsec_ble_vendor_services_count = 0;
+// The characteristics of a service follow each other
 static nsec_ble_characteristic_list_item_t _nsec_ble_vendor_services_characteristics[NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT];
+static uint8_t _nsec_ble_vendor_services_characteristics_count = 0;
+// By value or CCCD handle, the characteristic index + 1, 0 for none
+static uint8_t _nsec_ble_vendor_characteristic_by_handle[NSEC_BLE_LIMIT_MAX_ATTR_HANDLE];
+
+// Characteristics with a notification to send, oldest first. One is queued
+// at most once, a new value set meanwhile goes out in its place. Changed in
+// critical regions: values are set from the scheduler and from the BLE
+// events. Sent from the scheduler.
+static uint8_t _nsec_ble_notify_queue[NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT];
+static uint8_t _nsec_ble_notify_queue_head = 0;
+static uint8_t _nsec_ble_notify_queue_count = 0;
+static uint16_t _nsec_ble_notify_conn_handle = BLE_CONN_HANDLE_INVALID;
+// Left in the stack, given back by BLE_EVT_TX_COMPLETE
+static uint8_t _nsec_ble_notify_tx_buffers = 0;
+static volatile uint8_t _nsec_ble_notify_scheduled = 0;
+static nsec_ble_notify_stats_t _nsec_ble_notify_stats;
 
 static void _nsec_ble_add_caracteristic(nsec_ble_service_handle service_handle, nsec_ble_characteristic_t * charac, ble_gatts_char_handles_t * charac_handle);
 static void _nsec_ble_vendor_uuid_provider(size_t * uuid_count, ble_uuid_t * uuids);
@@ -31,23 +56,28 @@ static void _nsec_ble_vendor_evt_handler(ble_evt_t * p_ble_evt);
 int nsec_ble_register_vendor_service(nsec_ble_service_t * srv, nsec_ble_service_handle * handle) {
     ble_uuid128_t     base_uuid;
 
-    bzero(_nsec_ble_vendor_services, sizeof(_nsec_ble_vendor_services));
+    if(_nsec_ble_vendor_services_count >= NSEC_BLE_LIMIT_MAX_VENDOR_SERVICE_COUNT) {
+        // NSEC_BLE_ERROR_TOO_MANY_VENDOR_SERVICES
+        return -1;
+    }
+    if(_nsec_ble_vendor_services_characteristics_count + srv->characteristics_count > NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT) {
+        // NSEC_BLE_ERROR_TOO_MANY_VENDOR_SERVICES_CHARACT
+        return -1;
+    }
 
     memcpy(&base_uuid.uuid128, srv->uuid, sizeof(base_uuid.uuid128));
 
-    nsec_ble_service_handle new_service_handle = NULL;
-    for(int i = 0; i < NSEC_BLE_LIMIT_MAX_VENDOR_SERVICE_COUNT; i++) {
-        if(!_nsec_ble_vendor_services[i].is_used) {
-            new_service_handle = &_nsec_ble_vendor_services[i];
-            new_service_handle->is_used = 1;
-            break;
-        }
+    if(_nsec_ble_vendor_services_count == 0) {
+        // Before any characteristic, a service left incomplete still gets
+        // its events
+        nsec_ble_register_adv_uuid_provider(_nsec_ble_vendor_uuid_provider);
+        nsec_ble_register_evt_handler(_nsec_ble_vendor_evt_handler);
     }
 
-    if(new_service_handle == NULL) {
-        // NSEC_BLE_ERROR_TOO_MANY_VENDOR_SERVICES
-        return -1;
-    }
+    nsec_ble_service_handle new_service_handle = &_nsec_ble_vendor_services[_nsec_ble_vendor_services_count++];
+    new_service_handle->is_used = 1;
+    new_service_handle->first_characteristic = _nsec_ble_vendor_services_characteristics_count;
+    new_service_handle->characteristics_count = 0;
 
     APP_ERROR_CHECK(sd_ble_uuid_vs_add(&base_uuid, &new_service_handle->uuid.type));
     new_service_handle->uuid.uuid = srv->uuid[12] << 8 | srv->uuid[13];
@@ -57,57 +87,180 @@ int nsec_ble_register_vendor_service(nsec_ble_service_t * srv, nsec_ble_service_
     *handle = new_service_handle;
 
     for(int i = 0; i < srv->characteristics_count; i++) {
-        nsec_ble_characteristic_list_item_t * charac_handle = NULL;
-        for(int j = 0; j < NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT; j++) {
-            if(_nsec_ble_vendor_services_characteristics[j].service == NULL) {
-                charac_handle = &_nsec_ble_vendor_services_characteristics[j];
-                break;
-            }
-        }
-        if(charac_handle == NULL) {
-            // NSEC_BLE_ERROR_TOO_MANY_VENDOR_SERVICES_CHARACT
-            return -1;
-        }
+        uint8_t charac_index = _nsec_ble_vendor_services_characteristics_count;
+        nsec_ble_characteristic_list_item_t * charac_handle = &_nsec_ble_vendor_services_characteristics[charac_index];
         charac_handle->service = new_service_handle;
         charac_handle->index = i;
         charac_handle->definition = srv->characteristics[i];
         _nsec_ble_add_caracteristic(new_service_handle, &charac_handle->definition, &charac_handle->sd_ble_handle);
+        if(charac_handle->sd_ble_handle.value_handle >= NSEC_BLE_LIMIT_MAX_ATTR_HANDLE ||
+           charac_handle->sd_ble_handle.cccd_handle >= NSEC_BLE_LIMIT_MAX_ATTR_HANDLE) {
+            // NSEC_BLE_ERROR_ATTR_HANDLE_TOO_HIGH, the service is left with
+            // the characteristics added so far
+            return -1;
+        }
+        _nsec_ble_vendor_characteristic_by_handle[charac_handle->sd_ble_handle.value_handle] = charac_index + 1;
+        _nsec_ble_vendor_characteristic_by_handle[charac_handle->sd_ble_handle.cccd_handle] = charac_index + 1;
+        _nsec_ble_vendor_services_characteristics_count++;
+        new_service_handle->characteristics_count++;
     }
-
-    nsec_ble_register_adv_uuid_provider(_nsec_ble_vendor_uuid_provider);
-    nsec_ble_register_evt_handler(_nsec_ble_vendor_evt_handler);
     return 0;
 }
 
 static void _nsec_ble_vendor_uuid_provider(size_t * uuid_count, ble_uuid_t * uuids) {
     size_t count = 0;
-    for(int i = 0; i < NSEC_BLE_LIMIT_MAX_VENDOR_SERVICE_COUNT && i < *uuid_count; i++) {
-        if(_nsec_ble_vendor_services[i].is_used) {
-            uuids[count++] = _nsec_ble_vendor_services[i].uuid;
-        }
+    if(*uuid_count > 0 && _nsec_ble_vendor_services_count > 0) {
+        uuids[count++] = _nsec_ble_vendor_services[0].uuid;
     }
     *uuid_count = count;
 }
 
+static void _nsec_ble_notify_pump(void * data, uint16_t size) {
+    _nsec_ble_notify_scheduled = 0;
+    while(1) {
+        nsec_ble_characteristic_list_item_t * charac_item = NULL;
+        uint16_t conn_handle;
+        CRITICAL_REGION_ENTER();
+        conn_handle = _nsec_ble_notify_conn_handle;
+        if(_nsec_ble_notify_queue_count > 0 && _nsec_ble_notify_tx_buffers > 0) {
+            // Off the queue first, a value set from now on queues it again
+            charac_item = &_nsec_ble_vendor_services_characteristics[_nsec_ble_notify_queue[_nsec_ble_notify_queue_head]];
+            _nsec_ble_notify_queue_head = (_nsec_ble_notify_queue_head + 1) % NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT;
+            _nsec_ble_notify_queue_count--;
+            charac_item->notify_queued = 0;
+        }
+        CRITICAL_REGION_EXIT();
+        if(charac_item == NULL) {
+            return;
+        }
+
+        // The value in the stack, as last set
+        uint16_t length = charac_item->value_length < NSEC_BLE_NOTIFY_MAX_LENGTH ? charac_item->value_length : NSEC_BLE_NOTIFY_MAX_LENGTH;
+        ble_gatts_hvx_params_t hvx_params = {
+            .handle = charac_item->sd_ble_handle.value_handle,
+            .type   = BLE_GATT_HVX_NOTIFICATION,
+            .offset = 0,
+            .p_len  = &length,
+            .p_data = NULL,
+        };
+        uint32_t err_code = sd_ble_gatts_hvx(conn_handle, &hvx_params);
+
+        CRITICAL_REGION_ENTER();
+        if(err_code == NRF_SUCCESS) {
+            _nsec_ble_notify_stats.sent++;
+            _nsec_ble_notify_tx_buffers--;
+        }
+        else if(err_code == BLE_ERROR_NO_TX_BUFFERS) {
+            // Back in front, unless queued again meanwhile
+            _nsec_ble_notify_tx_buffers = 0;
+            if(!charac_item->notify_queued) {
+                _nsec_ble_notify_queue_head = (_nsec_ble_notify_queue_head + NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT - 1) % NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT;
+                _nsec_ble_notify_queue[_nsec_ble_notify_queue_head] = charac_item - _nsec_ble_vendor_services_characteristics;
+                _nsec_ble_notify_queue_count++;
+                charac_item->notify_queued = 1;
+            }
+        }
+        else {
+            // Disconnected or unsubscribed meanwhile
+            _nsec_ble_notify_stats.dropped++;
+        }
+        CRITICAL_REGION_EXIT();
+    }
+}
+
+static void _nsec_ble_notify_schedule(void) {
+    if(!_nsec_ble_notify_scheduled) {
+        _nsec_ble_notify_scheduled = 1;
+        if(app_sched_event_put(NULL, 0, _nsec_ble_notify_pump) != NRF_SUCCESS) {
+            // Scheduler queue full, the next value or TX_COMPLETE will try again
+            _nsec_ble_notify_scheduled = 0;
+        }
+    }
+}
+
+static void _nsec_ble_notify_queue_add(nsec_ble_characteristic_list_item_t * charac_item) {
+    uint8_t added = 0;
+    CRITICAL_REGION_ENTER();
+    if(_nsec_ble_notify_conn_handle != BLE_CONN_HANDLE_INVALID && charac_item->notify_enabled) {
+        if(charac_item->notify_queued) {
+            _nsec_ble_notify_stats.coalesced++;
+        }
+        else {
+            uint8_t tail = (_nsec_ble_notify_queue_head + _nsec_ble_notify_queue_count) % NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT;
+            _nsec_ble_notify_queue[tail] = charac_item - _nsec_ble_vendor_services_characteristics;
+            _nsec_ble_notify_queue_count++;
+            charac_item->notify_queued = 1;
+            _nsec_ble_notify_stats.queued++;
+            if(_nsec_ble_notify_queue_count > _nsec_ble_notify_stats.max_depth) {
+                _nsec_ble_notify_stats.max_depth = _nsec_ble_notify_queue_count;
+            }
+            added = 1;
+        }
+    }
+    CRITICAL_REGION_EXIT();
+    if(added) {
+        _nsec_ble_notify_schedule();
+    }
+}
+
+// Called from the BLE events
+static void _nsec_ble_notify_reset(uint16_t conn_handle) {
+    uint8_t tx_buffers = 0;
+    if(conn_handle != BLE_CONN_HANDLE_INVALID) {
+        sd_ble_tx_buffer_count_get(&tx_buffers);
+    }
+    CRITICAL_REGION_ENTER();
+    _nsec_ble_notify_conn_handle = conn_handle;
+    _nsec_ble_notify_tx_buffers = tx_buffers;
+    _nsec_ble_notify_stats.dropped += _nsec_ble_notify_queue_count;
+    _nsec_ble_notify_queue_count = 0;
+    for(int i = 0; i < _nsec_ble_vendor_services_characteristics_count; i++) {
+        _nsec_ble_vendor_services_characteristics[i].notify_enabled = 0;
+        _nsec_ble_vendor_services_characteristics[i].notify_queued = 0;
+    }
+    CRITICAL_REGION_EXIT();
+}
+
 static void _nsec_ble_vendor_evt_handler(ble_evt_t * p_ble_evt) {
     switch (p_ble_evt->header.evt_id) {
+        case BLE_GAP_EVT_CONNECTED:
+            _nsec_ble_notify_reset(p_ble_evt->evt.gap_evt.conn_handle);
+            break;
+
+        case BLE_GAP_EVT_DISCONNECTED:
+            _nsec_ble_notify_reset(BLE_CONN_HANDLE_INVALID);
+            break;
+
+        case BLE_EVT_TX_COMPLETE:
+            CRITICAL_REGION_ENTER();
+            _nsec_ble_notify_tx_buffers += p_ble_evt->evt.common_evt.params.tx_complete.count;
+            CRITICAL_REGION_EXIT();
+            _nsec_ble_notify_schedule();
+            break;
+
         case BLE_GATTS_EVT_WRITE: {
-            nsec_ble_characteristic_list_item_t * charac_item = NULL;
-            for(int i = 0; i < NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT; i++) {
-                if(_nsec_ble_vendor_services_characteristics[i].definition.char_uuid == p_ble_evt->evt.gatts_evt.params.write.context.char_uuid.uuid &&
-                   _nsec_ble_vendor_services_characteristics[i].service->sd_ble_handle == p_ble_evt->evt.gatts_evt.params.write.context.srvc_handle) {
-                    charac_item = &_nsec_ble_vendor_services_characteristics[i];
-                    break;
+            ble_gatts_evt_write_t * write = &p_ble_evt->evt.gatts_evt.params.write;
+            uint8_t charac_index = 0;
+            if(write->handle < NSEC_BLE_LIMIT_MAX_ATTR_HANDLE) {
+                charac_index = _nsec_ble_vendor_characteristic_by_handle[write->handle];
+            }
+            if(charac_index == 0) {
+                // Bad send request
+                break;
+            }
+            nsec_ble_characteristic_list_item_t * charac_item = &_nsec_ble_vendor_services_characteristics[charac_index - 1];
+            if(write->handle == charac_item->sd_ble_handle.cccd_handle) {
+                // Starts with the current value
+                charac_item->notify_enabled = write->len >= 1 && (write->data[0] & BLE_GATT_HVX_NOTIFICATION);
+                if(charac_item->value_length > 0) {
+                    _nsec_ble_notify_queue_add(charac_item);
                 }
             }
-            if(charac_item != NULL) {
+            else {
                 charac_item->definition.on_write(charac_item->service,
                                                  charac_item->definition.char_uuid,
-                                                 p_ble_evt->evt.gatts_evt.params.write.data,
-                                                 p_ble_evt->evt.gatts_evt.params.write.len);
-            }
-            else {
-                // Bad send request
+                                                 write->data,
+                                                 write->len);
             }
         }
             break;
@@ -144,9 +297,9 @@ static void _nsec_ble_add_caracteristic(nsec_ble_service_handle service_handle,
         BLE_GAP_CONN_SEC_MODE_SET_NO_ACCESS(&attr_md.read_perm);
     }
 
-    if(charac->permissions & NSEC_BLE_CHARACT_PERM_WRITE) {
-        char_md.char_props.write = 1;
-        char_md.char_props.write_wo_resp = 1;
+    if(charac->permissions & (NSEC_BLE_CHARACT_PERM_WRITE | NSEC_BLE_CHARACT_PERM_WRITE_NO_RESPONSE)) {
+        char_md.char_props.write = (charac->permissions & NSEC_BLE_CHARACT_PERM_WRITE) != 0;
+        char_md.char_props.write_wo_resp = (charac->permissions & NSEC_BLE_CHARACT_PERM_WRITE_NO_RESPONSE) != 0;
         BLE_GAP_CONN_SEC_MODE_SET_OPEN(&attr_md.write_perm);
     }
     else {
@@ -167,7 +320,7 @@ static void _nsec_ble_add_caracteristic(nsec_ble_service_handle service_handle,
     attr_char_value.p_attr_md    = &attr_md;
     attr_char_value.init_len     = 0;
     attr_char_value.init_offs    = 0;
-    attr_char_value.max_len      = (64 * sizeof(uint8_t)); // FIXME: hardcoded
+    attr_char_value.max_len      = charac->max_length ? charac->max_length : NSEC_BLE_CHARACT_DEFAULT_MAX_LENGTH;
     attr_char_value.p_value      = NULL;
 
     APP_ERROR_CHECK(sd_ble_gatts_characteristic_add(service_handle->sd_ble_handle, &char_md,
@@ -175,22 +328,58 @@ static void _nsec_ble_add_caracteristic(nsec_ble_service_handle service_handle,
                                                     charac_handle));
 }
 
-int nsec_ble_set_charateristic_value(nsec_ble_service_handle service, uint16_t characteristic_uuid, void * value, uint16_t value_size) {
-    nsec_ble_characteristic_list_item_t * charac_handle = NULL;
-    for(int j = 0; j < NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT; j++) {
-        if(_nsec_ble_vendor_services_characteristics[j].service == service &&
-           _nsec_ble_vendor_services_characteristics[j].definition.char_uuid == characteristic_uuid) {
-            charac_handle = &_nsec_ble_vendor_services_characteristics[j];
-            break;
-        }
-    }
-    if(charac_handle == NULL) {
+static int _nsec_ble_set_value(nsec_ble_characteristic_list_item_t * charac_handle, void * value, uint16_t value_size) {
+    // TODO: Check if everything was written
+    APP_ERROR_CHECK(sd_ble_gatts_value_set(charac_handle->sd_ble_handle.value_handle, 0, &value_size, value));
+    charac_handle->value_length = value_size;
+    _nsec_ble_notify_queue_add(charac_handle);
+    return 0;
+}
+
+int nsec_ble_set_charateristic_value_at(nsec_ble_service_handle service, uint8_t index, void * value, uint16_t value_size) {
+    if(service == NULL || index >= service->characteristics_count) {
         // NSEC_BLE_ERROR_CHARAC_NOT_FOUND
         return -1;
     }
+    return _nsec_ble_set_value(&_nsec_ble_vendor_services_characteristics[service->first_characteristic + index], value, value_size);
+}
 
-    // TODO: Check if everything was written
-    APP_ERROR_CHECK(sd_ble_gatts_value_set(charac_handle->sd_ble_handle.value_handle, 0, &value_size, value));
-    return 0;
+int nsec_ble_notify_charateristic_at(nsec_ble_service_handle service, uint8_t index, const void * data, uint16_t length) {
+    if(service == NULL || index >= service->characteristics_count) {
+        // NSEC_BLE_ERROR_CHARAC_NOT_FOUND
+        return -1;
+    }
+    nsec_ble_characteristic_list_item_t * charac_item = &_nsec_ble_vendor_services_characteristics[service->first_characteristic + index];
+    uint16_t conn_handle = _nsec_ble_notify_conn_handle;
+    if(conn_handle == BLE_CONN_HANDLE_INVALID || !charac_item->notify_enabled) {
+        return -1;
+    }
+    ble_gatts_hvx_params_t hvx_params = {
+        .handle = charac_item->sd_ble_handle.value_handle,
+        .type   = BLE_GATT_HVX_NOTIFICATION,
+        .offset = 0,
+        .p_len  = &length,
+        .p_data = (uint8_t *) data,
+    };
+    uint32_t err_code = sd_ble_gatts_hvx(conn_handle, &hvx_params);
+    CRITICAL_REGION_ENTER();
+    if(err_code == NRF_SUCCESS) {
+        if(_nsec_ble_notify_tx_buffers > 0) {
+            _nsec_ble_notify_tx_buffers--;
+        }
+    }
+    else if(err_code == BLE_ERROR_NO_TX_BUFFERS) {
+        _nsec_ble_notify_tx_buffers = 0;
+    }
+    CRITICAL_REGION_EXIT();
+    return err_code == NRF_SUCCESS ? 0 : -1;
 }
 
+nsec_ble_notify_stats_t nsec_ble_get_notify_stats(void) {
+    nsec_ble_notify_stats_t stats;
+    CRITICAL_REGION_ENTER();
+    stats = _nsec_ble_notify_stats;
+    stats.depth = _nsec_ble_notify_queue_count;
+    CRITICAL_REGION_EXIT();
+    return stats;
+}
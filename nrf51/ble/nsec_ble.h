@@ -10,10 +10,25 @@
 #define nsec_ble_h
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <stdlib.h>
 
-#define NSEC_BLE_LIMIT_MAX_VENDOR_SERVICE_COUNT (2)
-#define NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT (8)
+// Shared by every vendor service. A GATT write finds its characteristic
+// through a table indexed by attribute handle, the S110 hands them out in
+// order from 1 and all of them must stay below the last limit.
+#ifndef NSEC_BLE_LIMIT_MAX_VENDOR_SERVICE_COUNT
+#define NSEC_BLE_LIMIT_MAX_VENDOR_SERVICE_COUNT (4)
+#endif
+#ifndef NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT
+#define NSEC_BLE_LIMIT_MAX_VENDOR_CHAR_COUNT (16)
+#endif
+#ifndef NSEC_BLE_LIMIT_MAX_ATTR_HANDLE
+#define NSEC_BLE_LIMIT_MAX_ATTR_HANDLE (128)
+#endif
+
+// A notification carries at most this much of a value (default ATT MTU)
+#define NSEC_BLE_NOTIFY_MAX_LENGTH (20)
+#define NSEC_BLE_CHARACT_DEFAULT_MAX_LENGTH (64)
 
 struct nsec_ble_service_handle_s;
 typedef struct nsec_ble_service_handle_s * nsec_ble_service_handle;
@@ -25,14 +40,28 @@ enum NSEC_BLE_CHARACT_PERM {
     NSEC_BLE_CHARACT_PERM_READ  = (1 << 0),
     NSEC_BLE_CHARACT_PERM_WRITE = (1 << 1),
     NSEC_BLE_CHARACT_PERM_RW    = NSEC_BLE_CHARACT_PERM_READ | NSEC_BLE_CHARACT_PERM_WRITE,
+    NSEC_BLE_CHARACT_PERM_WRITE_NO_RESPONSE = (1 << 2),
 };
 
 typedef struct {
     uint16_t char_uuid;
     uint8_t permissions; // see NSEC_BLE_CHARACT_PERM
+    uint16_t max_length; // 0 for NSEC_BLE_CHARACT_DEFAULT_MAX_LENGTH
     nsec_ble_characteristic_write_callback on_write;
 } nsec_ble_characteristic_t;
 
+// Notifications of the vendor characteristics. A value set while the
+// central has notifications on for it is queued and sent as the stack has
+// buffers for it.
+typedef struct {
+    uint32_t queued;
+    uint32_t coalesced;     // Set again before it went out, sent once
+    uint32_t sent;
+    uint32_t dropped;       // Refused by the stack, or left at disconnection
+    uint8_t depth;
+    uint8_t max_depth;
+} nsec_ble_notify_stats_t;
+
 typedef struct {
     uint8_t uuid[16];
     size_t characteristics_count;
@@ -42,7 +71,13 @@ typedef struct {
 
 int nsec_ble_init(char * device_name);
 
-int nsec_ble_set_charateristic_value(nsec_ble_service_handle service, uint16_t characteristic_uuid, void * value, uint16_t value_size);
+// By position in the characteristics of the service as registered
+int nsec_ble_set_charateristic_value_at(nsec_ble_service_handle service, uint8_t index, void * value, uint16_t value_size);
+// Sends data in a notification right away, instead of the value. Returns
+// -1 when the central is not subscribed or the stack has no buffer left,
+// BLE_EVT_TX_COMPLETE tells when to try again.
+int nsec_ble_notify_charateristic_at(nsec_ble_service_handle service, uint8_t index, const void * data, uint16_t length);
+nsec_ble_notify_stats_t nsec_ble_get_notify_stats(void);
 
 uint8_t nsec_ble_toggle(void);
 
@@ -53,10 +88,78 @@ void nsec_ble_add_device_information_service(char * manufacturer_name,
                                              char * fw_revision,
                                              char * sw_revision);
 
-// returns handle
+// returns handle, only the first service registered is advertised (one
+// 128-bit UUID fills most of the advertising data)
 int nsec_ble_register_vendor_service(nsec_ble_service_t * srv, nsec_ble_service_handle * handle);
 
 void nsec_ble_hid_add_device(void);
 void nsec_ble_battery_add(void);
 
+// Bulk transfers of blobs larger than a value, on a vendor service of their
+// own. The phone writes packets without response to the RX characteristic
+// and gets the others in notifications of the TX one, which it turns on
+// first. As many go out per connection event as the stack has buffers for.
+// Numbers are big endian, a packet is at most NSEC_BLE_NOTIFY_MAX_LENGTH
+// bytes:
+//
+//   phone  PUSH   blob, size (32 bits), CRC32 (32 bits)
+//          PULL   blob, offset (32 bits)
+//          DATA   offset (24 bits), data...
+//          ACK    offset (32 bits)    Of a pull, received in order up to it
+//          ABORT
+//   badge  READY  status, size (32 bits), CRC32 (32 bits)
+//          DATA   offset (24 bits), data...
+//          ACK    offset (32 bits)    Of a push, received in order up to it
+//          DONE   status
+//
+// PUSH and PULL get READY back, or DONE when refused. The CRC32 is the one
+// of zlib. The sender runs at most NSEC_BLE_BULK_WINDOW packets ahead of the
+// last ACK, the badge acks a push every half window and at its end. DATA
+// out of order is dropped and gets an ACK with the offset expected, once:
+// the phone goes back to it. A pull goes back with another PULL. A push
+// ends with DONE once its CRC32 is checked, a pull once the phone has it
+// all. A new PUSH or PULL, ABORT or a disconnection ends the transfer in
+// progress, one at a time.
+#define NSEC_BLE_BULK_UUID_RX       (0x4201)
+#define NSEC_BLE_BULK_UUID_TX       (0x4202)
+
+#define NSEC_BLE_BULK_PUSH          (0x01)
+#define NSEC_BLE_BULK_PULL          (0x02)
+#define NSEC_BLE_BULK_DATA          (0x03)
+#define NSEC_BLE_BULK_ACK           (0x04)
+#define NSEC_BLE_BULK_ABORT         (0x05)
+#define NSEC_BLE_BULK_READY         (0x81)
+#define NSEC_BLE_BULK_DATA_OUT      (0x83)
+#define NSEC_BLE_BULK_ACK_OUT       (0x84)
+#define NSEC_BLE_BULK_DONE          (0x85)
+
+#define NSEC_BLE_BULK_STATUS_OK             (0)
+#define NSEC_BLE_BULK_STATUS_UNKNOWN_BLOB   (1)
+#define NSEC_BLE_BULK_STATUS_BAD_SIZE       (2)
+#define NSEC_BLE_BULK_STATUS_BAD_CRC        (3)
+#define NSEC_BLE_BULK_STATUS_REFUSED        (4) // By the blob, busy or not that way
+#define NSEC_BLE_BULK_STATUS_ABORTED        (5)
+#define NSEC_BLE_BULK_STATUS_BAD_OFFSET     (6)
+
+#define NSEC_BLE_BULK_DATA_HEADER_SIZE  (4)
+#define NSEC_BLE_BULK_CHUNK_SIZE        (NSEC_BLE_NOTIFY_MAX_LENGTH - NSEC_BLE_BULK_DATA_HEADER_SIZE)
+#define NSEC_BLE_BULK_MAX_SIZE          (0xFFFFFF)
+#define NSEC_BLE_BULK_WINDOW            (12)
+
+// Called from the scheduler. A blob without push or pull refuses it.
+typedef struct {
+    uint8_t id;
+    // false refuses the push
+    bool (*push_begin)(uint32_t size);
+    // In order, each byte once
+    void (*push_data)(uint32_t offset, const uint8_t * data, uint8_t length);
+    // complete is false when aborted or the CRC32 is wrong
+    void (*push_end)(bool complete);
+    // The data, kept as it is until the pull is done, NULL refuses it
+    const uint8_t * (*pull)(uint32_t * size, uint32_t * crc);
+} nsec_ble_bulk_blob_t;
+
+// After the first vendor service, the one advertised. blobs is kept.
+void nsec_ble_bulk_add(const nsec_ble_bulk_blob_t * blobs, uint8_t count);
+
 #endif /* nsec_ble_h */
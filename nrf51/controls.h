@@ -10,8 +10,7 @@
 #define controls_h
 
 #include <stdbool.h>
-
-#define NSEC_CONTROLS_LIMIT_MAX_HANDLERS (8)
+#include <stdint.h>
 
 typedef enum {
     BUTTON_UP,
@@ -22,10 +21,33 @@ typedef enum {
     BUTTON_BACK,
 } button_t;
 
-typedef void (*button_handler)(button_t button);
-
-void nsec_controls_add_handler(button_handler handler);
+#define BUTTON_COUNT (BUTTON_BACK + 1)
 
-void nsec_controls_trigger(button_t button);
+typedef enum {
+    BUTTON_GESTURE_PRESS,       // Finger down, on the direction cross once it
+                                // is not the start of a swipe (at most 80 ms)
+    BUTTON_GESTURE_RELEASE,     // Finger up
+    BUTTON_GESTURE_LONG_PRESS,  // Held down, sent once before the first repeat
+    BUTTON_GESTURE_REPEAT,      // Still held down, faster and faster
+    BUTTON_GESTURE_DOUBLE_TAP,  // Second quick press, sent after its PRESS
+    BUTTON_GESTURE_SWIPE,       // Finger slid across pads, button is the direction.
+                                // The pads it went over send no PRESS.
+} button_gesture_type_t;
+
+typedef struct {
+    button_gesture_type_t type;
+    // For a swipe, BUTTON_UP, BUTTON_DOWN, BUTTON_LEFT or BUTTON_RIGHT
+    button_t button;
+    // Repeats sent so far for this press, 1 on the first REPEAT
+    uint8_t repeat_count;
+} button_gesture_t;
+
+typedef void (*button_gesture_handler)(const button_gesture_t * gesture);
+
+// The navigator routes the gestures to the screen shown
+void nsec_controls_set_handler(button_gesture_handler handler);
+
+// Must be called from the main context (app_scheduler), never from an IRQ
+void nsec_controls_trigger(const button_gesture_t * gesture);
 
 #endif /* controls_h */
@@ -0,0 +1,364 @@
+//
+//  display_stream.c
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#include "display_stream.h"
+#include "boards.h"
+
+#include <string.h>
+
+#include <nrf51.h>
+#include <app_timer.h>
+#include <app_scheduler.h>
+#include <app_error.h>
+
+#include "navigator.h"
+#include "nsec_link.h"
+#include "ssd1306.h"
+#include "touch_button.h"
+
+// Bytes from the SPIS interrupt, decoded from the scheduler. Power of two.
+#define DISPLAY_STREAM_RING_SIZE  512
+// The STM32 sees the hold one frame late and may have one more on its way,
+// with room to spare for a retransmit
+#define DISPLAY_STREAM_HOLD_ROOM  (4 * NSEC_LINK_MAX_PAYLOAD)
+#define DISPLAY_STREAM_REPORT_MS  1000
+// The stream owns the display until this long after its last frame
+#define DISPLAY_STREAM_ACTIVE_MS  2000
+#define DISPLAY_STREAM_CHECK_MS   500
+
+#define DISPLAY_STREAM_TICKS(ms) APP_TIMER_TICKS(ms, APP_TIMER_PRESCALER)
+#define DISPLAY_STREAM_TICKS_PER_S (32768 / (APP_TIMER_PRESCALER + 1))
+
+// Single producer (SPIS IRQ) and single consumer (scheduler)
+static uint8_t ring[DISPLAY_STREAM_RING_SIZE];
+static volatile uint16_t ring_head = 0; // Written by the IRQ only
+static volatile uint16_t ring_tail = 0; // Written by the scheduler only
+static volatile bool process_scheduled = false;
+static volatile bool overrun = false;
+
+static struct {
+    uint8_t command;        // 0 between commands
+    uint8_t args[4];
+    uint8_t arg_count;      // Received so far
+    uint8_t page;
+    uint8_t column;         // Where the next COPY byte goes
+    uint8_t data_left;      // COPY bytes still to come
+    bool in_frame;
+    bool skipping;          // Up to the next FRAME, after an error
+    bool frame_valid;       // A frame number was seen
+    uint16_t frame;
+    uint8_t first_page;     // Touched by the frame, none when first > last
+    uint8_t last_page;
+} decoder;
+
+static display_stream_stats_t stats;
+
+static struct {
+    bool shown;             // A frame was shown since boot
+    uint32_t last_show;     // RTC ticks
+    uint32_t start;         // Of the report period, RTC ticks
+    uint32_t frames;        // Shown in the report period
+} timing;
+
+// The UI is suspended while the stream owns the display
+static struct {
+    bool owner;
+    uint32_t last_frame;    // RTC ticks, of the last FRAME or SHOW
+} display;
+
+static app_timer_id_t release_timer;
+
+static uint32_t display_stream_elapsed(uint32_t since) {
+    uint32_t now, elapsed;
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, since, &elapsed);
+    return elapsed;
+}
+
+static void display_stream_error(void) {
+    stats.decode_errors++;
+    if(decoder.in_frame) {
+        stats.frames_dropped++;
+        decoder.in_frame = false;
+    }
+    decoder.command = 0;
+    decoder.data_left = 0;
+    decoder.skipping = true;
+}
+
+static void display_stream_report(void) {
+    uint8_t record[NSEC_LINK_DISPLAY_STATS_SIZE] = {
+        stats.frames_shown >> 24, stats.frames_shown >> 16, stats.frames_shown >> 8, stats.frames_shown,
+        stats.frames_dropped >> 24, stats.frames_dropped >> 16, stats.frames_dropped >> 8, stats.frames_dropped,
+        stats.decode_errors >> 8, stats.decode_errors,
+        stats.fps_x10 >> 8, stats.fps_x10,
+    };
+    // A report lost to a full queue is made up for by the next one
+    touch_link_send(NSEC_LINK_RECORD_DISPLAY_STATS, record, sizeof(record));
+}
+
+static void display_stream_show(void) {
+    decoder.in_frame = false;
+    if(decoder.first_page <= decoder.last_page) {
+        ssd1306_show_pages(decoder.first_page, decoder.last_page);
+    }
+    stats.frames_shown++;
+    app_timer_cnt_get(&display.last_frame);
+
+    if(!timing.shown || display_stream_elapsed(timing.last_show) >= DISPLAY_STREAM_TICKS(DISPLAY_STREAM_ACTIVE_MS)) {
+        // The first frame in a while starts a new period
+        app_timer_cnt_get(&timing.start);
+        timing.frames = 0;
+    }
+    timing.shown = true;
+    app_timer_cnt_get(&timing.last_show);
+    timing.frames++;
+
+    uint32_t elapsed = display_stream_elapsed(timing.start);
+    if(elapsed >= DISPLAY_STREAM_TICKS(DISPLAY_STREAM_REPORT_MS)) {
+        stats.fps_x10 = timing.frames * 10 * DISPLAY_STREAM_TICKS_PER_S / elapsed;
+        display_stream_report();
+        app_timer_cnt_get(&timing.start);
+        timing.frames = 0;
+    }
+}
+
+// The UI stays off the framebuffer from the first frame, and its menu off
+// the pads
+static bool display_stream_take(void) {
+    if(!display.owner) {
+        if(!ssd1306_suspend_ui()) {
+            // A screen push has it
+            return false;
+        }
+        display.owner = true;
+        uint32_t err_code = app_timer_start(release_timer, DISPLAY_STREAM_TICKS(DISPLAY_STREAM_CHECK_MS), NULL);
+        APP_ERROR_CHECK(err_code);
+    }
+    app_timer_cnt_get(&display.last_frame);
+    return true;
+}
+
+// No frame for a while, the current screen is drawn again. A frame cut
+// short is dropped, its spans would land on the UI.
+static void display_stream_check_release(void * p_context) {
+    if(!display.owner ||
+       display_stream_elapsed(display.last_frame) < DISPLAY_STREAM_TICKS(DISPLAY_STREAM_ACTIVE_MS)) {
+        return;
+    }
+    app_timer_stop(release_timer);
+    if(decoder.in_frame) {
+        stats.frames_dropped++;
+        decoder.in_frame = false;
+    }
+    decoder.command = 0;
+    decoder.data_left = 0;
+    decoder.skipping = true;
+    display.owner = false;
+    ssd1306_resume_ui();
+    nsec_nav_redraw();
+}
+
+static uint8_t display_stream_arg_count(uint8_t command) {
+    switch (command) {
+        case DISPLAY_STREAM_FRAME:
+        case DISPLAY_STREAM_SHOW:
+            return 2;
+        case DISPLAY_STREAM_COPY:
+            return 3;
+        case DISPLAY_STREAM_FILL:
+            return 4;
+        default:
+            return 0;
+    }
+}
+
+// The pages and columns of a span, false when it is off the display
+static bool display_stream_span(uint8_t page, uint8_t column, uint8_t count) {
+    if(!decoder.in_frame || count == 0 || page >= SSD1306_LCDPAGES ||
+       column + count > SSD1306_LCDWIDTH) {
+        return false;
+    }
+    if(page < decoder.first_page) {
+        decoder.first_page = page;
+    }
+    if(page > decoder.last_page) {
+        decoder.last_page = page;
+    }
+    return true;
+}
+
+static void display_stream_command(void) {
+    const uint8_t * args = decoder.args;
+    uint16_t number = args[0] << 8 | args[1];
+    uint8_t command = decoder.command;
+    decoder.command = 0;
+
+    switch (command) {
+        case DISPLAY_STREAM_FRAME:
+            if(!display_stream_take()) {
+                // Tried again with the next one, which counts this one
+                // in its gap
+                decoder.skipping = true;
+                return;
+            }
+            if(decoder.in_frame) {
+                // The last one never got its SHOW
+                stats.frames_dropped++;
+            }
+            else if(decoder.frame_valid) {
+                // Numbers going back are a new stream, not a gap
+                uint16_t gap = number - decoder.frame - 1;
+                if(gap < 0x8000) {
+                    stats.frames_dropped += gap;
+                }
+            }
+            decoder.frame = number;
+            decoder.frame_valid = true;
+            decoder.in_frame = true;
+            decoder.first_page = SSD1306_LCDPAGES;
+            decoder.last_page = 0;
+            break;
+
+        case DISPLAY_STREAM_COPY:
+            if(!display_stream_span(args[0], args[1], args[2])) {
+                display_stream_error();
+                return;
+            }
+            decoder.page = args[0];
+            decoder.column = args[1];
+            decoder.data_left = args[2];
+            break;
+
+        case DISPLAY_STREAM_FILL:
+            if(!display_stream_span(args[0], args[1], args[2])) {
+                display_stream_error();
+                return;
+            }
+            ssd1306_fill_span(args[0], args[1], args[3], args[2]);
+            break;
+
+        case DISPLAY_STREAM_SHOW:
+            if(!decoder.in_frame || number != decoder.frame) {
+                display_stream_error();
+                return;
+            }
+            display_stream_show();
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void display_stream_decode(uint8_t byte) {
+    if(decoder.skipping) {
+        if(byte != DISPLAY_STREAM_FRAME) {
+            return;
+        }
+        decoder.skipping = false;
+    }
+    if(decoder.command == 0) {
+        if(display_stream_arg_count(byte) == 0) {
+            display_stream_error();
+            return;
+        }
+        decoder.command = byte;
+        decoder.arg_count = 0;
+        return;
+    }
+    decoder.args[decoder.arg_count++] = byte;
+    if(decoder.arg_count == display_stream_arg_count(decoder.command)) {
+        display_stream_command();
+    }
+}
+
+static void display_stream_process(void * p_event_data, uint16_t event_size) {
+    // Cleared first: bytes queued from now on schedule another run
+    process_scheduled = false;
+    if(overrun) {
+        overrun = false;
+        display_stream_error();
+    }
+    while(ring_tail != ring_head) {
+        uint16_t tail = ring_tail;
+        uint16_t index = tail % DISPLAY_STREAM_RING_SIZE;
+        if(decoder.data_left == 0) {
+            display_stream_decode(ring[index]);
+            ring_tail = tail + 1;
+            continue;
+        }
+        // COPY data goes to the framebuffer as it is, up to the end of the
+        // ring or of what was received
+        uint16_t length = DISPLAY_STREAM_RING_SIZE - index;
+        if(length > (uint16_t)(ring_head - tail)) {
+            length = ring_head - tail;
+        }
+        if(length > decoder.data_left) {
+            length = decoder.data_left;
+        }
+        ssd1306_write_span(decoder.page, decoder.column, &ring[index], length);
+        decoder.column += length;
+        decoder.data_left -= length;
+        ring_tail = tail + length;
+    }
+}
+
+// From the SPIS interrupt
+static void display_stream_schedule(void) {
+    if(!process_scheduled) {
+        process_scheduled = true;
+        if(app_sched_event_put(NULL, 0, display_stream_process) != NRF_SUCCESS) {
+            // Scheduler queue full, the next frame from the STM32 will try again
+            process_scheduled = false;
+        }
+    }
+}
+
+void display_stream_receive(const uint8_t * data, uint8_t length) {
+    uint16_t head = ring_head;
+    if(DISPLAY_STREAM_RING_SIZE - (uint16_t)(head - ring_tail) < length) {
+        stats.overruns++;
+        overrun = true;
+    }
+    else {
+        for(uint8_t i = 0; i < length; i++) {
+            ring[head++ % DISPLAY_STREAM_RING_SIZE] = data[i];
+        }
+        stats.bytes += length;
+        // The bytes must be written before the consumer can see them
+        __DMB();
+        ring_head = head;
+    }
+    display_stream_schedule();
+}
+
+bool display_stream_should_hold(void) {
+    if(ring_head != ring_tail) {
+        // Held records never come to schedule the decoding again
+        display_stream_schedule();
+    }
+    return DISPLAY_STREAM_RING_SIZE - (uint16_t)(ring_head - ring_tail) < DISPLAY_STREAM_HOLD_ROOM;
+}
+
+bool display_stream_active(void) {
+    return display.owner;
+}
+
+display_stream_stats_t display_stream_get_stats(void) {
+    return stats;
+}
+
+void display_stream_init(void) {
+    memset(&decoder, 0, sizeof(decoder));
+    memset(&stats, 0, sizeof(stats));
+    memset(&timing, 0, sizeof(timing));
+    memset(&display, 0, sizeof(display));
+    decoder.skipping = true;
+    uint32_t err_code = app_timer_create(&release_timer, APP_TIMER_MODE_REPEATED, display_stream_check_release);
+    APP_ERROR_CHECK(err_code);
+}
@@ -0,0 +1,52 @@
+//
+//  display_stream.h
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#ifndef display_stream_h
+#define display_stream_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Frames streamed by a host on the USB serial port of the STM32 (set to
+// CDC_DISPLAY_BITRATE), relayed in NSEC_LINK_RECORD_DISPLAY_DATA records and
+// written straight into the framebuffer. Only what changed since the last
+// frame is sent, as spans of a page in the display's own layout (no
+// rotation), with runs of one byte sent once:
+//
+//   FRAME  number (16 bits)                 Starts a frame
+//   COPY   page, column, count, data...     count bytes, 1 to 128
+//   FILL   page, column, count, value       count times the same byte
+//   SHOW   number (16 bits)                 Ends the frame, the pages
+//                                           touched go to the display
+//
+// Numbers are big endian. Records may cut a command anywhere. A frame number
+// skipped, or a frame cut short by a bad command, counts as dropped; the
+// decoder then skips everything up to the next FRAME.
+#define DISPLAY_STREAM_FRAME    0xD0
+#define DISPLAY_STREAM_COPY     0xD1
+#define DISPLAY_STREAM_FILL     0xD2
+#define DISPLAY_STREAM_SHOW     0xD3
+
+typedef struct {
+    uint32_t bytes;
+    uint32_t frames_shown;
+    uint32_t frames_dropped;
+    uint16_t decode_errors;
+    uint16_t overruns;          // Records lost, the link hold came too late
+    uint16_t fps_x10;           // Over the last report period
+} display_stream_stats_t;
+
+void display_stream_init(void);
+// Called from the SPIS interrupt, for each display record
+void display_stream_receive(const uint8_t * data, uint8_t length);
+// Called from the SPIS interrupt: the STM32 should hold its display records
+bool display_stream_should_hold(void);
+// Frames came recently, the stream owns the display and the UI is suspended
+bool display_stream_active(void);
+display_stream_stats_t display_stream_get_stats(void);
+
+#endif /* display_stream_h */
@@ -0,0 +1,145 @@
+from PIL import Image
+import argparse
+import os
+
+# Panel geometry, see ssd1306.h
+LCD_WIDTH = 128
+LCD_HEIGHT = 64
+
+C_TEMPLATE="""/*
+    This file was automatically genereted by """ + os.path.basename(__file__) + """ from {scene:s}
+    Rows {y:d} to {last:d}, page-native for rotation {rotation:d}. Use with gfx_blitRows.
+*/
+const unsigned char {var_name:s}[] = {{
+    {byte_array:s}
+}};
+const unsigned int {var_name:s}_y = {y:d};
+
+const unsigned int {var_name:s}_height = {height:d};
+"""
+
+class Canvas(object):
+    def __init__(self):
+        self.pixels = [[0] * LCD_WIDTH for _ in range(LCD_HEIGHT)]
+
+    def pixel(self, x, y, color):
+        if 0 <= x < LCD_WIDTH and 0 <= y < LCD_HEIGHT:
+            self.pixels[y][x] = color
+
+    def fill(self, x, y, w, h, color):
+        for j in range(y, y + h):
+            for i in range(x, x + w):
+                self.pixel(i, j, color)
+
+    def rect(self, x, y, w, h, color):
+        self.fill(x, y, w, 1, color)
+        self.fill(x, y + h - 1, w, 1, color)
+        self.fill(x, y, 1, h, color)
+        self.fill(x + w - 1, y, 1, h, color)
+
+    def bitmap(self, x, y, image, transparent):
+        for j in range(image.height):
+            for i in range(image.width):
+                on = image.getpixel((i, j)) != 0
+                if on or not transparent:
+                    self.pixel(x + i, y + j, 1 if on else 0)
+
+    def pages(self, y, height, rotation):
+        # Physical rows covered by the logical rows y..y+height-1
+        if rotation == 0:
+            first = y
+        elif rotation == 2:
+            first = LCD_HEIGHT - (y + height)
+        else:
+            raise Exception("Rotation {:d} has no page-aligned rows.".format(rotation))
+        data = []
+        for page in range(first // 8, (first + height) // 8):
+            for column in range(LCD_WIDTH):
+                byte = 0
+                for bit in range(8):
+                    px, py = column, page * 8 + bit
+                    if rotation == 2:
+                        px, py = LCD_WIDTH - 1 - px, LCD_HEIGHT - 1 - py
+                    if self.pixels[py][px]:
+                        byte |= 1 << bit
+                data.append(byte)
+        return data
+
+def parse_color(args, index):
+    if len(args) <= index:
+        return 1
+    return {"white": 1, "black": 0}[args[index]]
+
+def open_image(scene_dir, path):
+    image = Image.open(os.path.join(scene_dir, path))
+    if image.mode != '1':
+        raise Exception("Image must be in 1-bit color mode.")
+    return image
+
+# A scene is a list of drawing commands, one per line, in drawing order:
+#   rows y height            logical rows to emit, multiples of 8
+#   fill x y w h [color]     like gfx_fillRect
+#   rect x y w h [color]     like gfx_drawRect
+#   hline x y w [color]      like gfx_drawFastHLine
+#   vline x y h [color]      like gfx_drawFastVLine
+#   bitmap x y file.png      like gfx_drawBitmapBg(..., WHITE, BLACK)
+#   overlay x y file.png     like gfx_drawBitmap(..., WHITE)
+# The canvas starts black, color is white (default) or black.
+def render_scene(input_file_path):
+    canvas = Canvas()
+    scene_dir = os.path.dirname(input_file_path)
+    rows = None
+    with open(input_file_path) as f:
+        for line_number, line in enumerate(f, 1):
+            args = line.split("#", 1)[0].split()
+            if not args:
+                continue
+            command, args = args[0], args[1:]
+            try:
+                if command == "rows":
+                    rows = (int(args[0]), int(args[1]))
+                elif command == "fill":
+                    canvas.fill(*[int(a) for a in args[:4]], color=parse_color(args, 4))
+                elif command == "rect":
+                    canvas.rect(*[int(a) for a in args[:4]], color=parse_color(args, 4))
+                elif command == "hline":
+                    canvas.fill(int(args[0]), int(args[1]), int(args[2]), 1, parse_color(args, 3))
+                elif command == "vline":
+                    canvas.fill(int(args[0]), int(args[1]), 1, int(args[2]), parse_color(args, 3))
+                elif command in ("bitmap", "overlay"):
+                    image = open_image(scene_dir, args[2])
+                    canvas.bitmap(int(args[0]), int(args[1]), image, command == "overlay")
+                else:
+                    raise Exception("Unknown command " + command)
+            except (IndexError, ValueError, KeyError):
+                raise Exception("{:s}:{:d}: {:s}".format(input_file_path, line_number, line.strip()))
+    if rows is None or rows[0] % 8 or rows[1] % 8 or rows[1] <= 0 or rows[0] + rows[1] > LCD_HEIGHT:
+        raise Exception("Scene needs page-aligned rows inside the display.")
+    return canvas, rows
+
+def encode_scene(input_file_path, output_file_path, rotation):
+    canvas, (y, height) = render_scene(input_file_path)
+    array = ",".join([hex(b) for b in canvas.pages(y, height, rotation)])
+
+    with open(output_file_path, "w") as f:
+        f.write(C_TEMPLATE.format(
+            scene=input_file_path,
+            byte_array=array,
+            var_name=os.path.splitext(os.path.basename(output_file_path))[0],
+            y=y,
+            last=y + height - 1,
+            height=height,
+            rotation=rotation
+        ))
+
+if __name__ == "__main__":
+    parser = argparse.ArgumentParser(description='Pre-render the static part of a screen to a page-native C array.')
+    parser.add_argument('-i', '--infile',
+                        help='Scene file')
+    parser.add_argument('-o', '--outfile',
+                        help='Output file')
+    parser.add_argument('-r', '--rotation', type=int, default=2,
+                        help='Display rotation, must match gfx_rotation in ssd1306.c')
+
+    args = parser.parse_args()
+    encode_scene(args.infile, args.outfile, args.rotation)
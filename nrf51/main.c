@@ -32,13 +32,19 @@
 #include "ssd1306.h"
 
 #include "images/nsec_logo_bitmap.c"
+#include "images/main_menu_scene.c"
 #include "animal_care.h"
 #include "status_bar.h"
 #include "menu.h"
+#include "navigator.h"
 #include "nsec_conf_schedule.h"
 #include "nsec_settings.h"
 #include "battery.h"
 #include "touch_button.h"
+#include "nsec_latency.h"
+#include "display_stream.h"
+#include "nsec_provision.h"
+#include "nsec_offload.h"
 
 static char g_device_id[32];
 
@@ -101,6 +107,11 @@ static void heartbeat_timeout_handler(void * p_context) {
     NRF_WDT->RR[0] = WDT_RR_RR_Reload;
 }
 
+// A screen pushed over BLE stays up this long, then the UI comes back
+#define SCREEN_PUSH_SHOW_MS 5000
+static app_timer_id_t m_screen_push_timer_id;
+static void screen_push_timeout_handler(void * p_context);
+
 /**
  * Init functions
  */
@@ -115,10 +126,15 @@ static void timers_init(void) {
             APP_TIMER_MODE_REPEATED,
             heartbeat_timeout_handler);
     APP_ERROR_CHECK(err_code);
+
+    err_code = app_timer_create(&m_screen_push_timer_id,
+            APP_TIMER_MODE_SINGLE_SHOT,
+            screen_push_timeout_handler);
+    APP_ERROR_CHECK(err_code);
 }
 
 void sys_evt_dispatch(uint32_t evt_id) {
-
+    nsec_provision_on_sys_evt(evt_id);
 }
 
 static void softdevice_init(void) {
@@ -140,56 +156,164 @@ static void application_timers_start(void) {
     APP_ERROR_CHECK(err_code);
 }
 
+// Top of the logo once nsec_intro is done, and in images/main_menu.scene
+#define MAIN_MENU_LOGO_Y 12
+
+// The logo of the provisioned bundle, if it has one that fits between the
+// status bar and the menu
+static const uint8_t * provisioned_logo(uint8_t * width, uint8_t * height) {
+    uint16_t length;
+    const uint8_t * entry = nsec_provision_find(NSEC_BUNDLE_BITMAP, NSEC_BUNDLE_BITMAP_LOGO, &length);
+    if(entry == NULL || length < 2) {
+        return NULL;
+    }
+    *width = entry[0];
+    *height = entry[1];
+    if(*width == 0 || *width > 128 || *height == 0 ||
+       MAIN_MENU_LOGO_Y + *height > main_menu_scene_y + main_menu_scene_height ||
+       length < 2 + (*width + 7) / 8 * *height) {
+        return NULL;
+    }
+    return entry + 2;
+}
+
 static void nsec_intro(void) {
+    const uint8_t * logo = nsec_logo_bitmap;
+    uint8_t width = nsec_logo_bitmap_width;
+    uint8_t height = nsec_logo_bitmap_height;
+    const uint8_t * provisioned = provisioned_logo(&width, &height);
+    if(provisioned != NULL) {
+        logo = provisioned;
+    }
+    int16_t x = (128 - width) / 2;
     gfx_fillScreen(BLACK);
-    gfx_drawBitmap(17, 60, nsec_logo_bitmap, nsec_logo_bitmap_width, nsec_logo_bitmap_height, WHITE);
+    gfx_drawBitmap(x, 60, logo, width, height, WHITE);
     gfx_update();
-    for(int y = 60; y > 11; y--) {
+    for(int y = 60; y >= MAIN_MENU_LOGO_Y; y--) {
         gfx_fillScreen(BLACK);
-        gfx_drawBitmap(17, y, nsec_logo_bitmap, nsec_logo_bitmap_width, nsec_logo_bitmap_height, WHITE);
+        gfx_drawBitmap(x, y, logo, width, height, WHITE);
         gfx_update();
     }
 }
 
-void open_animal_care(uint8_t item);
-void open_conference_schedule(uint8_t item);
-void open_settings(uint8_t item);
+static void main_menu_draw(void) {
+    // The logo where nsec_intro left it, see images/main_menu.scene.
+    // The status bar and the menu cover the rest of the screen.
+    uint8_t width, height;
+    const uint8_t * logo = provisioned_logo(&width, &height);
+    if(logo != NULL) {
+        gfx_fillRect(0, main_menu_scene_y, 128, main_menu_scene_height, BLACK);
+        gfx_drawBitmap((128 - width) / 2, MAIN_MENU_LOGO_Y, logo, width, height, WHITE);
+    }
+    else {
+        gfx_blitRows(main_menu_scene_y, main_menu_scene_height, main_menu_scene);
+    }
+    nsec_status_bar_ui_redraw();
+}
+
+static void load_badge_class(void) {
+    uint16_t length;
+    const char * badge_class = (const char *) nsec_provision_find(NSEC_BUNDLE_STRING, NSEC_BUNDLE_STRING_BADGE_CLASS, &length);
+    if(badge_class == NULL || length == 0 || badge_class[length - 1] != '\0') {
+        badge_class = "";
+    }
+    nsec_status_set_badge_class((char *) badge_class);
+}
 
-static menu_item_s main_menu_items[] = {
+static const menu_item_s main_menu_items[] = {
     {
         .label = "Conference schedule",
-        .handler = open_conference_schedule,
+        .screen = &nsec_schedule_screen,
     }, {
         .label = "My Cyber Pet",
-        .handler = open_animal_care,
+        .screen = &animal_screen,
     }, {
         .label = "Settings",
-        .handler = open_settings,
+        .screen = &nsec_settings_screen,
     }
 };
 
-void open_animal_care(uint8_t item) {
-    menu_close();
-    animal_show();
+static const nsec_screen_t main_menu_screen = {
+    .menu_items = main_menu_items,
+    .menu_item_count = NSEC_SCREEN_MENU_COUNT(main_menu_items),
+    .menu_frame = { 0, 64 - 8, 128, 8 },
+    .draw = main_menu_draw,
+};
+
+// A bundle was committed, or the one in use is about to be erased: back to
+// the main menu, so no screen shows what was read from it
+static void on_provision_change(void) {
+    nsec_nav_home();
+    nsec_schedule_load();
+    load_badge_class();
+    main_menu_draw();
+    gfx_update();
+}
+
+// Bulk transfers over BLE, see nsec_ble.h: the bundle in use can be pulled,
+// a frame pushed to the screen. A pull cut by a new bundle fails its CRC32.
+enum {
+    BLE_BLOB_BUNDLE = 0,
+    BLE_BLOB_SCREEN = 1,
+};
+
+// The frame is written straight into the framebuffer, with the UI suspended
+// from the first byte to the end of its time on screen
+static bool screen_push_owner = false;
+
+static void screen_push_release(void) {
+    screen_push_owner = false;
+    ssd1306_resume_ui();
+    nsec_nav_redraw();
 }
 
-void open_conference_schedule(uint8_t item) {
-    menu_close();
-    nsec_schedule_show_dates();
+static void screen_push_timeout_handler(void * p_context) {
+    if(screen_push_owner) {
+        screen_push_release();
+    }
 }
 
-void open_settings(uint8_t item) {
-    menu_close();
-    nsec_setting_show();
+static bool screen_push_begin(uint32_t size) {
+    if(size != SSD1306_LCDWIDTH * SSD1306_LCDPAGES) {
+        return false;
+    }
+    if(screen_push_owner) {
+        // Over the last one pushed, still on screen
+        app_timer_stop(m_screen_push_timer_id);
+        return true;
+    }
+    // Refused while the display stream has the screen
+    screen_push_owner = ssd1306_suspend_ui();
+    return screen_push_owner;
 }
 
-void show_main_menu(void) {
-    gfx_fillScreen(BLACK);
-    nsec_intro();
-    nsec_status_bar_ui_redraw();
-    menu_init(0, 64-8, 128, 8, sizeof(main_menu_items) / sizeof(main_menu_items[0]), main_menu_items);
+static void screen_push_data(uint32_t offset, const uint8_t * data, uint8_t length) {
+    while(length > 0) {
+        uint8_t column = offset % SSD1306_LCDWIDTH;
+        uint8_t count = SSD1306_LCDWIDTH - column < length ? SSD1306_LCDWIDTH - column : length;
+        ssd1306_write_span(offset / SSD1306_LCDWIDTH, column, data, count);
+        offset += count;
+        data += count;
+        length -= count;
+    }
+}
+
+static void screen_push_end(bool complete) {
+    if(!complete) {
+        // What came of the frame never reached the display
+        screen_push_release();
+        return;
+    }
+    ssd1306_show_pages(0, SSD1306_LCDPAGES - 1);
+    uint32_t err_code = app_timer_start(m_screen_push_timer_id, APP_TIMER_TICKS(SCREEN_PUSH_SHOW_MS, APP_TIMER_PRESCALER), NULL);
+    APP_ERROR_CHECK(err_code);
 }
 
+static const nsec_ble_bulk_blob_t ble_blobs[] = {
+    { .id = BLE_BLOB_BUNDLE, .pull = nsec_provision_bundle },
+    { .id = BLE_BLOB_SCREEN, .push_begin = screen_push_begin, .push_data = screen_push_data, .push_end = screen_push_end },
+};
+
 /**
  * Main
  */
@@ -211,6 +335,11 @@ int main() {
     APP_GPIOTE_INIT(2);
 
     ssd1306_init();
+    nsec_latency_init();
+    display_stream_init();
+    nsec_provision_init(on_provision_change);
+    nsec_schedule_load();
+    nsec_offload_init();
     touch_init();
     gfx_setTextBackgroundColor(WHITE, BLACK);
 
@@ -221,17 +350,23 @@ int main() {
     nsec_ble_add_device_information_service(g_device_id, "NSEC 2016 Badge", NULL, NULL, NULL, NULL);
 
     animal_init();
+    nsec_ble_bulk_add(ble_blobs, sizeof(ble_blobs) / sizeof(ble_blobs[0]));
+    nsec_latency_ble_add();
 
     nsec_status_bar_init();
     nsec_status_set_name(g_device_id);
-    nsec_status_set_badge_class("");
+    load_badge_class();
     nsec_status_set_ble_status(STATUS_BLUETOOTH_ON);
 
-    show_main_menu();
+    nsec_intro();
+    nsec_nav_init(&main_menu_screen);
 
     while (true) {
         app_sched_execute();
 
+        // Nothing left to do until the next event, get the next menu rows ready
+        menu_prerender();
+
         uint32_t err_code = sd_app_evt_wait();
         APP_ERROR_CHECK(err_code);
     }
@@ -9,6 +9,17 @@
 #define FONT_SIZE_WIDTH  (6)
 #define FONT_SIZE_HEIGHT (8)
 
+// Rows just outside of the view, rendered ahead of time while the CPU is
+// idle so a scroll is only a page copy.
+#define MENU_BAND_ABOVE (0)
+#define MENU_BAND_BELOW (1)
+#define MENU_BAND_EMPTY (0xFF)
+
+typedef struct {
+    uint8_t item_index; // MENU_BAND_EMPTY when the band is stale
+    uint8_t page[SSD1306_LCDWIDTH];
+} menu_band_t;
+
 typedef struct {
     uint16_t pos_x;
     uint16_t pos_y;
@@ -17,30 +28,47 @@ typedef struct {
     uint8_t item_count;
     uint8_t selected_item;
     uint8_t item_on_top;
-    uint8_t is_handling_buttons;
-    menu_item_s items[MENU_LIMIT_MAX_ITEM_COUNT];
+    bool page_aligned; // Rows are whole display pages, scrolling can use the bands
+    const menu_item_s * items;
+    uint8_t label_lengths[MENU_LIMIT_MAX_ITEM_COUNT];
+    menu_band_t bands[2];
 } menu_state_t;
 
 static menu_state_t menu;
+static menu_prerender_stats_t menu_prerender_stats;
 
+static void menu_ui_draw_items(uint8_t start, uint8_t end);
 static void menu_ui_redraw_items(uint8_t start, uint8_t end);
-void menu_button_handler(button_t button);
 
-void menu_init(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t height, uint8_t item_count, menu_item_s * items) {
-    menu.item_count = 0;
+static void menu_setup(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t height, uint8_t item_count, const menu_item_s * items, const menu_cursor_t * cursor) {
+    menu.items = items;
+    menu.item_count = item_count < MENU_LIMIT_MAX_ITEM_COUNT ? item_count : MENU_LIMIT_MAX_ITEM_COUNT;
     menu.selected_item = 0;
     menu.item_on_top = 0;
+    if(cursor != NULL && cursor->selected_item < menu.item_count) {
+        menu.selected_item = cursor->selected_item;
+        menu.item_on_top = cursor->item_on_top;
+    }
     menu_set_position(pos_x, pos_y, width, height);
-    gfx_fillRect(pos_x, pos_y, width, height, BLACK);
-    for(uint8_t i = 0; i < item_count; i++) {
-        menu_add_item(items + i);
+    menu.bands[MENU_BAND_ABOVE].item_index = MENU_BAND_EMPTY;
+    menu.bands[MENU_BAND_BELOW].item_index = MENU_BAND_EMPTY;
+    for(uint8_t i = 0; i < menu.item_count; i++) {
+        size_t length = strlen(items[i].label);
+        menu.label_lengths[i] = length > UINT8_MAX ? UINT8_MAX : length;
     }
-    menu.is_handling_buttons = 1;
-    nsec_controls_add_handler(menu_button_handler);
 }
 
-void menu_close(void) {
-    menu.is_handling_buttons = 0;
+void menu_init(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t height, uint8_t item_count, const menu_item_s * items, const menu_cursor_t * cursor) {
+    menu_setup(pos_x, pos_y, width, height, item_count, items, cursor);
+    gfx_fillRect(pos_x, pos_y, width, height, BLACK);
+    menu_ui_draw_items(menu.item_on_top, menu.item_on_top + menu.line_height - 1);
+    // The caller usually cleared more than the menu area, flush it all once
+    gfx_update();
+}
+
+// Same as menu_init, for a menu whose pixels are already in the framebuffer
+void menu_restore(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t height, uint8_t item_count, const menu_item_s * items, const menu_cursor_t * cursor) {
+    menu_setup(pos_x, pos_y, width, height, item_count, items, cursor);
 }
 
 void menu_set_position(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t height) {
@@ -48,61 +76,175 @@ void menu_set_position(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t
     menu.pos_y = pos_y;
     menu.col_width = width / FONT_SIZE_WIDTH;
     menu.line_height = height / FONT_SIZE_HEIGHT;
+    menu.page_aligned = pos_x == 0 && width >= SSD1306_LCDWIDTH && pos_y % FONT_SIZE_HEIGHT == 0;
 }
 
-void menu_add_item(menu_item_s * new_item) {
-    if(menu.item_count >= MENU_LIMIT_MAX_ITEM_COUNT) {
-        return;
-    }
-    else {
-        memcpy(menu.items + menu.item_count++, new_item, sizeof(menu.items[0]));
+const menu_item_s * menu_get_selected_item(void) {
+    return &menu.items[menu.selected_item];
+}
+
+menu_cursor_t menu_get_cursor(void) {
+    menu_cursor_t cursor = {
+        .selected_item = menu.selected_item,
+        .item_on_top = menu.item_on_top,
+    };
+    return cursor;
+}
+
+static int16_t menu_ui_item_y(uint8_t item_index) {
+    return menu.pos_y + (item_index - menu.item_on_top) * FONT_SIZE_HEIGHT;
+}
+
+// Width in pixels of the label as it is printed, ellipsis included
+static int16_t menu_ui_item_width(uint8_t item_index) {
+    uint8_t length = menu.label_lengths[item_index];
+    if(length > menu.col_width) {
+        length = menu.col_width;
     }
-    menu_ui_redraw_items(menu.item_count - 1, menu.item_count - 1);
+    return length * FONT_SIZE_WIDTH;
 }
 
-static void menu_ui_redraw_items(uint8_t start, uint8_t end) {
+static void menu_ui_invert_item(uint8_t item_index) {
+    gfx_fillRect(menu.pos_x, menu_ui_item_y(item_index),
+                 menu_ui_item_width(item_index), FONT_SIZE_HEIGHT, INVERSE);
+}
+
+static void menu_ui_draw_items(uint8_t start, uint8_t end) {
     if(start < menu.item_on_top) {
         start = menu.item_on_top;
     }
-    else if(start > menu.item_on_top + menu.line_height) {
+    else if(start >= menu.item_on_top + menu.line_height) {
         return;
     }
-    if(end > menu.item_on_top + menu.line_height) {
-        end = menu.item_on_top + menu.line_height;
+    if(end >= menu.item_on_top + menu.line_height) {
+        end = menu.item_on_top + menu.line_height - 1;
     }
     else if(end < start) {
         return;
     }
     gfx_fillRect(menu.pos_x,
-                 menu.pos_y + FONT_SIZE_HEIGHT * (start - menu.item_on_top),
+                 menu_ui_item_y(start),
                  menu.col_width * FONT_SIZE_WIDTH,
                  (end - start + 1) * FONT_SIZE_HEIGHT,
                  BLACK);
+    gfx_setTextBackgroundColor(WHITE, BLACK);
     for(int item_index = start; item_index < menu.item_count && item_index <= end; item_index++) {
-        gfx_setCursor(menu.pos_x, menu.pos_y + (item_index - menu.item_on_top) * FONT_SIZE_HEIGHT);
-        if(item_index == menu.selected_item) {
-            gfx_setTextBackgroundColor(BLACK,WHITE);
+        gfx_setCursor(menu.pos_x, menu_ui_item_y(item_index));
+        const char * label = menu.items[item_index].label;
+        if(menu.label_lengths[item_index] <= menu.col_width) {
+            for(uint8_t i = 0; i < menu.label_lengths[item_index]; i++) {
+                gfx_putc(label[i]);
+            }
         }
         else {
-            gfx_setTextBackgroundColor(WHITE,BLACK);
+            for(uint8_t i = 0; i < menu.col_width - 1; i++) {
+                gfx_putc(label[i]);
+            }
+            gfx_putc('\x01'); // Elipse: ...
         }
-        char * string = menu.items[item_index].label;
-        if(strlen(string) <= menu.col_width) {
-            gfx_puts(string);
+        if(item_index == menu.selected_item) {
+            menu_ui_invert_item(item_index);
+        }
+    }
+}
+
+static void menu_ui_redraw_items(uint8_t start, uint8_t end) {
+    menu_ui_draw_items(start, end);
+    gfx_updateRows(menu_ui_item_y(start), (end - start + 1) * FONT_SIZE_HEIGHT);
+}
+
+void menu_ui_redraw_all(void) {
+    menu_ui_redraw_items(menu.item_on_top, menu.item_on_top + menu.line_height - 1);
+}
+
+// Move the highlight between two visible rows without drawing any text:
+// both label bands are inverted in place and only their pages are sent.
+static void menu_ui_move_selection(uint8_t from, uint8_t to) {
+    menu_ui_invert_item(from);
+    menu_ui_invert_item(to);
+    uint8_t top = from < to ? from : to;
+    uint8_t bottom = from < to ? to : from;
+    gfx_updateRows(menu_ui_item_y(top), (bottom - top + 1) * FONT_SIZE_HEIGHT);
+}
+
+static void menu_ui_render_band(menu_band_t * band, uint8_t item_index) {
+    memset(band->page, 0, sizeof(band->page));
+    band->item_index = MENU_BAND_EMPTY;
+    if(item_index < menu.item_count) {
+        const char * label = menu.items[item_index].label;
+        bool rendered;
+        if(menu.label_lengths[item_index] <= menu.col_width) {
+            rendered = gfx_renderTextRow(band->page, menu.pos_x, label, menu.label_lengths[item_index]);
         }
         else {
-            char printable[menu.col_width + 1];
-            strncpy(printable, string, sizeof(printable) - 2);
-            printable[menu.col_width - 1] = '\x01'; // Elipse: ...
-            printable[menu.col_width] = '\0';
-            gfx_puts(printable);
+            rendered = gfx_renderTextRow(band->page, menu.pos_x, label, menu.col_width - 1) &&
+                       gfx_renderTextRow(band->page, menu.pos_x + (menu.col_width - 1) * FONT_SIZE_WIDTH, "\x01", 1);
+        }
+        if(!rendered) {
+            return;
         }
     }
-    gfx_update();
+    band->item_index = item_index;
 }
 
-void menu_ui_redraw_all(void) {
-    menu_ui_redraw_items(menu.item_on_top, menu.item_on_top + menu.line_height);
+void menu_prerender(void) {
+    if(!menu.page_aligned || menu.items == NULL) {
+        return;
+    }
+    if(menu.item_on_top > 0 &&
+       menu.bands[MENU_BAND_ABOVE].item_index != menu.item_on_top - 1) {
+        menu_ui_render_band(&menu.bands[MENU_BAND_ABOVE], menu.item_on_top - 1);
+    }
+    // One past the last item is a blank row, it is what scrolls in at the end
+    uint8_t below = menu.item_on_top + menu.line_height;
+    if(below <= menu.item_count &&
+       menu.bands[MENU_BAND_BELOW].item_index != below) {
+        menu_ui_render_band(&menu.bands[MENU_BAND_BELOW], below);
+    }
+}
+
+menu_prerender_stats_t menu_get_prerender_stats(void) {
+    return menu_prerender_stats;
+}
+
+// The view moved by one row (item_on_top is already updated): shift the
+// pages, copy the pre-rendered row in and move the highlight. Returns false
+// when the row was not ready, the caller then redraws everything.
+static bool menu_ui_scroll(MENU_DIRECTION direction, uint8_t previous_selection) {
+    if(!menu.page_aligned) {
+        return false;
+    }
+    int16_t height = menu.line_height * FONT_SIZE_HEIGHT;
+    menu_band_t * band;
+    int16_t band_y;
+    int16_t dy;
+    if(direction == MENU_DIRECTION_DOWN) {
+        band = &menu.bands[MENU_BAND_BELOW];
+        band_y = menu.pos_y + height - FONT_SIZE_HEIGHT;
+        dy = -FONT_SIZE_HEIGHT;
+    }
+    else {
+        band = &menu.bands[MENU_BAND_ABOVE];
+        band_y = menu.pos_y;
+        dy = FONT_SIZE_HEIGHT;
+    }
+    uint8_t wanted = direction == MENU_DIRECTION_DOWN ?
+        menu.item_on_top + menu.line_height - 1 : menu.item_on_top;
+    if(band->item_index != wanted ||
+       !gfx_scrollRows(menu.pos_y, height, dy) ||
+       !gfx_blitRow(band_y, band->page)) {
+        menu_prerender_stats.misses++;
+        return false;
+    }
+    band->item_index = MENU_BAND_EMPTY;
+    if(previous_selection >= menu.item_on_top &&
+       previous_selection < menu.item_on_top + menu.line_height) {
+        menu_ui_invert_item(previous_selection);
+    }
+    menu_ui_invert_item(menu.selected_item);
+    gfx_updateRows(menu.pos_y, height);
+    menu_prerender_stats.hits++;
+    return true;
 }
 
 void menu_change_selected_item(MENU_DIRECTION direction) {
@@ -112,10 +254,12 @@ void menu_change_selected_item(MENU_DIRECTION direction) {
                 menu.selected_item++;
                 if(menu.selected_item >= menu.item_on_top + (menu.line_height - 1)) {
                     menu.item_on_top++;
-                    menu_ui_redraw_all();
+                    if(!menu_ui_scroll(direction, menu.selected_item - 1)) {
+                        menu_ui_redraw_all();
+                    }
                 }
                 else {
-                    menu_ui_redraw_items(menu.selected_item - 1, menu.selected_item);
+                    menu_ui_move_selection(menu.selected_item - 1, menu.selected_item);
                 }
             }
         }
@@ -125,10 +269,12 @@ void menu_change_selected_item(MENU_DIRECTION direction) {
                 menu.selected_item--;
                 if(menu.item_on_top > menu.selected_item) {
                     menu.item_on_top--;
-                    menu_ui_redraw_all();
+                    if(!menu_ui_scroll(direction, menu.selected_item + 1)) {
+                        menu_ui_redraw_all();
+                    }
                 }
                 else {
-                    menu_ui_redraw_items(menu.selected_item, menu.selected_item + 1);
+                    menu_ui_move_selection(menu.selected_item + 1, menu.selected_item);
                 }
             }
         }
@@ -140,6 +286,35 @@ void menu_change_selected_item(MENU_DIRECTION direction) {
     }
 }
 
+// Move the selection by one screen of items and redraw once
+void menu_change_page(MENU_DIRECTION direction) {
+    uint8_t step = menu.line_height > 1 ? menu.line_height - 1 : 1;
+    // Rows kept under the selection when scrolling down, like
+    // menu_change_selected_item does
+    uint8_t keep = menu.line_height > 1 ? menu.line_height - 2 : 0;
+    uint8_t selected = menu.selected_item;
+    switch(direction) {
+        case MENU_DIRECTION_DOWN:
+            selected = selected + step < menu.item_count ? selected + step : menu.item_count - 1;
+            if(selected > menu.item_on_top + keep) {
+                menu.item_on_top = selected - keep;
+            }
+            break;
+        case MENU_DIRECTION_UP:
+            selected = selected > step ? selected - step : 0;
+            if(menu.item_on_top > selected) {
+                menu.item_on_top = selected;
+            }
+            break;
+        default:
+            return;
+    }
+    if(selected != menu.selected_item) {
+        menu.selected_item = selected;
+        menu_ui_redraw_all();
+    }
+}
+
 void menu_trigger_action(void) {
     if(menu.items[menu.selected_item].handler != NULL) {
         menu.items[menu.selected_item].handler(menu.selected_item);
@@ -148,22 +323,20 @@ void menu_trigger_action(void) {
 
 
 void menu_button_handler(button_t button) {
-    if(menu.is_handling_buttons) {
-        switch (button) {
-            case BUTTON_UP:
-            case BUTTON_LEFT:
-                menu_change_selected_item(MENU_DIRECTION_UP);
-                break;
-
-            case BUTTON_DOWN:
-            case BUTTON_RIGHT:
-                menu_change_selected_item(MENU_DIRECTION_DOWN);
-                break;
-            case BUTTON_ENTER:
-                menu_trigger_action();
-                break;
-            default:
-                break;
-        }
+    switch (button) {
+        case BUTTON_UP:
+        case BUTTON_LEFT:
+            menu_change_selected_item(MENU_DIRECTION_UP);
+            break;
+
+        case BUTTON_DOWN:
+        case BUTTON_RIGHT:
+            menu_change_selected_item(MENU_DIRECTION_DOWN);
+            break;
+        case BUTTON_ENTER:
+            menu_trigger_action();
+            break;
+        default:
+            break;
     }
 }
@@ -1,13 +1,26 @@
+#ifndef menu_h
+#define menu_h
 
 #include <stdint.h>
 
-#define MENU_LIMIT_MAX_ITEM_COUNT (10)
+#include "controls.h"
+
+#define MENU_LIMIT_MAX_ITEM_COUNT (32)
+
+struct nsec_screen_s;
+typedef struct nsec_screen_s nsec_screen_t;
 
 typedef struct {
-	char * label;
+	const char * label;
 	void (*handler)(uint8_t item_index);
+	const nsec_screen_t * screen; // Opened by the navigator when selected
 } menu_item_s;
 
+typedef struct {
+	uint8_t selected_item;
+	uint8_t item_on_top;
+} menu_cursor_t;
+
 typedef enum {
 	MENU_DIRECTION_UP,
 	MENU_DIRECTION_DOWN,
@@ -15,10 +28,22 @@ typedef enum {
 	MENU_DIRECTION_RIGHT,
 } MENU_DIRECTION;
 
-void menu_init(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t height, uint8_t item_count, menu_item_s * items);
+typedef struct {
+    uint32_t hits;   // Scrolls served from a row rendered ahead of time
+    uint32_t misses; // Scrolls that had to render on the spot
+} menu_prerender_stats_t;
+
+void menu_init(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t height, uint8_t item_count, const menu_item_s * items, const menu_cursor_t * cursor);
+void menu_restore(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t height, uint8_t item_count, const menu_item_s * items, const menu_cursor_t * cursor);
 void menu_set_position(uint16_t pos_x, uint16_t pos_y, uint16_t width, uint16_t height);
-void menu_add_item(menu_item_s * new_item);
 void menu_ui_redraw_all(void);
 void menu_change_selected_item(MENU_DIRECTION direction);
+void menu_change_page(MENU_DIRECTION direction);
 void menu_trigger_action(void);
-void menu_close(void);
\ No newline at end of file
+const menu_item_s * menu_get_selected_item(void);
+menu_cursor_t menu_get_cursor(void);
+void menu_button_handler(button_t button);
+void menu_prerender(void);
+menu_prerender_stats_t menu_get_prerender_stats(void);
+
+#endif /* menu_h */
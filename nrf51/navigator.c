@@ -0,0 +1,262 @@
+//
+//  navigator.c
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#include "navigator.h"
+#include "ssd1306.h"
+#include "status_bar.h"
+
+#include <stddef.h>
+
+#include <string.h>
+
+typedef struct {
+    const nsec_screen_t * screen;
+    menu_cursor_t cursor; // Saved when a child screen is pushed
+    uint16_t snapshot_offset; // In _nav_snapshot_pool
+    uint16_t snapshot_length; // 0 when there is no snapshot
+} nsec_nav_entry_t;
+
+static nsec_nav_entry_t _nav_stack[NSEC_NAV_LIMIT_MAX_DEPTH];
+static uint8_t _nav_depth = 0;
+
+// Snapshots are stored in stack order, the deepest one at the end
+static uint8_t _nav_snapshot_pool[NSEC_NAV_SNAPSHOT_POOL_SIZE];
+static uint16_t _nav_snapshot_used = 0;
+
+static void _nsec_nav_gesture_handler(const button_gesture_t * gesture);
+
+static void _nsec_nav_show(const nsec_nav_entry_t * entry, const menu_cursor_t * cursor) {
+    const nsec_screen_t * screen = entry->screen;
+    if(screen->draw != NULL) {
+        screen->draw();
+    }
+    if(screen->menu_items != NULL) {
+        menu_init(screen->menu_frame.x, screen->menu_frame.y,
+                  screen->menu_frame.width, screen->menu_frame.height,
+                  screen->menu_item_count, screen->menu_items, cursor);
+    }
+}
+
+// Make room by dropping the snapshot closest to the root, it is the one
+// least likely to be needed soon.
+static bool _nsec_nav_drop_oldest_snapshot(void) {
+    for(uint8_t i = 0; i <= _nav_depth; i++) {
+        nsec_nav_entry_t * entry = &_nav_stack[i];
+        if(entry->snapshot_length == 0) {
+            continue;
+        }
+        uint16_t length = entry->snapshot_length;
+        memmove(_nav_snapshot_pool, _nav_snapshot_pool + length, _nav_snapshot_used - length);
+        _nav_snapshot_used -= length;
+        entry->snapshot_length = 0;
+        for(uint8_t j = i + 1; j <= _nav_depth; j++) {
+            _nav_stack[j].snapshot_offset -= length;
+        }
+        return true;
+    }
+    return false;
+}
+
+static void _nsec_nav_take_snapshot(nsec_nav_entry_t * entry) {
+    entry->snapshot_length = 0;
+    if(entry->screen->flags & NSEC_SCREEN_FLAG_NO_SNAPSHOT) {
+        return;
+    }
+    uint16_t length = ssd1306_snapshot_rle(NULL, 0);
+    if(length > sizeof(_nav_snapshot_pool)) {
+        return;
+    }
+    while(_nav_snapshot_used + length > sizeof(_nav_snapshot_pool)) {
+        if(!_nsec_nav_drop_oldest_snapshot()) {
+            return;
+        }
+    }
+    entry->snapshot_offset = _nav_snapshot_used;
+    entry->snapshot_length = ssd1306_snapshot_rle(_nav_snapshot_pool + _nav_snapshot_used,
+                                                  sizeof(_nav_snapshot_pool) - _nav_snapshot_used);
+    _nav_snapshot_used += entry->snapshot_length;
+}
+
+// Only valid for the deepest snapshot in the pool
+static void _nsec_nav_release_snapshot(nsec_nav_entry_t * entry) {
+    if(entry->snapshot_length > 0) {
+        _nav_snapshot_used = entry->snapshot_offset;
+        entry->snapshot_length = 0;
+    }
+}
+
+// The entry is back on top, its snapshot is restored (if it has one) and freed
+static bool _nsec_nav_restore_snapshot(nsec_nav_entry_t * entry) {
+    if(entry->snapshot_length == 0) {
+        return false;
+    }
+    bool restored = ssd1306_restore_rle(_nav_snapshot_pool + entry->snapshot_offset,
+                                        entry->snapshot_length);
+    _nsec_nav_release_snapshot(entry);
+    if(!restored) {
+        return false;
+    }
+    const nsec_screen_t * screen = entry->screen;
+    if(screen->menu_items != NULL) {
+        menu_restore(screen->menu_frame.x, screen->menu_frame.y,
+                     screen->menu_frame.width, screen->menu_frame.height,
+                     screen->menu_item_count, screen->menu_items, &entry->cursor);
+    }
+    if(screen->flags & NSEC_SCREEN_FLAG_FULLSCREEN) {
+        gfx_update();
+    }
+    else {
+        // The status bar may have changed while the child was shown
+        nsec_status_bar_ui_redraw();
+    }
+    return true;
+}
+
+void nsec_nav_init(const nsec_screen_t * root) {
+    _nav_depth = 0;
+    _nav_snapshot_used = 0;
+    _nav_stack[0].screen = root;
+    _nav_stack[0].snapshot_length = 0;
+    nsec_controls_set_handler(_nsec_nav_gesture_handler);
+    _nsec_nav_show(&_nav_stack[0], NULL);
+}
+
+void nsec_nav_push(const nsec_screen_t * screen) {
+    if(_nav_depth + 1 >= NSEC_NAV_LIMIT_MAX_DEPTH) {
+        return;
+    }
+    nsec_nav_entry_t * parent = &_nav_stack[_nav_depth];
+    if(parent->screen->menu_items != NULL) {
+        parent->cursor = menu_get_cursor();
+    }
+    _nsec_nav_take_snapshot(parent);
+    _nav_depth++;
+    _nav_stack[_nav_depth].screen = screen;
+    _nav_stack[_nav_depth].snapshot_length = 0;
+    _nsec_nav_show(&_nav_stack[_nav_depth], NULL);
+}
+
+void nsec_nav_back(void) {
+    if(_nav_depth == 0) {
+        return;
+    }
+    const nsec_screen_t * leaving = _nav_stack[_nav_depth].screen;
+    _nav_depth--;
+    if(leaving->on_leave != NULL) {
+        leaving->on_leave();
+    }
+    if(_nsec_nav_restore_snapshot(&_nav_stack[_nav_depth])) {
+        return;
+    }
+    if(leaving->flags & NSEC_SCREEN_FLAG_FULLSCREEN) {
+        gfx_fillScreen(BLACK);
+        nsec_status_bar_ui_redraw();
+    }
+    _nsec_nav_show(&_nav_stack[_nav_depth], &_nav_stack[_nav_depth].cursor);
+}
+
+// Straight back to the root screen, the screens in between are not shown
+void nsec_nav_home(void) {
+    while(_nav_depth > 1) {
+        const nsec_screen_t * leaving = _nav_stack[_nav_depth].screen;
+        _nav_depth--;
+        if(leaving->on_leave != NULL) {
+            leaving->on_leave();
+        }
+        _nsec_nav_release_snapshot(&_nav_stack[_nav_depth]);
+    }
+    nsec_nav_back();
+}
+
+// The display was taken by something else (the display stream, a screen
+// push), the current screen is drawn again from scratch
+void nsec_nav_redraw(void) {
+    nsec_nav_entry_t * entry = &_nav_stack[_nav_depth];
+    if(entry->screen == NULL) {
+        return;
+    }
+    if(entry->screen->menu_items != NULL) {
+        entry->cursor = menu_get_cursor();
+    }
+    gfx_fillScreen(BLACK);
+    if(!(entry->screen->flags & NSEC_SCREEN_FLAG_FULLSCREEN)) {
+        nsec_status_bar_ui_redraw();
+    }
+    _nsec_nav_show(entry, &entry->cursor);
+    gfx_update();
+}
+
+bool nsec_nav_is_showing(const nsec_screen_t * screen) {
+    return _nav_stack[_nav_depth].screen == screen;
+}
+
+static void _nsec_nav_button_handler(button_t button) {
+    const nsec_screen_t * screen = _nav_stack[_nav_depth].screen;
+    if(screen->on_button != NULL && screen->on_button(button)) {
+        return;
+    }
+    switch (button) {
+        case BUTTON_BACK:
+            nsec_nav_back();
+            break;
+
+        case BUTTON_ENTER:
+            if(screen->menu_items != NULL) {
+                const menu_item_s * item = menu_get_selected_item();
+                if(item->screen != NULL) {
+                    nsec_nav_push(item->screen);
+                }
+                else {
+                    menu_trigger_action();
+                }
+            }
+            break;
+
+        default:
+            if(screen->menu_items != NULL) {
+                menu_button_handler(button);
+            }
+            break;
+    }
+}
+
+static void _nsec_nav_gesture_handler(const button_gesture_t * gesture) {
+    const nsec_screen_t * screen = _nav_stack[_nav_depth].screen;
+    switch (gesture->type) {
+        case BUTTON_GESTURE_PRESS:
+            _nsec_nav_button_handler(gesture->button);
+            break;
+
+        case BUTTON_GESTURE_REPEAT:
+            // Holding a pad moves around, it never enters or leaves screens
+            if(gesture->button != BUTTON_ENTER && gesture->button != BUTTON_BACK) {
+                _nsec_nav_button_handler(gesture->button);
+            }
+            break;
+
+        case BUTTON_GESTURE_LONG_PRESS:
+            if(gesture->button == BUTTON_BACK) {
+                nsec_nav_home();
+            }
+            break;
+
+        case BUTTON_GESTURE_SWIPE:
+            // Sliding towards the DOWN pad shows the next page of the menu
+            if(screen->menu_items != NULL) {
+                if(gesture->button == BUTTON_DOWN) {
+                    menu_change_page(MENU_DIRECTION_DOWN);
+                }
+                else if(gesture->button == BUTTON_UP) {
+                    menu_change_page(MENU_DIRECTION_UP);
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
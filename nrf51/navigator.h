@@ -0,0 +1,60 @@
+//
+//  navigator.h
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#ifndef navigator_h
+#define navigator_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "controls.h"
+#include "menu.h"
+
+#define NSEC_NAV_LIMIT_MAX_DEPTH (5)
+// Shared by the RLE snapshots of every screen below the current one.
+// A text menu usually compresses to a few hundred bytes.
+#ifndef NSEC_NAV_SNAPSHOT_POOL_SIZE
+#define NSEC_NAV_SNAPSHOT_POOL_SIZE (1024)
+#endif
+
+enum NSEC_SCREEN_FLAG {
+    NSEC_SCREEN_FLAG_NONE        = 0,
+    NSEC_SCREEN_FLAG_FULLSCREEN  = (1 << 0), // Draws over the status bar
+    NSEC_SCREEN_FLAG_NO_SNAPSHOT = (1 << 1), // Content changes while hidden, redraw on back
+};
+
+// A screen lives in flash. The navigator draws it, shows its menu (if any),
+// routes the buttons to it and takes care of going back to its parent.
+// The parent framebuffer is kept when a child is pushed, so going back
+// only restores pixels and the menu cursor; draw is not called again.
+struct nsec_screen_s {
+    const menu_item_s * menu_items;
+    uint8_t menu_item_count;
+    struct {
+        uint8_t x;
+        uint8_t y;
+        uint8_t width;
+        uint8_t height;
+    } menu_frame;
+    uint8_t flags; // see NSEC_SCREEN_FLAG
+    // Draws everything but the menu, unless a snapshot is restored
+    void (*draw)(void);
+    // Gets the buttons first, returns true when the button was consumed
+    bool (*on_button)(button_t button);
+    void (*on_leave)(void);
+};
+
+#define NSEC_SCREEN_MENU_COUNT(items) (sizeof(items) / sizeof(items[0]))
+
+void nsec_nav_init(const nsec_screen_t * root);
+void nsec_nav_push(const nsec_screen_t * screen);
+void nsec_nav_back(void);
+void nsec_nav_home(void);
+void nsec_nav_redraw(void);
+bool nsec_nav_is_showing(const nsec_screen_t * screen);
+
+#endif /* navigator_h */
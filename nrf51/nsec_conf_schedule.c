@@ -10,82 +10,79 @@
 #include "menu.h"
 #include "ssd1306.h"
 #include "controls.h"
-#include "app_glue.h"
+#include "nsec_provision.h"
+#include "nsec_offload.h"
 #include <stdlib.h>
+#include <string.h>
 
-void nsec_schedule_show_talks(uint8_t item);
-void nsec_schedule_show_details(uint8_t item);
+#define NSEC_SCHEDULE_MAX_DAYS 4
+#define NSEC_SCHEDULE_MAX_TALKS MENU_LIMIT_MAX_ITEM_COUNT
+// Characters on a row of the description
+#define NSEC_SCHEDULE_DETAIL_COLUMNS (128 / 6)
 
-static menu_item_s days_schedule_items[] = {
-    {
-        .label = "Thursday May 19th '16",
-        .handler = nsec_schedule_show_talks,
-    }, {
-        .label = "Friday, May 20th 2016",
-        .handler = nsec_schedule_show_talks,
-    },
-};
+static void nsec_schedule_show_details_may_19(uint8_t item);
+static void nsec_schedule_show_details_may_20(uint8_t item);
 
-static menu_item_s schedule_items_may_19[] = {
+static const menu_item_s schedule_items_may_19[] = {
     {
         .label = "09:00 KEYNOTE : How Anonymous (narrowly) Evaded the Cyberterrorism Rhetorical Machine",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_19
     }, {
         .label = "10:00 Applying DevOps Principles for Better Malware Analysis",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_19
     }, {
         .label = "10:30 Stupid Pentester Tricks",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_19
     }, {
         .label = "11:00 The New Wave of Deserialization Bugs",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_19
     }, {
         .label = "13:30 Inter-VM Data Exfiltration: The Art of Cache Timing Covert Channel on x86 Multi-Core",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_19
     }, {
         .label = "14:30 Not Safe For Organizing: The state of targeted attacks against civil society",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_19
     }, {
         .label = "15:30 Practical Uses of Program Analysis: Automatic Exploit Generation",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_19
     }, {
         .label = "16:30 CANtact: An Open Tool for Automotive Exploitation",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_19
     }, {
         .label = "17:00 Security Problems of an Eleven Year Old and How to Solve Them",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_19
     }, {
         .label = "19:30 NorthSec Party",
         .handler = NULL
     },
 };
 
-static menu_item_s schedule_items_may_20[] = {
+static const menu_item_s schedule_items_may_20[] = {
     {
         .label = "10:00 Bypassing Application Whitelisting in Critical Infrastructures",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_20
     }, {
         .label = "11:00 Law, Metaphor and the Encrypted Machine",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_20
     }, {
         .label = "13:30 Android - Practical Introduction into the (In)Security",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_20
     }, {
         .label = "14:30 Analysis of High-level Intermediate Representation in a Distributed Environment for Large Scale Malware Processing",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_20
     }, {
         .label = "15:30 Hide Yo' Kids: Hacking Your Family's Connected Things",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_20
     }, {
         .label = "16:30 Real Solutions From Real Incidents: Save Money and Your Job!",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_20
     }, {
         .label = "17:30 Conference Closing Speeches",
-        .handler = nsec_schedule_show_details
+        .handler = nsec_schedule_show_details_may_20
     },
 };
 
-const char * presenters_may_19[] = {
+static const char * const presenters_may_19[] = {
     "Gabriella Coleman",
     "Olivier Bilodeau & Hugo Genesse",
     "Laurent Desaulniers",
@@ -96,7 +93,7 @@ const char * presenters_may_19[] = {
     "Eric Evenchick",
     "Jake Sethi-Reiner",
 };
-const char * presenters_may_20[] = {
+static const char * const presenters_may_20[] = {
     "Ren\x82 Freingruber",
     "Lex Gill",
     "Miroslav Stampar",
@@ -105,7 +102,7 @@ const char * presenters_may_20[] = {
     "Guillaume Ross & Jordan Rogers",
 };
 
-const char * descriptions_may_19[] = {
+static const char * const descriptions_may_19[] = {
     "Anonymous-the masked activists who have contributed to hundreds of political operations around the world since 2008–were perfectly positioned to earn the title of cyberterrorists. In this talk I consider the various factors that allowed them to narrowly escape this designation.",
     "The malware battle online is far from being over. Several thousands of new malware binaries are collected by antivirus companies every day. Most organizations don't have the expertise on staff to know if they are being targeted or if they are hit with mass-spreading malware, although knowing the difference is vital for a proper defensive strategy.",
     "Stumped in a pentest? You tried *everything* and yet have not been able to breach your target? \"Stupid Pentest Tricks\" presents several dirty tricks/cheats/ways to compromise your target in *creative ways*! Improve your ProxMark cloning skills, open doors using a universal RFID card, steal keys (no pickpocketing or impressioning skills needed), improve your phishing game and learn the mindset to cheat in a pentest. All this in a 30 minute talk.",
@@ -116,7 +113,7 @@ const char * descriptions_may_19[] = {
     "Controller Area Network (CAN) remains the leading protocol for networking automotive controllers. Access to CAN gives an attacker the ability to modify system operation, perform diagnostic actions, and disable the system. CAN is also used in SCADA networks and industrial control systems. Historically, software and hardware for CAN has been expensive and targeted at automotive OEMs. Last year, we launched CANtact, an open source hardware CAN tool for PCs. This provides a low cost solution for converting CAN to USB and getting on the bus.",
     "This presentation will focus on the security problems faced by many eleven year olds, including protecting online accounts, securing your devices against siblings, circumventing parental restrictions, etc., and will present some potential solutions to these problems.",
 };
-const char * descriptions_may_20[] = {
+static const char * const descriptions_may_20[] = {
     "Application whitelisting is a concept which can be used to further harden critical systems such as server systems in SCADA environments or client systems with high security requirements like administrative workstations. It works by whitelisting all installed software on a system and after that prevent the execution of not whitelisted software. This should prevent the execution of malware and therefore protect against advanced persistent threat (APT) attacks. In this talk we discuss the general security of such a concept and what holes are still open for attackers.",
     "Encryption technology raises unavoidable and ideologically loaded problems for courts—as recent cases like the FBI v Apple debate have bluntly illustrated. This tension has meant a real risk of shortsighted policy decisions that both jeopardize our civil liberties and compromise commercial interests. We all have a stake in the outcome of these debates, but the legal arguments are normally murky… at best. Judges reason through analogy and metaphor, using conceptual bridges to transition between old and new technologies in the law. But when new technologies inherit old metaphors, they also inherit old rules, models and limitations. So how do courts and lawmakers think about the encrypted machine—and how should they?",
     "This presentation covers the user's deadly sins of Android (In)Security, together with implied system security problems. Each topic could potentially introduce unrecoverable damage from security perspective. Both local and remote attacks are covered, along with accompanying practical demo of most interesting ones.",
@@ -126,13 +123,13 @@ const char * descriptions_may_20[] = {
 };
 
 struct schedule_day_s {
-    menu_item_s * menu_items;
-    const char ** presenters;
-    const char ** descriptions;
+    const menu_item_s * menu_items;
+    const char * const * presenters;
+    const char * const * descriptions;
     uint8_t item_count;
 };
 
-struct schedule_day_s nsec_schedule[] = {
+static const struct schedule_day_s nsec_schedule[] = {
     {
         .menu_items = schedule_items_may_19,
         .presenters = presenters_may_19,
@@ -148,68 +145,227 @@ struct schedule_day_s nsec_schedule[] = {
 
 };
 
-enum schedule_state {
-    SCHEDULE_STATE_CLOSED,
-    SCHEDULE_STATE_DATES,
-    SCHEDULE_STATE_TALKS,
-    SCHEDULE_STATE_TALK_DETAILS,
+static const nsec_screen_t nsec_schedule_talks_screens[] = {
+    {
+        .menu_items = schedule_items_may_19,
+        .menu_item_count = NSEC_SCREEN_MENU_COUNT(schedule_items_may_19),
+        .menu_frame = { 0, 8, 128, 56 },
+    }, {
+        .menu_items = schedule_items_may_20,
+        .menu_item_count = NSEC_SCREEN_MENU_COUNT(schedule_items_may_20),
+        .menu_frame = { 0, 8, 128, 56 },
+    },
 };
 
-static enum schedule_state schedule_state = SCHEDULE_STATE_CLOSED;
-static uint8_t date_selected = 0;
+static const menu_item_s days_schedule_items[] = {
+    {
+        .label = "Thursday May 19th '16",
+        .screen = &nsec_schedule_talks_screens[0],
+    }, {
+        .label = "Friday, May 20th 2016",
+        .screen = &nsec_schedule_talks_screens[1],
+    },
+};
 
-void nsec_schedule_show_talks(uint8_t date);
+nsec_screen_t nsec_schedule_screen = {
+    .menu_items = days_schedule_items,
+    .menu_item_count = NSEC_SCREEN_MENU_COUNT(days_schedule_items),
+    .menu_frame = { 0, 8, 128, 56 },
+};
 
-static void nsec_schedule_button_handler(button_t button) {
-    if(schedule_state == SCHEDULE_STATE_TALK_DETAILS && button != BUTTON_ENTER) {
-        schedule_state = SCHEDULE_STATE_TALKS;
-        menu_ui_redraw_all();
-    }
-    else if(button == BUTTON_BACK) {
-        switch (schedule_state) {
-            case SCHEDULE_STATE_TALKS:
-                nsec_schedule_show_dates();
-                break;
-            case SCHEDULE_STATE_DATES:
-                schedule_state = SCHEDULE_STATE_CLOSED;
-                show_main_menu();
-                break;
+// From the provisioned bundle, the labels point in the flash. Only the
+// talks of the day shown are listed, read again when a day is opened.
+static menu_item_s bundle_days_items[NSEC_SCHEDULE_MAX_DAYS];
+static struct {
+    const char * entry;
+    uint16_t length;
+} bundle_days[NSEC_SCHEDULE_MAX_DAYS];
+static menu_item_s bundle_talks_items[NSEC_SCHEDULE_MAX_TALKS];
+static nsec_screen_t bundle_talks_screen = {
+    .menu_items = bundle_talks_items,
+    .menu_frame = { 0, 8, 128, 56 },
+};
+
+static const char * detail_label = NULL;
+static const char * detail_presenter = NULL;
+static const char * detail_description = NULL;
+
+// The description is word wrapped by a NSEC_JOB_LAYOUT job, on the STM32
+// when it does it faster. Only its start is laid out, more than fits on
+// the screen. One job at a time: a description shown while one runs is
+// laid out once it is done.
+static uint8_t detail_layout_input[NSEC_JOB_MAX_INPUT];
+static uint8_t detail_layout_length = 0;
+static int16_t detail_description_y = 0;
+static bool detail_layout_running = false;
+static bool detail_layout_again = false;
 
-            default:
+static const nsec_screen_t nsec_schedule_details_screen;
+
+static void nsec_schedule_layout_start(void);
+
+static void nsec_schedule_layout_done(int16_t length, const uint8_t * lines) {
+    detail_layout_running = false;
+    if(detail_layout_again) {
+        detail_layout_again = false;
+        nsec_schedule_layout_start();
+        return;
+    }
+    if(length <= 0 || !nsec_nav_is_showing(&nsec_schedule_details_screen)) {
+        return;
+    }
+    const char * text = (const char *) detail_layout_input + 1;
+    uint8_t text_length = detail_layout_length - 1;
+    int16_t y = detail_description_y;
+    gfx_setTextBackgroundColor(WHITE, BLACK);
+    for(int16_t line = 0; line < length && y + 8 <= 64; line++, y += 8) {
+        uint8_t end = line + 1 < length ? lines[line + 1] : text_length;
+        gfx_setCursor(0, y);
+        for(uint8_t i = lines[line]; i < end && i - lines[line] < NSEC_SCHEDULE_DETAIL_COLUMNS; i++) {
+            if(text[i] == '\n') {
                 break;
+            }
+            gfx_write(text[i]);
         }
     }
+    gfx_updateRows(detail_description_y, y - detail_description_y);
 }
 
-void nsec_schedule_show_dates(void) {
-    menu_init(0, 8, 128, 56, sizeof(days_schedule_items) / sizeof(days_schedule_items[0]), days_schedule_items);
-    schedule_state = SCHEDULE_STATE_DATES;
-    nsec_controls_add_handler(nsec_schedule_button_handler);
-}
-
-void nsec_schedule_show_talks(uint8_t item) {
-    date_selected = item;
-    menu_init(0, 8, 128, 56, nsec_schedule[item].item_count, nsec_schedule[item].menu_items);
-    schedule_state = SCHEDULE_STATE_TALKS;
+static void nsec_schedule_layout_start(void) {
+    if(detail_layout_running) {
+        detail_layout_again = true;
+        return;
+    }
+    uint8_t length = strnlen(detail_description, sizeof(detail_layout_input) - 1);
+    detail_layout_input[0] = NSEC_SCHEDULE_DETAIL_COLUMNS;
+    memcpy(detail_layout_input + 1, detail_description, length);
+    detail_layout_length = length + 1;
+    detail_layout_running = true;
+    nsec_offload_run(NSEC_JOB_LAYOUT, detail_layout_input, detail_layout_length, nsec_schedule_layout_done);
 }
 
-void _nsec_schedule_show_details(uint8_t day, uint8_t item) {
+static void nsec_schedule_details_draw(void) {
     gfx_fillRect(0, 8, 128, 56, BLACK);
     gfx_setCursor(0, 8);
     gfx_setTextBackgroundColor(WHITE, BLACK);
-    gfx_puts(nsec_schedule[day].menu_items[item].label);
+    gfx_puts((char *) detail_label);
     gfx_puts("\n");
     gfx_setTextBackgroundColor(BLACK, WHITE);
-    gfx_puts((char *) nsec_schedule[day].presenters[item]);
+    gfx_puts((char *) detail_presenter);
     gfx_puts("\n");
-    gfx_setTextBackgroundColor(WHITE, BLACK);
-    gfx_puts((char *) nsec_schedule[day].descriptions[item]);
     gfx_update();
-    schedule_state = SCHEDULE_STATE_TALK_DETAILS;
+    // Drawn by nsec_schedule_layout_done
+    detail_description_y = gfx_getCursorY();
+    nsec_schedule_layout_start();
+}
+
+static bool nsec_schedule_details_on_button(button_t button) {
+    // Any button but ENTER brings back the list of talks
+    if(button != BUTTON_ENTER) {
+        nsec_nav_back();
+    }
+    return true;
+}
+
+static const nsec_screen_t nsec_schedule_details_screen = {
+    .draw = nsec_schedule_details_draw,
+    .on_button = nsec_schedule_details_on_button,
+};
+
+static void nsec_schedule_show_details(uint8_t day, uint8_t item) {
+    if(item < nsec_schedule[day].item_count - 1) {
+        detail_label = nsec_schedule[day].menu_items[item].label;
+        detail_presenter = nsec_schedule[day].presenters[item];
+        detail_description = nsec_schedule[day].descriptions[item];
+        nsec_nav_push(&nsec_schedule_details_screen);
+    }
+}
+
+static void nsec_schedule_show_details_may_19(uint8_t item) {
+    nsec_schedule_show_details(0, item);
 }
 
-void nsec_schedule_show_details(uint8_t item) {
-    if(item < nsec_schedule[date_selected].item_count - 1) {
-        _nsec_schedule_show_details(date_selected, item);
+static void nsec_schedule_show_details_may_20(uint8_t item) {
+    nsec_schedule_show_details(1, item);
+}
+
+// The presenter and the description follow the label of the talk
+static void nsec_schedule_show_bundle_details(uint8_t item) {
+    if(!nsec_nav_is_showing(&bundle_talks_screen)) {
+        return;
+    }
+    const char * label = bundle_talks_items[item].label;
+    const char * presenter = label + strlen(label) + 1;
+    const char * description = presenter + strlen(presenter) + 1;
+    if(presenter[0] != '\0' || description[0] != '\0') {
+        detail_label = label;
+        detail_presenter = presenter;
+        detail_description = description;
+        nsec_nav_push(&nsec_schedule_details_screen);
+    }
+}
+
+// Returns the number of talks, 0 when the entry is not a day. The talks go
+// in items, unless it is NULL.
+static uint8_t nsec_schedule_read_day(const char * entry, uint16_t length, menu_item_s * items) {
+    // Every string ends in the entry
+    if(length == 0 || entry[length - 1] != '\0') {
+        return 0;
+    }
+    const char * end = entry + length;
+    const char * next = entry + strlen(entry) + 1;
+    uint8_t count = 0;
+    while(next < end && count < NSEC_SCHEDULE_MAX_TALKS) {
+        const char * label = next;
+        const char * presenter = label + strlen(label) + 1;
+        if(presenter >= end) {
+            break;
+        }
+        const char * description = presenter + strlen(presenter) + 1;
+        if(description >= end) {
+            break;
+        }
+        next = description + strlen(description) + 1;
+        if(items != NULL) {
+            items[count] = (menu_item_s) {
+                .label = label,
+                .handler = nsec_schedule_show_bundle_details,
+            };
+        }
+        count++;
+    }
+    return count;
+}
+
+static void nsec_schedule_show_bundle_day(uint8_t day) {
+    bundle_talks_screen.menu_item_count = nsec_schedule_read_day(bundle_days[day].entry, bundle_days[day].length,
+                                                                 bundle_talks_items);
+    nsec_nav_push(&bundle_talks_screen);
+}
+
+void nsec_schedule_load(void) {
+    uint8_t day_count = 0;
+    while(day_count < NSEC_SCHEDULE_MAX_DAYS) {
+        uint16_t length;
+        const char * entry = (const char *) nsec_provision_find(NSEC_BUNDLE_SCHEDULE_DAY, day_count, &length);
+        if(entry == NULL || nsec_schedule_read_day(entry, length, NULL) == 0) {
+            break;
+        }
+        bundle_days[day_count].entry = entry;
+        bundle_days[day_count].length = length;
+        bundle_days_items[day_count] = (menu_item_s) {
+            .label = entry,
+            .handler = nsec_schedule_show_bundle_day,
+        };
+        day_count++;
+    }
+
+    if(day_count > 0) {
+        nsec_schedule_screen.menu_items = bundle_days_items;
+        nsec_schedule_screen.menu_item_count = day_count;
+    }
+    else {
+        nsec_schedule_screen.menu_items = days_schedule_items;
+        nsec_schedule_screen.menu_item_count = NSEC_SCREEN_MENU_COUNT(days_schedule_items);
     }
 }
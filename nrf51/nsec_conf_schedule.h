@@ -9,6 +9,13 @@
 #ifndef nsec_conf_schedule_h
 #define nsec_conf_schedule_h
 
-void nsec_schedule_show_dates(void);
+#include "navigator.h"
+
+// The days of the provisioned bundle when it has some, the built-in ones
+// otherwise. Pointed at by a menu item, filled by nsec_schedule_load.
+extern nsec_screen_t nsec_schedule_screen;
+
+// Not while a schedule screen is shown
+void nsec_schedule_load(void);
 
 #endif /* nsec_conf_schedule_h */
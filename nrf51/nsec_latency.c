@@ -0,0 +1,280 @@
+//
+//  nsec_latency.c
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#include "nsec_latency.h"
+#include "boards.h"
+
+#include <stdbool.h>
+#include <string.h>
+
+#include <app_timer.h>
+#include <app_error.h>
+
+#include "ble/nsec_ble.h"
+
+#ifdef NSEC_LATENCY_UART
+#include <stdio.h>
+#include <app_uart.h>
+#include <app_scheduler.h>
+#endif
+
+// Longest time converted, 8 seconds, keeps the math in 32 bits
+#define NSEC_LATENCY_MAX_TICKS 0x3FFFF
+
+static nsec_latency_histogram_t histograms[NSEC_LATENCY_STAGE_COUNT];
+
+static const uint8_t nsec_latency_ble_uuid[16] = { 0x71, 0x2D, 0x0E, 0x95, 0x3B, 0xC8, 0x4F, 0x10, 0xA6, 0x57, 0x2E, 0x8B, 0x43, 0x00, 0xB3, 0x77 };
+static nsec_ble_service_handle ble_handle = NULL;
+static app_timer_id_t ble_timer;
+static bool ble_dirty = false;
+
+// The input being handled, until its first display flush
+static struct {
+    bool active;
+    bool flushing;
+    uint16_t stm32_age_us;
+    uint32_t received;      // RTC ticks, in the SPIS interrupt
+    uint32_t dispatched;    // RTC ticks, from the scheduler
+    uint32_t flush_start;   // RTC ticks
+} input;
+
+static uint32_t nsec_latency_us_between(uint32_t from, uint32_t to) {
+    uint32_t ticks;
+    app_timer_cnt_diff_compute(to, from, &ticks);
+    ticks *= (APP_TIMER_PRESCALER + 1);
+    if(ticks > NSEC_LATENCY_MAX_TICKS) {
+        ticks = NSEC_LATENCY_MAX_TICKS;
+    }
+    return ticks * 15625 / 512; // 1000000 / 32768
+}
+
+static void nsec_latency_record(nsec_latency_stage_t stage, uint32_t us) {
+    nsec_latency_histogram_t * histogram = &histograms[stage];
+    uint8_t bucket = 0;
+    uint32_t bound = 1 << NSEC_LATENCY_BUCKET_SHIFT;
+    while(us >= bound && bucket < NSEC_LATENCY_BUCKET_COUNT - 1) {
+        bucket++;
+        bound <<= 1;
+    }
+    if(histogram->buckets[bucket] < UINT16_MAX) {
+        histogram->buckets[bucket]++;
+    }
+    histogram->count++;
+    if(us > histogram->max_us) {
+        histogram->max_us = us;
+    }
+    ble_dirty = true;
+}
+
+void nsec_latency_input_begin(uint32_t received_ticks, uint16_t stm32_age_us) {
+    input.active = true;
+    input.flushing = false;
+    input.stm32_age_us = stm32_age_us;
+    input.received = received_ticks;
+    app_timer_cnt_get(&input.dispatched);
+}
+
+void nsec_latency_input_end(void) {
+    // Nothing was drawn, there is no latency to speak of
+    input.active = false;
+}
+
+void nsec_latency_flush_begin(void) {
+    if(input.active) {
+        input.flushing = true;
+        app_timer_cnt_get(&input.flush_start);
+    }
+}
+
+void nsec_latency_flush_end(void) {
+    if(!input.active || !input.flushing) {
+        return;
+    }
+    uint32_t now;
+    app_timer_cnt_get(&now);
+    input.active = false;
+
+    nsec_latency_record(NSEC_LATENCY_STAGE_QUEUE, nsec_latency_us_between(input.received, input.dispatched));
+    nsec_latency_record(NSEC_LATENCY_STAGE_RENDER, nsec_latency_us_between(input.dispatched, input.flush_start));
+    nsec_latency_record(NSEC_LATENCY_STAGE_FLUSH, nsec_latency_us_between(input.flush_start, now));
+    if(input.stm32_age_us != NSEC_LATENCY_AGE_UNKNOWN) {
+        // The wire time of the frame is not accounted for, about 170 us
+        nsec_latency_record(NSEC_LATENCY_STAGE_TOUCH, input.stm32_age_us);
+        nsec_latency_record(NSEC_LATENCY_STAGE_TOTAL,
+                            input.stm32_age_us + nsec_latency_us_between(input.received, now));
+    }
+}
+
+const nsec_latency_histogram_t * nsec_latency_get_histogram(nsec_latency_stage_t stage) {
+    if(stage >= NSEC_LATENCY_STAGE_COUNT) {
+        return NULL;
+    }
+    return &histograms[stage];
+}
+
+void nsec_latency_reset(void) {
+    memset(histograms, 0, sizeof(histograms));
+    ble_dirty = true;
+}
+
+static uint8_t * nsec_latency_put(uint8_t * data, uint32_t value, uint8_t size) {
+    for(uint8_t i = 0; i < size; i++) {
+        *data++ = value >> (8 * i);
+    }
+    return data;
+}
+
+// Runs from the scheduler
+static void nsec_latency_ble_refresh(void * context) {
+    if(!ble_dirty) {
+        return;
+    }
+    ble_dirty = false;
+    uint8_t value[NSEC_LATENCY_STAGE_COUNT * NSEC_LATENCY_BLE_STAGE_SIZE];
+    uint8_t * data = value;
+    for(uint8_t stage = 0; stage < NSEC_LATENCY_STAGE_COUNT; stage++) {
+        const nsec_latency_histogram_t * histogram = &histograms[stage];
+        data = nsec_latency_put(data, histogram->count, 4);
+        data = nsec_latency_put(data, histogram->max_us, 4);
+        for(uint8_t i = 0; i < NSEC_LATENCY_BUCKET_COUNT; i++) {
+            data = nsec_latency_put(data, histogram->buckets[i], 2);
+        }
+    }
+    nsec_ble_set_charateristic_value_at(ble_handle, 0, value, sizeof(value));
+}
+
+void nsec_latency_ble_add(void) {
+    nsec_ble_characteristic_t c[] = {
+        {
+            .char_uuid = NSEC_LATENCY_BLE_UUID,
+            .permissions = NSEC_BLE_CHARACT_PERM_READ,
+            .max_length = NSEC_LATENCY_STAGE_COUNT * NSEC_LATENCY_BLE_STAGE_SIZE,
+        },
+    };
+    nsec_ble_service_t srv = {
+        .characteristics_count = sizeof(c) / sizeof(c[0]),
+        .characteristics = c,
+    };
+    memcpy(srv.uuid, nsec_latency_ble_uuid, sizeof(srv.uuid));
+    if(nsec_ble_register_vendor_service(&srv, &ble_handle) != 0) {
+        ble_handle = NULL;
+        return;
+    }
+    ble_dirty = true;
+    nsec_latency_ble_refresh(NULL);
+    uint32_t err_code = app_timer_create(&ble_timer, APP_TIMER_MODE_REPEATED, nsec_latency_ble_refresh);
+    APP_ERROR_CHECK(err_code);
+    err_code = app_timer_start(ble_timer, APP_TIMER_TICKS(NSEC_LATENCY_BLE_REFRESH_MS, APP_TIMER_PRESCALER), NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+#ifdef NSEC_LATENCY_UART
+
+#define NSEC_LATENCY_UART_RX_BUF_SIZE 8
+#define NSEC_LATENCY_UART_TX_BUF_SIZE 256 // Power of two, holds a whole line
+
+static const char * const stage_names[NSEC_LATENCY_STAGE_COUNT] = {
+    "touch", "queue", "render", "flush", "total",
+};
+
+// Next stage to print, NSEC_LATENCY_STAGE_COUNT when not printing
+static volatile uint8_t report_stage = NSEC_LATENCY_STAGE_COUNT;
+
+// One line per stage: the count, the maximum and the non-empty buckets,
+// each as its upper bound in microseconds and its count.
+static void nsec_latency_report_line(void * p_event_data, uint16_t event_size) {
+    uint8_t stage = report_stage;
+    if(stage >= NSEC_LATENCY_STAGE_COUNT) {
+        return;
+    }
+    report_stage = stage + 1;
+
+    const nsec_latency_histogram_t * histogram = &histograms[stage];
+    char line[NSEC_LATENCY_UART_TX_BUF_SIZE];
+    size_t size = sizeof(line) - 2; // Room for the line break
+    size_t length = snprintf(line, size, "%s n=%lu max=%luus", stage_names[stage],
+                             (unsigned long) histogram->count, (unsigned long) histogram->max_us);
+    for(uint8_t i = 0; i < NSEC_LATENCY_BUCKET_COUNT && length < size; i++) {
+        if(histogram->buckets[i] == 0) {
+            continue;
+        }
+        unsigned long bound = 1UL << (NSEC_LATENCY_BUCKET_SHIFT + i);
+        if(i == NSEC_LATENCY_BUCKET_COUNT - 1) {
+            length += snprintf(line + length, size - length, " >=%lu:%u", bound >> 1, histogram->buckets[i]);
+        }
+        else {
+            length += snprintf(line + length, size - length, " <%lu:%u", bound, histogram->buckets[i]);
+        }
+    }
+    if(length > size - 1) {
+        length = size - 1;
+    }
+    line[length++] = '\r';
+    line[length++] = '\n';
+    for(size_t i = 0; i < length; i++) {
+        app_uart_put(line[i]);
+    }
+}
+
+static void nsec_latency_reset_handler(void * p_event_data, uint16_t event_size) {
+    nsec_latency_reset();
+}
+
+// Called from the UART interrupt, the histograms are only touched from the scheduler
+static void nsec_latency_uart_handler(app_uart_evt_t * p_event) {
+    uint8_t byte;
+    switch (p_event->evt_type) {
+        case APP_UART_DATA_READY:
+            while(app_uart_get(&byte) == NRF_SUCCESS) {
+                if(byte == 'l' && report_stage >= NSEC_LATENCY_STAGE_COUNT) {
+                    report_stage = 0;
+                    app_sched_event_put(NULL, 0, nsec_latency_report_line);
+                }
+                else if(byte == 'r') {
+                    app_sched_event_put(NULL, 0, nsec_latency_reset_handler);
+                }
+            }
+            break;
+
+        case APP_UART_TX_EMPTY:
+            if(report_stage < NSEC_LATENCY_STAGE_COUNT) {
+                app_sched_event_put(NULL, 0, nsec_latency_report_line);
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void nsec_latency_uart_init(void) {
+    uint32_t err_code;
+    const app_uart_comm_params_t comm_params = {
+        .rx_pin_no = RX_PIN_NUMBER,
+        .tx_pin_no = TX_PIN_NUMBER,
+        .flow_control = APP_UART_FLOW_CONTROL_DISABLED,
+        .use_parity = false,
+        .baud_rate = UART_BAUDRATE,
+    };
+    APP_UART_FIFO_INIT(&comm_params,
+                       NSEC_LATENCY_UART_RX_BUF_SIZE,
+                       NSEC_LATENCY_UART_TX_BUF_SIZE,
+                       nsec_latency_uart_handler,
+                       APP_IRQ_PRIORITY_LOW,
+                       err_code);
+    APP_ERROR_CHECK(err_code);
+}
+
+#endif
+
+void nsec_latency_init(void) {
+    nsec_latency_reset();
+    input.active = false;
+#ifdef NSEC_LATENCY_UART
+    nsec_latency_uart_init();
+#endif
+}
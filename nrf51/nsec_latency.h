@@ -0,0 +1,62 @@
+//
+//  nsec_latency.h
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#ifndef nsec_latency_h
+#define nsec_latency_h
+
+#include <stdint.h>
+
+// Time from a finger on a pad to the pixels reaching the display, split in
+// stages. The STM32 tells how old an event is when it sends it, the nRF side
+// is timed with the RTC (about 30 us resolution). Only the first display
+// flush after an input is measured; an input that draws nothing is dropped.
+typedef enum {
+    NSEC_LATENCY_STAGE_TOUCH,   // STM32: acquisition start to the event sent
+    NSEC_LATENCY_STAGE_QUEUE,   // SPIS interrupt to the scheduler handling it
+    NSEC_LATENCY_STAGE_RENDER,  // Handling the input to the display flush
+    NSEC_LATENCY_STAGE_FLUSH,   // Sending the pages to the display
+    NSEC_LATENCY_STAGE_TOTAL,   // Acquisition start to the end of the flush
+    NSEC_LATENCY_STAGE_COUNT,
+} nsec_latency_stage_t;
+
+// The STM32 did not send the age of the event
+#define NSEC_LATENCY_AGE_UNKNOWN 0xFFFF
+
+// Bucket 0 is below 64 us, bucket n (n > 0) is 2^(n+5) us up to 2^(n+6) us,
+// the last one also holds everything longer.
+#define NSEC_LATENCY_BUCKET_COUNT 16
+#define NSEC_LATENCY_BUCKET_SHIFT 6
+
+typedef struct {
+    uint32_t count;
+    uint32_t max_us;
+    uint16_t buckets[NSEC_LATENCY_BUCKET_COUNT];
+} nsec_latency_histogram_t;
+
+// The histograms can be read over BLE, see nsec_latency_ble_add. Define
+// NSEC_LATENCY_UART to also print them on the UART (bridged to USB by the
+// STM32): send 'l' to get them, 'r' to clear them. The UART keeps the high
+// frequency clock running, leave it off in production.
+void nsec_latency_init(void);
+// A read-only characteristic with every histogram, stage by stage: count
+// (32 bits), maximum in microseconds (32 bits), then the buckets (16 bits
+// each), little endian. Refreshed every NSEC_LATENCY_BLE_REFRESH_MS when
+// something changed. After nsec_ble_init.
+#define NSEC_LATENCY_BLE_UUID       0x4301
+#define NSEC_LATENCY_BLE_REFRESH_MS 1000
+#define NSEC_LATENCY_BLE_STAGE_SIZE (4 + 4 + 2 * NSEC_LATENCY_BUCKET_COUNT)
+void nsec_latency_ble_add(void);
+
+void nsec_latency_input_begin(uint32_t received_ticks, uint16_t stm32_age_us);
+void nsec_latency_input_end(void);
+void nsec_latency_flush_begin(void);
+void nsec_latency_flush_end(void);
+
+const nsec_latency_histogram_t * nsec_latency_get_histogram(nsec_latency_stage_t stage);
+void nsec_latency_reset(void);
+
+#endif /* nsec_latency_h */
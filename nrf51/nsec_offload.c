@@ -0,0 +1,335 @@
+//
+//  nsec_offload.c
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#include "nsec_offload.h"
+#include "boards.h"
+
+#include <string.h>
+
+#include <nrf51.h>
+#include <app_error.h>
+#include <app_timer.h>
+#include <app_scheduler.h>
+
+#define NSEC_OFFLOAD_TICKS(ms)          APP_TIMER_TICKS(ms, APP_TIMER_PRESCALER)
+// Longest time converted, 8 seconds, keeps the math in 32 bits
+#define NSEC_OFFLOAD_MAX_TICKS          0x3FFFF
+// Each new time counts for 1/8 of the average
+#define NSEC_OFFLOAD_AVERAGE_WEIGHT     8
+// The RTC ticks every 30.5 us, a batch is timed as a whole
+#define NSEC_OFFLOAD_BENCH_LOCAL_RUNS   32
+#define NSEC_OFFLOAD_BENCH_REMOTE_RUNS  8
+#define NSEC_OFFLOAD_BENCH_DELTA_SPAN   64
+
+static nsec_offload_stats_t stats[NSEC_JOB_TYPE_COUNT];
+static uint8_t route_count[NSEC_JOB_TYPE_COUNT];
+// Of the job done last, handed to its handler
+static uint8_t output[NSEC_JOB_MAX_OUTPUT];
+
+// The job on the STM32. Its input stays in tx for a run here on timeout.
+static struct {
+    bool busy;
+    uint8_t id;
+    uint32_t start;         // RTC ticks
+    nsec_offload_handler_t done;
+} remote;
+
+static app_timer_id_t timeout_timer;
+
+// Read by the SPIS interrupt while tx_ready, written by the scheduler otherwise
+static nsec_job_message_t tx;
+static volatile bool tx_ready = false;
+// Written by the SPIS interrupt until rx_complete, read by the scheduler then
+static nsec_job_message_t rx;
+static volatile bool rx_complete = false;
+
+// 124 bytes of schedule, see NSEC_JOB_INFLATE
+static const uint8_t bench_inflate[] = {
+    0x17, 0x31, 0x30, 0x3A, 0x30, 0x30, 0x20, 0x4F, 0x70, 0x65, 0x6E, 0x69,
+    0x6E, 0x67, 0x2C, 0x20, 0x52, 0x6F, 0x6F, 0x6D, 0x20, 0x41, 0x0A, 0x31,
+    0x31, 0x90, 0x15, 0x06, 0x4B, 0x65, 0x79, 0x6E, 0x6F, 0x74, 0x65, 0xF0,
+    0x15, 0x00, 0x33, 0x90, 0x15, 0x07, 0x57, 0x6F, 0x72, 0x6B, 0x73, 0x68,
+    0x6F, 0x70, 0xC0, 0x16, 0x03, 0x42, 0x0A, 0x31, 0x34, 0x90, 0x16, 0x04,
+    0x4C, 0x69, 0x67, 0x68, 0x74, 0x90, 0x44, 0x05, 0x20, 0x74, 0x61, 0x6C,
+    0x6B, 0x73, 0xF0, 0x34, 0x00, 0x35, 0x90, 0x1D, 0x08, 0x43, 0x54, 0x46,
+    0x20, 0x62, 0x72, 0x69, 0x65, 0x66, 0xF0, 0x65, 0x01, 0x42, 0x0A,
+};
+static const char bench_layout[] = "\x15" "Welcome to NorthSec! The talks start at 10:00 "
+                                   "in room A, the CTF runs all weekend long.\nHave fun.";
+static const char bench_glyphs[] = "\x00" "Conference schedule";
+// As shown then as it should be, filled by nsec_offload_bench
+static uint8_t bench_delta[2 * NSEC_OFFLOAD_BENCH_DELTA_SPAN];
+
+static struct {
+    bool running;
+    bool waiting;           // For the STM32 to be done with another job
+    uint8_t type;           // On the STM32
+    uint8_t runs_left;      // Of the type
+    int16_t expected_length;
+    uint8_t expected[NSEC_JOB_MAX_OUTPUT];
+    nsec_offload_bench_handler_t done;
+} bench;
+
+static uint32_t nsec_offload_us_since(uint32_t start) {
+    uint32_t now, ticks;
+    app_timer_cnt_get(&now);
+    app_timer_cnt_diff_compute(now, start, &ticks);
+    ticks *= (APP_TIMER_PRESCALER + 1);
+    if(ticks > NSEC_OFFLOAD_MAX_TICKS) {
+        ticks = NSEC_OFFLOAD_MAX_TICKS;
+    }
+    return ticks * 15625 / 512; // 1000000 / 32768
+}
+
+static void nsec_offload_average(uint32_t * average, uint16_t runs, uint32_t us) {
+    if(runs == 0) {
+        *average = us;
+    }
+    else {
+        *average = (*average * (NSEC_OFFLOAD_AVERAGE_WEIGHT - 1) + us + NSEC_OFFLOAD_AVERAGE_WEIGHT / 2) /
+                   NSEC_OFFLOAD_AVERAGE_WEIGHT;
+    }
+}
+
+static void nsec_offload_run_local(uint8_t type, const uint8_t * input, uint8_t length,
+                                   nsec_offload_handler_t done) {
+    uint32_t start;
+    app_timer_cnt_get(&start);
+    int16_t result = nsec_job_run(type, input, length, output);
+    uint32_t us = nsec_offload_us_since(start);
+    nsec_offload_stats_t * type_stats = &stats[type];
+    nsec_offload_average(&type_stats->local_us, type_stats->local_runs, us);
+    if(type_stats->local_runs < UINT16_MAX) {
+        type_stats->local_runs++;
+    }
+    done(result, output);
+}
+
+static void nsec_offload_add_remote_time(uint8_t type) {
+    nsec_offload_stats_t * type_stats = &stats[type];
+    nsec_offload_average(&type_stats->remote_us, type_stats->remote_runs, nsec_offload_us_since(remote.start));
+    if(type_stats->remote_runs < UINT16_MAX) {
+        type_stats->remote_runs++;
+    }
+}
+
+static void nsec_offload_bench_step(void);
+
+// Done with the STM32, done is called once it can take the next job
+static void nsec_offload_remote_done(int16_t length) {
+    nsec_offload_handler_t done = remote.done;
+    remote.busy = false;
+    done(length, output);
+    if(bench.waiting && !remote.busy) {
+        bench.waiting = false;
+        nsec_offload_bench_step();
+    }
+}
+
+static void nsec_offload_complete(void * data, uint16_t size) {
+    if(!rx_complete) {
+        return;
+    }
+    uint8_t id = rx.id;
+    uint8_t length = rx.data[0];
+    uint8_t status = rx.data[1];
+    uint16_t stm32_us = rx.data[2] << 8 | rx.data[3];
+    memcpy(output, rx.data + NSEC_JOB_HEADER_SIZE, length);
+    // Free for the next result
+    __DMB();
+    rx_complete = false;
+
+    // A result late for its job was run here already
+    if(!remote.busy || id != remote.id) {
+        return;
+    }
+    app_timer_stop(timeout_timer);
+    tx_ready = false;
+    uint8_t type = tx.data[1];
+    nsec_offload_add_remote_time(type);
+    stats[type].stm32_us = stm32_us;
+    nsec_offload_remote_done(status == NSEC_JOB_STATUS_OK ? length : NSEC_JOB_FAILED);
+}
+
+static void nsec_offload_on_timeout(void * context) {
+    // The result may be in, its event lost to a full scheduler queue
+    nsec_offload_complete(NULL, 0);
+    if(!remote.busy) {
+        return;
+    }
+    tx_ready = false;
+    uint8_t type = tx.data[1];
+    nsec_offload_add_remote_time(type);
+    stats[type].timeouts++;
+    remote.busy = false;
+    nsec_offload_run_local(type, tx.data + NSEC_JOB_HEADER_SIZE, tx.data[0], remote.done);
+    if(bench.waiting && !remote.busy) {
+        bench.waiting = false;
+        nsec_offload_bench_step();
+    }
+}
+
+static void nsec_offload_run_remote(uint8_t type, const uint8_t * input, uint8_t length,
+                                    nsec_offload_handler_t done) {
+    remote.busy = true;
+    remote.id++;
+    remote.done = done;
+    // Not read by the interrupt until tx_ready
+    tx_ready = false;
+    nsec_job_message_set(&tx, remote.id, type, 0, input, length);
+    __DMB();
+    tx_ready = true;
+    app_timer_cnt_get(&remote.start);
+    app_timer_start(timeout_timer, NSEC_OFFLOAD_TICKS(NSEC_OFFLOAD_TIMEOUT_MS), NULL);
+}
+
+static bool nsec_offload_should_send(uint8_t type) {
+    const nsec_offload_stats_t * type_stats = &stats[type];
+    if(remote.busy) {
+        return false;
+    }
+    if(type_stats->local_runs < NSEC_OFFLOAD_WARMUP_RUNS) {
+        return false;
+    }
+    if(type_stats->remote_runs < NSEC_OFFLOAD_WARMUP_RUNS) {
+        return true;
+    }
+    bool faster = type_stats->remote_us < type_stats->local_us;
+    if(++route_count[type] >= NSEC_OFFLOAD_PROBE_EVERY) {
+        route_count[type] = 0;
+        return !faster;
+    }
+    return faster;
+}
+
+void nsec_offload_init(void) {
+    uint32_t err_code = app_timer_create(&timeout_timer, APP_TIMER_MODE_SINGLE_SHOT, nsec_offload_on_timeout);
+    APP_ERROR_CHECK(err_code);
+}
+
+void nsec_offload_run(uint8_t type, const uint8_t * input, uint8_t length, nsec_offload_handler_t done) {
+    if(type == 0 || type >= NSEC_JOB_TYPE_COUNT || length > NSEC_JOB_MAX_INPUT) {
+        done(NSEC_JOB_FAILED, output);
+    }
+    else if(nsec_offload_should_send(type)) {
+        nsec_offload_run_remote(type, input, length, done);
+    }
+    else {
+        nsec_offload_run_local(type, input, length, done);
+    }
+}
+
+static uint8_t nsec_offload_bench_sample(uint8_t type, const uint8_t ** input) {
+    switch (type) {
+        case NSEC_JOB_INFLATE:
+            *input = bench_inflate;
+            return sizeof(bench_inflate);
+        case NSEC_JOB_LAYOUT:
+            *input = (const uint8_t *) bench_layout;
+            return sizeof(bench_layout) - 1;
+        case NSEC_JOB_GLYPHS:
+            *input = (const uint8_t *) bench_glyphs;
+            return sizeof(bench_glyphs) - 1;
+        default:
+            *input = bench_delta;
+            return sizeof(bench_delta);
+    }
+}
+
+static void nsec_offload_bench_result(int16_t length, const uint8_t * result) {
+    if(length != bench.expected_length || (length > 0 && memcmp(result, bench.expected, length) != 0)) {
+        stats[bench.type].mismatches++;
+    }
+    bench.runs_left--;
+    nsec_offload_bench_step();
+}
+
+static void nsec_offload_bench_step(void) {
+    if(bench.runs_left == 0) {
+        bench.type++;
+        bench.runs_left = NSEC_OFFLOAD_BENCH_REMOTE_RUNS;
+    }
+    if(bench.type >= NSEC_JOB_TYPE_COUNT) {
+        bench.running = false;
+        bench.done();
+        return;
+    }
+    if(remote.busy) {
+        bench.waiting = true;
+        return;
+    }
+    const uint8_t * input;
+    uint8_t length = nsec_offload_bench_sample(bench.type, &input);
+    bench.expected_length = nsec_job_run(bench.type, input, length, bench.expected);
+    nsec_offload_run_remote(bench.type, input, length, nsec_offload_bench_result);
+}
+
+void nsec_offload_bench(nsec_offload_bench_handler_t done) {
+    if(bench.running) {
+        return;
+    }
+    // A page span with a few changes close together and one on its own
+    for(uint8_t i = 0; i < NSEC_OFFLOAD_BENCH_DELTA_SPAN; i++) {
+        bench_delta[i] = i * 7;
+        bench_delta[NSEC_OFFLOAD_BENCH_DELTA_SPAN + i] = (i % 3 == 0 && i < 24) || i == 50 ? ~(i * 7) : i * 7;
+    }
+
+    for(uint8_t type = 1; type < NSEC_JOB_TYPE_COUNT; type++) {
+        const uint8_t * input;
+        uint8_t length = nsec_offload_bench_sample(type, &input);
+        uint32_t start;
+        app_timer_cnt_get(&start);
+        for(uint8_t i = 0; i < NSEC_OFFLOAD_BENCH_LOCAL_RUNS; i++) {
+            nsec_job_run(type, input, length, output);
+        }
+        stats[type].local_us = nsec_offload_us_since(start) / NSEC_OFFLOAD_BENCH_LOCAL_RUNS;
+        stats[type].local_runs += NSEC_OFFLOAD_BENCH_LOCAL_RUNS;
+        stats[type].mismatches = 0;
+    }
+
+    // Then the STM32, one job after the other
+    bench.running = true;
+    bench.done = done;
+    bench.type = 0;
+    bench.runs_left = 0;
+    nsec_offload_bench_step();
+}
+
+bool nsec_offload_bench_running(void) {
+    return bench.running;
+}
+
+nsec_offload_stats_t nsec_offload_get_stats(uint8_t type) {
+    return stats[type < NSEC_JOB_TYPE_COUNT ? type : 0];
+}
+
+uint8_t nsec_offload_next_record(uint8_t * record, uint8_t space) {
+    if(!tx_ready) {
+        return 0;
+    }
+    uint8_t length = nsec_job_message_next(&tx, record, space);
+    if(nsec_job_message_sent(&tx)) {
+        tx_ready = false;
+    }
+    return length;
+}
+
+bool nsec_offload_has_records(void) {
+    return tx_ready;
+}
+
+void nsec_offload_receive(const uint8_t * data, uint8_t length) {
+    // The last one is still being read
+    if(rx_complete) {
+        return;
+    }
+    if(nsec_job_message_receive(&rx, data, length)) {
+        rx_complete = true;
+        // On failure the timeout picks it up
+        app_sched_event_put(NULL, 0, nsec_offload_complete);
+    }
+}
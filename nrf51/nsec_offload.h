@@ -0,0 +1,57 @@
+//
+//  nsec_offload.h
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#ifndef nsec_offload_h
+#define nsec_offload_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "nsec_job.h"
+
+// Runs jobs (see nsec_job.h) here or on the STM32, whichever has been
+// faster for the type. Both sides are timed: here the run, there the round
+// trip, waiting for the STM32 to poll included. A type is tried
+// NSEC_OFFLOAD_WARMUP_RUNS times on each side first, then the slower side
+// gets one job out of NSEC_OFFLOAD_PROBE_EVERY to follow how it does. One
+// job is on the STM32 at a time, the others run here meanwhile. A job the
+// STM32 does not answer in NSEC_OFFLOAD_TIMEOUT_MS runs here after all.
+#define NSEC_OFFLOAD_WARMUP_RUNS    4
+#define NSEC_OFFLOAD_PROBE_EVERY    16
+#define NSEC_OFFLOAD_TIMEOUT_MS     50
+
+// Called from the scheduler, output is only good until it returns
+typedef void (*nsec_offload_handler_t)(int16_t length, const uint8_t * output);
+typedef void (*nsec_offload_bench_handler_t)(void);
+
+typedef struct {
+    uint32_t local_us;      // Moving average, 0 until run here
+    uint32_t remote_us;     // Moving average of the round trip, 0 until run there
+    uint16_t stm32_us;      // The STM32 took, for the last result
+    uint16_t local_runs;
+    uint16_t remote_runs;
+    uint16_t timeouts;      // Ran here after all
+    uint16_t mismatches;    // Results that differ, found by the benchmark
+} nsec_offload_stats_t;
+
+void nsec_offload_init(void);
+// Called from the scheduler. done may be called before this returns.
+void nsec_offload_run(uint8_t type, const uint8_t * input, uint8_t length, nsec_offload_handler_t done);
+// Runs each type on both sides with sample inputs, which also settles the
+// routing. done is called from the scheduler once the stats are in.
+void nsec_offload_bench(nsec_offload_bench_handler_t done);
+bool nsec_offload_bench_running(void);
+nsec_offload_stats_t nsec_offload_get_stats(uint8_t type);
+
+// Called from the SPIS interrupt: the next part of the job for the STM32,
+// 0 when there is none or space is too short
+uint8_t nsec_offload_next_record(uint8_t * record, uint8_t space);
+bool nsec_offload_has_records(void);
+// Called from the SPIS interrupt, for each result record
+void nsec_offload_receive(const uint8_t * data, uint8_t length);
+
+#endif /* nsec_offload_h */
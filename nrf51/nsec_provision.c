@@ -0,0 +1,555 @@
+//
+//  nsec_provision.c
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#include "nsec_provision.h"
+#include "boards.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <nrf51.h>
+#include <nrf_soc.h>
+#include <nrf_error.h>
+#include <app_scheduler.h>
+
+#include "nsec_link.h"
+#include "touch_button.h"
+
+// Bytes from the SPIS interrupt, parsed from the scheduler. Power of two.
+#define PROVISION_RING_SIZE       512
+// The STM32 sees the hold one frame late and may have one more on its way,
+// with room to spare for a retransmit. A page erase takes about 20 ms, the
+// hold is what keeps the ring from overflowing meanwhile.
+#define PROVISION_HOLD_ROOM       (4 * NSEC_LINK_MAX_PAYLOAD)
+// The softdevice gives up on a flash operation the radio leaves no time for
+#define PROVISION_FLASH_RETRIES   3
+#define PROVISION_BLOCK_COUNT     (NSEC_PROVISION_MAX_SIZE / NSEC_PROVISION_BLOCK_SIZE)
+#define PROVISION_COMMITTED       0x4E534F4B // "NSOK"
+#define PROVISION_BEGIN_ARGS      12
+#define PROVISION_DATA_ARGS       5
+#define PROVISION_REPLY_CHUNK     (NSEC_LINK_MAX_PAYLOAD - NSEC_LINK_RECORD_HEADER_SIZE)
+
+// The first page of the region. Erased words read 0xFFFFFFFF, a word can
+// only be written once until the page is erased again.
+typedef struct {
+    uint32_t magic;
+    uint32_t size;
+    uint32_t crc;
+    uint32_t committed;     // PROVISION_COMMITTED once the CRC32 matched
+    uint32_t blocks[PROVISION_BLOCK_COUNT]; // 0 once written
+} provision_header_t;
+
+#define PROVISION_DATA_START  (NSEC_PROVISION_START + NSEC_PROVISION_PAGE_SIZE)
+#define PROVISION_HEADER  ((const provision_header_t *) NSEC_PROVISION_START)
+#define PROVISION_DATA    ((const uint8_t *) PROVISION_DATA_START)
+#define PROVISION_PAGE(address) ((address) / NSEC_PROVISION_PAGE_SIZE)
+
+typedef enum {
+    FLASH_IDLE,
+    FLASH_ERASE_HEADER,     // Then FLASH_WRITE_HEADER
+    FLASH_WRITE_HEADER,
+    FLASH_ERASE_PAGE,       // Then FLASH_WRITE_BLOCK
+    FLASH_WRITE_BLOCK,      // Then FLASH_WRITE_PROGRESS
+    FLASH_WRITE_PROGRESS,
+    FLASH_WRITE_COMMITTED,
+    FLASH_DISCARD,          // Erases the header of a bundle with a bad CRC32
+} provision_flash_step_t;
+
+// Single producer (SPIS IRQ) and single consumer (scheduler)
+static uint8_t ring[PROVISION_RING_SIZE];
+static volatile uint16_t ring_head = 0; // Written by the IRQ only
+static volatile uint16_t ring_tail = 0; // Written by the scheduler only
+static volatile bool process_scheduled = false;
+static volatile bool overrun = false;
+// An empty record started a new session, at this point of the ring
+static volatile bool restart = false;
+static volatile uint16_t restart_at = 0;
+
+static struct {
+    uint8_t command;        // 0 between commands
+    uint8_t args[PROVISION_BEGIN_ARGS];
+    uint8_t arg_count;      // Received so far
+    uint8_t data_left;      // DATA bytes still to come
+    bool skipping;          // Up to the next BEGIN, after an error
+} parser;
+
+static struct {
+    bool valid;             // The bundle in flash is the one in use
+    bool receiving;         // A BEGIN was accepted, DATA goes on
+    bool refused;           // A DATA was refused since the last BEGIN
+    uint32_t size;
+    uint32_t crc;
+    uint32_t offset;        // Of the next DATA byte
+    uint32_t block_start;   // Offset of the block being filled
+    uint16_t block_length;
+    uint32_t block[NSEC_PROVISION_BLOCK_SIZE / 4]; // Words for sd_flash_write
+} state;
+
+static struct {
+    provision_flash_step_t step;
+    uint8_t retries;
+    uint32_t words[3];      // Written from, kept until the operation is done
+    volatile bool done;     // Set by the softdevice event
+    volatile bool failed;
+} flash;
+
+static nsec_provision_change_handler_t change_handler = NULL;
+
+uint32_t nsec_provision_crc32(uint32_t crc, const uint8_t * data, uint32_t length) {
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+    crc = ~crc;
+    for(uint32_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+        crc = (crc >> 4) ^ table[crc & 0x0F];
+    }
+    return ~crc;
+}
+
+static uint32_t provision_arg32(const uint8_t * arg) {
+    return (uint32_t) arg[0] << 24 | arg[1] << 16 | arg[2] << 8 | arg[3];
+}
+
+static void provision_reply(const char * status) {
+    char line[48];
+    int length = snprintf(line, sizeof(line), "provision %s %lu %lu\r\n", status,
+                          (unsigned long) state.offset, (unsigned long) state.size);
+    // A line cut by a full queue is asked for again with STATUS
+    for(int i = 0; i < length; i += PROVISION_REPLY_CHUNK) {
+        int count = length - i < PROVISION_REPLY_CHUNK ? length - i : PROVISION_REPLY_CHUNK;
+        touch_link_send(NSEC_LINK_RECORD_USB_DATA, line + i, count);
+    }
+}
+
+// Only once per BEGIN, the DATA after it is refused too
+static void provision_refuse(const char * status) {
+    state.receiving = false;
+    if(!state.refused) {
+        state.refused = true;
+        provision_reply(status);
+    }
+}
+
+static void provision_schedule(void);
+
+static uint32_t provision_flash_issue(void) {
+    uint32_t block_address = PROVISION_DATA_START + state.block_start;
+    switch (flash.step) {
+        case FLASH_ERASE_HEADER:
+        case FLASH_DISCARD:
+            return sd_flash_page_erase(PROVISION_PAGE(NSEC_PROVISION_START));
+        case FLASH_WRITE_HEADER:
+            return sd_flash_write((uint32_t *) NSEC_PROVISION_START, flash.words, 3);
+        case FLASH_ERASE_PAGE:
+            return sd_flash_page_erase(PROVISION_PAGE(block_address));
+        case FLASH_WRITE_BLOCK:
+            return sd_flash_write((uint32_t *) block_address, state.block, (state.block_length + 3) / 4);
+        case FLASH_WRITE_PROGRESS:
+            return sd_flash_write((uint32_t *) &PROVISION_HEADER->blocks[state.block_start / NSEC_PROVISION_BLOCK_SIZE],
+                                  flash.words, 1);
+        case FLASH_WRITE_COMMITTED:
+            return sd_flash_write((uint32_t *) &PROVISION_HEADER->committed, flash.words, 1);
+        default:
+            return NRF_SUCCESS;
+    }
+}
+
+// Parsing stops until the step is done, see provision_flash_done
+static void provision_flash_start(provision_flash_step_t step) {
+    flash.step = step;
+    flash.retries = 0;
+    switch (step) {
+        case FLASH_WRITE_HEADER:
+            flash.words[0] = NSEC_PROVISION_MAGIC;
+            flash.words[1] = state.size;
+            flash.words[2] = state.crc;
+            break;
+        case FLASH_WRITE_PROGRESS:
+            flash.words[0] = 0;
+            break;
+        case FLASH_WRITE_COMMITTED:
+            flash.words[0] = PROVISION_COMMITTED;
+            break;
+        default:
+            break;
+    }
+    if(provision_flash_issue() != NRF_SUCCESS) {
+        flash.failed = true;
+        flash.done = true;
+        provision_schedule();
+    }
+}
+
+static void provision_flash_done(bool failed) {
+    if(failed) {
+        if(flash.retries++ < PROVISION_FLASH_RETRIES && provision_flash_issue() == NRF_SUCCESS) {
+            return;
+        }
+        flash.step = FLASH_IDLE;
+        state.receiving = false;
+        provision_reply("flash-error");
+        return;
+    }
+
+    provision_flash_step_t step = flash.step;
+    flash.step = FLASH_IDLE;
+    switch (step) {
+        case FLASH_ERASE_HEADER:
+            provision_flash_start(FLASH_WRITE_HEADER);
+            break;
+
+        case FLASH_WRITE_HEADER:
+            state.receiving = true;
+            provision_reply("ready");
+            break;
+
+        case FLASH_ERASE_PAGE:
+            provision_flash_start(FLASH_WRITE_BLOCK);
+            break;
+
+        case FLASH_WRITE_BLOCK:
+            // Already marked when the page is written again after a resume
+            if(PROVISION_HEADER->blocks[state.block_start / NSEC_PROVISION_BLOCK_SIZE] != 0) {
+                provision_flash_start(FLASH_WRITE_PROGRESS);
+            }
+            else {
+                state.block_length = 0;
+            }
+            break;
+
+        case FLASH_WRITE_PROGRESS:
+            state.block_length = 0;
+            break;
+
+        case FLASH_WRITE_COMMITTED:
+            state.receiving = false;
+            state.valid = true;
+            provision_reply("done");
+            if(change_handler != NULL) {
+                change_handler();
+            }
+            break;
+
+        case FLASH_DISCARD:
+            state.receiving = false;
+            provision_reply("bad-crc");
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void provision_begin(uint32_t size, uint32_t crc) {
+    state.receiving = false;
+    state.refused = false;
+    state.size = size;
+    state.crc = crc;
+    state.offset = 0;
+    state.block_length = 0;
+    if(size == 0 || size > NSEC_PROVISION_MAX_SIZE) {
+        provision_reply("bad-size");
+        return;
+    }
+
+    const provision_header_t * header = PROVISION_HEADER;
+    if(header->magic == NSEC_PROVISION_MAGIC && header->size == size && header->crc == crc) {
+        if(state.valid) {
+            state.offset = size;
+            provision_reply("done");
+            return;
+        }
+        if(header->committed != PROVISION_COMMITTED) {
+            uint16_t blocks = 0;
+            while(blocks < PROVISION_BLOCK_COUNT && header->blocks[blocks] == 0) {
+                blocks++;
+            }
+            // The block after the last one marked may be half written, its
+            // page gets erased again
+            state.offset = blocks * NSEC_PROVISION_BLOCK_SIZE / NSEC_PROVISION_PAGE_SIZE * NSEC_PROVISION_PAGE_SIZE;
+            state.receiving = true;
+            provision_reply("ready");
+            return;
+        }
+    }
+
+    if(state.valid) {
+        state.valid = false;
+        if(change_handler != NULL) {
+            change_handler();
+        }
+    }
+    provision_flash_start(FLASH_ERASE_HEADER);
+}
+
+static void provision_data_byte(uint8_t byte) {
+    if(state.block_length == 0) {
+        state.block_start = state.offset;
+    }
+    ((uint8_t *) state.block)[state.block_length++] = byte;
+    state.offset++;
+    if(state.block_length == NSEC_PROVISION_BLOCK_SIZE || state.offset == state.size) {
+        // The last block is padded to a word, erased bytes read 0xFF anyway
+        memset((uint8_t *) state.block + state.block_length, 0xFF,
+               NSEC_PROVISION_BLOCK_SIZE - state.block_length);
+        if(state.block_start % NSEC_PROVISION_PAGE_SIZE == 0) {
+            provision_flash_start(FLASH_ERASE_PAGE);
+        }
+        else {
+            provision_flash_start(FLASH_WRITE_BLOCK);
+        }
+    }
+}
+
+static void provision_commit(void) {
+    if(!state.receiving || state.offset != state.size) {
+        provision_reply("not-ready");
+        return;
+    }
+    if(nsec_provision_crc32(0, PROVISION_DATA, state.size) != state.crc) {
+        provision_flash_start(FLASH_DISCARD);
+        return;
+    }
+    provision_flash_start(FLASH_WRITE_COMMITTED);
+}
+
+static void provision_status(void) {
+    if(state.receiving) {
+        provision_reply("receiving");
+    }
+    else if(state.valid) {
+        state.size = PROVISION_HEADER->size;
+        state.offset = state.size;
+        provision_reply("done");
+    }
+    else {
+        state.size = 0;
+        state.offset = 0;
+        provision_reply("empty");
+    }
+}
+
+// A command cut or unknown, nothing can be trusted up to the next BEGIN
+static void provision_parse_error(void) {
+    parser.command = 0;
+    parser.data_left = 0;
+    parser.skipping = true;
+    if(state.receiving) {
+        provision_refuse("bad-command");
+    }
+}
+
+static uint8_t provision_arg_count(uint8_t command) {
+    switch (command) {
+        case NSEC_PROVISION_BEGIN:
+            return PROVISION_BEGIN_ARGS;
+        case NSEC_PROVISION_DATA:
+            return PROVISION_DATA_ARGS;
+        default:
+            return 0;
+    }
+}
+
+static void provision_command(void) {
+    const uint8_t * args = parser.args;
+    uint8_t command = parser.command;
+    parser.command = 0;
+
+    switch (command) {
+        case NSEC_PROVISION_BEGIN:
+            // The magic tells a BEGIN from data, when looking for one
+            if(provision_arg32(args) != NSEC_PROVISION_MAGIC) {
+                provision_parse_error();
+                return;
+            }
+            parser.skipping = false;
+            provision_begin(provision_arg32(args + 4), provision_arg32(args + 8));
+            break;
+
+        case NSEC_PROVISION_DATA: {
+            uint32_t offset = provision_arg32(args);
+            parser.data_left = args[4];
+            if(!state.receiving) {
+                provision_refuse("not-ready");
+            }
+            else if(offset != state.offset || args[4] > state.size - state.offset) {
+                provision_refuse("bad-offset");
+            }
+            break;
+        }
+
+        case NSEC_PROVISION_COMMIT:
+            provision_commit();
+            break;
+
+        case NSEC_PROVISION_STATUS:
+            provision_status();
+            break;
+
+        default:
+            break;
+    }
+}
+
+static void provision_parse(uint8_t byte) {
+    if(parser.data_left > 0) {
+        parser.data_left--;
+        if(state.receiving) {
+            provision_data_byte(byte);
+        }
+        return;
+    }
+    if(parser.command == 0) {
+        if(parser.skipping && byte != NSEC_PROVISION_BEGIN) {
+            return;
+        }
+        if(byte < NSEC_PROVISION_BEGIN || byte > NSEC_PROVISION_STATUS) {
+            provision_parse_error();
+            return;
+        }
+        parser.command = byte;
+        parser.arg_count = 0;
+        if(provision_arg_count(byte) == 0) {
+            provision_command();
+        }
+        return;
+    }
+    parser.args[parser.arg_count++] = byte;
+    if(parser.arg_count == provision_arg_count(parser.command)) {
+        provision_command();
+    }
+}
+
+// What was received before the new session is dropped with it
+static void provision_restart(void) {
+    memset(&parser, 0, sizeof(parser));
+    state.receiving = false;
+    state.refused = false;
+    state.block_length = 0;
+}
+
+static void provision_process(void * p_event_data, uint16_t event_size) {
+    // Cleared first: bytes queued from now on schedule another run
+    process_scheduled = false;
+    if(flash.done) {
+        flash.done = false;
+        provision_flash_done(flash.failed);
+        flash.failed = false;
+    }
+    if(overrun) {
+        overrun = false;
+        provision_parse_error();
+    }
+    // A block goes to the flash before the bytes after it are parsed
+    while(flash.step == FLASH_IDLE) {
+        if(restart && ring_tail == restart_at) {
+            restart = false;
+            provision_restart();
+        }
+        uint16_t tail = ring_tail;
+        if(tail == ring_head) {
+            break;
+        }
+        provision_parse(ring[tail % PROVISION_RING_SIZE]);
+        ring_tail = tail + 1;
+    }
+}
+
+// From the SPIS interrupt or the softdevice event
+static void provision_schedule(void) {
+    if(!process_scheduled) {
+        process_scheduled = true;
+        if(app_sched_event_put(NULL, 0, provision_process) != NRF_SUCCESS) {
+            // Scheduler queue full, the next frame from the STM32 will try again
+            process_scheduled = false;
+        }
+    }
+}
+
+void nsec_provision_receive(const uint8_t * data, uint8_t length) {
+    uint16_t head = ring_head;
+    if(length == 0) {
+        restart_at = head;
+        restart = true;
+    }
+    else if(PROVISION_RING_SIZE - (uint16_t)(head - ring_tail) < length) {
+        overrun = true;
+    }
+    else {
+        for(uint8_t i = 0; i < length; i++) {
+            ring[head++ % PROVISION_RING_SIZE] = data[i];
+        }
+        // The bytes must be written before the consumer can see them
+        __DMB();
+        ring_head = head;
+    }
+    provision_schedule();
+}
+
+bool nsec_provision_should_hold(void) {
+    if(ring_head != ring_tail || flash.done) {
+        // Held records never come to schedule the parsing again
+        provision_schedule();
+    }
+    return PROVISION_RING_SIZE - (uint16_t)(ring_head - ring_tail) < PROVISION_HOLD_ROOM;
+}
+
+void nsec_provision_on_sys_evt(uint32_t evt_id) {
+    if(flash.step == FLASH_IDLE) {
+        return;
+    }
+    if(evt_id == NRF_EVT_FLASH_OPERATION_SUCCESS || evt_id == NRF_EVT_FLASH_OPERATION_ERROR) {
+        flash.failed = evt_id == NRF_EVT_FLASH_OPERATION_ERROR;
+        flash.done = true;
+        provision_schedule();
+    }
+}
+
+const uint8_t * nsec_provision_find(uint8_t type, uint8_t index, uint16_t * length) {
+    if(!state.valid) {
+        return NULL;
+    }
+    const uint8_t * entry = PROVISION_DATA;
+    const uint8_t * end = PROVISION_DATA + PROVISION_HEADER->size;
+    while(end - entry >= NSEC_BUNDLE_ENTRY_HEADER_SIZE) {
+        uint16_t entry_length = entry[2] << 8 | entry[3];
+        const uint8_t * data = entry + NSEC_BUNDLE_ENTRY_HEADER_SIZE;
+        if(entry_length > end - data) {
+            return NULL;
+        }
+        if(entry[0] == type && entry[1] == index) {
+            *length = entry_length;
+            return data;
+        }
+        entry = data + entry_length;
+    }
+    return NULL;
+}
+
+const uint8_t * nsec_provision_bundle(uint32_t * size, uint32_t * crc) {
+    if(!state.valid) {
+        return NULL;
+    }
+    *size = PROVISION_HEADER->size;
+    *crc = PROVISION_HEADER->crc;
+    return PROVISION_DATA;
+}
+
+void nsec_provision_init(nsec_provision_change_handler_t on_change) {
+    change_handler = on_change;
+    memset(&parser, 0, sizeof(parser));
+    memset(&state, 0, sizeof(state));
+    memset(&flash, 0, sizeof(flash));
+    // Checked at every boot, a bundle cut short or worn out is not used
+    const provision_header_t * header = PROVISION_HEADER;
+    state.valid = header->magic == NSEC_PROVISION_MAGIC && header->committed == PROVISION_COMMITTED &&
+                  header->size <= NSEC_PROVISION_MAX_SIZE &&
+                  nsec_provision_crc32(0, PROVISION_DATA, header->size) == header->crc;
+}
@@ -0,0 +1,84 @@
+//
+//  nsec_provision.h
+//  nsec16
+//
+//  License: MIT (see LICENSE for details)
+//
+
+#ifndef nsec_provision_h
+#define nsec_provision_h
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// A content bundle (schedule, bitmaps, strings) streamed by a host on the
+// USB serial port of the STM32 (set to CDC_PROVISION_BITRATE), relayed in
+// NSEC_LINK_RECORD_PROVISION_DATA records and kept in the flash region
+// below. See stm32/tools/provision.py.
+//
+//   BEGIN   magic (32 bits), size (32 bits), CRC32 (32 bits)
+//   DATA    offset (32 bits), count (8 bits), data...
+//   COMMIT                                   Checks the CRC32 of the flash
+//   STATUS
+//
+// Numbers are big endian, the magic is NSEC_PROVISION_MAGIC. The CRC32 is
+// the one of zlib. DATA must come in order from the offset given by the
+// reply to BEGIN: a bundle already partly written resumes where it was,
+// rounded down to a flash page. Every command but DATA gets a line of text
+// back on the USB serial port:
+//
+//   provision <state> <offset> <size>
+//
+// with state one of ready (send from offset), done (the bundle is in use),
+// empty, receiving, bad-size, bad-offset, bad-command, not-ready, bad-crc or
+// flash-error. Only the first DATA refused after a BEGIN gets a reply.
+// After a command cut or unknown, everything up to the next BEGIN is
+// skipped.
+#define NSEC_PROVISION_BEGIN    0xB0
+#define NSEC_PROVISION_DATA     0xB1
+#define NSEC_PROVISION_COMMIT   0xB2
+#define NSEC_PROVISION_STATUS   0xB3
+#define NSEC_PROVISION_MAGIC    0x4E535031 // "NSP1"
+
+// The last 24 pages of the flash, the application must stay below. The
+// first page holds the size, the CRC32 and which blocks are written, the
+// bundle follows.
+#define NSEC_PROVISION_START        0x3A000
+#define NSEC_PROVISION_PAGE_SIZE    1024
+#define NSEC_PROVISION_PAGE_COUNT   24
+#define NSEC_PROVISION_BLOCK_SIZE   256
+#define NSEC_PROVISION_MAX_SIZE     ((NSEC_PROVISION_PAGE_COUNT - 1) * NSEC_PROVISION_PAGE_SIZE)
+
+// The bundle is a list of entries: type, index, length (16 bits, big
+// endian), data
+#define NSEC_BUNDLE_ENTRY_HEADER_SIZE   4
+// Index: day from 0. The day label then, for each talk, its label, presenter
+// and description, all NUL terminated, at most MENU_LIMIT_MAX_ITEM_COUNT
+// talks. A talk with neither presenter nor description has no details.
+#define NSEC_BUNDLE_SCHEDULE_DAY        0x01
+// Width, height, then the rows as for gfx_drawBitmap
+#define NSEC_BUNDLE_BITMAP              0x02
+#define NSEC_BUNDLE_BITMAP_LOGO         0   // Instead of nsec_logo_bitmap
+// NUL terminated
+#define NSEC_BUNDLE_STRING              0x03
+#define NSEC_BUNDLE_STRING_BADGE_CLASS  0   // In the status bar
+
+// Called from the scheduler when a bundle was committed, or right before
+// the one in use gets erased: nothing from nsec_provision_find must be kept.
+typedef void (*nsec_provision_change_handler_t)(void);
+
+void nsec_provision_init(nsec_provision_change_handler_t on_change);
+// Called from the SPIS interrupt, for each provisioning record
+void nsec_provision_receive(const uint8_t * data, uint8_t length);
+// Called from the SPIS interrupt: the STM32 should hold its provisioning records
+bool nsec_provision_should_hold(void);
+// Called from sys_evt_dispatch, for the flash events
+void nsec_provision_on_sys_evt(uint32_t evt_id);
+// The data of an entry in the bundle in use, NULL when there is none
+const uint8_t * nsec_provision_find(uint8_t type, uint8_t index, uint16_t * length);
+// The whole bundle in use, NULL when there is none
+const uint8_t * nsec_provision_bundle(uint32_t * size, uint32_t * crc);
+// The CRC32 of zlib, from 0 or to go on from the one of the data before
+uint32_t nsec_provision_crc32(uint32_t crc, const uint8_t * data, uint32_t length);
+
+#endif /* nsec_provision_h */
@@ -12,48 +12,130 @@
 #include <nrf.h>
 #include "ble/nsec_ble.h"
 #include "status_bar.h"
-#include "app_glue.h"
 #include "controls.h"
 #include "animal_care.h"
+#include "navigator.h"
+#include "nsec_offload.h"
+
+#include <stdio.h>
 
 static void toggle_bluetooth(uint8_t item);
-static void show_credit(uint8_t item);
-static void turn_off_screen(uint8_t item);
-static void flashlight(uint8_t item);
 static void reset_pet(uint8_t item);
-static void setting_handle_buttons(button_t button);
-
-enum setting_state {
-    SETTING_STATE_CLOSED,
-    SETTING_STATE_MENU,
-    SETTING_STATE_CREDIT,
-    SETTING_STATE_SCREEN_OFF,
-    SETTING_STATE_FLASHLIGHT,
+
+static void credit_draw(void) {
+    gfx_fillRect(0, 8, 128, 56, BLACK);
+    gfx_setCursor(0, 8);
+    gfx_setTextBackgroundColor(WHITE, BLACK);
+    gfx_puts("nsec 2016 badge team:");
+    gfx_puts("@bvanheu (hw, sw)\n");
+    gfx_puts("@marc_etienne_ (sw)\n");
+    gfx_puts("Cat based on work by Ate-Bit (CC BY-NC-ND 3.0) on DevianArt.");
+    gfx_update();
+}
+
+static void screen_off_draw(void) {
+    gfx_fillScreen(BLACK);
+    gfx_update();
+}
+
+static void flashlight_draw(void) {
+    gfx_fillScreen(WHITE);
+    gfx_update();
+}
+
+static const char * const offload_job_names[NSEC_JOB_TYPE_COUNT] = {
+    NULL, "text", "layout", "glyphs", "delta",
+};
+
+static void offload_bench_draw(void);
+
+// Redrawn by the benchmark when done, not restored from a snapshot
+static const nsec_screen_t offload_bench_screen = {
+    .flags = NSEC_SCREEN_FLAG_NO_SNAPSHOT,
+    .draw = offload_bench_draw,
+};
+
+static void offload_bench_show(void) {
+    gfx_fillRect(0, 8, 128, 56, BLACK);
+    gfx_setCursor(0, 8);
+    gfx_setTextBackgroundColor(WHITE, BLACK);
+    // Time per job in us, round trip for the STM32
+    gfx_puts("job      nRF  STM\n");
+    if(nsec_offload_bench_running()) {
+        gfx_puts("Running...");
+    }
+    for(uint8_t type = 1; type < NSEC_JOB_TYPE_COUNT && !nsec_offload_bench_running(); type++) {
+        nsec_offload_stats_t stats = nsec_offload_get_stats(type);
+        const char * faster = stats.remote_us < stats.local_us ? "STM" : "nRF";
+        if(stats.mismatches > 0) {
+            faster = "BAD";
+        }
+        char line[24];
+        snprintf(line, sizeof(line), "%-7s%5lu%5lu %s\n", offload_job_names[type], stats.local_us,
+                 stats.remote_us, faster);
+        gfx_puts(line);
+    }
+    gfx_update();
+}
+
+static void offload_bench_done(void) {
+    if(nsec_nav_is_showing(&offload_bench_screen)) {
+        offload_bench_show();
+    }
+}
+
+static void offload_bench_draw(void) {
+    nsec_offload_bench(offload_bench_done);
+    offload_bench_show();
+}
+
+static const nsec_screen_t credit_screen = {
+    .draw = credit_draw,
 };
 
-static enum setting_state _state = SETTING_STATE_CLOSED;
+static const nsec_screen_t screen_off_screen = {
+    .flags = NSEC_SCREEN_FLAG_FULLSCREEN,
+    .draw = screen_off_draw,
+};
 
-static void setting_handle_buttons(button_t button);
+static const nsec_screen_t flashlight_screen = {
+    .flags = NSEC_SCREEN_FLAG_FULLSCREEN,
+    .draw = flashlight_draw,
+};
 
-static menu_item_s settings_items[] = {
+static const menu_item_s settings_items[] = {
     {
         .label = "Toggle Bluetooth",
         .handler = toggle_bluetooth,
     }, {
         .label = "Turn screen off",
-        .handler = turn_off_screen,
+        .screen = &screen_off_screen,
     }, {
         .label = "Flashlight",
-        .handler = flashlight,
+        .screen = &flashlight_screen,
     }, {
         .label = "Credit",
-        .handler = show_credit,
+        .screen = &credit_screen,
     }, {
         .label = "Reset Cyber Pet",
         .handler = reset_pet,
+    }, {
+        .label = "Offload benchmark",
+        .screen = &offload_bench_screen,
     }
 };
 
+static void settings_draw(void) {
+    gfx_fillRect(0, 8, 128, 65 - 8, BLACK);
+}
+
+const nsec_screen_t nsec_settings_screen = {
+    .menu_items = settings_items,
+    .menu_item_count = NSEC_SCREEN_MENU_COUNT(settings_items),
+    .menu_frame = { 0, 12, 128, 64 - 12 },
+    .draw = settings_draw,
+};
+
 static void toggle_bluetooth(uint8_t item) {
     if(nsec_ble_toggle()) {
         nsec_status_set_ble_status(STATUS_BLUETOOTH_ON);
@@ -63,33 +145,6 @@ static void toggle_bluetooth(uint8_t item) {
     }
 }
 
-static void show_credit(uint8_t item) {
-    _state = SETTING_STATE_CREDIT;
-    menu_close();
-    gfx_fillRect(0, 8, 128, 56, BLACK);
-    gfx_setCursor(0, 8);
-    gfx_setTextBackgroundColor(WHITE, BLACK);
-    gfx_puts("nsec 2016 badge team:");
-    gfx_puts("@bvanheu (hw, sw)\n");
-    gfx_puts("@marc_etienne_ (sw)\n");
-    gfx_puts("Cat based on work by Ate-Bit (CC BY-NC-ND 3.0) on DevianArt.");
-    gfx_update();
-}
-
-static void turn_off_screen(uint8_t item) {
-    menu_close();
-    gfx_fillScreen(BLACK);
-    gfx_update();
-    _state = SETTING_STATE_SCREEN_OFF;
-}
-
-static void flashlight(uint8_t item) {
-    menu_close();
-    gfx_fillScreen(WHITE);
-    gfx_update();
-    _state = SETTING_STATE_FLASHLIGHT;
-}
-
 static void reset_pet(uint8_t item) {
     animal_state_reset();
     gfx_setCursor(17 * 6, 12 + 8 * 4);
@@ -97,33 +152,3 @@ static void reset_pet(uint8_t item) {
     gfx_puts("DONE");
     gfx_update();
 }
-
-void nsec_setting_show(void) {
-    gfx_fillRect(0, 8, 128, 65 - 8, BLACK);
-    menu_init(0, 12, 128, 64 - 12, sizeof(settings_items) / sizeof(settings_items[0]), settings_items);
-    nsec_controls_add_handler(setting_handle_buttons);
-    _state = SETTING_STATE_MENU;
-}
-
-static void setting_handle_buttons(button_t button) {
-    if (button == BUTTON_BACK) {
-        switch (_state) {
-            case SETTING_STATE_MENU:
-                _state = SETTING_STATE_CLOSED;
-                menu_close();
-                show_main_menu();
-                break;
-
-            case SETTING_STATE_FLASHLIGHT:
-                gfx_fillScreen(BLACK);
-            case SETTING_STATE_SCREEN_OFF:
-                nsec_status_bar_ui_redraw();
-            case SETTING_STATE_CREDIT:
-                nsec_setting_show();
-                break;
-
-            default:
-                break;
-        }
-    }
-}
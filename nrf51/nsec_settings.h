@@ -9,6 +9,8 @@
 #ifndef nsec_settings_h
 #define nsec_settings_h
 
-void nsec_setting_show(void);
+#include "navigator.h"
+
+extern const nsec_screen_t nsec_settings_screen;
 
 #endif /* nsec_settings_h */
@@ -28,6 +28,7 @@ All text above, and the splash screen below must be included in any redistributi
 #include <nrf_delay.h>
 
 #include "boards.h"
+#include "nsec_latency.h"
 #include "glcdfont.h"
 
 #include "ssd1306.h"
@@ -98,11 +99,16 @@ uint8_t spi_master_tx(uint8_t * const p_tx_data, const uint16_t len) {
 
 // the memory buffer for the LCD
 static uint8_t buffer[SSD1306_LCDHEIGHT * SSD1306_LCDWIDTH / 8] = {0};
+// The framebuffer was taken by a frame from outside the UI, see
+// ssd1306_suspend_ui
+static bool ui_suspended = false;
 
 // the most basic function, set a single pixel
 void ssd1306_drawPixel(int16_t x, int16_t y, uint16_t color) {
     if ((x < 0) || (x >= SSD1306_LCDWIDTH) || (y < 0) || (y >= SSD1306_LCDHEIGHT))
         return;
+    if (ui_suspended)
+        return;
 
     // check rotation, move pixel around if necessary
     switch (gfx_rotation) {
@@ -359,31 +365,187 @@ void ssd1306_dim(bool dim) {
 }
 
 void ssd1306_update(void) {
+    ssd1306_update_pages(0, SSD1306_LCDPAGES - 1);
+}
+
+// Only send the pages first_page..last_page (inclusive) to the display.
+// A page is a band of 8 physical rows, SSD1306_LCDWIDTH bytes long.
+void ssd1306_update_pages(uint8_t first_page, uint8_t last_page) {
+    if (ui_suspended) {
+        return;
+    }
+    ssd1306_show_pages(first_page, last_page);
+}
+
+// The display stream and the screen pushes take the framebuffer for their
+// own frames, the UI draws and sends nothing until it is resumed. The
+// current screen is then drawn again, see nsec_nav_redraw. Returns false
+// when the UI was already suspended by someone else.
+bool ssd1306_suspend_ui(void) {
+    if (ui_suspended) {
+        return false;
+    }
+    ui_suspended = true;
+    return true;
+}
+
+void ssd1306_resume_ui(void) {
+    ui_suspended = false;
+}
+
+// Same as ssd1306_update_pages, even with the UI suspended
+void ssd1306_show_pages(uint8_t first_page, uint8_t last_page) {
+    if (last_page >= SSD1306_LCDPAGES) {
+        last_page = SSD1306_LCDPAGES - 1;
+    }
+    if (first_page > last_page) {
+        return;
+    }
+
+    nsec_latency_flush_begin();
     ssd1306_command(SSD1306_COLUMNADDR);
     ssd1306_command(0);   // Column start address (0 = reset)
     ssd1306_command(SSD1306_LCDWIDTH-1); // Column end address (127 = reset)
 
     ssd1306_command(SSD1306_PAGEADDR);
-    ssd1306_command(0); // Page start address (0 = reset)
-    #if SSD1306_LCDHEIGHT == 64
-        ssd1306_command(7); // Page end address
-    #endif
-    #if SSD1306_LCDHEIGHT == 32
-        ssd1306_command(3); // Page end address
-    #endif
-    #if SSD1306_LCDHEIGHT == 16
-        ssd1306_command(1); // Page end address
-    #endif
+    ssd1306_command(first_page);
+    ssd1306_command(last_page);
 
     nrf_gpio_pin_write(OLED_DC_MODE, DATA);
-    spi_master_tx(buffer, SSD1306_LCDWIDTH * SSD1306_LCDHEIGHT / 8);
+    spi_master_tx(buffer + first_page * SSD1306_LCDWIDTH,
+                  (last_page - first_page + 1) * SSD1306_LCDWIDTH);
+    nsec_latency_flush_end();
 }
 
 // clear everything
 void ssd1306_clearDisplay(void) {
+    if (ui_suspended) {
+        return;
+    }
     memset(buffer, 0, (SSD1306_LCDWIDTH*SSD1306_LCDHEIGHT/8));
 }
 
+// Framebuffer snapshots are PackBits-like: a header byte below 0x80 is
+// followed by (header + 1) literal bytes, a header byte of 0x80 or more is
+// followed by one byte repeated ((header & 0x7F) + 3) times.
+#define SSD1306_RLE_MAX_LITERAL 128
+#define SSD1306_RLE_MIN_RUN     3
+#define SSD1306_RLE_MAX_RUN     (0x7F + SSD1306_RLE_MIN_RUN)
+
+static bool ssd1306_rle_emit(uint8_t * dst, uint16_t dst_size, uint16_t * pos,
+                             const uint8_t * data, uint16_t len) {
+    if (dst != NULL) {
+        if (*pos + len > dst_size) {
+            return false;
+        }
+        memcpy(dst + *pos, data, len);
+    }
+    *pos += len;
+    return true;
+}
+
+// Compress the framebuffer into dst. Returns the compressed length, or 0
+// when it does not fit in dst_size. With a NULL dst only the length is
+// computed.
+uint16_t ssd1306_snapshot_rle(uint8_t * dst, uint16_t dst_size) {
+    if (ui_suspended) {
+        // The framebuffer holds someone else's frame
+        return 0;
+    }
+    uint16_t in = 0;
+    uint16_t out = 0;
+    uint16_t literal_start = 0;
+    uint8_t literal_len = 0;
+    uint8_t header;
+
+    while (in < sizeof(buffer)) {
+        uint16_t run = 1;
+        while (in + run < sizeof(buffer) && run < SSD1306_RLE_MAX_RUN &&
+               buffer[in + run] == buffer[in]) {
+            run++;
+        }
+        if (run < SSD1306_RLE_MIN_RUN) {
+            if (literal_len == 0) {
+                literal_start = in;
+            }
+            literal_len++;
+            in++;
+            if (literal_len < SSD1306_RLE_MAX_LITERAL && in < sizeof(buffer)) {
+                continue;
+            }
+        }
+        if (literal_len > 0) {
+            header = literal_len - 1;
+            if (!ssd1306_rle_emit(dst, dst_size, &out, &header, 1) ||
+                !ssd1306_rle_emit(dst, dst_size, &out, buffer + literal_start, literal_len)) {
+                return 0;
+            }
+            literal_len = 0;
+        }
+        if (run >= SSD1306_RLE_MIN_RUN) {
+            header = 0x80 | (run - SSD1306_RLE_MIN_RUN);
+            if (!ssd1306_rle_emit(dst, dst_size, &out, &header, 1) ||
+                !ssd1306_rle_emit(dst, dst_size, &out, buffer + in, 1)) {
+                return 0;
+            }
+            in += run;
+        }
+    }
+    return out;
+}
+
+// Replace the framebuffer with a snapshot taken by ssd1306_snapshot_rle.
+// Nothing is sent to the display. Returns false on a malformed snapshot,
+// in which case the framebuffer content is undefined.
+bool ssd1306_restore_rle(const uint8_t * src, uint16_t src_len) {
+    if (ui_suspended) {
+        return false;
+    }
+    uint16_t in = 0;
+    uint16_t out = 0;
+
+    while (in < src_len && out < sizeof(buffer)) {
+        uint8_t header = src[in++];
+        if (header & 0x80) {
+            uint16_t run = (header & 0x7F) + SSD1306_RLE_MIN_RUN;
+            if (in >= src_len || out + run > sizeof(buffer)) {
+                return false;
+            }
+            memset(buffer + out, src[in++], run);
+            out += run;
+        }
+        else {
+            uint16_t len = header + 1;
+            if (in + len > src_len || out + len > sizeof(buffer)) {
+                return false;
+            }
+            memcpy(buffer + out, src + in, len);
+            in += len;
+            out += len;
+        }
+    }
+    return in == src_len && out == sizeof(buffer);
+}
+
+// Write length bytes of page from column, laid out as the display takes them
+// (the rotation is not applied). Nothing is sent to the display. For frames
+// from outside the UI, the UI being suspended does not stop them.
+bool ssd1306_write_span(uint8_t page, uint8_t column, const uint8_t * data, uint8_t length) {
+    if (page >= SSD1306_LCDPAGES || column + length > SSD1306_LCDWIDTH) {
+        return false;
+    }
+    memcpy(buffer + page * SSD1306_LCDWIDTH + column, data, length);
+    return true;
+}
+
+bool ssd1306_fill_span(uint8_t page, uint8_t column, uint8_t value, uint8_t length) {
+    if (page >= SSD1306_LCDPAGES || column + length > SSD1306_LCDWIDTH) {
+        return false;
+    }
+    memset(buffer + page * SSD1306_LCDWIDTH + column, value, length);
+    return true;
+}
+
 void ssd1306_drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) {
   bool bSwap = false;
   switch(gfx_rotation) {
@@ -421,6 +583,7 @@ void ssd1306_drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) {
 void ssd1306_drawFastHLineInternal(int16_t x, int16_t y, int16_t w, uint16_t color) {
   // Do bounds/limit checks
   if(y < 0 || y >= SSD1306_LCDHEIGHT) { return; }
+  if(ui_suspended) { return; }
 
   // make sure we don't try to draw below 0
   if(x < 0) {
@@ -491,6 +654,7 @@ void ssd1306_drawFastVLineInternal(int16_t x, int16_t __y, int16_t __h, uint16_t
 
   // do nothing if we're off the left or right side of the screen
   if(x < 0 || x >= SSD1306_LCDWIDTH) { return; }
+  if(ui_suspended) { return; }
 
   // make sure we don't try to draw below 0
   if(__y < 0) {
@@ -764,13 +928,12 @@ void gfx_drawRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
 }
 
 void gfx_drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color) {
-    // Update in subclasses if desired!
-    gfx_drawLine(x, y, x, y+h-1, color);
+    // Write whole bytes of the page instead of going pixel by pixel
+    ssd1306_drawFastVLine(x, y, h, color);
 }
 
 void gfx_drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color) {
-    // Update in subclasses if desired!
-    gfx_drawLine(x, y, x+w-1, y, color);
+    ssd1306_drawFastHLine(x, y, w, color);
 }
 
 void gfx_fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
@@ -781,6 +944,9 @@ void gfx_fillRect(int16_t x, int16_t y, int16_t w, int16_t h, uint16_t color) {
 }
 
 void gfx_fillScreen(uint16_t color) {
+    if (ui_suspended) {
+        return;
+    }
     if (color == BLACK) {
         memset(buffer, 0, sizeof(buffer));
     }
@@ -997,6 +1163,10 @@ void gfx_setCursor(int16_t x, int16_t y) {
     gfx_cursor_y = y;
 }
 
+int16_t gfx_getCursorY(void) {
+    return gfx_cursor_y;
+}
+
 void gfx_setTextSize(uint8_t s) {
     gfx_textsize = (s > 0) ? s : 1;
 }
@@ -1029,3 +1199,126 @@ void gfx_puts(char *s) {
 void gfx_update() {
     ssd1306_update();
 }
+
+// Send only the pages covering the logical rows y..y+h-1.
+void gfx_updateRows(int16_t y, int16_t h) {
+    if (y < 0) {
+        h += y;
+        y = 0;
+    }
+    if (y + h > gfx_height) {
+        h = gfx_height - y;
+    }
+    if (h <= 0) {
+        return;
+    }
+
+    int16_t first = y;
+    int16_t last = y + h - 1;
+    switch (gfx_rotation) {
+        case 0:
+            break;
+        case 2:
+            first = SSD1306_LCDHEIGHT - (y + h);
+            last = SSD1306_LCDHEIGHT - 1 - y;
+            break;
+        default:
+            // Rows are columns of the panel, every page is touched
+            ssd1306_update();
+            return;
+    }
+    ssd1306_update_pages(first / 8, last / 8);
+}
+
+// Framebuffer page holding the logical rows y..y+7, NULL when those rows
+// do not line up with a page of the panel in the current rotation.
+static uint8_t * gfx_rowPage(int16_t y) {
+    if (ui_suspended || y < 0 || y + 8 > gfx_height || (y & 7) != 0) {
+        return NULL;
+    }
+    switch (gfx_rotation) {
+        case 0:
+            return buffer + (y / 8) * SSD1306_LCDWIDTH;
+        case 2:
+            return buffer + (SSD1306_LCDPAGES - 1 - y / 8) * SSD1306_LCDWIDTH;
+        default:
+            return NULL;
+    }
+}
+
+static uint8_t gfx_reverseBits(uint8_t b) {
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+// Render length characters at the logical column x into an off-screen page
+// (SSD1306_LCDWIDTH bytes), white on black, laid out like the framebuffer
+// so it can later be copied with gfx_blitRow. Returns false when the
+// rotation has no page-aligned rows.
+bool gfx_renderTextRow(uint8_t * page, int16_t x, const char * text, uint8_t length) {
+    if (gfx_rotation != 0 && gfx_rotation != 2) {
+        return false;
+    }
+    for (uint8_t i = 0; i < length; i++) {
+        unsigned char c = text[i];
+        for (int8_t col = 0; col < 6; col++, x++) {
+            if (x < 0) {
+                continue;
+            }
+            if (x >= gfx_width) {
+                return true;
+            }
+            uint8_t line = col == 5 ? 0x0 : pgm_read_byte(font + (c * 5) + col);
+            if (gfx_rotation == 2) {
+                page[SSD1306_LCDWIDTH - 1 - x] = gfx_reverseBits(line);
+            }
+            else {
+                page[x] = line;
+            }
+        }
+    }
+    return true;
+}
+
+// Copy an off-screen page over the logical rows y..y+7
+bool gfx_blitRow(int16_t y, const uint8_t * page) {
+    return gfx_blitRows(y, 8, page);
+}
+
+// Copy pages laid out like the framebuffer for the current rotation (as
+// gen_scene.py outputs them) over the logical rows y..y+h-1.
+bool gfx_blitRows(int16_t y, int16_t h, const uint8_t * pages) {
+    if (h <= 0 || (h & 7) != 0) {
+        return false;
+    }
+    uint8_t * first = gfx_rowPage(y);
+    uint8_t * last = gfx_rowPage(y + h - 8);
+    if (first == NULL || last == NULL) {
+        return false;
+    }
+    memcpy(first < last ? first : last, pages, (h / 8) * SSD1306_LCDWIDTH);
+    return true;
+}
+
+// Scroll the logical rows y..y+h-1 by dy rows, as whole pages. Rows
+// scrolled out of the window are lost, the ones uncovered are left as
+// they were. Nothing is sent to the display.
+bool gfx_scrollRows(int16_t y, int16_t h, int16_t dy) {
+    if (gfx_rowPage(y) == NULL || gfx_rowPage(y + h - 8) == NULL ||
+        (h & 7) != 0 || (dy & 7) != 0) {
+        return false;
+    }
+    if (dy > 0) {
+        for (int16_t row = y + h - 8; row - dy >= y; row -= 8) {
+            memcpy(gfx_rowPage(row), gfx_rowPage(row - dy), SSD1306_LCDWIDTH);
+        }
+    }
+    else if (dy < 0) {
+        for (int16_t row = y; row - dy < y + h; row += 8) {
+            memcpy(gfx_rowPage(row), gfx_rowPage(row - dy), SSD1306_LCDWIDTH);
+        }
+    }
+    return true;
+}
@@ -69,6 +69,8 @@ All text above, and the splash screen must be included in any redistribution
   #define SSD1306_LCDHEIGHT                 16
 #endif
 
+#define SSD1306_LCDPAGES                  (SSD1306_LCDHEIGHT / 8)
+
 #define SSD1306_SETCONTRAST 0x81
 #define SSD1306_DISPLAYALLON_RESUME 0xA4
 #define SSD1306_DISPLAYALLON 0xA5
@@ -128,7 +130,15 @@ void ssd1306_startscrolldiagleft(uint8_t start, uint8_t stop);
 void ssd1306_stopscroll(void);
 void ssd1306_dim(bool dim);
 void ssd1306_update(void);
+void ssd1306_update_pages(uint8_t first_page, uint8_t last_page);
+bool ssd1306_suspend_ui(void);
+void ssd1306_resume_ui(void);
+void ssd1306_show_pages(uint8_t first_page, uint8_t last_page);
 void ssd1306_clearDisplay(void);
+uint16_t ssd1306_snapshot_rle(uint8_t * dst, uint16_t dst_size);
+bool ssd1306_restore_rle(const uint8_t * src, uint16_t src_len);
+bool ssd1306_write_span(uint8_t page, uint8_t column, const uint8_t * data, uint8_t length);
+bool ssd1306_fill_span(uint8_t page, uint8_t column, uint8_t value, uint8_t length);
 void ssd1306_drawFastHLine(int16_t x, int16_t y, int16_t w, uint16_t color);
 void ssd1306_drawFastHLineInternal(int16_t x, int16_t y, int16_t w, uint16_t color);
 void ssd1306_drawFastVLine(int16_t x, int16_t y, int16_t h, uint16_t color);
@@ -154,6 +164,7 @@ void gfx_drawXBitmap(int16_t x, int16_t y, const uint8_t *bitmap, int16_t w, int
 void gfx_write(uint8_t c);
 void gfx_drawChar(int16_t x, int16_t y, unsigned char c, uint16_t color, uint16_t bg, uint8_t size);
 void gfx_setCursor(int16_t x, int16_t y);
+int16_t gfx_getCursorY(void);
 void gfx_setTextSize(uint8_t s);
 void gfx_setTextColor(uint16_t c);
 void gfx_setTextBackgroundColor(uint16_t c, uint16_t b);
@@ -161,5 +172,10 @@ void gfx_setTextWrap(bool w);
 void gfx_putc(char c);
 void gfx_puts(char *s);
 void gfx_update();
+void gfx_updateRows(int16_t y, int16_t h);
+bool gfx_renderTextRow(uint8_t * page, int16_t x, const char * text, uint8_t length);
+bool gfx_blitRow(int16_t y, const uint8_t * page);
+bool gfx_blitRows(int16_t y, int16_t h, const uint8_t * pages);
+bool gfx_scrollRows(int16_t y, int16_t h, int16_t dy);
 
 #endif
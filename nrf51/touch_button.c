@@ -9,100 +9,518 @@
 #include "touch_button.h"
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 
 #include <nrf51.h>
 #include <nrf_gpio.h>
 #include <spi_slave.h>
 #include <app_error.h>
 #include <app_timer.h>
+#include <app_scheduler.h>
 
 #include "ssd1306.h"
 #include "boards.h"
 #include "controls.h"
+#include "nsec_latency.h"
+#include "display_stream.h"
+#include "nsec_provision.h"
+#include "nsec_offload.h"
 
 
-#define TX_BUF_SIZE   2
-#define RX_BUF_SIZE   2
+#define TX_BUF_SIZE   NSEC_LINK_FRAME_SIZE
+#define RX_BUF_SIZE   NSEC_LINK_FRAME_SIZE
 // SPI default character. Character clocked out in case of an ignored transaction
 #define DEF_CHARACTER 0xAAu
 // SPI over-read character. Character clocked out after an    over-read of the transmit buffer
 #define ORC_CHARACTER 0x55u
 
+// Touch events are queued by the SPIS interrupt and handled from the
+// scheduler, so the button handlers (drawing, SPI to the display) never
+// run in IRQ context. Power of two.
+#define TOUCH_EVENT_QUEUE_SIZE 8
+
+// Records for the STM32, each a type, a length and its data. They are moved
+// to the link frame by the SPIS interrupt. Power of two.
+#define TOUCH_LINK_QUEUE_SIZE 128
+
+typedef struct {
+    uint8_t event;
+    uint8_t button;
+    uint16_t stm32_age_us; // From the touch record, see nsec_latency.h
+    uint32_t time; // RTC ticks when the transfer completed
+} touch_queued_event_t;
+
+// Gesture timings, in milliseconds
+#define TOUCH_LONG_PRESS_MS             500
+#define TOUCH_REPEAT_FIRST_INTERVAL_MS  200
+#define TOUCH_REPEAT_MIN_INTERVAL_MS    40
+#define TOUCH_REPEAT_ACCELERATION       4   // Each repeat is 1/4 sooner
+#define TOUCH_DOUBLE_TAP_GAP_MS         250
+#define TOUCH_SWIPE_WINDOW_MS           80  // A cross pad holds its PRESS back this long
+
+#define TOUCH_TICKS(ms) APP_TIMER_TICKS(ms, APP_TIMER_PRESCALER)
+
+typedef struct {
+    bool is_down;
+    bool was_long;  // The last press turned into a long press
+    bool in_swipe;  // The finger slid onto this pad
+} touch_pad_state_t;
+
 static uint8_t m_tx_buf[TX_BUF_SIZE];
 static uint8_t m_rx_buf[RX_BUF_SIZE];
-static uint32_t last_event_received_time;
-
-void touch_on_event(enum touch_event event, enum touch_button button) {
-    uint32_t event_received_time, event_received_diff;
-    app_timer_cnt_get(&event_received_time);
-    app_timer_cnt_diff_compute(event_received_time, last_event_received_time, &event_received_diff);
-    last_event_received_time = event_received_time;
-    if(event_received_diff < 3000) {
+
+static touch_pad_state_t pads[BUTTON_COUNT];
+static app_timer_id_t gesture_timer;
+static button_t swipe_direction;
+
+// The pad waiting for its long press, then repeating
+static struct {
+    bool active;
+    button_t button;
+    uint8_t repeat_count;
+    uint32_t interval;
+} held;
+
+static struct {
+    bool valid;
+    button_t button;
+    uint32_t time;
+} last_release;
+
+static struct {
+    bool valid;
+    button_t button;
+} last_touched;
+
+// A cross pad just touched, its PRESS held back: the next pad on the same
+// line touched meanwhile makes it a swipe instead
+static struct {
+    bool active;
+    bool double_tap;
+    button_t button;
+    uint32_t time;
+} pending;
+
+// Single producer (SPIS IRQ) and single consumer (scheduler), no lock needed
+static touch_queued_event_t event_queue[TOUCH_EVENT_QUEUE_SIZE];
+static volatile uint8_t event_queue_head = 0; // Written by the IRQ only
+static volatile uint8_t event_queue_tail = 0; // Written by the scheduler only
+static volatile bool event_queue_drain_scheduled = false;
+static volatile uint32_t event_queue_dropped = 0;
+
+// The link state is only touched by the SPIS interrupt
+static nsec_link_t stm32_link;
+
+// Single producer (scheduler) and single consumer (SPIS IRQ)
+static uint8_t link_queue[TOUCH_LINK_QUEUE_SIZE];
+static volatile uint8_t link_queue_head = 0; // Written by the scheduler only
+static volatile uint8_t link_queue_tail = 0; // Written by the IRQ only
+
+#ifdef TOUCH_ISR_TIMING
+static touch_timing_stats_t timing_stats;
+
+// TIMER1 counts microseconds, each context captures in its own CC register
+static void touch_timing_init(void) {
+    NRF_TIMER1->MODE = TIMER_MODE_MODE_Timer;
+    NRF_TIMER1->BITMODE = TIMER_BITMODE_BITMODE_32Bit;
+    NRF_TIMER1->PRESCALER = 4;
+    NRF_TIMER1->TASKS_CLEAR = 1;
+    NRF_TIMER1->TASKS_START = 1;
+}
+
+static uint32_t touch_timing_now(uint8_t channel) {
+    NRF_TIMER1->TASKS_CAPTURE[channel] = 1;
+    return NRF_TIMER1->CC[channel];
+}
+
+static void touch_timing_add(touch_timing_t * timing, uint32_t start, uint32_t end) {
+    uint32_t elapsed = end - start;
+    timing->count++;
+    timing->total_us += elapsed;
+    if(elapsed > timing->max_us) {
+        timing->max_us = elapsed;
+    }
+}
+
+touch_timing_stats_t touch_get_timing_stats(void) {
+    return timing_stats;
+}
+#endif
+
+uint32_t touch_get_dropped_event_count(void) {
+    return event_queue_dropped;
+}
+
+static bool touch_button_from_pad(uint8_t pad, button_t * button) {
+    switch (pad) {
+        case TOUCH_BUTTON_UP:
+            *button = BUTTON_UP;
+            return true;
+        case TOUCH_BUTTON_DOWN:
+            *button = BUTTON_DOWN;
+            return true;
+        case TOUCH_BUTTON_LEFT:
+            *button = BUTTON_LEFT;
+            return true;
+        case TOUCH_BUTTON_RIGHT:
+            *button = BUTTON_RIGHT;
+            return true;
+        case TOUCH_BUTTON_BACK:
+            *button = BUTTON_BACK;
+            return true;
+        case TOUCH_BUTTON_ENTER:
+            *button = BUTTON_ENTER;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void touch_emit(button_gesture_type_t type, button_t button, uint8_t repeat_count) {
+    button_gesture_t gesture = {
+        .type = type,
+        .button = button,
+        .repeat_count = repeat_count,
+    };
+    nsec_controls_trigger(&gesture);
+}
+
+// Pads of the direction cross, by column and row. A finger going from one
+// to the next on the same line is a swipe. BACK is off the cross.
+static bool touch_pad_position(button_t button, int8_t * column, int8_t * row) {
+    switch (button) {
+        case BUTTON_UP:    *column = 1; *row = 0; return true;
+        case BUTTON_LEFT:  *column = 0; *row = 1; return true;
+        case BUTTON_ENTER: *column = 1; *row = 1; return true;
+        case BUTTON_RIGHT: *column = 2; *row = 1; return true;
+        case BUTTON_DOWN:  *column = 1; *row = 2; return true;
+        default:
+            return false;
+    }
+}
+
+static bool touch_swipe_direction(button_t from, button_t to, button_t * direction) {
+    int8_t from_column, from_row, to_column, to_row;
+    if(!touch_pad_position(from, &from_column, &from_row) ||
+       !touch_pad_position(to, &to_column, &to_row)) {
+        return false;
+    }
+    if(from_column == to_column && from_row != to_row) {
+        *direction = to_row > from_row ? BUTTON_DOWN : BUTTON_UP;
+        return true;
+    }
+    if(from_row == to_row && from_column != to_column) {
+        *direction = to_column > from_column ? BUTTON_RIGHT : BUTTON_LEFT;
+        return true;
+    }
+    return false;
+}
+
+static uint32_t touch_elapsed(uint32_t now, uint32_t then) {
+    uint32_t elapsed;
+    app_timer_cnt_diff_compute(now, then, &elapsed);
+    return elapsed;
+}
+
+static void touch_start_gesture_timer(uint32_t ticks) {
+    app_timer_stop(gesture_timer);
+    uint32_t err_code = app_timer_start(gesture_timer, ticks, NULL);
+    APP_ERROR_CHECK(err_code);
+}
+
+static void touch_press(button_t button, bool double_tap, uint32_t long_press_ticks) {
+    touch_emit(BUTTON_GESTURE_PRESS, button, 0);
+    if(double_tap) {
+        touch_emit(BUTTON_GESTURE_DOUBLE_TAP, button, 0);
+    }
+
+    held.active = true;
+    held.button = button;
+    held.repeat_count = 0;
+    held.interval = TOUCH_TICKS(TOUCH_REPEAT_FIRST_INTERVAL_MS);
+    touch_start_gesture_timer(long_press_ticks);
+}
+
+// Not a swipe after all. Timed from the touch, the STM32 part is left out.
+static void touch_press_pending(void) {
+    if(!pending.active) {
         return;
     }
+    pending.active = false;
+    nsec_latency_input_begin(pending.time, NSEC_LATENCY_AGE_UNKNOWN);
+    touch_press(pending.button, pending.double_tap, TOUCH_TICKS(TOUCH_LONG_PRESS_MS - TOUCH_SWIPE_WINDOW_MS));
+    nsec_latency_input_end();
+}
 
-    if(event == TOUCH_EVENT_DOWN) {
-        button_t button_pressed;
-        switch (button) {
-            case TOUCH_BUTTON_UP:
-                button_pressed = BUTTON_UP;
-                break;
-            case TOUCH_BUTTON_DOWN:
-                button_pressed = BUTTON_DOWN;
-                break;
-            case TOUCH_BUTTON_LEFT:
-                button_pressed = BUTTON_LEFT;
-                break;
-            case TOUCH_BUTTON_RIGHT:
-                button_pressed = BUTTON_RIGHT;
-                break;
-            case TOUCH_BUTTON_BACK:
-                button_pressed = BUTTON_BACK;
-                break;
-            case TOUCH_BUTTON_ENTER:
-                button_pressed = BUTTON_ENTER;
-                break;
-            default:
-                break;
+// Runs from the scheduler: the pending press is due, or the held pad for
+// its long press or next repeat
+static void touch_on_gesture_timer(void * context) {
+    if(pending.active) {
+        touch_press_pending();
+        return;
+    }
+    if(!held.active || !pads[held.button].is_down) {
+        held.active = false;
+        return;
+    }
+    if(held.repeat_count == 0) {
+        touch_emit(BUTTON_GESTURE_LONG_PRESS, held.button, 0);
+        pads[held.button].was_long = true;
+    }
+    if(held.repeat_count < UINT8_MAX) {
+        held.repeat_count++;
+    }
+    touch_emit(BUTTON_GESTURE_REPEAT, held.button, held.repeat_count);
+    touch_start_gesture_timer(held.interval);
+    held.interval -= held.interval / TOUCH_REPEAT_ACCELERATION;
+    if(held.interval < TOUCH_TICKS(TOUCH_REPEAT_MIN_INTERVAL_MS)) {
+        held.interval = TOUCH_TICKS(TOUCH_REPEAT_MIN_INTERVAL_MS);
+    }
+}
+
+// The pad a finger may be sliding from: still touched, its PRESS held back
+// or already part of the swipe
+static bool touch_swipe_origin(button_t button, button_t * from) {
+    if(!last_touched.valid || last_touched.button == button || !pads[last_touched.button].is_down) {
+        return false;
+    }
+    *from = last_touched.button;
+    return pads[*from].in_swipe || (pending.active && pending.button == *from);
+}
+
+static void touch_on_pad_down(button_t button, uint32_t time) {
+    touch_pad_state_t * pad = &pads[button];
+    button_t from;
+    button_t direction;
+    int8_t column, row;
+    bool is_swipe = touch_swipe_origin(button, &from) &&
+                    touch_swipe_direction(from, button, &direction);
+    bool is_double_tap = !is_swipe && last_release.valid && last_release.button == button &&
+                         !pad->was_long &&
+                         touch_elapsed(time, last_release.time) < TOUCH_TICKS(TOUCH_DOUBLE_TAP_GAP_MS);
+
+    // A second DOWN means the UP got lost, it simply starts over
+    pad->is_down = true;
+    pad->was_long = false;
+    last_release.valid = false;
+    last_touched.valid = true;
+    last_touched.button = button;
+
+    if(is_swipe) {
+        // A slide over three pads is still one swipe
+        bool continued = pads[from].in_swipe && swipe_direction == direction;
+        // The pad it started from gets neither PRESS nor RELEASE
+        pending.active = false;
+        pads[from].in_swipe = true;
+        pad->in_swipe = true;
+        held.active = false;
+        app_timer_stop(gesture_timer);
+        if(!continued) {
+            swipe_direction = direction;
+            touch_emit(BUTTON_GESTURE_SWIPE, direction, 0);
+        }
+        return;
+    }
+    pad->in_swipe = false;
+
+    // Another pad held back, touched along with this one
+    touch_press_pending();
+    if(touch_pad_position(button, &column, &row)) {
+        pending.active = true;
+        pending.double_tap = is_double_tap;
+        pending.button = button;
+        pending.time = time;
+        held.active = false;
+        touch_start_gesture_timer(TOUCH_TICKS(TOUCH_SWIPE_WINDOW_MS));
+        return;
+    }
+    touch_press(button, is_double_tap, TOUCH_TICKS(TOUCH_LONG_PRESS_MS));
+}
+
+static void touch_on_pad_up(button_t button, uint32_t time) {
+    touch_pad_state_t * pad = &pads[button];
+    if(!pad->is_down) {
+        return;
+    }
+    if(pending.active && pending.button == button) {
+        // A tap
+        touch_press_pending();
+    }
+    pad->is_down = false;
+    if(held.active && held.button == button) {
+        held.active = false;
+        app_timer_stop(gesture_timer);
+    }
+    if(!pad->in_swipe) {
+        touch_emit(BUTTON_GESTURE_RELEASE, button, 0);
+    }
+    last_release.valid = true;
+    last_release.button = button;
+    last_release.time = time;
+}
+
+static void touch_on_event(enum touch_event event, enum touch_button pad, uint32_t event_received_time) {
+    button_t button;
+    if(!touch_button_from_pad(pad, &button)) {
+        return;
+    }
+    switch (event) {
+        case TOUCH_EVENT_DOWN:
+            touch_on_pad_down(button, event_received_time);
+            break;
+        case TOUCH_EVENT_UP:
+            touch_on_pad_up(button, event_received_time);
+            break;
+        default:
+            break;
+    }
+}
+
+static void touch_process_events(void * p_event_data, uint16_t event_size) {
+    // Cleared first: an event queued from now on schedules another run
+    event_queue_drain_scheduled = false;
+    while(event_queue_tail != event_queue_head) {
+        touch_queued_event_t queued = event_queue[event_queue_tail % TOUCH_EVENT_QUEUE_SIZE];
+        event_queue_tail++;
+        if(display_stream_active()) {
+            // The pads would drive a menu nobody sees
+            continue;
+        }
+        nsec_latency_input_begin(queued.time, queued.stm32_age_us);
+#ifdef TOUCH_ISR_TIMING
+        uint32_t start = touch_timing_now(1);
+        touch_on_event(queued.event, queued.button, queued.time);
+        touch_timing_add(&timing_stats.dispatch, start, touch_timing_now(1));
+#else
+        touch_on_event(queued.event, queued.button, queued.time);
+#endif
+        nsec_latency_input_end();
+    }
+}
+
+// Called from the SPIS interrupt
+static void touch_queue_event(uint8_t event, uint8_t button, uint16_t stm32_age_us) {
+    uint8_t head = event_queue_head;
+    if((uint8_t)(head - event_queue_tail) >= TOUCH_EVENT_QUEUE_SIZE) {
+        event_queue_dropped++;
+    }
+    else {
+        touch_queued_event_t * queued = &event_queue[head % TOUCH_EVENT_QUEUE_SIZE];
+        queued->event = event;
+        queued->button = button;
+        queued->stm32_age_us = stm32_age_us;
+        app_timer_cnt_get(&queued->time);
+        // The slot must be written before the consumer can see it
+        __DMB();
+        event_queue_head = head + 1;
+    }
+    if(!event_queue_drain_scheduled) {
+        event_queue_drain_scheduled = true;
+        if(app_sched_event_put(NULL, 0, touch_process_events) != NRF_SUCCESS) {
+            // Scheduler queue full, the next event will try again
+            event_queue_drain_scheduled = false;
         }
-        nsec_controls_trigger(button_pressed);
     }
 }
 
-static void spi_slave_buffers_init(uint8_t * const p_tx_buf,
-                                   uint8_t * const p_rx_buf,
-                                   const uint16_t len) {
-    uint16_t i;
+// Called from the SPIS interrupt, for each record of a frame from the STM32
+static void touch_on_record(uint8_t type, const uint8_t * data, uint8_t length) {
+    if(type == NSEC_LINK_RECORD_TOUCH && length >= NSEC_LINK_TOUCH_RECORD_SIZE) {
+        touch_queue_event(data[2], data[3], data[0] << 8 | data[1]);
+    }
+    else if(type == NSEC_LINK_RECORD_DISPLAY_DATA) {
+        display_stream_receive(data, length);
+    }
+    else if(type == NSEC_LINK_RECORD_PROVISION_DATA) {
+        nsec_provision_receive(data, length);
+    }
+    else if(type == NSEC_LINK_RECORD_JOB_RESULT) {
+        nsec_offload_receive(data, length);
+    }
+}
 
-    for (i = 0; i < len; i++) {
-        p_tx_buf[i] = (uint8_t)('a' + i);
-        p_rx_buf[i] = 0;
+bool touch_link_send(uint8_t type, const void * data, uint8_t length) {
+    uint8_t head = link_queue_head;
+    uint8_t used = head - link_queue_tail;
+    if(NSEC_LINK_RECORD_HEADER_SIZE + length > NSEC_LINK_MAX_PAYLOAD ||
+       used + NSEC_LINK_RECORD_HEADER_SIZE + length > TOUCH_LINK_QUEUE_SIZE) {
+        return false;
+    }
+    link_queue[head++ % TOUCH_LINK_QUEUE_SIZE] = type;
+    link_queue[head++ % TOUCH_LINK_QUEUE_SIZE] = length;
+    for(uint8_t i = 0; i < length; i++) {
+        link_queue[head++ % TOUCH_LINK_QUEUE_SIZE] = ((const uint8_t *) data)[i];
+    }
+    // The record must be written before the consumer can see it
+    __DMB();
+    link_queue_head = head;
+    return true;
+}
+
+nsec_link_stats_t touch_get_link_stats(void) {
+    return stm32_link.stats;
+}
+
+// Called from the SPIS interrupt: queued records go in the frame, as many as
+// it holds, then a part of the job for the STM32 if there is room left
+static void touch_link_fill_frame(void) {
+    uint8_t record[NSEC_LINK_MAX_PAYLOAD];
+    while(link_queue_tail != link_queue_head) {
+        uint8_t tail = link_queue_tail;
+        uint8_t type = link_queue[tail++ % TOUCH_LINK_QUEUE_SIZE];
+        uint8_t length = link_queue[tail++ % TOUCH_LINK_QUEUE_SIZE];
+        for(uint8_t i = 0; i < length; i++) {
+            record[i] = link_queue[tail++ % TOUCH_LINK_QUEUE_SIZE];
+        }
+        if(!nsec_link_add_record(&stm32_link, type, record, length)) {
+            return;
+        }
+        link_queue_tail = tail;
+    }
+    uint8_t length = nsec_offload_next_record(record, nsec_link_record_space(&stm32_link));
+    if(length > 0) {
+        nsec_link_add_record(&stm32_link, NSEC_LINK_RECORD_JOB, record, length);
     }
 }
 
 static void spi_slave_event_handle(spi_slave_evt_t event) {
     uint32_t err_code;
+#ifdef TOUCH_ISR_TIMING
+    uint32_t start = touch_timing_now(0);
+#endif
 
     if (event.evt_type == SPI_SLAVE_XFER_DONE) {
-        // Check if buffer size is the same as amount of received data
-        APP_ERROR_CHECK_BOOL(event.rx_amount == RX_BUF_SIZE);
-
-        // Check if received data is valid
-        //bool success = spi_slave_buffer_check(m_rx_buf, event.rx_amount);
-        //APP_ERROR_CHECK_BOOL(success);
+        if(event.rx_amount < RX_BUF_SIZE) {
+            // Cut short, whatever is left of the last frame fails its CRC
+            memset(m_rx_buf + event.rx_amount, 0, RX_BUF_SIZE - event.rx_amount);
+        }
+        nsec_link_receive(&stm32_link, m_rx_buf, touch_on_record);
 
-        touch_on_event(m_rx_buf[0], m_rx_buf[1]);
+        // The answer goes out with the next frame from the STM32
+        touch_link_fill_frame();
+        // Both are called, each one schedules its own parsing
+        bool hold = display_stream_should_hold();
+        hold = nsec_provision_should_hold() || hold;
+        nsec_link_set_hold(&stm32_link, hold);
+        nsec_link_build(&stm32_link, m_tx_buf, link_queue_tail != link_queue_head || nsec_offload_has_records());
 
         // Reset buffers
         err_code = spi_slave_buffers_set(m_tx_buf, m_rx_buf, sizeof(m_tx_buf), sizeof(m_rx_buf));
         APP_ERROR_CHECK(err_code);
     }
+#ifdef TOUCH_ISR_TIMING
+    touch_timing_add(&timing_stats.isr, start, touch_timing_now(0));
+#endif
 }
 
 uint32_t touch_init(void) {
     uint32_t err_code;
     spi_slave_config_t spi_slave_config;
 
+#ifdef TOUCH_ISR_TIMING
+    touch_timing_init();
+#endif
+
     err_code = spi_slave_evt_handler_register(spi_slave_event_handle);
     APP_ERROR_CHECK(err_code);
 
@@ -118,11 +536,14 @@ uint32_t touch_init(void) {
     err_code = spi_slave_init(&spi_slave_config);
     APP_ERROR_CHECK(err_code);
 
-    spi_slave_buffers_init(m_tx_buf, m_rx_buf, (uint16_t)TX_BUF_SIZE);
+    nsec_link_init(&stm32_link);
+    nsec_link_build(&stm32_link, m_tx_buf, false);
 
     err_code = spi_slave_buffers_set(m_tx_buf, m_rx_buf, sizeof(m_tx_buf), sizeof(m_rx_buf));
     APP_ERROR_CHECK(err_code);
-    app_timer_cnt_get(&last_event_received_time);
+
+    err_code = app_timer_create(&gesture_timer, APP_TIMER_MODE_SINGLE_SHOT, touch_on_gesture_timer);
+    APP_ERROR_CHECK(err_code);
 
     return NRF_SUCCESS;
 }
@@ -10,6 +10,9 @@
 #define touch_button_h
 
 #include <stdint.h>
+#include <stdbool.h>
+
+#include "nsec_link.h"
 
 enum touch_event {
     TOUCH_EVENT_DOWN    = 0x01,
@@ -25,7 +28,30 @@ enum touch_button {
     TOUCH_BUTTON_BACK   = 0x06,
 };
 
+// Define TOUCH_ISR_TIMING to measure, in microseconds with TIMER1, the time
+// spent in the SPIS interrupt and the time spent handling the buttons from
+// the scheduler (which is what the interrupt used to do). The timer keeps
+// the high frequency clock running, leave it off in production.
+typedef struct {
+    uint32_t count;
+    uint32_t total_us;
+    uint32_t max_us;
+} touch_timing_t;
+
+typedef struct {
+    touch_timing_t isr;
+    touch_timing_t dispatch;
+} touch_timing_stats_t;
+
 uint32_t touch_init(void);
+uint32_t touch_get_dropped_event_count(void);
+// Queues a record for the STM32 (see nsec_link.h), it goes out the next
+// time the STM32 polls the link. False when the queue is full.
+bool touch_link_send(uint8_t type, const void * data, uint8_t length);
+nsec_link_stats_t touch_get_link_stats(void);
+#ifdef TOUCH_ISR_TIMING
+touch_timing_stats_t touch_get_timing_stats(void);
+#endif
 
 
 #endif /* touch_button_h */
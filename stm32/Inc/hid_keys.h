@@ -0,0 +1,68 @@
+#ifndef HID_KEYS_H
+#define HID_KEYS_H
+
+#include <stdint.h>
+#include "touch_scan.h"
+
+// The touch buttons as a USB keyboard and consumer control, next to the
+// serial port (see usbd_composite.h): each button sends a key with its
+// modifiers, or a consumer usage (volume, play/pause, ...), for as long as
+// it is pressed. The nRF still gets every button.
+//
+// Reports are queued as the buttons change, so a short tap is never lost
+// between two polls of the host. The latency is measured from the start of
+// the acquisition that found the change to the host taking the report.
+
+#define HID_KEYS_BUTTON_COUNT       TOUCH_SCAN_BUTTON_COUNT // Buttons 1 to 6
+
+#define HID_KEYS_TYPE_NONE          0
+#define HID_KEYS_TYPE_KEY           1 // Keyboard usage, 8 bits
+#define HID_KEYS_TYPE_CONSUMER      2 // Consumer usage, 16 bits
+
+// Feature report USBD_HID_REPORT_KEYMAP: per button, from button 1, its
+// type, modifiers (the keyboard report bits), and usage (16 bits, little
+// endian). Set by the host, lost at reset.
+#define HID_KEYS_ENTRY_SIZE         4
+#define HID_KEYS_KEYMAP_SIZE        (HID_KEYS_BUTTON_COUNT * HID_KEYS_ENTRY_SIZE)
+
+// Feature report USBD_HID_REPORT_LATENCY, read only: reports taken by the
+// host (32 bits), the longest latency and the longest wait for the host
+// poll in microseconds (32 bits each), then the buckets (16 bits each).
+// Bucket 0 is below 64 us, bucket n (n > 0) is 2^(n+5) us up to
+// 2^(n+6) us, the last one also holds everything longer. Little endian.
+// Setting it clears the counts.
+#define HID_KEYS_BUCKET_COUNT       12
+#define HID_KEYS_BUCKET_SHIFT       6
+#define HID_KEYS_LATENCY_SIZE       (12 + HID_KEYS_BUCKET_COUNT * 2)
+
+typedef struct {
+    uint8_t type;
+    uint8_t modifiers;
+    uint16_t usage;
+} hid_key_t;
+
+// For the debugger too
+typedef struct {
+    uint32_t reports;
+    uint32_t max_us;
+    uint32_t max_poll_us;       // Queued to taken by the host
+    uint16_t buckets[HID_KEYS_BUCKET_COUNT];
+    uint32_t reports_dropped;   // Queue full
+} hid_keys_latency_t;
+
+extern hid_keys_latency_t hid_keys_latency;
+
+// Main loop only
+void hid_keys_on_button(uint8_t button, uint8_t pressed, uint32_t start_us);
+// Sends the next queued report once the endpoint is free
+void hid_keys_process(void);
+
+// From the USB interrupt, see usbd_composite.c
+void hid_keys_reset(void);
+void hid_keys_report_sent(void);
+// Returns the length written, 0 for a report that does not exist
+uint16_t hid_keys_get_feature(uint8_t report_id, uint8_t * data, uint16_t size);
+// Returns 0 when the report is refused
+uint8_t hid_keys_set_feature(uint8_t report_id, const uint8_t * data, uint16_t length);
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stdint.h>
+
+// Jobs from the nRF (see nsec_job.h), run as soon as they are in and
+// answered in NSEC_LINK_RECORD_JOB_RESULT records, with the time they took.
+// One at a time: a new job replaces a result not sent yet, the nRF has given
+// up on it.
+//
+// The nRF cannot start a transfer and waits on the result, so the link is
+// polled every OFFLOAD_POLL_MS for OFFLOAD_ACTIVE_MS after the last job,
+// for the next one of a batch to come in early too.
+#define OFFLOAD_POLL_MS     1
+#define OFFLOAD_ACTIVE_MS   100
+
+// For the debugger
+typedef struct {
+    uint32_t jobs;
+    uint32_t failed;        // Bad input or unknown type
+    uint32_t replaced;      // Result not sent when the next job came
+    uint32_t max_us;
+} offload_stats_t;
+
+extern offload_stats_t offload_stats;
+
+// Main loop only, for each NSEC_LINK_RECORD_JOB record
+void offload_on_record(const uint8_t * data, uint8_t length);
+// Writes the next result record, returns its length, 0 when there is none
+// or space is too short
+uint8_t offload_next_record(uint8_t * record, uint8_t space);
+// A result is waiting to be sent
+uint8_t offload_pending(void);
+// A job came in the last OFFLOAD_ACTIVE_MS
+uint8_t offload_active(void);
+
+#endif
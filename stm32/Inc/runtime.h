@@ -0,0 +1,41 @@
+#ifndef RUNTIME_H
+#define RUNTIME_H
+
+#include <stdint.h>
+#include "stm32f0xx_hal.h"
+
+// Work posted by the interrupts for the main loop, which sleeps when none is
+// left. One bit per kind of work: posting it twice before the loop comes
+// around is the same as posting it once, the handlers drain their own queues.
+#define RUNTIME_WORK_TSC        (1 << 0) // Touch samples queued
+#define RUNTIME_WORK_LINK       (1 << 1) // Link transfer done
+#define RUNTIME_WORK_SCAN       (1 << 2) // RTC wakeup, time for an idle scan
+#define RUNTIME_WORK_USB_RESET  (1 << 3) // A host is on the bus
+#define RUNTIME_WORK_USB_POWER  (1 << 4) // Bus suspended or resumed
+#define RUNTIME_WORK_UART       (1 << 5) // UART bytes in, or the line went idle
+#define RUNTIME_WORK_USB_IN     (1 << 6) // IN packet sent, the endpoint is free
+
+extern volatile uint32_t runtime_work;
+
+// Microseconds since boot, from the main loop or any interrupt. It stands
+// still while the HAL tick is suspended.
+uint32_t micros(void);
+
+// From any interrupt, or from the main loop
+static inline void runtime_post(uint32_t work) {
+    uint32_t primask = __get_PRIMASK();
+    __disable_irq();
+    runtime_work |= work;
+    __set_PRIMASK(primask);
+}
+
+// Main loop only, the work taken is cleared
+static inline uint32_t runtime_take(void) {
+    __disable_irq();
+    uint32_t work = runtime_work;
+    runtime_work = 0;
+    __enable_irq();
+    return work;
+}
+
+#endif
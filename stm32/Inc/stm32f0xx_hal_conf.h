@@ -63,7 +63,7 @@
 //#define HAL_LCD_MODULE_ENABLED
 //#define HAL_LPTIM_MODULE_ENABLED
 //#define HAL_RNG_MODULE_ENABLED
-//#define HAL_RTC_MODULE_ENABLED
+#define HAL_RTC_MODULE_ENABLED
 #define HAL_SPI_MODULE_ENABLED
 #define HAL_TIM_MODULE_ENABLED
 #define HAL_UART_MODULE_ENABLED
@@ -71,7 +71,7 @@
 //#define HAL_IRDA_MODULE_ENABLED
 //#define HAL_SMARTCARD_MODULE_ENABLED
 //#define HAL_SMBUS_MODULE_ENABLED
-#define HAL_WWDG_MODULE_ENABLED
+//#define HAL_WWDG_MODULE_ENABLED
 #define HAL_PCD_MODULE_ENABLED
 #define HAL_CORTEX_MODULE_ENABLED
 #define HAL_DMA_MODULE_ENABLED
@@ -49,6 +49,9 @@ void NMI_Handler(void);
 void HardFault_Handler(void);
 void SysTick_Handler(void);
 void TSC_IRQHandler(void);
+void RTC_IRQHandler(void);
+void TIM6_DAC_IRQHandler(void);
+void SPI1_IRQHandler(void);
 void DMA1_Channel2_3_IRQHandler(void);
 void USART1_IRQHandler(void);
 void USB_IRQHandler(void);
@@ -0,0 +1,56 @@
+#ifndef TOUCH_DETECT_H
+#define TOUCH_DETECT_H
+
+#include <stdint.h>
+
+// Turns raw TSC acquisition values into pressed/released, per channel.
+// A finger adds capacitance, so the value drops below the baseline. The
+// baseline is learnt at boot and follows slow drifts (humidity, power
+// source) while the pad is released. Samples go through a 3-sample median
+// and an IIR filter; the press threshold is a fraction of the baseline or
+// a multiple of the measured noise, whichever is larger, and the release
+// threshold is half of it.
+
+// One per pad, then one per group with all its pads sensed together: a
+// hand near any pad of the group, used to wake up from the idle scans.
+#define TOUCH_DETECT_CHANNEL_COUNT        8
+#define TOUCH_DETECT_PROXIMITY_GROUP1     6
+#define TOUCH_DETECT_PROXIMITY_GROUP2     7
+
+#define TOUCH_DETECT_CALIBRATION_SAMPLES  16
+#define TOUCH_DETECT_FILTER_SHIFT         1   // IIR weight of a new sample, 1/2
+#define TOUCH_DETECT_THRESHOLD_PERCENT    20  // Of the baseline, default
+#define TOUCH_DETECT_NOISE_FACTOR         4   // Of the mean deviation when released
+#define TOUCH_DETECT_NOISE_SHIFT          4   // Noise follows 1/16 of the difference
+#define TOUCH_DETECT_DEBOUNCE             2   // Samples past a threshold to change state, default
+#define TOUCH_DETECT_DRIFT_SHIFT          6   // Baseline follows 1/64 of the difference
+#define TOUCH_DETECT_RECOVERY_SHIFT       2   // Faster when the value goes above the baseline
+#define TOUCH_DETECT_MAX_PRESS_MS         10000 // Longer is a drift, not a finger
+
+// Values are fixed point with 4 fractional bits
+#define TOUCH_DETECT_FRACTION_BITS        4
+
+typedef struct {
+    uint16_t history[3];
+    uint8_t history_count;
+    uint8_t calibration_left;
+    uint8_t debounce;
+    uint8_t pressed;
+    uint8_t threshold_percent;
+    uint8_t debounce_samples;
+    int32_t filtered;
+    int32_t baseline;
+    int32_t noise;
+    uint32_t pressed_since_ms;
+} touch_channel_t;
+
+void touch_detect_init(void);
+// Returns 1 when the channel changed state, *pressed is then the new state
+uint8_t touch_detect_update(uint8_t channel, uint16_t value, uint32_t now_ms, uint8_t * pressed);
+// Forget the channel state, it is calibrated again from the next samples
+void touch_detect_recalibrate(uint8_t channel);
+void touch_detect_configure(uint8_t channel, uint8_t threshold_percent, uint8_t debounce_samples);
+uint8_t touch_detect_any_pressed(uint8_t first_channel, uint8_t count);
+const touch_channel_t * touch_detect_get_channel(uint8_t channel);
+
+#endif
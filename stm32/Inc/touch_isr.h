@@ -0,0 +1,56 @@
+#ifndef TOUCH_ISR_H
+#define TOUCH_ISR_H
+
+#include <stdint.h>
+#include "stm32f0xx_hal.h"
+
+// Build options for the touch and link interrupts, see the Makefile.
+//
+// TOUCH_FAST_PATH: the TSC, TIM6 and SPI1 interrupts and the start of a
+// link transfer go straight to the registers. The HAL only sets the
+// peripherals up, its handles are not used (nor updated) afterwards.
+//
+// TOUCH_ISR_CYCLES: TIM2 runs free at the core clock and counts the cycles
+// spent in those interrupts, for both implementations. It stops in STOP
+// mode like everything else.
+
+void tsc_fast_irq_handler(void);
+void tsc_fast_discharge_done(void);
+void link_fast_spi_irq_handler(void);
+
+#ifdef TOUCH_ISR_CYCLES
+typedef struct {
+    uint32_t count;
+    uint32_t total_cycles;
+    uint32_t max_cycles;
+} touch_isr_cycles_t;
+
+typedef struct {
+    touch_isr_cycles_t tsc;         // Acquisition done: sample, next channel, discharge
+    touch_isr_cycles_t discharge;   // Discharge done: acquisition started
+    touch_isr_cycles_t link_start;  // Frame built to the transfer started, main loop
+    touch_isr_cycles_t spi;         // Each SPI1 interrupt
+    uint32_t link_frames;           // To get the SPI1 cycles per frame
+} touch_isr_stats_t;
+
+// For the debugger
+extern touch_isr_stats_t touch_isr_stats;
+
+void touch_isr_cycles_init(void);
+
+static inline void touch_isr_cycles_add(touch_isr_cycles_t * cycles, uint32_t elapsed) {
+    cycles->count++;
+    cycles->total_cycles += elapsed;
+    if (elapsed > cycles->max_cycles) {
+        cycles->max_cycles = elapsed;
+    }
+}
+
+#define TOUCH_ISR_CYCLES_BEGIN()      uint32_t touch_isr_cycles_start = TIM2->CNT
+#define TOUCH_ISR_CYCLES_END(stage)   touch_isr_cycles_add(&touch_isr_stats.stage, TIM2->CNT - touch_isr_cycles_start)
+#else
+#define TOUCH_ISR_CYCLES_BEGIN()
+#define TOUCH_ISR_CYCLES_END(stage)
+#endif
+
+#endif
@@ -0,0 +1,37 @@
+#ifndef TOUCH_SCAN_H
+#define TOUCH_SCAN_H
+
+#include <stdint.h>
+
+// What the touch controller does with an acquisition, without the hardware:
+// the order the channels are scanned in and which pad each group value
+// belongs to. Builds on the host too, see bench/touch_bench.c.
+//
+// Channel n senses button n+1 on group 1 and button n+4 on group 2. The
+// proximity channel senses every pad of a group at once.
+
+#define TOUCH_SCAN_CHANNEL_COUNT  3
+#define TOUCH_SCAN_PROXIMITY      3
+#define TOUCH_SCAN_BUTTON_COUNT   (TOUCH_SCAN_CHANNEL_COUNT * 2)
+
+#define TOUCH_SCAN_GROUP1         (1 << 0)
+#define TOUCH_SCAN_GROUP2         (1 << 1)
+
+// Group values of one acquisition
+typedef struct {
+    uint8_t channel;
+    uint8_t completed; // TOUCH_SCAN_GROUPx
+    uint16_t group1_value;
+    uint16_t group2_value;
+    uint32_t start_us;
+} touch_scan_sample_t;
+
+// A button changed state, pressed is 1 for down and 0 for up
+typedef void (*touch_scan_handler_t)(uint8_t button, uint8_t pressed, uint32_t start_us);
+
+uint8_t touch_scan_next_channel(uint8_t channel);
+// Runs the detection on a sample of a regular channel, changes go to the
+// handler. For the proximity channel, returns 1 when a hand came near.
+uint8_t touch_scan_process(const touch_scan_sample_t * sample, uint32_t now_ms, touch_scan_handler_t handler);
+
+#endif
@@ -97,8 +97,40 @@ extern USBD_CDC_ItfTypeDef  USBD_Interface_fops_FS;
   * @{
   */ 
 uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
+void CDC_UART_Process(void);
+void CDC_UART_IRQHandler(void);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
+// A host setting this rate streams to the display instead of the UART (see
+// display_stream.h on the nRF side), once the data before it is sent
+#define CDC_DISPLAY_BITRATE 2000000
+
+// The same for a content bundle to keep in the nRF flash (see
+// nsec_provision.h on the nRF side). Setting it again starts a new session,
+// the nRF drops what it was in the middle of.
+#define CDC_PROVISION_BITRATE 2000001
+
+uint8_t CDC_Display_Active(void);
+uint8_t CDC_Provision_Active(void);
+// Once after the provisioning mode is set
+uint8_t CDC_Provision_Started(void);
+// Display or provisioning
+uint8_t CDC_Stream_Active(void);
+uint8_t CDC_Stream_Pending(void);
+uint16_t CDC_Stream_Read(uint8_t* Buf, uint16_t Len);
+
+// Benchmarks of the USB stack, selected the same way (see
+// tools/cdc_bench.py). The packets from the host go through the same ring
+// as for the UART, which is left alone.
+// Sink: drops them, and prints "bench sink <bytes/s> stalls=<n>" once a
+// second while they come.
+#define CDC_BENCH_SINK_BITRATE      3000001
+// Source: full packets of counting bytes, as fast as the host reads them.
+#define CDC_BENCH_SOURCE_BITRATE    3000002
+// Loopback: sends every packet back as it was received.
+#define CDC_BENCH_LOOPBACK_BITRATE  3000003
+
+uint8_t CDC_Bench_Active(void);
 /* USER CODE END EXPORTED_FUNCTIONS */
 /**
   * @}
@@ -0,0 +1,33 @@
+#ifndef USBD_COMPOSITE_H
+#define USBD_COMPOSITE_H
+
+#include "usbd_cdc.h"
+
+// The CDC class of the USB library with a HID interface after it. The CDC
+// interfaces and endpoints stay as they were, an interface association
+// groups them for the host. The HID interface carries a keyboard, a
+// consumer control and a vendor collection for the feature reports, see
+// hid_keys.h; its input reports are polled every millisecond.
+
+#define USBD_HID_INTERFACE          2
+#define USBD_HID_EPIN_ADDR          0x83
+#define USBD_HID_EPIN_SIZE          9   // Report ID and a keyboard report
+#define USBD_HID_INTERVAL_MS        1
+
+// Report IDs
+#define USBD_HID_REPORT_KEYBOARD    1   // Modifiers, reserved, 6 key usages
+#define USBD_HID_REPORT_CONSUMER    2   // One consumer usage, 16 bits
+#define USBD_HID_REPORT_KEYMAP      3   // Feature
+#define USBD_HID_REPORT_LATENCY     4   // Feature
+
+#define USBD_HID_KEYBOARD_SIZE      9
+#define USBD_HID_CONSUMER_SIZE      3
+
+extern USBD_ClassTypeDef USBD_Composite;
+
+// Input reports, with their ID first. Fails while the previous one waits
+// for the host, or without a configuration.
+uint8_t USBD_HID_SendReport(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len);
+uint8_t USBD_HID_Ready(USBD_HandleTypeDef *pdev);
+
+#endif
@@ -0,0 +1,243 @@
+#include "hid_keys.h"
+
+#include <string.h>
+#include "usb_device.h"
+#include "usbd_composite.h"
+#include "runtime.h"
+
+// Power of two
+#define HID_KEYS_QUEUE_SIZE 8
+
+// Keyboard usages
+#define HID_KEYS_UP_ARROW     0x52
+#define HID_KEYS_DOWN_ARROW   0x51
+#define HID_KEYS_LEFT_ARROW   0x50
+#define HID_KEYS_RIGHT_ARROW  0x4F
+#define HID_KEYS_RETURN       0x28
+#define HID_KEYS_ESCAPE       0x29
+
+typedef struct {
+    uint8_t report[USBD_HID_KEYBOARD_SIZE];
+    uint8_t length;
+    uint8_t timed;      // Sent for a button, not for a keymap change
+    uint32_t start_us;
+} hid_keys_report_t;
+
+extern USBD_HandleTypeDef hUsbDeviceFS;
+
+hid_keys_latency_t hid_keys_latency;
+
+// A presentation clicker by default, in the order of the nRF buttons: up,
+// enter, right, left, down, back. Read from the USB interrupt too.
+static hid_key_t keymap[HID_KEYS_BUTTON_COUNT] = {
+    { HID_KEYS_TYPE_KEY, 0, HID_KEYS_UP_ARROW },
+    { HID_KEYS_TYPE_KEY, 0, HID_KEYS_RETURN },
+    { HID_KEYS_TYPE_KEY, 0, HID_KEYS_RIGHT_ARROW },
+    { HID_KEYS_TYPE_KEY, 0, HID_KEYS_LEFT_ARROW },
+    { HID_KEYS_TYPE_KEY, 0, HID_KEYS_DOWN_ARROW },
+    { HID_KEYS_TYPE_KEY, 0, HID_KEYS_ESCAPE },
+};
+
+// Bit n for button n+1
+static uint8_t pressed = 0;
+
+// Main loop only, emptied after a new configuration
+static hid_keys_report_t queue[HID_KEYS_QUEUE_SIZE];
+static uint8_t queue_head = 0;
+static uint8_t queue_tail = 0;
+static volatile uint8_t queue_flush = 0;
+// The keymap changed, the buttons held may have to send something else
+static volatile uint8_t queue_refresh = 0;
+
+// The report the host has yet to take
+static uint8_t sent_timed = 0;
+static uint32_t sent_start_us = 0;
+static uint32_t sent_us = 0;
+
+static void hid_keys_put32(uint8_t * data, uint32_t value) {
+    data[0] = value & 0xFF;
+    data[1] = (value >> 8) & 0xFF;
+    data[2] = (value >> 16) & 0xFF;
+    data[3] = value >> 24;
+}
+
+static void hid_keys_record(uint32_t us, uint32_t poll_us) {
+    uint8_t bucket = 0;
+    uint32_t bound = 1 << HID_KEYS_BUCKET_SHIFT;
+    while (us >= bound && bucket < HID_KEYS_BUCKET_COUNT - 1) {
+        bucket++;
+        bound <<= 1;
+    }
+    if (hid_keys_latency.buckets[bucket] < UINT16_MAX) {
+        hid_keys_latency.buckets[bucket]++;
+    }
+    hid_keys_latency.reports++;
+    if (us > hid_keys_latency.max_us) {
+        hid_keys_latency.max_us = us;
+    }
+    if (poll_us > hid_keys_latency.max_poll_us) {
+        hid_keys_latency.max_poll_us = poll_us;
+    }
+}
+
+// The whole state goes in each report
+static void hid_keys_queue(uint8_t type, uint8_t timed, uint32_t start_us) {
+    if ((uint8_t)(queue_head - queue_tail) >= HID_KEYS_QUEUE_SIZE) {
+        hid_keys_latency.reports_dropped++;
+        return;
+    }
+    hid_keys_report_t * entry = &queue[queue_head % HID_KEYS_QUEUE_SIZE];
+    memset(entry->report, 0, sizeof(entry->report));
+    entry->timed = timed;
+    entry->start_us = start_us;
+
+    __disable_irq();
+    if (type == HID_KEYS_TYPE_KEY) {
+        entry->report[0] = USBD_HID_REPORT_KEYBOARD;
+        entry->length = USBD_HID_KEYBOARD_SIZE;
+        uint8_t count = 0;
+        for (uint8_t i = 0; i < HID_KEYS_BUTTON_COUNT; i++) {
+            if (!(pressed & (1 << i)) || keymap[i].type != HID_KEYS_TYPE_KEY) {
+                continue;
+            }
+            entry->report[1] |= keymap[i].modifiers;
+            // A modifier alone has no usage
+            if (keymap[i].usage != 0 && count < 6) {
+                entry->report[3 + count++] = keymap[i].usage;
+            }
+        }
+    }
+    else {
+        entry->report[0] = USBD_HID_REPORT_CONSUMER;
+        entry->length = USBD_HID_CONSUMER_SIZE;
+        for (uint8_t i = 0; i < HID_KEYS_BUTTON_COUNT; i++) {
+            if ((pressed & (1 << i)) && keymap[i].type == HID_KEYS_TYPE_CONSUMER) {
+                entry->report[1] = keymap[i].usage & 0xFF;
+                entry->report[2] = keymap[i].usage >> 8;
+                break;
+            }
+        }
+    }
+    __enable_irq();
+    queue_head++;
+}
+
+void hid_keys_on_button(uint8_t button, uint8_t is_pressed, uint32_t start_us) {
+    if (button < 1 || button > HID_KEYS_BUTTON_COUNT) {
+        return;
+    }
+    uint8_t bit = 1 << (button - 1);
+    if (is_pressed) {
+        pressed |= bit;
+    }
+    else {
+        pressed &= ~bit;
+    }
+    // Nothing is kept for a host that shows up later
+    if (hUsbDeviceFS.dev_state != USBD_STATE_CONFIGURED) {
+        return;
+    }
+    uint8_t type = keymap[button - 1].type;
+    if (type != HID_KEYS_TYPE_NONE) {
+        hid_keys_queue(type, 1, start_us);
+    }
+}
+
+void hid_keys_process(void) {
+    if (queue_flush) {
+        queue_flush = 0;
+        queue_tail = queue_head;
+    }
+    if (queue_refresh) {
+        queue_refresh = 0;
+        if (pressed && hUsbDeviceFS.dev_state == USBD_STATE_CONFIGURED) {
+            hid_keys_queue(HID_KEYS_TYPE_KEY, 0, 0);
+            hid_keys_queue(HID_KEYS_TYPE_CONSUMER, 0, 0);
+        }
+    }
+    if (queue_tail == queue_head || !USBD_HID_Ready(&hUsbDeviceFS)) {
+        return;
+    }
+    hid_keys_report_t * entry = &queue[queue_tail % HID_KEYS_QUEUE_SIZE];
+    sent_timed = entry->timed;
+    sent_start_us = entry->start_us;
+    sent_us = micros();
+    if (USBD_HID_SendReport(&hUsbDeviceFS, entry->report, entry->length) == USBD_OK) {
+        queue_tail++;
+    }
+}
+
+void hid_keys_reset(void) {
+    queue_flush = 1;
+}
+
+void hid_keys_report_sent(void) {
+    if (sent_timed) {
+        uint32_t now = micros();
+        hid_keys_record(now - sent_start_us, now - sent_us);
+    }
+}
+
+uint16_t hid_keys_get_feature(uint8_t report_id, uint8_t * data, uint16_t size) {
+    switch (report_id) {
+        case USBD_HID_REPORT_KEYMAP:
+            if (size < HID_KEYS_KEYMAP_SIZE) {
+                return 0;
+            }
+            for (uint8_t i = 0; i < HID_KEYS_BUTTON_COUNT; i++) {
+                uint8_t * entry = data + i * HID_KEYS_ENTRY_SIZE;
+                entry[0] = keymap[i].type;
+                entry[1] = keymap[i].modifiers;
+                entry[2] = keymap[i].usage & 0xFF;
+                entry[3] = keymap[i].usage >> 8;
+            }
+            return HID_KEYS_KEYMAP_SIZE;
+
+        case USBD_HID_REPORT_LATENCY:
+            if (size < HID_KEYS_LATENCY_SIZE) {
+                return 0;
+            }
+            hid_keys_put32(data, hid_keys_latency.reports);
+            hid_keys_put32(data + 4, hid_keys_latency.max_us);
+            hid_keys_put32(data + 8, hid_keys_latency.max_poll_us);
+            for (uint8_t i = 0; i < HID_KEYS_BUCKET_COUNT; i++) {
+                data[12 + i * 2] = hid_keys_latency.buckets[i] & 0xFF;
+                data[13 + i * 2] = hid_keys_latency.buckets[i] >> 8;
+            }
+            return HID_KEYS_LATENCY_SIZE;
+
+        default:
+            return 0;
+    }
+}
+
+uint8_t hid_keys_set_feature(uint8_t report_id, const uint8_t * data, uint16_t length) {
+    switch (report_id) {
+        case USBD_HID_REPORT_KEYMAP:
+            if (length < HID_KEYS_KEYMAP_SIZE) {
+                return 0;
+            }
+            // All or nothing
+            for (uint8_t i = 0; i < HID_KEYS_BUTTON_COUNT; i++) {
+                if (data[i * HID_KEYS_ENTRY_SIZE] > HID_KEYS_TYPE_CONSUMER) {
+                    return 0;
+                }
+            }
+            for (uint8_t i = 0; i < HID_KEYS_BUTTON_COUNT; i++) {
+                const uint8_t * entry = data + i * HID_KEYS_ENTRY_SIZE;
+                keymap[i].type = entry[0];
+                keymap[i].modifiers = entry[1];
+                keymap[i].usage = entry[2] | entry[3] << 8;
+            }
+            queue_refresh = 1;
+            runtime_post(RUNTIME_WORK_USB_IN);
+            return 1;
+
+        case USBD_HID_REPORT_LATENCY:
+            memset(&hid_keys_latency, 0, sizeof(hid_keys_latency));
+            return 1;
+
+        default:
+            return 0;
+    }
+}
@@ -1,15 +1,26 @@
+#include <stdio.h>
 #include "stm32f0xx_hal.h"
 #include "usb_device.h"
+#include "usbd_cdc_if.h"
+#include "touch_detect.h"
+#include "touch_scan.h"
+#include "nsec_link.h"
+#include "touch_isr.h"
+#include "runtime.h"
+#include "hid_keys.h"
+#include "offload.h"
 
 I2C_HandleTypeDef hi2c1;
 IWDG_HandleTypeDef hiwdg;
+RTC_HandleTypeDef hrtc;
 SPI_HandleTypeDef hspi1;
 SPI_HandleTypeDef hspi2;
+TIM_HandleTypeDef htim6;
 TSC_HandleTypeDef htsc;
 UART_HandleTypeDef huart1;
 UART_HandleTypeDef huart3;
+DMA_HandleTypeDef hdma_usart1_rx;
 DMA_HandleTypeDef hdma_usart1_tx;
-WWDG_HandleTypeDef hwwdg;
 
 TSC_IOConfigTypeDef tsc_ioconfig;
 
@@ -19,11 +30,12 @@ static void MX_DMA_Init(void);
 static void MX_USART3_UART_Init(void);
 static void MX_I2C1_Init(void);
 static void MX_IWDG_Init(void);
+static void MX_RTC_Init(void);
 static void MX_SPI1_Init(void);
 static void MX_SPI2_Init(void);
+static void MX_TIM6_Init(void);
 static void MX_TSC_Init(void);
 static void MX_USART1_UART_Init(void);
-static void MX_WWDG_Init(void);
 void MX_NVIC_Init(void);
 
 static void Error_Handler(void) {
@@ -33,92 +45,791 @@ static void Error_Handler(void) {
 
 static uint8_t volatile tsc_iochannel = 1;
 
-#define BUTTON_UP   0
-#define BUTTON_DOWN 1
-uint8_t tsc_iochannel_status[6] = {0};
+// One per group, they measure the charge moved from the pads
+#define TSC_SAMPLING_IOS      (TSC_GROUP1_IO1 | TSC_GROUP2_IO4)
 
-void HAL_TSC_ConvCpltCallback(TSC_HandleTypeDef* p_htsc) {
-    uint32_t acquisition_value = 0;
+// Pads of each channel (see touch_scan.h), the proximity channel has every
+// pad of a group at once, as one big electrode
+static const uint32_t tsc_channel_ios[] = {
+    TSC_GROUP1_IO4 | TSC_GROUP2_IO3,
+    TSC_GROUP1_IO2 | TSC_GROUP2_IO1,
+    TSC_GROUP1_IO3 | TSC_GROUP2_IO2,
+    TSC_GROUP1_IO2 | TSC_GROUP1_IO3 | TSC_GROUP1_IO4 |
+    TSC_GROUP2_IO1 | TSC_GROUP2_IO2 | TSC_GROUP2_IO3,
+};
 
-    if (HAL_TSC_GroupGetStatus(p_htsc, TSC_GROUP1_IDX) == TSC_GROUP_COMPLETED) {
-        // Group 1 -
-        acquisition_value = HAL_TSC_GroupGetValue(p_htsc, TSC_GROUP1_IDX);
-         if (acquisition_value < 3) {
-             // Button pressed
-             if (tsc_iochannel_status[tsc_iochannel] == BUTTON_UP) {
-                uint8_t spi_buffer[2] = {0};
-                spi_buffer[0] = tsc_iochannel+1;
-                spi_buffer[1] = 1; // button down
-                HAL_SPI_Transmit(&hspi1, spi_buffer, 0x01, 0x100);
-                tsc_iochannel_status[tsc_iochannel] = BUTTON_DOWN;
-             }
-         }
-         else {
-            // Button unpressed
-            if (tsc_iochannel_status[tsc_iochannel] == BUTTON_DOWN) {
-               uint8_t spi_buffer[2] = {0};
-               spi_buffer[0] = tsc_iochannel+1;
-               spi_buffer[1] = 2; // button down
-               HAL_SPI_Transmit(&hspi1, spi_buffer, 0x01, 0x100);
-               tsc_iochannel_status[tsc_iochannel] = BUTTON_UP;
-            }
-         }
+// Fast full scans go on for a while after the last touch. Then the core
+// sleeps in STOP and the RTC wakes it up for a proximity scan now and then,
+// a hand near the pads brings back the full scans.
+#define SCAN_ACTIVE_HOLD_MS   3000
+#define SCAN_IDLE_PERIOD_MS   100
+#define SCAN_RTC_WAKEUP_HZ    2500 // LSI / 16
+// Proximity sees a finger on one pad of three, it is a smaller change
+#define SCAN_PROXIMITY_THRESHOLD_PERCENT (TOUCH_DETECT_THRESHOLD_PERCENT / 3)
+// Rough typical figures from the datasheet, for the estimate in scan_stats
+#define SCAN_RUN_CURRENT_UA   20000 // HSI48, peripherals on
+#define SCAN_STOP_CURRENT_UA  5     // Low power regulator, LSI and RTC
+
+typedef enum {
+    SCAN_MODE_ACTIVE,
+    SCAN_MODE_IDLE,
+} scan_mode_t;
+
+// Time given to the sampling capacitors to discharge between acquisitions,
+// counted by TIM6 so nothing waits for it.
+#define TSC_DISCHARGE_US      100
+
+// The nRF hands a new buffer to its SPI slave after each frame, a frame
+// sent before that is lost.
+#define LINK_FRAME_GAP_US     50
+// The nRF can only answer when it is clocked, it is asked now and then for
+// anything it has to say. In idle scan mode, on each RTC wakeup instead.
+#define LINK_POLL_MS          20
+// Bytes from the nRF for the USB serial port, waiting for the IN endpoint
+#define LINK_USB_BUFFER_SIZE  64
+// The nRF holds the display stream while it catches up, it is asked this
+// often when it can take more
+#define LINK_HOLD_POLL_MS     1
+
+#ifdef TOUCH_FAST_PATH
+#define LINK_NSS_LOW()        (GPIOA->BRR = GPIO_PIN_15)
+#define LINK_NSS_HIGH()       (GPIOA->BSRR = GPIO_PIN_15)
+// Bytes of a frame sent and not read back yet, the receive FIFO holds four
+#define LINK_FAST_IN_FLIGHT   2
+#else
+#define LINK_NSS_LOW()        HAL_GPIO_WritePin(GPIOA, GPIO_PIN_15, GPIO_PIN_RESET)
+#define LINK_NSS_HIGH()       HAL_GPIO_WritePin(GPIOA, GPIO_PIN_15, GPIO_PIN_SET)
+#endif
+
+// Power of two
+#define TSC_SAMPLE_QUEUE_SIZE 8
+#define LINK_EVENT_QUEUE_SIZE 16
+
+typedef struct {
+    uint8_t button;
+    uint8_t state;
+    uint32_t start_us; // Acquisition that found the event
+} link_event_t;
+
+// For the debugger
+typedef struct {
+    uint32_t scans;
+    uint32_t samples_dropped;
+    uint32_t events_sent;
+    uint32_t events_dropped;
+    uint32_t max_age_us;
+} touch_stats_t;
+
+touch_stats_t touch_stats;
+
+// For the debugger too. Run time is the HAL tick, it stops in STOP mode.
+typedef struct {
+    uint32_t wakeups;           // Idle to active
+    uint32_t stop_count;
+    uint32_t stop_ms;           // Estimated from the RTC wakeup period
+    uint32_t average_current_ua;
+    uint32_t wake_to_detect_us; // Proximity scan to the first press found, last one
+    uint32_t max_wake_to_detect_us;
+} scan_stats_t;
+
+scan_stats_t scan_stats;
+
+// The main loop sleeps whenever the interrupts have posted nothing. SysTick
+// wakes it up every millisecond while the full scans run; in idle mode the
+// tick is stopped and only the TSC, the link, the RTC and the USB wake it up.
+// The watchdog is fed when the loop comes around and the work it guards
+// moves on: the scans in active mode, the link transfers.
+#define RUNTIME_WATCHDOG_MS   1000
+#define RUNTIME_STALL_MS      250
+
+typedef struct {
+    uint32_t sleeps;
+    uint32_t tickless_sleeps;   // SysTick stopped, STOP not counted
+    uint32_t usb_suspends;
+    uint32_t watchdog_held;     // Passes without a refresh, a stall
+} runtime_stats_t;
+
+volatile uint32_t runtime_work = 0;
+// For the debugger
+runtime_stats_t runtime_stats;
+
+static volatile scan_mode_t scan_mode = SCAN_MODE_ACTIVE;
+// An acquisition, or the discharge before it, is in progress
+static volatile uint8_t tsc_running = 0;
+static volatile uint8_t scan_wakeup_pending = 0;
+static uint32_t scan_last_activity_ms = 0;
+static uint8_t scan_waiting_for_press = 0;
+static uint32_t scan_wake_start_us = 0;
+
+// A host has reset the bus since boot, the USB then needs the clocks until
+// it suspends it
+static uint8_t runtime_usb_host_seen = 0;
+static uint32_t runtime_watchdog_scans = 0;
+static uint32_t runtime_watchdog_scans_ms = 0;
+
+// Microseconds when the current acquisition was started
+static uint32_t tsc_acquisition_start_us = 0;
+
+// Captured by the TSC interrupt, decoded from the main loop.
+// Single producer (TSC interrupt) and single consumer (main loop)
+static touch_scan_sample_t tsc_samples[TSC_SAMPLE_QUEUE_SIZE];
+static volatile uint8_t tsc_samples_head = 0;
+static volatile uint8_t tsc_samples_tail = 0;
+
+// Main loop only
+static link_event_t link_events[LINK_EVENT_QUEUE_SIZE];
+static uint8_t link_events_head = 0;
+static uint8_t link_events_tail = 0;
+
+// One frame each way, with NSS held low
+static uint8_t link_tx_frame[NSEC_LINK_FRAME_SIZE];
+static uint8_t link_rx_frame[NSEC_LINK_FRAME_SIZE];
+static volatile uint8_t link_busy = 0;
+static volatile uint8_t link_rx_ready = 0;
+static volatile uint32_t link_idle_since_us = 0;
+static uint32_t link_last_exchange_ms = 0;
+static uint8_t link_poll_requested = 0;
+// A provisioning session started, the nRF has yet to get its empty record
+static uint8_t link_provision_start = 0;
+
+static uint8_t link_usb_buffer[LINK_USB_BUFFER_SIZE];
+static uint8_t link_usb_length = 0;
+
+// For the debugger
+nsec_link_t nrf_link;
+uint32_t link_usb_bytes_dropped;
+
+// Link use while the host streams to the display, reported with the nRF
+// counters. Payload bytes include the retransmits.
+typedef struct {
+    uint32_t exchanges;
+    uint32_t payload_bytes;
+    uint32_t stream_bytes;
+} link_display_stats_t;
+
+link_display_stats_t link_display_stats;
+static link_display_stats_t link_display_reported;
+static uint32_t link_display_reported_ms = 0;
+
+#ifdef TOUCH_FAST_PATH
+// The frame being moved by link_fast_spi_irq_handler
+static struct {
+    const uint8_t * tx;
+    uint8_t * rx;
+    uint8_t tx_left;
+    uint8_t rx_left;
+} link_fast;
+#endif
+
+#ifdef TOUCH_ISR_CYCLES
+touch_isr_stats_t touch_isr_stats;
+
+void touch_isr_cycles_init(void) {
+    __HAL_RCC_TIM2_CLK_ENABLE();
+    TIM2->PSC = 0;
+    TIM2->ARR = 0xFFFFFFFF;
+    TIM2->EGR = TIM_EGR_UG;
+    TIM2->CR1 = TIM_CR1_CEN;
+}
+#endif
+
+// From the 1 ms HAL tick and the SysTick down-counter. The TSC and USB
+// interrupts have the same priority as SysTick, so a tick may be pending.
+uint32_t micros(void) {
+    uint32_t ms, ticks, pending;
+    do {
+        ms = HAL_GetTick();
+        ticks = SysTick->VAL;
+        pending = SCB->ICSR & SCB_ICSR_PENDSTSET_Msk;
+        if (pending) {
+            ticks = SysTick->VAL;
+        }
+    } while (ms != HAL_GetTick());
+    if (pending) {
+        ms++;
+    }
+    return ms * 1000 + (SysTick->LOAD - ticks) * 1000 / (SysTick->LOAD + 1);
+}
+
+static void tsc_start_acquisition(TSC_HandleTypeDef* p_htsc) {
+    tsc_acquisition_start_us = micros();
+#ifdef TOUCH_FAST_PATH
+    // What HAL_TSC_Start_IT does for this configuration: the end of
+    // acquisition interrupt stays enabled, the IOs are already low.
+    TSC->ICR = TSC_ICR_EOAIC | TSC_ICR_MCEIC;
+    TSC->CR |= TSC_CR_START;
+#else
+    if (HAL_TSC_Start_IT(p_htsc) != HAL_OK) {
+        Error_Handler();
+    }
+#endif
+}
+
+// One shot, the next acquisition starts from HAL_TIM_PeriodElapsedCallback
+static void tsc_discharge_timer_start(void) {
+    __HAL_TIM_SET_COUNTER(&htim6, 0);
+    __HAL_TIM_ENABLE(&htim6);
+}
+
+// Configure the pads of the channel and discharge them, the conversion
+// starts once they are discharged
+static void tsc_select_channel(TSC_HandleTypeDef* p_htsc, uint8_t channel) {
+    tsc_iochannel = channel;
+#ifdef TOUCH_FAST_PATH
+    // HAL_TSC_IOConfig and HAL_TSC_IODischarge, less what never changes:
+    // the sampling IOs and the enabled groups.
+    TSC->IOHCR = ~(tsc_channel_ios[channel] | TSC_SAMPLING_IOS);
+    TSC->IOCCR = tsc_channel_ios[channel];
+    TSC->CR &= ~TSC_CR_IODEF;
+#else
+    tsc_ioconfig.ChannelIOs = tsc_channel_ios[channel];
+    if (HAL_TSC_IOConfig(p_htsc, &tsc_ioconfig) != HAL_OK) {
+        Error_Handler();
+    }
+
+    HAL_TSC_IODischarge(p_htsc, ENABLE);
+#endif
+    tsc_running = 1;
+    tsc_discharge_timer_start();
+}
+
+// Called from the TSC interrupt, the values are only valid for the groups completed
+static void tsc_acquisition_done(TSC_HandleTypeDef* p_htsc, uint8_t completed,
+                                 uint16_t group1_value, uint16_t group2_value) {
+    uint8_t head = tsc_samples_head;
+    if ((uint8_t)(head - tsc_samples_tail) < TSC_SAMPLE_QUEUE_SIZE) {
+        touch_scan_sample_t * sample = &tsc_samples[head % TSC_SAMPLE_QUEUE_SIZE];
+        sample->channel = tsc_iochannel;
+        sample->start_us = tsc_acquisition_start_us;
+        sample->completed = completed;
+        sample->group1_value = group1_value;
+        sample->group2_value = group2_value;
+        // The sample must be written before the main loop can see it
+        __DMB();
+        tsc_samples_head = head + 1;
+    }
+    else {
+        touch_stats.samples_dropped++;
+    }
+    touch_stats.scans++;
+    runtime_post(RUNTIME_WORK_TSC);
+
+    if (scan_mode != SCAN_MODE_ACTIVE) {
+        // Idle scans are started one at a time by the main loop
+        tsc_running = 0;
+        return;
     }
+    // Switch channel
+    tsc_select_channel(p_htsc, touch_scan_next_channel(tsc_iochannel));
+}
 
+void HAL_TSC_ConvCpltCallback(TSC_HandleTypeDef* p_htsc) {
+    uint8_t completed = 0;
+    uint16_t group1_value = 0;
+    uint16_t group2_value = 0;
+    if (HAL_TSC_GroupGetStatus(p_htsc, TSC_GROUP1_IDX) == TSC_GROUP_COMPLETED) {
+        completed |= TOUCH_SCAN_GROUP1;
+        group1_value = HAL_TSC_GroupGetValue(p_htsc, TSC_GROUP1_IDX);
+    }
     if (HAL_TSC_GroupGetStatus(p_htsc, TSC_GROUP2_IDX) == TSC_GROUP_COMPLETED) {
-        // Group 2 -
-        acquisition_value = HAL_TSC_GroupGetValue(p_htsc, TSC_GROUP2_IDX);
-        if (acquisition_value <= 1) {
-            // Button pressed
-            if (tsc_iochannel_status[tsc_iochannel+3] == BUTTON_UP) {
-               uint8_t spi_buffer[2] = {0};
-               spi_buffer[0] = tsc_iochannel+4;
-               spi_buffer[1] = 1; // button down
-               HAL_SPI_Transmit(&hspi1, spi_buffer, 0x01, 0x100);
-               tsc_iochannel_status[tsc_iochannel+3] = BUTTON_DOWN;
+        completed |= TOUCH_SCAN_GROUP2;
+        group2_value = HAL_TSC_GroupGetValue(p_htsc, TSC_GROUP2_IDX);
+    }
+    tsc_acquisition_done(p_htsc, completed, group1_value, group2_value);
+}
+
+#ifdef TOUCH_FAST_PATH
+static void tsc_fast_init(void) {
+    // HAL_TSC_Init enabled the groups and set the sampling IOs
+    TSC->IER = TSC_IER_EOAIE;
+}
+
+// HAL_TSC_IRQHandler and HAL_TSC_ConvCpltCallback. A max count error ends
+// the acquisition too, its groups are simply not completed.
+void tsc_fast_irq_handler(void) {
+    if (!(TSC->ISR & (TSC_ISR_EOAF | TSC_ISR_MCEF))) {
+        return;
+    }
+    TSC->ICR = TSC_ICR_EOAIC | TSC_ICR_MCEIC;
+    uint32_t status = TSC->IOGCSR;
+    uint8_t completed = 0;
+    if (status & TSC_IOGCSR_G1S) {
+        completed |= TOUCH_SCAN_GROUP1;
+    }
+    if (status & TSC_IOGCSR_G2S) {
+        completed |= TOUCH_SCAN_GROUP2;
+    }
+    tsc_acquisition_done(&htsc, completed,
+                         TSC->IOGXCR[TSC_GROUP1_IDX], TSC->IOGXCR[TSC_GROUP2_IDX]);
+}
+
+// TIM6 update, the pads are discharged
+void tsc_fast_discharge_done(void) {
+    TIM6->SR = ~TIM_SR_UIF;
+    tsc_start_acquisition(&htsc);
+}
+#endif
+
+// Max count reached, the pads of this acquisition have no value. The scan
+// goes on, it would otherwise stop here.
+void HAL_TSC_ErrorCallback(TSC_HandleTypeDef* p_htsc) {
+    HAL_TSC_ConvCpltCallback(p_htsc);
+}
+
+void HAL_RTCEx_WakeUpTimerEventCallback(RTC_HandleTypeDef *p_hrtc) {
+    scan_wakeup_pending = 1;
+    runtime_post(RUNTIME_WORK_SCAN);
+}
+
+void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim) {
+    if (htim->Instance == TIM6) {
+        tsc_start_acquisition(&htsc);
+    }
+}
+
+static void link_queue_event(uint8_t button, uint8_t state, uint32_t start_us) {
+    if ((uint8_t)(link_events_head - link_events_tail) >= LINK_EVENT_QUEUE_SIZE) {
+        touch_stats.events_dropped++;
+        return;
+    }
+    link_event_t * event = &link_events[link_events_head % LINK_EVENT_QUEUE_SIZE];
+    event->button = button;
+    event->state = state;
+    event->start_us = start_us;
+    link_events_head++;
+
+    if (state == 1) {
+        scan_last_activity_ms = HAL_GetTick();
+        if (scan_waiting_for_press) {
+            scan_waiting_for_press = 0;
+            scan_stats.wake_to_detect_us = start_us - scan_wake_start_us;
+            if (scan_stats.wake_to_detect_us > scan_stats.max_wake_to_detect_us) {
+                scan_stats.max_wake_to_detect_us = scan_stats.wake_to_detect_us;
             }
         }
-        else {
-           // Button unpressed
-           if (tsc_iochannel_status[tsc_iochannel+3] == BUTTON_DOWN) {
-              uint8_t spi_buffer[2] = {0};
-              spi_buffer[0] = tsc_iochannel+4;
-              spi_buffer[1] = 2; // button down
-              HAL_SPI_Transmit(&hspi1, spi_buffer, 0x01, 0x100);
-              tsc_iochannel_status[tsc_iochannel+3] = BUTTON_UP;
-           }
+    }
+}
+
+#ifdef TOUCH_FAST_PATH
+static void link_transfer_done(uint8_t error);
+
+// HAL_SPI_TransmitReceive_IT, with fewer interrupts: only the receive one,
+// each byte read back lets the next one go out.
+static void link_fast_spi_start(const uint8_t * tx, uint8_t * rx, uint8_t size) {
+    link_fast.tx = tx;
+    link_fast.rx = rx;
+    link_fast.tx_left = size;
+    link_fast.rx_left = size;
+    // RXNE on each byte, not on each 16 bits
+    SPI1->CR2 |= SPI_CR2_FRXTH;
+    SPI1->CR1 |= SPI_CR1_SPE;
+    while (link_fast.tx_left > 0 && size - link_fast.tx_left < LINK_FAST_IN_FLIGHT) {
+        *(__IO uint8_t *)&SPI1->DR = *link_fast.tx++;
+        link_fast.tx_left--;
+    }
+    SPI1->CR2 |= SPI_CR2_RXNEIE | SPI_CR2_ERRIE;
+}
+
+void link_fast_spi_irq_handler(void) {
+    if (SPI1->SR & SPI_SR_OVR) {
+        SPI1->CR2 &= ~(SPI_CR2_RXNEIE | SPI_CR2_ERRIE);
+        // Reading DR then SR clears it, the FIFO is emptied on the way
+        while (SPI1->SR & (SPI_SR_RXNE | SPI_SR_BSY)) {
+            (void)*(__IO uint8_t *)&SPI1->DR;
+        }
+        (void)SPI1->SR;
+        link_transfer_done(1);
+        return;
+    }
+    while (link_fast.rx_left > 0 && (SPI1->SR & SPI_SR_RXNE)) {
+        *link_fast.rx++ = *(__IO uint8_t *)&SPI1->DR;
+        link_fast.rx_left--;
+        if (link_fast.tx_left > 0) {
+            *(__IO uint8_t *)&SPI1->DR = *link_fast.tx++;
+            link_fast.tx_left--;
         }
     }
+    if (link_fast.rx_left == 0) {
+        SPI1->CR2 &= ~(SPI_CR2_RXNEIE | SPI_CR2_ERRIE);
+        link_transfer_done(0);
+    }
+}
+#endif
 
-    // Switch channel
-    switch (tsc_iochannel) {
-        case 0:
-            tsc_ioconfig.ChannelIOs = TSC_GROUP1_IO2 | TSC_GROUP2_IO1;
-            tsc_iochannel = 1;
+// The nRF counters and the link use since the last report, as a line of text
+// for the host streaming to the display
+static void link_display_report(const uint8_t * data) {
+    if (!CDC_Display_Active()) {
+        return;
+    }
+    uint32_t shown = data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3];
+    uint32_t dropped = data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7];
+    uint16_t errors = data[8] << 8 | data[9];
+    uint16_t fps_x10 = data[10] << 8 | data[11];
+
+    uint32_t now = HAL_GetTick();
+    uint32_t elapsed_ms = now - link_display_reported_ms;
+    uint32_t exchanges = link_display_stats.exchanges - link_display_reported.exchanges;
+    uint32_t payload = link_display_stats.payload_bytes - link_display_reported.payload_bytes;
+    uint32_t stream = link_display_stats.stream_bytes - link_display_reported.stream_bytes;
+    link_display_reported = link_display_stats;
+    link_display_reported_ms = now;
+
+    uint32_t use_percent = exchanges > 0 ? payload * 100 / (exchanges * NSEC_LINK_MAX_PAYLOAD) : 0;
+    uint32_t stream_bps = elapsed_ms > 0 ? stream * 1000 / elapsed_ms : 0;
+    int length = snprintf((char *)link_usb_buffer, LINK_USB_BUFFER_SIZE,
+                          "display n=%lu drop=%lu err=%u fps=%u.%u link=%lu%% %luB/s\r\n",
+                          (unsigned long)shown, (unsigned long)dropped, errors,
+                          fps_x10 / 10, fps_x10 % 10,
+                          (unsigned long)use_percent, (unsigned long)stream_bps);
+    // Sent by link_usb_flush, a report replaces whatever was waiting
+    link_usb_length = length < LINK_USB_BUFFER_SIZE ? length : LINK_USB_BUFFER_SIZE - 1;
+}
+
+// Commands from the nRF
+static void link_on_record(uint8_t type, const uint8_t * data, uint8_t length) {
+    switch (type) {
+        case NSEC_LINK_RECORD_TOUCH_CONFIG:
+            if (length >= 3 && data[0] < TOUCH_DETECT_CHANNEL_COUNT) {
+                touch_detect_configure(data[0], data[1], data[2]);
+            }
+            break;
+        case NSEC_LINK_RECORD_TOUCH_RECALIBRATE:
+            if (length >= 1 && data[0] == NSEC_LINK_ALL_CHANNELS) {
+                for (uint8_t i = 0; i < TOUCH_DETECT_CHANNEL_COUNT; i++) {
+                    touch_detect_recalibrate(i);
+                }
+            }
+            else if (length >= 1 && data[0] < TOUCH_DETECT_CHANNEL_COUNT) {
+                touch_detect_recalibrate(data[0]);
+            }
+            break;
+        case NSEC_LINK_RECORD_DISPLAY_STATS:
+            if (length >= NSEC_LINK_DISPLAY_STATS_SIZE) {
+                link_display_report(data);
+            }
             break;
-        case 1:
-            tsc_ioconfig.ChannelIOs = TSC_GROUP1_IO3 | TSC_GROUP2_IO2;
-            tsc_iochannel = 2;
+        case NSEC_LINK_RECORD_JOB:
+            offload_on_record(data, length);
             break;
-        case 2:
-            tsc_ioconfig.ChannelIOs = TSC_GROUP1_IO4 | TSC_GROUP2_IO3;
-            tsc_iochannel = 0;
+        case NSEC_LINK_RECORD_USB_DATA:
+            for (uint8_t i = 0; i < length; i++) {
+                if (link_usb_length < LINK_USB_BUFFER_SIZE) {
+                    link_usb_buffer[link_usb_length++] = data[i];
+                }
+                else {
+                    link_usb_bytes_dropped++;
+                }
+            }
+            break;
+        default:
             break;
     }
+}
 
-    // Configure the next buttons and call another conversion
-    if (HAL_TSC_IOConfig(p_htsc, &tsc_ioconfig) != HAL_OK) {
-        Error_Handler();
+// The endpoint copies the packet to its own memory, the buffer is free again
+static void link_usb_flush(void) {
+    if (link_usb_length == 0) {
+        return;
+    }
+    // Nothing goes in the middle of the bench data
+    if (hUsbDeviceFS.dev_state != USBD_STATE_CONFIGURED || CDC_Bench_Active()) {
+        link_usb_bytes_dropped += link_usb_length;
+        link_usb_length = 0;
+        return;
+    }
+    if (CDC_Transmit_FS(link_usb_buffer, link_usb_length) == USBD_OK) {
+        link_usb_length = 0;
     }
+}
 
-    HAL_TSC_IODischarge(p_htsc, ENABLE);
-    HAL_Delay(0.5);
+// Queued touch events go in the frame, as many as it holds
+static void link_fill_frame(uint32_t now) {
+    while (link_events_tail != link_events_head) {
+        const link_event_t * event = &link_events[link_events_tail % LINK_EVENT_QUEUE_SIZE];
+        uint32_t age_us = now - event->start_us;
+        if (age_us > touch_stats.max_age_us) {
+            touch_stats.max_age_us = age_us;
+        }
+        if (age_us > NSEC_LINK_TOUCH_AGE_MAX) {
+            age_us = NSEC_LINK_TOUCH_AGE_MAX;
+        }
+        uint8_t record[NSEC_LINK_TOUCH_RECORD_SIZE] = {
+            age_us >> 8, age_us & 0xFF, event->state, event->button,
+        };
+        if (!nsec_link_add_record(&nrf_link, NSEC_LINK_RECORD_TOUCH, record, sizeof(record))) {
+            return;
+        }
+        touch_stats.events_sent++;
+        link_events_tail++;
+    }
 
-    if (HAL_TSC_Start_IT(p_htsc) != HAL_OK) {
-        Error_Handler();
+    // Before any byte of the new session
+    if (CDC_Provision_Started()) {
+        link_provision_start = 1;
+    }
+    uint8_t record[NSEC_LINK_MAX_PAYLOAD];
+    if (link_provision_start) {
+        if (!nsec_link_add_record(&nrf_link, NSEC_LINK_RECORD_PROVISION_DATA, record, 0)) {
+            return;
+        }
+        link_provision_start = 0;
+    }
+
+    // A job result goes first, the nRF is waiting on it
+    uint8_t result_length = offload_next_record(record, nsec_link_record_space(&nrf_link));
+    if (result_length > 0) {
+        nsec_link_add_record(&nrf_link, NSEC_LINK_RECORD_JOB_RESULT, record, result_length);
+    }
+
+    // The display stream or the bundle fills the rest, unless the nRF is
+    // catching up
+    uint8_t space = nsec_link_record_space(&nrf_link);
+    if (space > 0 && CDC_Stream_Pending() && !nsec_link_peer_holds(&nrf_link)) {
+        uint8_t length = CDC_Stream_Read(record, space);
+        if (CDC_Display_Active()) {
+            nsec_link_add_record(&nrf_link, NSEC_LINK_RECORD_DISPLAY_DATA, record, length);
+            link_display_stats.stream_bytes += length;
+        }
+        else {
+            nsec_link_add_record(&nrf_link, NSEC_LINK_RECORD_PROVISION_DATA, record, length);
+        }
+    }
+}
+
+static uint8_t link_wants_exchange(void) {
+    return link_events_tail != link_events_head || link_poll_requested || offload_pending() ||
+           nsec_link_wants_exchange(&nrf_link) ||
+           (CDC_Stream_Pending() && (!nsec_link_peer_holds(&nrf_link) ||
+                                      HAL_GetTick() - link_last_exchange_ms >= LINK_HOLD_POLL_MS)) ||
+           (scan_mode == SCAN_MODE_ACTIVE && HAL_GetTick() - link_last_exchange_ms >= LINK_POLL_MS) ||
+           (offload_active() && HAL_GetTick() - link_last_exchange_ms >= OFFLOAD_POLL_MS);
+}
+
+static void link_exchange(void) {
+    if (link_busy) {
+        return;
+    }
+    if (link_rx_ready) {
+        link_rx_ready = 0;
+        nsec_link_receive(&nrf_link, link_rx_frame, link_on_record);
+    }
+    link_usb_flush();
+    if (!link_wants_exchange()) {
+        return;
+    }
+    uint32_t now = micros();
+    if (now - link_idle_since_us < LINK_FRAME_GAP_US) {
+        return;
+    }
+
+    link_fill_frame(now);
+    uint8_t payload = nsec_link_build(&nrf_link, link_tx_frame,
+                                      link_events_tail != link_events_head || offload_pending());
+    if (CDC_Display_Active()) {
+        link_display_stats.exchanges++;
+        link_display_stats.payload_bytes += payload;
+    }
+    link_poll_requested = 0;
+    link_last_exchange_ms = HAL_GetTick();
+
+    TOUCH_ISR_CYCLES_BEGIN();
+    link_busy = 1;
+    LINK_NSS_LOW();
+#ifdef TOUCH_FAST_PATH
+    link_fast_spi_start(link_tx_frame, link_rx_frame, NSEC_LINK_FRAME_SIZE);
+#else
+    if (HAL_SPI_TransmitReceive_IT(&hspi1, link_tx_frame, link_rx_frame, NSEC_LINK_FRAME_SIZE) != HAL_OK) {
+        // The frame built is sent again on the next pass, like a lost one
+        LINK_NSS_HIGH();
+        link_busy = 0;
+    }
+#endif
+    TOUCH_ISR_CYCLES_END(link_start);
+}
+
+// Called from the SPI1 interrupt
+static void link_transfer_done(uint8_t error) {
+    LINK_NSS_HIGH();
+    link_idle_since_us = micros();
+    if (error) {
+        // Counted as a bad frame, the one in flight is sent again
+        link_rx_frame[0] = 0;
+    }
+#ifdef TOUCH_ISR_CYCLES
+    touch_isr_stats.link_frames++;
+#endif
+    link_rx_ready = 1;
+    link_busy = 0;
+    runtime_post(RUNTIME_WORK_LINK);
+}
+
+void HAL_SPI_TxRxCpltCallback(SPI_HandleTypeDef *hspi) {
+    if (hspi->Instance == SPI1) {
+        link_transfer_done(0);
+    }
+}
+
+void HAL_SPI_ErrorCallback(SPI_HandleTypeDef *hspi) {
+    if (hspi->Instance == SPI1) {
+        link_transfer_done(1);
+    }
+}
+
+static void tsc_on_button(uint8_t button, uint8_t pressed, uint32_t start_us) {
+    link_queue_event(button, pressed ? 1 : 2, start_us); // button down or up
+    hid_keys_on_button(button, pressed, start_us);
+}
+
+// Back to the full scans, a hand is near the pads
+static void scan_wake(uint32_t start_us) {
+    scan_mode = SCAN_MODE_ACTIVE;
+    scan_last_activity_ms = HAL_GetTick();
+    scan_waiting_for_press = 1;
+    scan_wake_start_us = start_us;
+    scan_stats.wakeups++;
+    HAL_RTCEx_DeactivateWakeUpTimer(&hrtc);
+    scan_wakeup_pending = 0;
+    if (!tsc_running) {
+        tsc_select_channel(&htsc, 0);
+    }
+}
+
+static void tsc_process_samples(void) {
+    while (tsc_samples_tail != tsc_samples_head) {
+        const touch_scan_sample_t * sample = &tsc_samples[tsc_samples_tail % TSC_SAMPLE_QUEUE_SIZE];
+        uint8_t near = touch_scan_process(sample, HAL_GetTick(), tsc_on_button);
+        if (near && scan_mode == SCAN_MODE_IDLE) {
+            scan_wake(sample->start_us);
+        }
+        tsc_samples_tail++;
+    }
+}
+
+static void scan_update_current_estimate(void) {
+    uint64_t run_ms = HAL_GetTick();
+    uint64_t total_ms = run_ms + scan_stats.stop_ms;
+    if (total_ms > 0) {
+        scan_stats.average_current_ua = (run_ms * SCAN_RUN_CURRENT_UA +
+                                         (uint64_t)scan_stats.stop_ms * SCAN_STOP_CURRENT_UA) / total_ms;
+    }
+}
+
+static void scan_enter_stop(void) {
+    uint32_t awake_since_ms = HAL_GetTick();
+
+    __disable_irq();
+    // Work posted since the check is not lost, WFI returns at once
+    if (!runtime_work && !scan_wakeup_pending) {
+        HAL_SuspendTick();
+        HAL_PWR_EnterSTOPMode(PWR_LOWPOWERREGULATOR_ON, PWR_STOPENTRY_WFI);
+        // The core wakes up on HSI, back to HSI48 before anything else runs
+        SystemClock_Config();
+        HAL_ResumeTick();
+        scan_stats.stop_count++;
+    }
+    __enable_irq();
+
+    // The RTC period less the time spent awake since the last wakeup
+    static uint32_t last_wake_ms = 0;
+    uint32_t awake_ms = awake_since_ms - last_wake_ms;
+    if (awake_ms < SCAN_IDLE_PERIOD_MS) {
+        scan_stats.stop_ms += SCAN_IDLE_PERIOD_MS - awake_ms;
+    }
+    last_wake_ms = HAL_GetTick();
+    scan_update_current_estimate();
+}
+
+static void scan_schedule(void) {
+    if (scan_mode == SCAN_MODE_ACTIVE) {
+        if (HAL_GetTick() - scan_last_activity_ms < SCAN_ACTIVE_HOLD_MS ||
+            touch_detect_any_pressed(0, TOUCH_SCAN_BUTTON_COUNT)) {
+            return;
+        }
+        // The full scans stop after the current acquisition
+        scan_mode = SCAN_MODE_IDLE;
+        scan_waiting_for_press = 0;
+        HAL_RTCEx_SetWakeUpTimer_IT(&hrtc, SCAN_IDLE_PERIOD_MS * SCAN_RTC_WAKEUP_HZ / 1000 - 1,
+                                    RTC_WAKEUPCLOCK_RTCCLK_DIV16);
+        return;
+    }
+
+    if (tsc_running) {
+        return;
+    }
+    if (scan_wakeup_pending) {
+        scan_wakeup_pending = 0;
+        link_poll_requested = 1;
+        tsc_select_channel(&htsc, TOUCH_SCAN_PROXIMITY);
     }
 }
 
+// Without a host, or with the bus suspended, nothing on the USB side needs
+// the clocks. A resume wakes the core up from STOP through its EXTI line.
+static uint8_t runtime_usb_allows_stop(void) {
+    return hUsbDeviceFS.dev_state == USBD_STATE_SUSPENDED ||
+           (hUsbDeviceFS.dev_state == USBD_STATE_DEFAULT && !runtime_usb_host_seen);
+}
+
+static void runtime_usb_event(uint32_t work) {
+    if (work & RUNTIME_WORK_USB_RESET) {
+        runtime_usb_host_seen = 1;
+    }
+    if ((work & RUNTIME_WORK_USB_POWER) && hUsbDeviceFS.dev_state == USBD_STATE_SUSPENDED) {
+        runtime_stats.usb_suspends++;
+    }
+}
+
+// Held back when the scans stop in active mode or a link transfer never
+// ends, the chip resets RUNTIME_WATCHDOG_MS later
+static void runtime_watchdog(void) {
+    uint32_t now = HAL_GetTick();
+    if (scan_mode != SCAN_MODE_ACTIVE || touch_stats.scans != runtime_watchdog_scans) {
+        runtime_watchdog_scans = touch_stats.scans;
+        runtime_watchdog_scans_ms = now;
+    }
+    if (now - runtime_watchdog_scans_ms > RUNTIME_STALL_MS ||
+        (link_busy && now - link_last_exchange_ms > RUNTIME_STALL_MS)) {
+        runtime_stats.watchdog_held++;
+        return;
+    }
+    HAL_IWDG_Refresh(&hiwdg);
+}
+
+// Sleeps until the next interrupt, unless there is work left. The HAL tick
+// stands still while SysTick is stopped, so does micros(): the tick stays on
+// while an acquisition or a transfer is timed.
+static void runtime_idle(void) {
+    if (!link_busy && link_wants_exchange()) {
+        // Waiting out the frame gap
+        return;
+    }
+    // The display stream and the bundle wait on the HAL tick while the nRF
+    // holds them, the bench reports and the offload polls go by it too
+    uint8_t tickless = scan_mode == SCAN_MODE_IDLE && !tsc_running && !link_busy &&
+                       !CDC_Stream_Active() && !CDC_Bench_Active() && !offload_active();
+    if (tickless && runtime_usb_allows_stop()) {
+        scan_enter_stop();
+        return;
+    }
+
+    __disable_irq();
+    // Work posted since runtime_take is not lost, WFI returns at once
+    if (!runtime_work) {
+        if (tickless) {
+            HAL_SuspendTick();
+            __WFI();
+            HAL_ResumeTick();
+            runtime_stats.tickless_sleeps++;
+        }
+        else {
+            __WFI();
+        }
+        runtime_stats.sleeps++;
+    }
+    __enable_irq();
+}
+
 int main(void) {
   HAL_Init();
 
@@ -129,13 +840,27 @@ int main(void) {
   MX_DMA_Init();
   MX_USART3_UART_Init();
   MX_USB_DEVICE_Init();
+  __HAL_USB_WAKEUP_EXTI_ENABLE_IT();
   MX_I2C1_Init();
   MX_IWDG_Init();
+  MX_RTC_Init();
   MX_SPI1_Init();
   MX_SPI2_Init();
+  MX_TIM6_Init();
   MX_TSC_Init();
+#ifdef TOUCH_FAST_PATH
+  tsc_fast_init();
+#endif
+#ifdef TOUCH_ISR_CYCLES
+  touch_isr_cycles_init();
+#endif
+  touch_detect_init();
+  nsec_link_init(&nrf_link);
+  touch_detect_configure(TOUCH_DETECT_PROXIMITY_GROUP1, SCAN_PROXIMITY_THRESHOLD_PERCENT, 1);
+  touch_detect_configure(TOUCH_DETECT_PROXIMITY_GROUP2, SCAN_PROXIMITY_THRESHOLD_PERCENT, 1);
   //MX_USART1_UART_Init();
-  MX_WWDG_Init();
+  // No window watchdog: it needs a refresh every few tens of milliseconds,
+  // the main loop sleeps longer than that in idle mode. The IWDG is enough.
 
   // Init interrupts
   MX_NVIC_Init();
@@ -145,22 +870,25 @@ int main(void) {
   //    TSC_GROUP1_IO2 + TSC_GROUP1_IO3 + TSC_GROUP1_IO4
   // Group2:
   //    TSC_GROUP2_IO1 + TSC_GROUP2_IO2 + TSC_GROUP2_IO3
-  tsc_ioconfig.ChannelIOs = TSC_GROUP1_IO2 | TSC_GROUP2_IO1;
   // Samples both group at the same time
-  tsc_ioconfig.SamplingIOs = TSC_GROUP1_IO1|TSC_GROUP2_IO4;
+  tsc_ioconfig.SamplingIOs = TSC_SAMPLING_IOS;
   tsc_ioconfig.ShieldIOs = 0;
-  if (HAL_TSC_IOConfig(&htsc, &tsc_ioconfig) != HAL_OK) {
-    Error_Handler();
-  }
-
-  HAL_TSC_IODischarge(&htsc, ENABLE);
-  HAL_Delay(0.5);
-
-  if (HAL_TSC_Start_IT(&htsc) != HAL_OK) {
-    Error_Handler();
-  }
+  scan_last_activity_ms = HAL_GetTick();
+  tsc_select_channel(&htsc, 1);
 
   while (1) {
+    uint32_t work = runtime_take();
+    if (work & RUNTIME_WORK_TSC) {
+      tsc_process_samples();
+    }
+    // Right after the samples, the keys go out on the next poll of the host
+    hid_keys_process();
+    runtime_usb_event(work);
+    link_exchange();
+    CDC_UART_Process();
+    scan_schedule();
+    runtime_watchdog();
+    runtime_idle();
   }
 }
 
@@ -186,10 +914,11 @@ void SystemClock_Config(void) {
   HAL_RCC_ClockConfig(&RCC_ClkInitStruct, FLASH_LATENCY_1);
 
   PeriphClkInit.PeriphClockSelection = RCC_PERIPHCLK_USB|RCC_PERIPHCLK_USART1
-                              |RCC_PERIPHCLK_I2C1;
+                              |RCC_PERIPHCLK_I2C1|RCC_PERIPHCLK_RTC;
   PeriphClkInit.Usart1ClockSelection = RCC_USART1CLKSOURCE_PCLK1;
   PeriphClkInit.I2c1ClockSelection = RCC_I2C1CLKSOURCE_HSI;
   PeriphClkInit.UsbClockSelection = RCC_USBCLKSOURCE_HSI48;
+  PeriphClkInit.RTCClockSelection = RCC_RTCCLKSOURCE_LSI;
   HAL_RCCEx_PeriphCLKConfig(&PeriphClkInit);
 
   HAL_SYSTICK_Config(HAL_RCC_GetHCLKFreq()/1000);
@@ -221,28 +950,43 @@ void MX_I2C1_Init(void) {
 
 void MX_IWDG_Init(void) {
   hiwdg.Instance = IWDG;
-  hiwdg.Init.Prescaler = IWDG_PRESCALER_4;
+  // LSI / 32, RUNTIME_WATCHDOG_MS
+  hiwdg.Init.Prescaler = IWDG_PRESCALER_32;
   hiwdg.Init.Window = 4095;
-  hiwdg.Init.Reload = 4095;
+  hiwdg.Init.Reload = 40000 / 32 * RUNTIME_WATCHDOG_MS / 1000;
   HAL_IWDG_Init(&hiwdg);
 
 }
 
+void MX_RTC_Init(void) {
+  // Only the wakeup timer is used, the calendar ticks at about 1 Hz on LSI
+  hrtc.Instance = RTC;
+  hrtc.Init.HourFormat = RTC_HOURFORMAT_24;
+  hrtc.Init.AsynchPrediv = 124;
+  hrtc.Init.SynchPrediv = 319;
+  hrtc.Init.OutPut = RTC_OUTPUT_DISABLE;
+  hrtc.Init.OutPutPolarity = RTC_OUTPUT_POLARITY_HIGH;
+  hrtc.Init.OutPutType = RTC_OUTPUT_TYPE_OPENDRAIN;
+  HAL_RTC_Init(&hrtc);
+}
+
 void MX_SPI1_Init(void) {
   hspi1.Instance = SPI1;
   hspi1.Init.Mode = SPI_MODE_MASTER;
   hspi1.Init.Direction = SPI_DIRECTION_2LINES;
-  hspi1.Init.DataSize = SPI_DATASIZE_16BIT;
+  hspi1.Init.DataSize = SPI_DATASIZE_8BIT;
   hspi1.Init.CLKPolarity = SPI_POLARITY_LOW;
   hspi1.Init.CLKPhase = SPI_PHASE_1EDGE;
-  hspi1.Init.NSS = SPI_NSS_HARD_OUTPUT;
-  hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_256;
+  // NSS is driven by hand, low for a whole frame
+  hspi1.Init.NSS = SPI_NSS_SOFT;
+  // 1.5 MHz, a 32 byte frame takes about 170 us
+  hspi1.Init.BaudRatePrescaler = SPI_BAUDRATEPRESCALER_32;
   hspi1.Init.FirstBit = SPI_FIRSTBIT_MSB;
   hspi1.Init.TIMode = SPI_TIMODE_DISABLE;
   hspi1.Init.CRCCalculation = SPI_CRCCALCULATION_DISABLE;
   hspi1.Init.CRCPolynomial = 7;
   hspi1.Init.CRCLength = SPI_CRC_LENGTH_DATASIZE;
-  hspi1.Init.NSSPMode = SPI_NSS_PULSE_ENABLE;
+  hspi1.Init.NSSPMode = SPI_NSS_PULSE_DISABLE;
 
   HAL_SPI_Init(&hspi1);
 }
@@ -266,14 +1010,29 @@ void MX_SPI2_Init(void) {
   HAL_SPI_Init(&hspi2);
 }
 
+void MX_TIM6_Init(void) {
+  htim6.Instance = TIM6;
+  htim6.Init.Prescaler = (HAL_RCC_GetPCLK1Freq() / 1000000) - 1; // 1 us
+  htim6.Init.CounterMode = TIM_COUNTERMODE_UP;
+  htim6.Init.Period = TSC_DISCHARGE_US - 1;
+  htim6.Init.ClockDivision = TIM_CLOCKDIVISION_DIV1;
+  HAL_TIM_Base_Init(&htim6);
+
+  // One pulse: the counter stops at the update event
+  htim6.Instance->CR1 |= TIM_CR1_OPM;
+  __HAL_TIM_CLEAR_IT(&htim6, TIM_IT_UPDATE);
+  __HAL_TIM_ENABLE_IT(&htim6, TIM_IT_UPDATE);
+}
+
 void MX_TSC_Init(void) {
   htsc.Instance = TSC;
-  htsc.Init.CTPulseHighLength = TSC_CTPH_16CYCLES;
-  htsc.Init.CTPulseLowLength = TSC_CTPL_16CYCLES;
+  // Short transfer pulses, the thresholds follow the values they give
+  htsc.Init.CTPulseHighLength = TSC_CTPH_4CYCLES;
+  htsc.Init.CTPulseLowLength = TSC_CTPL_4CYCLES;
   htsc.Init.SpreadSpectrum = ENABLE;
   htsc.Init.SpreadSpectrumDeviation = 64;
   htsc.Init.SpreadSpectrumPrescaler = TSC_SS_PRESC_DIV1;
-  htsc.Init.PulseGeneratorPrescaler = TSC_PG_PRESC_DIV64;
+  htsc.Init.PulseGeneratorPrescaler = TSC_PG_PRESC_DIV16;
   htsc.Init.MaxCountValue = TSC_MCV_255;
   htsc.Init.IODefaultMode = TSC_IODEF_OUT_PP_LOW;
   htsc.Init.SynchroPinPolarity = TSC_SYNC_POLARITY_FALLING;
@@ -281,7 +1040,7 @@ void MX_TSC_Init(void) {
   htsc.Init.MaxCountInterrupt = DISABLE;
   htsc.Init.ChannelIOs = TSC_GROUP1_IO2|TSC_GROUP1_IO3|TSC_GROUP1_IO4|TSC_GROUP2_IO1
                     |TSC_GROUP2_IO2|TSC_GROUP2_IO3;
-  htsc.Init.SamplingIOs = TSC_GROUP1_IO1|TSC_GROUP2_IO4;
+  htsc.Init.SamplingIOs = TSC_SAMPLING_IOS;
 
   HAL_TSC_Init(&htsc);
 }
@@ -316,15 +1075,6 @@ void MX_USART3_UART_Init(void) {
   HAL_UART_Init(&huart3);
 }
 
-void MX_WWDG_Init(void) {
-  hwwdg.Instance = WWDG;
-  hwwdg.Init.Prescaler = WWDG_PRESCALER_1;
-  hwwdg.Init.Window = 64;
-  hwwdg.Init.Counter = 64;
-
-  HAL_WWDG_Init(&hwwdg);
-}
-
 void MX_DMA_Init(void) {
   __HAL_RCC_DMA1_CLK_ENABLE();
 
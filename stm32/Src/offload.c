@@ -0,0 +1,63 @@
+#include "offload.h"
+
+#include "stm32f0xx_hal.h"
+#include "nsec_job.h"
+#include "runtime.h"
+
+offload_stats_t offload_stats;
+
+static nsec_job_message_t job;
+static nsec_job_message_t result;
+static uint8_t result_pending = 0;
+static uint8_t job_seen = 0;
+static uint32_t last_job_ms = 0;
+
+void offload_on_record(const uint8_t * data, uint8_t length) {
+    if (!nsec_job_message_receive(&job, data, length)) {
+        return;
+    }
+    if (result_pending) {
+        offload_stats.replaced++;
+    }
+    job_seen = 1;
+    last_job_ms = HAL_GetTick();
+
+    uint8_t output[NSEC_JOB_MAX_OUTPUT];
+    uint32_t start_us = micros();
+    int16_t size = nsec_job_run(job.data[1], job.data + NSEC_JOB_HEADER_SIZE, job.data[0], output);
+    uint32_t us = micros() - start_us;
+    offload_stats.jobs++;
+    if (us > offload_stats.max_us) {
+        offload_stats.max_us = us;
+    }
+    if (us > UINT16_MAX) {
+        us = UINT16_MAX;
+    }
+    if (size == NSEC_JOB_FAILED) {
+        offload_stats.failed++;
+        nsec_job_message_set(&result, job.id, NSEC_JOB_STATUS_FAILED, us, output, 0);
+    }
+    else {
+        nsec_job_message_set(&result, job.id, NSEC_JOB_STATUS_OK, us, output, size);
+    }
+    result_pending = 1;
+}
+
+uint8_t offload_next_record(uint8_t * record, uint8_t space) {
+    if (!result_pending) {
+        return 0;
+    }
+    uint8_t length = nsec_job_message_next(&result, record, space);
+    if (nsec_job_message_sent(&result)) {
+        result_pending = 0;
+    }
+    return length;
+}
+
+uint8_t offload_pending(void) {
+    return result_pending;
+}
+
+uint8_t offload_active(void) {
+    return job_seen && HAL_GetTick() - last_job_ms < OFFLOAD_ACTIVE_MS;
+}
@@ -1,5 +1,6 @@
 #include "stm32f0xx_hal.h"
 
+extern DMA_HandleTypeDef hdma_usart1_rx;
 extern DMA_HandleTypeDef hdma_usart1_tx;
 
 void HAL_MspInit(void) {
@@ -43,11 +44,12 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* hspi) {
   if(hspi->Instance == SPI1) {
     __HAL_RCC_SPI1_CLK_ENABLE();
 
+    // NSS is a plain output, held low by main.c for a whole frame
+    HAL_GPIO_WritePin(GPIOA, GPIO_PIN_15, GPIO_PIN_SET);
     GPIO_InitStruct.Pin = GPIO_PIN_15;
-    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+    GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
     GPIO_InitStruct.Pull = GPIO_NOPULL;
     GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
-    GPIO_InitStruct.Alternate = GPIO_AF0_SPI1;
     HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
 
     GPIO_InitStruct.Pin = GPIO_PIN_3|GPIO_PIN_4|GPIO_PIN_5;
@@ -56,6 +58,9 @@ void HAL_SPI_MspInit(SPI_HandleTypeDef* hspi) {
     GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
     GPIO_InitStruct.Alternate = GPIO_AF0_SPI1;
     HAL_GPIO_Init(GPIOB, &GPIO_InitStruct);
+
+    HAL_NVIC_SetPriority(SPI1_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(SPI1_IRQn);
   }
   else if(hspi->Instance == SPI2) {
     __HAL_RCC_SPI2_CLK_ENABLE();
@@ -80,6 +85,8 @@ void HAL_SPI_MspDeInit(SPI_HandleTypeDef* hspi) {
 
     HAL_GPIO_DeInit(GPIOA, GPIO_PIN_15);
     HAL_GPIO_DeInit(GPIOB, GPIO_PIN_3|GPIO_PIN_4|GPIO_PIN_5);
+
+    HAL_NVIC_DisableIRQ(SPI1_IRQn);
   }
   else if(hspi->Instance == SPI2) {
     __HAL_RCC_SPI2_CLK_DISABLE();
@@ -88,6 +95,38 @@ void HAL_SPI_MspDeInit(SPI_HandleTypeDef* hspi) {
   }
 }
 
+void HAL_RTC_MspInit(RTC_HandleTypeDef* hrtc) {
+  if(hrtc->Instance == RTC) {
+    __HAL_RCC_RTC_ENABLE();
+
+    HAL_NVIC_SetPriority(RTC_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(RTC_IRQn);
+  }
+}
+
+void HAL_RTC_MspDeInit(RTC_HandleTypeDef* hrtc) {
+  if(hrtc->Instance == RTC) {
+    __HAL_RCC_RTC_DISABLE();
+    HAL_NVIC_DisableIRQ(RTC_IRQn);
+  }
+}
+
+void HAL_TIM_Base_MspInit(TIM_HandleTypeDef* htim) {
+  if(htim->Instance == TIM6) {
+    __HAL_RCC_TIM6_CLK_ENABLE();
+
+    HAL_NVIC_SetPriority(TIM6_DAC_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(TIM6_DAC_IRQn);
+  }
+}
+
+void HAL_TIM_Base_MspDeInit(TIM_HandleTypeDef* htim) {
+  if(htim->Instance == TIM6) {
+    __HAL_RCC_TIM6_CLK_DISABLE();
+    HAL_NVIC_DisableIRQ(TIM6_DAC_IRQn);
+  }
+}
+
 void HAL_TSC_MspInit(TSC_HandleTypeDef* htsc) {
   GPIO_InitTypeDef GPIO_InitStruct;
   if(htsc->Instance == TSC) {
@@ -157,9 +196,22 @@ void HAL_UART_MspInit(UART_HandleTypeDef* huart) {
 
     __HAL_LINKDMA(huart,hdmatx,hdma_usart1_tx);
 
-    __HAL_RCC_TIM3_CLK_ENABLE();
-    HAL_NVIC_SetPriority(TIM3_IRQn, 5, 0);
-    HAL_NVIC_EnableIRQ(TIM3_IRQn);
+    // Circular, the ring in usbd_cdc_if.c
+    hdma_usart1_rx.Instance = DMA1_Channel3;
+    hdma_usart1_rx.Init.Direction = DMA_PERIPH_TO_MEMORY;
+    hdma_usart1_rx.Init.PeriphInc = DMA_PINC_DISABLE;
+    hdma_usart1_rx.Init.MemInc = DMA_MINC_ENABLE;
+    hdma_usart1_rx.Init.PeriphDataAlignment = DMA_PDATAALIGN_BYTE;
+    hdma_usart1_rx.Init.MemDataAlignment = DMA_MDATAALIGN_BYTE;
+    hdma_usart1_rx.Init.Mode = DMA_CIRCULAR;
+    hdma_usart1_rx.Init.Priority = DMA_PRIORITY_HIGH;
+    HAL_DMA_Init(&hdma_usart1_rx);
+
+    __HAL_LINKDMA(huart,hdmarx,hdma_usart1_rx);
+
+    // Disabled again by HAL_UART_MspDeInit, when the line coding changes
+    HAL_NVIC_SetPriority(USART1_IRQn, 0, 0);
+    HAL_NVIC_EnableIRQ(USART1_IRQn);
   }
   else if(huart->Instance == USART3) {
     __HAL_RCC_USART3_CLK_ENABLE();
@@ -180,9 +232,10 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart) {
     __HAL_RCC_USART1_CLK_DISABLE();
     HAL_GPIO_DeInit(GPIOB, GPIO_PIN_6|GPIO_PIN_7);
     HAL_DMA_DeInit(huart->hdmatx);
+    HAL_DMA_DeInit(huart->hdmarx);
     HAL_NVIC_DisableIRQ(USART1_IRQn);
-    __HAL_RCC_USART3_FORCE_RESET();
-    __HAL_RCC_USART3_RELEASE_RESET();
+    __HAL_RCC_USART1_FORCE_RESET();
+    __HAL_RCC_USART1_RELEASE_RESET();
   }
   else if(huart->Instance == USART3) {
     __HAL_RCC_USART3_CLK_DISABLE();
@@ -190,15 +243,3 @@ void HAL_UART_MspDeInit(UART_HandleTypeDef* huart) {
   }
 }
 
-void HAL_WWDG_MspInit(WWDG_HandleTypeDef* hwwdg) {
-  if(hwwdg->Instance==WWDG) {
-    __HAL_RCC_WWDG_CLK_ENABLE();
-  }
-}
-
-void HAL_WWDG_MspDeInit(WWDG_HandleTypeDef* hwwdg) {
-  if(hwwdg->Instance==WWDG) {
-    __HAL_RCC_WWDG_CLK_DISABLE();
-  }
-}
-
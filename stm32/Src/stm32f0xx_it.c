@@ -1,11 +1,16 @@
 #include "stm32f0xx_hal.h"
 #include "stm32f0xx.h"
 #include "stm32f0xx_it.h"
+#include "touch_isr.h"
+#include "usbd_cdc_if.h"
 
 extern PCD_HandleTypeDef hpcd_USB_FS;
 extern TSC_HandleTypeDef htsc;
+extern TIM_HandleTypeDef htim6;
+extern RTC_HandleTypeDef hrtc;
+extern SPI_HandleTypeDef hspi1;
+extern DMA_HandleTypeDef hdma_usart1_rx;
 extern DMA_HandleTypeDef hdma_usart1_tx;
-//extern UART_HandleTypeDef huart1;
 
 void NMI_Handler(void) {
 }
@@ -21,16 +26,47 @@ void SysTick_Handler(void) {
 }
 
 void TSC_IRQHandler(void) {
+  TOUCH_ISR_CYCLES_BEGIN();
+#ifdef TOUCH_FAST_PATH
+  tsc_fast_irq_handler();
+#else
   HAL_TSC_IRQHandler(&htsc);
+#endif
+  TOUCH_ISR_CYCLES_END(tsc);
+}
+
+void RTC_IRQHandler(void) {
+  HAL_RTCEx_WakeUpTimerIRQHandler(&hrtc);
+}
+
+void TIM6_DAC_IRQHandler(void) {
+  TOUCH_ISR_CYCLES_BEGIN();
+#ifdef TOUCH_FAST_PATH
+  tsc_fast_discharge_done();
+#else
+  HAL_TIM_IRQHandler(&htim6);
+#endif
+  TOUCH_ISR_CYCLES_END(discharge);
+}
+
+void SPI1_IRQHandler(void) {
+  TOUCH_ISR_CYCLES_BEGIN();
+#ifdef TOUCH_FAST_PATH
+  link_fast_spi_irq_handler();
+#else
+  HAL_SPI_IRQHandler(&hspi1);
+#endif
+  TOUCH_ISR_CYCLES_END(spi);
 }
 
 void DMA1_Channel2_3_IRQHandler(void) {
   HAL_DMA_IRQHandler(&hdma_usart1_tx);
+  HAL_DMA_IRQHandler(&hdma_usart1_rx);
 }
 
-//void USART1_IRQHandler(void) {
-//  HAL_UART_IRQHandler(&huart1);
-//}
+void USART1_IRQHandler(void) {
+  CDC_UART_IRQHandler();
+}
 
 void USB_IRQHandler(void) {
   HAL_PCD_IRQHandler(&hpcd_USB_FS);
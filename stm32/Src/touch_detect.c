@@ -0,0 +1,154 @@
+#include "touch_detect.h"
+
+#include <string.h>
+
+static touch_channel_t channels[TOUCH_DETECT_CHANNEL_COUNT];
+
+static uint16_t touch_detect_median(const uint16_t * history) {
+    uint16_t a = history[0], b = history[1], c = history[2];
+    if ((a <= b && b <= c) || (c <= b && b <= a)) {
+        return b;
+    }
+    if ((b <= a && a <= c) || (c <= a && a <= b)) {
+        return a;
+    }
+    return c;
+}
+
+static int32_t touch_detect_threshold(const touch_channel_t * channel) {
+    int32_t threshold = channel->baseline * channel->threshold_percent / 100;
+    int32_t noise_threshold = channel->noise * TOUCH_DETECT_NOISE_FACTOR;
+    if (noise_threshold > threshold) {
+        threshold = noise_threshold;
+    }
+    // At least one count
+    if (threshold < (1 << TOUCH_DETECT_FRACTION_BITS)) {
+        threshold = 1 << TOUCH_DETECT_FRACTION_BITS;
+    }
+    return threshold;
+}
+
+void touch_detect_recalibrate(uint8_t channel) {
+    if (channel >= TOUCH_DETECT_CHANNEL_COUNT) {
+        return;
+    }
+    uint8_t threshold_percent = channels[channel].threshold_percent;
+    uint8_t debounce_samples = channels[channel].debounce_samples;
+    memset(&channels[channel], 0, sizeof(channels[channel]));
+    channels[channel].calibration_left = TOUCH_DETECT_CALIBRATION_SAMPLES;
+    channels[channel].threshold_percent = threshold_percent;
+    channels[channel].debounce_samples = debounce_samples;
+}
+
+void touch_detect_configure(uint8_t channel, uint8_t threshold_percent, uint8_t debounce_samples) {
+    if (channel >= TOUCH_DETECT_CHANNEL_COUNT) {
+        return;
+    }
+    channels[channel].threshold_percent = threshold_percent;
+    channels[channel].debounce_samples = debounce_samples;
+}
+
+void touch_detect_init(void) {
+    for (uint8_t i = 0; i < TOUCH_DETECT_CHANNEL_COUNT; i++) {
+        channels[i].threshold_percent = TOUCH_DETECT_THRESHOLD_PERCENT;
+        channels[i].debounce_samples = TOUCH_DETECT_DEBOUNCE;
+        touch_detect_recalibrate(i);
+    }
+}
+
+uint8_t touch_detect_any_pressed(uint8_t first_channel, uint8_t count) {
+    for (uint8_t i = first_channel; i < first_channel + count && i < TOUCH_DETECT_CHANNEL_COUNT; i++) {
+        if (channels[i].pressed) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint8_t touch_detect_update(uint8_t channel_index, uint16_t value, uint32_t now_ms, uint8_t * pressed) {
+    if (channel_index >= TOUCH_DETECT_CHANNEL_COUNT) {
+        return 0;
+    }
+    touch_channel_t * channel = &channels[channel_index];
+
+    // A 3-sample median drops single spikes
+    if (channel->history_count < 3) {
+        channel->history[channel->history_count++] = value;
+        channel->filtered = (int32_t)value << TOUCH_DETECT_FRACTION_BITS;
+    }
+    else {
+        channel->history[0] = channel->history[1];
+        channel->history[1] = channel->history[2];
+        channel->history[2] = value;
+        int32_t median = (int32_t)touch_detect_median(channel->history) << TOUCH_DETECT_FRACTION_BITS;
+        channel->filtered += (median - channel->filtered) >> TOUCH_DETECT_FILTER_SHIFT;
+    }
+
+    if (channel->calibration_left > 0) {
+        // Running mean of the calibration samples
+        uint8_t count = TOUCH_DETECT_CALIBRATION_SAMPLES - channel->calibration_left + 1;
+        channel->baseline += (channel->filtered - channel->baseline) / count;
+        channel->calibration_left--;
+        return 0;
+    }
+
+    int32_t delta = channel->baseline - channel->filtered;
+    int32_t threshold = touch_detect_threshold(channel);
+    uint8_t changed = 0;
+
+    if (!channel->pressed) {
+        if (delta >= threshold) {
+            if (++channel->debounce >= channel->debounce_samples) {
+                channel->debounce = 0;
+                channel->pressed = 1;
+                channel->pressed_since_ms = now_ms;
+                changed = 1;
+            }
+        }
+        else {
+            channel->debounce = 0;
+            // Only quiet samples tell how noisy the pad is
+            if (delta < threshold / 2) {
+                int32_t deviation = delta < 0 ? -delta : delta;
+                channel->noise += (deviation - channel->noise) >> TOUCH_DETECT_NOISE_SHIFT;
+            }
+            if (delta < 0) {
+                // Above the baseline: calibrated with a finger on the pad, or drifting up
+                channel->baseline += (-delta) >> TOUCH_DETECT_RECOVERY_SHIFT;
+            }
+            else if (delta < threshold / 2) {
+                channel->baseline -= delta >> TOUCH_DETECT_DRIFT_SHIFT;
+            }
+        }
+    }
+    else {
+        if (delta < threshold / 2) {
+            if (++channel->debounce >= channel->debounce_samples) {
+                channel->debounce = 0;
+                channel->pressed = 0;
+                changed = 1;
+            }
+        }
+        else {
+            channel->debounce = 0;
+            if (now_ms - channel->pressed_since_ms > TOUCH_DETECT_MAX_PRESS_MS) {
+                // Take the current level as the new baseline
+                channel->baseline = channel->filtered;
+                channel->pressed = 0;
+                changed = 1;
+            }
+        }
+    }
+
+    if (changed) {
+        *pressed = channel->pressed;
+    }
+    return changed;
+}
+
+const touch_channel_t * touch_detect_get_channel(uint8_t channel) {
+    if (channel >= TOUCH_DETECT_CHANNEL_COUNT) {
+        return NULL;
+    }
+    return &channels[channel];
+}
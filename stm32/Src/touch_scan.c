@@ -0,0 +1,46 @@
+#include "touch_scan.h"
+#include "touch_detect.h"
+
+uint8_t touch_scan_next_channel(uint8_t channel) {
+    return (channel + 1) % TOUCH_SCAN_CHANNEL_COUNT;
+}
+
+static uint8_t touch_scan_update(uint8_t index, uint8_t button, uint16_t value, uint32_t now_ms,
+                                 uint32_t start_us, touch_scan_handler_t handler) {
+    uint8_t pressed;
+    if (!touch_detect_update(index, value, now_ms, &pressed)) {
+        return 0;
+    }
+    if (handler) {
+        handler(button, pressed, start_us);
+    }
+    return pressed;
+}
+
+uint8_t touch_scan_process(const touch_scan_sample_t * sample, uint32_t now_ms, touch_scan_handler_t handler) {
+    uint8_t near = 0;
+    if (sample->channel == TOUCH_SCAN_PROXIMITY) {
+        if (sample->completed & TOUCH_SCAN_GROUP1) {
+            near |= touch_scan_update(TOUCH_DETECT_PROXIMITY_GROUP1, 0, sample->group1_value,
+                                      now_ms, sample->start_us, 0);
+        }
+        if (sample->completed & TOUCH_SCAN_GROUP2) {
+            near |= touch_scan_update(TOUCH_DETECT_PROXIMITY_GROUP2, 0, sample->group2_value,
+                                      now_ms, sample->start_us, 0);
+        }
+        return near;
+    }
+    if (sample->channel >= TOUCH_SCAN_CHANNEL_COUNT) {
+        return 0;
+    }
+    if (sample->completed & TOUCH_SCAN_GROUP1) {
+        touch_scan_update(sample->channel, sample->channel + 1, sample->group1_value,
+                          now_ms, sample->start_us, handler);
+    }
+    if (sample->completed & TOUCH_SCAN_GROUP2) {
+        touch_scan_update(sample->channel + TOUCH_SCAN_CHANNEL_COUNT,
+                          sample->channel + TOUCH_SCAN_CHANNEL_COUNT + 1, sample->group2_value,
+                          now_ms, sample->start_us, handler);
+    }
+    return 0;
+}
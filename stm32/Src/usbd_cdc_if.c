@@ -33,7 +33,10 @@
 /* Includes ------------------------------------------------------------------*/
 #include "usbd_cdc_if.h"
 /* USER CODE BEGIN INCLUDE */
-#include "stm32f0xx_hal_tim.h"
+#include <stdio.h>
+#include <string.h>
+#include "usb_device.h"
+#include "runtime.h"
 /* USER CODE END INCLUDE */
 
 /** @addtogroup STM32_USB_OTG_DEVICE_LIBRARY
@@ -60,8 +63,24 @@
 /* USER CODE BEGIN PRIVATE_DEFINES */
 /* Define size for the receive and transmit buffer over CDC */
 /* It's up to user to redefine and/or remove those define */
-#define APP_RX_DATA_SIZE  4
-#define APP_TX_DATA_SIZE  4
+// USB to UART ring, whole packets: the OUT endpoint fills one while the
+// UART DMA sends another. A power of two.
+#define APP_RX_PACKET_COUNT 4
+#define APP_RX_DATA_SIZE  (APP_RX_PACKET_COUNT * CDC_DATA_FS_MAX_PACKET_SIZE)
+// Line codings waiting for the packets before them. A power of two, there
+// is at most one per packet in the ring and one after them.
+#define APP_LINE_CODING_COUNT 8
+// UART to USB ring, filled by the DMA. A power of two, so the byte counts
+// stay in step with the ring when they wrap.
+#define APP_TX_DATA_SIZE  512
+// What the packets from the host are for, set by the line coding
+#define CDC_MODE_UART      0
+#define CDC_MODE_DISPLAY   1
+#define CDC_MODE_PROVISION 2
+#define CDC_MODE_SINK      3
+#define CDC_MODE_SOURCE    4
+#define CDC_MODE_LOOPBACK  5
+#define CDC_BENCH_REPORT_MS 1000
 /* USER CODE END PRIVATE_DEFINES */
 /**
   * @}
@@ -94,15 +113,74 @@ uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
 /* USER CODE BEGIN PRIVATE_VARIABLES */
 
 uint32_t BuffLength;
-uint32_t UserTxBufPtrIn = 0;
-uint32_t UserTxBufPtrOut = 0;
+// Bytes written to UserTxBufferFS by the DMA and sent to the host since the
+// reception started, the ring index is the count modulo its size
+static uint32_t UserTxBufPtrIn = 0;
+static uint32_t UserTxBufPtrOut = 0;
+// Position of the DMA in the ring at the last update of UserTxBufPtrIn
+static uint32_t UserTxDmaPosition = 0;
+static volatile uint32_t UserTxIdleCount = 0;
+static uint32_t UserTxIdleSeen = 0;
+static uint8_t UserTxZlpOwed = 0;
+static volatile uint8_t UserTxRestart = 0;
+// The ring wraps, a USB packet does not
+static uint8_t UserTxPacketFS[CDC_DATA_FS_MAX_PACKET_SIZE];
+
+// Packets received from the host (head) and sent on the UART (tail) in
+// UserRxBufferFS, counted since the configuration. The USB and USART
+// interrupts share a priority, they do not preempt each other.
+static uint16_t UserRxLength[APP_RX_PACKET_COUNT];
+static volatile uint8_t UserRxHead = 0;
+static volatile uint8_t UserRxTail = 0;
+static volatile uint8_t UserRxUartBusy = 0;
+// The ring was full, the OUT endpoint NAKs until a packet is sent
+static volatile uint8_t UserRxStalled = 0;
+// New line codings wait for the packets received before them, the mark is
+// the head when each one was set
+static USBD_CDC_LineCodingTypeDef UserRxLineCoding[APP_LINE_CODING_COUNT];
+static uint8_t UserRxLineCodingMark[APP_LINE_CODING_COUNT];
+static volatile uint8_t UserRxLineCodingIn = 0;
+static volatile uint8_t UserRxLineCodingOut = 0;
+static uint8_t UserRxMode = CDC_MODE_UART;
+// Bytes of the tail packet already read for the display or the provisioning
+static uint16_t UserRxOffset = 0;
+// The provisioning mode was set, the nRF has not been told yet
+static uint8_t UserRxProvisionStart = 0;
+
+// Bench modes: next pattern byte to source, and the sink report window
+static uint8_t UserBenchPattern = 0;
+static uint32_t UserBenchBytes = 0;
+static uint32_t UserBenchStalls = 0;
+static uint32_t UserBenchTick = 0;
 
-TIM_HandleTypeDef TimHandle;
 UART_HandleTypeDef UartHandle;
 
+// For the debugger
+typedef struct {
+  uint32_t rx_bytes;        // From the UART
+  uint32_t tx_bytes;        // To the host
+  uint32_t packets;
+  uint32_t full_packets;
+  uint32_t idle_flushes;    // Short packets sent once the line went idle
+  uint32_t ring_overruns;   // Bytes written over by the DMA before being sent
+  uint32_t uart_overruns;   // Bytes lost in the USART, the DMA came too late
+  uint32_t uart_errors;     // Framing and noise
+  uint32_t dropped_bytes;   // No host to send them to
+  uint32_t out_packets;     // From the host
+  uint32_t out_bytes;       // Sent on the UART
+  uint32_t out_stalls;      // Packet ring full, the host had to wait
+  uint32_t line_codings;    // Applied
+  uint32_t stream_bytes;    // Read for the display stream or the provisioning
+  uint32_t bench_bytes;     // Sunk, sourced or looped back
+} cdc_uart_stats_t;
+
+cdc_uart_stats_t cdc_uart_stats;
+
 static void Error_Handler(void);
-static void ComPort_Config(void);
-static void TIM_Config(void);
+static void ComPort_Config(const USBD_CDC_LineCodingTypeDef *coding);
+static void UART_RxStart(void);
+static uint8_t *UART_TxPacket(uint8_t packet);
+static void UART_TxNext(void);
 
 USBD_CDC_LineCodingTypeDef LineCoding = {
     115200, /* baud rate*/
@@ -111,8 +189,6 @@ USBD_CDC_LineCodingTypeDef LineCoding = {
     0x08    /* nb. of bits 8*/
 };
 
-#define CDC_POLLING_INTERVAL        5 /* in ms. The max is 65 and the min is 1 */
-
 /* USER CODE END PRIVATE_VARIABLES */
 
 /**
@@ -177,18 +253,21 @@ static int8_t CDC_Init_FS(void)
     Error_Handler();
   }
 
-  if(HAL_UART_Receive_IT(&UartHandle, (uint8_t *)UserTxBufferFS, 1) != HAL_OK) {
-    Error_Handler();
-  }
-
-  TIM_Config();
+  // The main loop owns the ring, it starts the reception
+  UserTxRestart = 1;
+  runtime_post(RUNTIME_WORK_UART);
 
-  if(HAL_TIM_Base_Start_IT(&TimHandle) != HAL_OK) {
-    Error_Handler();
-  }
+  UserRxHead = 0;
+  UserRxTail = 0;
+  UserRxUartBusy = 0;
+  UserRxStalled = 0;
+  UserRxLineCodingOut = UserRxLineCodingIn;
+  UserRxMode = CDC_MODE_UART;
+  UserRxOffset = 0;
+  UserRxProvisionStart = 0;
 
-  USBD_CDC_SetTxBuffer(hUsbDevice_0, UserTxBufferFS, 0);
-  USBD_CDC_SetRxBuffer(hUsbDevice_0, UserRxBufferFS);
+  USBD_CDC_SetTxBuffer(hUsbDevice_0, UserTxPacketFS, 0);
+  USBD_CDC_SetRxBuffer(hUsbDevice_0, UART_TxPacket(UserRxHead));
 
   return (USBD_OK);
 
@@ -268,6 +347,15 @@ static int8_t CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length)
     LineCoding.format     = pbuf[4];
     LineCoding.paritytype = pbuf[5];
     LineCoding.datatype   = pbuf[6];
+    // Applied by the main loop once the UART is done with what came before.
+    // A change with no packet since the last one replaces it.
+    if(UserRxLineCodingIn == UserRxLineCodingOut ||
+       UserRxLineCodingMark[(uint8_t)(UserRxLineCodingIn - 1) % APP_LINE_CODING_COUNT] != UserRxHead) {
+      UserRxLineCodingMark[UserRxLineCodingIn % APP_LINE_CODING_COUNT] = UserRxHead;
+      UserRxLineCodingIn++;
+    }
+    UserRxLineCoding[(uint8_t)(UserRxLineCodingIn - 1) % APP_LINE_CODING_COUNT] = LineCoding;
+    runtime_post(RUNTIME_WORK_UART);
 
     break;
 
@@ -316,7 +404,21 @@ static int8_t CDC_Control_FS  (uint8_t cmd, uint8_t* pbuf, uint16_t length)
 static int8_t CDC_Receive_FS (uint8_t* Buf, uint32_t *Len)
 {
   /* USER CODE BEGIN 6 */
-  HAL_UART_Transmit_DMA(&UartHandle, Buf, *Len);
+  UserRxLength[UserRxHead % APP_RX_PACKET_COUNT] = *Len;
+  UserRxHead++;
+  cdc_uart_stats.out_packets++;
+  if(UserRxMode >= CDC_MODE_SINK) {
+    runtime_post(RUNTIME_WORK_UART);
+  }
+  if((uint8_t)(UserRxHead - UserRxTail) < APP_RX_PACKET_COUNT) {
+    USBD_CDC_SetRxBuffer(hUsbDevice_0, UART_TxPacket(UserRxHead));
+    USBD_CDC_ReceivePacket(hUsbDevice_0);
+  }
+  else {
+    UserRxStalled = 1;
+    cdc_uart_stats.out_stalls++;
+  }
+  UART_TxNext();
   return (USBD_OK);
   /* USER CODE END 6 */
 }
@@ -349,84 +451,430 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len)
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
 
 //
-// TIM3
+// UART to USB
+//
+// The DMA moves the UART bytes to UserTxBufferFS in circular mode. The main
+// loop sends them in full packets, back to back while the IN endpoint keeps
+// up, and the rest in a short one as soon as the line goes idle.
 //
 
-static void TIM_Config(void) {
-  TimHandle.Instance = TIM3;
+static void UART_RxStart(void) {
+  __disable_irq();
+  UserTxBufPtrIn = 0;
+  UserTxBufPtrOut = 0;
+  UserTxDmaPosition = 0;
+  UserTxIdleSeen = UserTxIdleCount;
+  UserTxZlpOwed = 0;
+  __enable_irq();
 
-  /* Initialize TIM3 peripheral as follow:
-       + Period = 10000 - 1
-       + Prescaler = ((SystemCoreClock/2)/10000) - 1
-       + ClockDivision = 0
-       + Counter direction = Up
-  */
-  TimHandle.Init.Period = (CDC_POLLING_INTERVAL*1000) - 1;
-  TimHandle.Init.Prescaler = 84-1;
-  TimHandle.Init.ClockDivision = 0;
-  TimHandle.Init.CounterMode = TIM_COUNTERMODE_UP;
-  if(HAL_TIM_Base_Init(&TimHandle) != HAL_OK) {
-    /* Initialization Error */
+  if(HAL_UART_Receive_DMA(&UartHandle, UserTxBufferFS, APP_TX_DATA_SIZE) != HAL_OK) {
     Error_Handler();
   }
+  __HAL_UART_CLEAR_IT(&UartHandle, UART_CLEAR_IDLEF);
+  __HAL_UART_ENABLE_IT(&UartHandle, UART_IT_IDLE);
 }
 
-void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim)
-{
-  uint32_t buffptr;
-  uint32_t buffsize;
+// Catches UserTxBufPtrIn up with the DMA. The half and full transfer
+// interrupts come twice a lap, the DMA never moves a whole lap between two
+// updates. From those interrupts, or with them masked.
+static void UART_RxUpdate(void) {
+  uint32_t position = APP_TX_DATA_SIZE - __HAL_DMA_GET_COUNTER(UartHandle.hdmarx);
+  uint32_t length = (position - UserTxDmaPosition) & (APP_TX_DATA_SIZE - 1);
+  UserTxBufPtrIn += length;
+  UserTxDmaPosition = position;
+  cdc_uart_stats.rx_bytes += length;
+}
 
-  if(UserTxBufPtrOut != UserTxBufPtrIn)
-  {
-    if(UserTxBufPtrOut > UserTxBufPtrIn) /* rollback */
-    {
-      buffsize = APP_RX_DATA_SIZE - UserTxBufPtrOut;
+static uint8_t *UART_TxPacket(uint8_t packet) {
+  return &UserRxBufferFS[(packet % APP_RX_PACKET_COUNT) * CDC_DATA_FS_MAX_PACKET_SIZE];
+}
+
+// The tail packet is sent, or read for the display
+static void UART_TxPacketDone(void) {
+  UserRxTail++;
+  if(UserRxStalled) {
+    // A packet is free again, the endpoint takes the next one in it
+    UserRxStalled = 0;
+    USBD_CDC_SetRxBuffer(hUsbDevice_0, UART_TxPacket(UserRxHead));
+    USBD_CDC_ReceivePacket(hUsbDevice_0);
+  }
+}
+
+// The oldest line coding waiting was set after the packets already sent
+static uint8_t CDC_LineCodingDue(void) {
+  return UserRxLineCodingIn != UserRxLineCodingOut &&
+         UserRxTail == UserRxLineCodingMark[UserRxLineCodingOut % APP_LINE_CODING_COUNT];
+}
+
+// Hands the next packet to the UART DMA. From the USB and USART interrupts,
+// or with them masked.
+static void UART_TxNext(void) {
+  while(UserRxMode == CDC_MODE_UART && !UserRxUartBusy && UserRxTail != UserRxHead) {
+    if(CDC_LineCodingDue()) {
+      return;
     }
-    else
-    {
-      buffsize = UserTxBufPtrIn - UserTxBufPtrOut;
+    uint16_t length = UserRxLength[UserRxTail % APP_RX_PACKET_COUNT];
+    if(length > 0) {
+      if(HAL_UART_Transmit_DMA(&UartHandle, UART_TxPacket(UserRxTail), length) != HAL_OK) {
+        // Tried again from the main loop
+        return;
+      }
+      UserRxUartBusy = 1;
+      return;
     }
+    UserRxTail++;
+  }
+}
 
-    buffptr = UserTxBufPtrOut;
+// Packets received before a line coding change are read, not the ones after
+static uint8_t CDC_PacketPending(void) {
+  return UserRxTail != UserRxHead && !CDC_LineCodingDue();
+}
 
-    USBD_CDC_SetTxBuffer(hUsbDevice_0, (uint8_t*)&UserTxBufferFS[buffptr], buffsize);
+static uint8_t CDC_ModeOf(uint32_t bitrate) {
+  switch(bitrate) {
+  case CDC_DISPLAY_BITRATE:
+    return CDC_MODE_DISPLAY;
+  case CDC_PROVISION_BITRATE:
+    return CDC_MODE_PROVISION;
+  case CDC_BENCH_SINK_BITRATE:
+    return CDC_MODE_SINK;
+  case CDC_BENCH_SOURCE_BITRATE:
+    return CDC_MODE_SOURCE;
+  case CDC_BENCH_LOOPBACK_BITRATE:
+    return CDC_MODE_LOOPBACK;
+  default:
+    return CDC_MODE_UART;
+  }
+}
 
-    if(USBD_CDC_TransmitPacket(hUsbDevice_0) == USBD_OK)
-    {
-      UserTxBufPtrOut += buffsize;
-      if (UserTxBufPtrOut == APP_RX_DATA_SIZE)
-      {
-        UserTxBufPtrOut = 0;
-      }
+uint8_t CDC_Display_Active(void) {
+  return UserRxMode == CDC_MODE_DISPLAY;
+}
+
+uint8_t CDC_Provision_Active(void) {
+  return UserRxMode == CDC_MODE_PROVISION;
+}
+
+uint8_t CDC_Provision_Started(void) {
+  uint8_t started = UserRxProvisionStart;
+  UserRxProvisionStart = 0;
+  return started;
+}
+
+uint8_t CDC_Stream_Active(void) {
+  return UserRxMode == CDC_MODE_DISPLAY || UserRxMode == CDC_MODE_PROVISION;
+}
+
+uint8_t CDC_Stream_Pending(void) {
+  return CDC_Stream_Active() && CDC_PacketPending();
+}
+
+// Up to Len bytes of the display stream or the bundle, for the link. Main
+// loop only.
+uint16_t CDC_Stream_Read(uint8_t* Buf, uint16_t Len) {
+  uint16_t length = 0;
+  __disable_irq();
+  while(length < Len && CDC_Stream_Pending()) {
+    uint16_t packet_length = UserRxLength[UserRxTail % APP_RX_PACKET_COUNT];
+    uint16_t count = packet_length - UserRxOffset;
+    if(count > Len - length) {
+      count = Len - length;
+    }
+    memcpy(Buf + length, UART_TxPacket(UserRxTail) + UserRxOffset, count);
+    length += count;
+    UserRxOffset += count;
+    if(UserRxOffset >= packet_length) {
+      UserRxOffset = 0;
+      UART_TxPacketDone();
     }
   }
+  __enable_irq();
+  cdc_uart_stats.stream_bytes += length;
+  return length;
 }
 
-void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
-  UserTxBufPtrIn++;
+//
+// Bench modes
+//
+// Everything happens in the main loop, like for the UART: the numbers
+// include the packet ring and the time the loop takes to get to it.
+//
 
-  if(UserTxBufPtrIn == APP_RX_DATA_SIZE) {
-    UserTxBufPtrIn = 0;
+uint8_t CDC_Bench_Active(void) {
+  return UserRxMode >= CDC_MODE_SINK;
+}
+
+static void CDC_Bench_Start(void) {
+  UserBenchPattern = 0;
+  UserBenchBytes = 0;
+  UserBenchStalls = cdc_uart_stats.out_stalls;
+  UserBenchTick = HAL_GetTick();
+  UserTxZlpOwed = 0;
+}
+
+// A packet sourced, looped back or reported that the host did not read
+// would keep the IN endpoint busy after the bench. It is dropped, NAKing
+// the endpoint leaves its data toggle as it was.
+static void CDC_Bench_Stop(void) {
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  PCD_HandleTypeDef *hpcd = (PCD_HandleTypeDef*)hUsbDeviceFS.pData;
+  if(hcdc == NULL) {
+    return;
   }
+  __disable_irq();
+  if(hcdc->TxState != 0) {
+    PCD_SET_EP_TX_STATUS(hpcd->Instance, CDC_IN_EP & 0x7F, USB_EP_TX_NAK);
+    hcdc->TxState = 0;
+  }
+  UserTxZlpOwed = 0;
+  __enable_irq();
+}
 
-  HAL_UART_Receive_IT(huart, (uint8_t *)(UserTxBufferFS + UserTxBufPtrIn), 1);
+// The IN endpoint has nothing else to do in sink mode
+static void CDC_Bench_Report(USBD_CDC_HandleTypeDef *hcdc) {
+  uint32_t elapsed = HAL_GetTick() - UserBenchTick;
+  if(elapsed < CDC_BENCH_REPORT_MS || hcdc->TxState != 0) {
+    return;
+  }
+  if(UserBenchBytes > 0) {
+    // Keeps to 32 bits for a window of a half minute at full speed
+    uint32_t rate = UserBenchBytes * 100 / elapsed * 10;
+    int length = snprintf((char *)UserTxPacketFS, sizeof(UserTxPacketFS),
+                          "bench sink %luB/s stalls=%lu\r\n", (unsigned long)rate,
+                          (unsigned long)(cdc_uart_stats.out_stalls - UserBenchStalls));
+    if(length >= (int)sizeof(UserTxPacketFS)) {
+      length = sizeof(UserTxPacketFS) - 1;
+    }
+    USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxPacketFS, length);
+    USBD_CDC_TransmitPacket(&hUsbDeviceFS);
+  }
+  // A window with no data is not reported, the next one starts fresh
+  UserBenchBytes = 0;
+  UserBenchStalls = cdc_uart_stats.out_stalls;
+  UserBenchTick += elapsed;
+}
+
+static void CDC_Bench_Process(void) {
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  if(hUsbDeviceFS.dev_state != USBD_STATE_CONFIGURED || hcdc == NULL) {
+    return;
+  }
+  uint16_t length = 0;
+  switch(UserRxMode) {
+  case CDC_MODE_SINK:
+    __disable_irq();
+    while(CDC_PacketPending()) {
+      length += UserRxLength[UserRxTail % APP_RX_PACKET_COUNT];
+      UART_TxPacketDone();
+    }
+    __enable_irq();
+    UserBenchBytes += length;
+    cdc_uart_stats.bench_bytes += length;
+    CDC_Bench_Report(hcdc);
+    break;
+
+  case CDC_MODE_SOURCE:
+    if(hcdc->TxState != 0) {
+      break;
+    }
+    for(uint8_t i = 0; i < CDC_DATA_FS_MAX_PACKET_SIZE; i++) {
+      UserTxPacketFS[i] = UserBenchPattern + i;
+    }
+    USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxPacketFS, CDC_DATA_FS_MAX_PACKET_SIZE);
+    if(USBD_CDC_TransmitPacket(&hUsbDeviceFS) == USBD_OK) {
+      UserBenchPattern += CDC_DATA_FS_MAX_PACKET_SIZE;
+      cdc_uart_stats.bench_bytes += CDC_DATA_FS_MAX_PACKET_SIZE;
+    }
+    break;
+
+  case CDC_MODE_LOOPBACK:
+    if(hcdc->TxState != 0) {
+      break;
+    }
+    __disable_irq();
+    uint8_t ready = CDC_PacketPending();
+    if(ready) {
+      length = UserRxLength[UserRxTail % APP_RX_PACKET_COUNT];
+      memcpy(UserTxPacketFS, UART_TxPacket(UserRxTail), length);
+      UART_TxPacketDone();
+    }
+    __enable_irq();
+    // A full packet is followed by a short one, even an empty one, so the
+    // host read returns
+    if(ready || UserTxZlpOwed) {
+      USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxPacketFS, length);
+      USBD_CDC_TransmitPacket(&hUsbDeviceFS);
+      UserTxZlpOwed = length == CDC_DATA_FS_MAX_PACKET_SIZE;
+      cdc_uart_stats.bench_bytes += length;
+    }
+    break;
+
+  default:
+    break;
+  }
+}
+
+// Called from the main loop, on every pass
+void CDC_UART_Process(void) {
+  if(!UserRxUartBusy && CDC_LineCodingDue()) {
+    // Nothing is sent while the USART is set up again, the packets that
+    // come in meanwhile wait in the ring
+    const USBD_CDC_LineCodingTypeDef *coding = &UserRxLineCoding[UserRxLineCodingOut % APP_LINE_CODING_COUNT];
+    if(CDC_Bench_Active()) {
+      CDC_Bench_Stop();
+    }
+    UserRxMode = CDC_ModeOf(coding->bitrate);
+    if(UserRxMode == CDC_MODE_UART) {
+      ComPort_Config(coding);
+    }
+    else if(UserRxMode == CDC_MODE_PROVISION) {
+      UserRxProvisionStart = 1;
+    }
+    else if(CDC_Bench_Active()) {
+      CDC_Bench_Start();
+    }
+    UserRxLineCodingOut++;
+    cdc_uart_stats.line_codings++;
+  }
+  if(UserTxRestart) {
+    UserTxRestart = 0;
+    UART_RxStart();
+  }
+  if(CDC_Bench_Active()) {
+    CDC_Bench_Process();
+  }
+  __disable_irq();
+  UART_TxNext();
+  __enable_irq();
+
+  __disable_irq();
+  UART_RxUpdate();
+  uint32_t in = UserTxBufPtrIn;
+  uint32_t idle_count = UserTxIdleCount;
+  __enable_irq();
+
+  uint32_t pending = in - UserTxBufPtrOut;
+  if(pending > APP_TX_DATA_SIZE) {
+    cdc_uart_stats.ring_overruns += pending - APP_TX_DATA_SIZE;
+    UserTxBufPtrOut = in - APP_TX_DATA_SIZE;
+    pending = APP_TX_DATA_SIZE;
+  }
+  // The host reads the display reports, the provisioning replies or the
+  // bench data, the UART would get in their way
+  if(hUsbDeviceFS.dev_state != USBD_STATE_CONFIGURED || hUsbDeviceFS.pClassData == NULL ||
+     UserRxMode != CDC_MODE_UART) {
+    cdc_uart_stats.dropped_bytes += pending;
+    UserTxBufPtrOut = in;
+    UserTxIdleSeen = idle_count;
+    return;
+  }
+  USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
+  if(hcdc->TxState != 0) {
+    return;
+  }
+
+  uint32_t length = pending;
+  if(length >= CDC_DATA_FS_MAX_PACKET_SIZE) {
+    length = CDC_DATA_FS_MAX_PACKET_SIZE;
+  }
+  else if(idle_count != UserTxIdleSeen) {
+    // Everything before the idle line is in, a short packet ends the transfer
+    UserTxIdleSeen = idle_count;
+    if(length > 0) {
+      cdc_uart_stats.idle_flushes++;
+    }
+  }
+  else {
+    length = 0;
+  }
+
+  if(length == 0) {
+    // A full packet last leaves the host waiting for the end of the transfer
+    if(UserTxZlpOwed) {
+      USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxPacketFS, 0);
+      if(USBD_CDC_TransmitPacket(&hUsbDeviceFS) == USBD_OK) {
+        UserTxZlpOwed = 0;
+      }
+    }
+    return;
+  }
+
+  // The endpoint copies a packet to its own memory when it is queued, the
+  // ring space is free again right after
+  uint32_t start = UserTxBufPtrOut & (APP_TX_DATA_SIZE - 1);
+  uint32_t first = APP_TX_DATA_SIZE - start;
+  if(first > length) {
+    first = length;
+  }
+  memcpy(UserTxPacketFS, &UserTxBufferFS[start], first);
+  memcpy(UserTxPacketFS + first, UserTxBufferFS, length - first);
+  USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxPacketFS, length);
+  if(USBD_CDC_TransmitPacket(&hUsbDeviceFS) == USBD_OK) {
+    UserTxBufPtrOut += length;
+    UserTxZlpOwed = length == CDC_DATA_FS_MAX_PACKET_SIZE;
+    cdc_uart_stats.tx_bytes += length;
+    cdc_uart_stats.packets++;
+    if(length == CDC_DATA_FS_MAX_PACKET_SIZE) {
+      cdc_uart_stats.full_packets++;
+    }
+  }
+}
+
+// The idle line and overrun flags are taken before HAL_UART_IRQHandler, the
+// HAL would stop the reception on an overrun
+void CDC_UART_IRQHandler(void) {
+  uint32_t isr = UartHandle.Instance->ISR;
+  if(isr & USART_ISR_IDLE) {
+    __HAL_UART_CLEAR_IT(&UartHandle, UART_CLEAR_IDLEF);
+    UART_RxUpdate();
+    UserTxIdleCount++;
+    runtime_post(RUNTIME_WORK_UART);
+  }
+  if(isr & USART_ISR_ORE) {
+    __HAL_UART_CLEAR_IT(&UartHandle, UART_CLEAR_OREF);
+    cdc_uart_stats.uart_overruns++;
+  }
+  HAL_UART_IRQHandler(&UartHandle);
+}
+
+void HAL_UART_RxHalfCpltCallback(UART_HandleTypeDef *huart) {
+  UART_RxUpdate();
+  runtime_post(RUNTIME_WORK_UART);
+}
+
+void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
+  UART_RxUpdate();
+  runtime_post(RUNTIME_WORK_UART);
 }
 
 void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
-  USBD_CDC_ReceivePacket(&hUsbDevice_0);
+  cdc_uart_stats.out_bytes += UserRxLength[UserRxTail % APP_RX_PACKET_COUNT];
+  UserRxUartBusy = 0;
+  UART_TxPacketDone();
+  UART_TxNext();
+  if(UserRxLineCodingIn != UserRxLineCodingOut) {
+    runtime_post(RUNTIME_WORK_UART);
+  }
 }
 
-void HAL_UART_ErrorCallback(UART_HandleTypeDef *UartHandle) {
-  Error_Handler();
+// Framing and noise errors leave the DMA running, anything that stopped it
+// gets the reception started again
+void HAL_UART_ErrorCallback(UART_HandleTypeDef *huart) {
+  cdc_uart_stats.uart_errors++;
+  if(!(huart->Instance->CR3 & USART_CR3_DMAR)) {
+    UserTxRestart = 1;
+    runtime_post(RUNTIME_WORK_UART);
+  }
 }
 
-static void ComPort_Config(void) {
+static void ComPort_Config(const USBD_CDC_LineCodingTypeDef *coding) {
   if(HAL_UART_DeInit(&UartHandle) != HAL_OK) {
     Error_Handler();
   }
 
   /* set the Stop bit */
-  switch (LineCoding.format)
+  switch (coding->format)
   {
   case 0:
     UartHandle.Init.StopBits = UART_STOPBITS_1;
@@ -440,7 +888,7 @@ static void ComPort_Config(void) {
   }
 
   /* set the parity bit*/
-  switch (LineCoding.paritytype)
+  switch (coding->paritytype)
   {
   case 0:
     UartHandle.Init.Parity = UART_PARITY_NONE;
@@ -457,7 +905,7 @@ static void ComPort_Config(void) {
   }
 
   /*set the data type : only 8bits and 9bits is supported */
-  switch (LineCoding.datatype)
+  switch (coding->datatype)
   {
   case 0x07:
     /* With this configuration a parity (Even or Odd) must be set */
@@ -479,7 +927,7 @@ static void ComPort_Config(void) {
     break;
   }
 
-  UartHandle.Init.BaudRate = LineCoding.bitrate;
+  UartHandle.Init.BaudRate = coding->bitrate;
   UartHandle.Init.HwFlowCtl  = UART_HWCONTROL_NONE;
   UartHandle.Init.Mode       = UART_MODE_TX_RX;
 
@@ -489,8 +937,7 @@ static void ComPort_Config(void) {
     Error_Handler();
   }
 
-  /* Start reception: provide the buffer pointer with offset and the buffer size */
-  HAL_UART_Receive_IT(&UartHandle, (uint8_t *)(UserTxBufferFS + UserTxBufPtrIn), 1);
+  UART_RxStart();
 }
 
 static void Error_Handler(void) {
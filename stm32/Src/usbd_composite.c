@@ -0,0 +1,399 @@
+#include "usbd_composite.h"
+#include "usbd_ctlreq.h"
+#include "usbd_ioreq.h"
+#include "hid_keys.h"
+
+// The CDC class keeps pClassData and pUserData to itself, the HID state
+// lives here. Class requests and endpoint events are routed by interface
+// and endpoint number, the CDC class does not check them.
+
+#define USBD_COMPOSITE_CONFIG_DESC_SIZE 100
+// Offset of the HID descriptor in the configuration descriptor
+#define USBD_HID_DESC_OFFSET        84
+#define USBD_HID_DESC_SIZE          9
+#define USBD_HID_REPORT_DESC_SIZE   99
+
+#define USBD_HID_DESCRIPTOR_TYPE    0x21
+#define USBD_HID_REPORT_DESC_TYPE   0x22
+
+#define USBD_HID_REQ_GET_REPORT     0x01
+#define USBD_HID_REQ_GET_IDLE       0x02
+#define USBD_HID_REQ_GET_PROTOCOL   0x03
+#define USBD_HID_REQ_SET_REPORT     0x09
+#define USBD_HID_REQ_SET_IDLE       0x0A
+#define USBD_HID_REQ_SET_PROTOCOL   0x0B
+
+#define USBD_HID_REPORT_TYPE_FEATURE 3
+
+// Feature reports go through EP0, the longest one and its ID
+#define USBD_HID_CONTROL_SIZE       64
+
+static struct {
+  volatile uint8_t busy;
+  uint8_t protocol;
+  uint8_t idle;
+  uint8_t alt_setting;
+  // A SET_REPORT waits for its data stage
+  uint8_t set_report_id;
+  uint16_t set_report_length;
+  uint8_t control[USBD_HID_CONTROL_SIZE];
+} hid;
+
+__ALIGN_BEGIN static uint8_t USBD_Composite_CfgFSDesc[USBD_COMPOSITE_CONFIG_DESC_SIZE] __ALIGN_END =
+{
+  /* Configuration Descriptor */
+  0x09,                         /* bLength */
+  USB_DESC_TYPE_CONFIGURATION,  /* bDescriptorType */
+  LOBYTE(USBD_COMPOSITE_CONFIG_DESC_SIZE), /* wTotalLength */
+  HIBYTE(USBD_COMPOSITE_CONFIG_DESC_SIZE),
+  0x03,                         /* bNumInterfaces: CDC control and data, HID */
+  0x01,                         /* bConfigurationValue */
+  0x00,                         /* iConfiguration */
+  0xC0,                         /* bmAttributes: self powered */
+  0x32,                         /* MaxPower 100 mA */
+
+  /* Interface Association Descriptor, for the CDC interfaces */
+  0x08,                         /* bLength */
+  0x0B,                         /* bDescriptorType: IAD */
+  0x00,                         /* bFirstInterface */
+  0x02,                         /* bInterfaceCount */
+  0x02,                         /* bFunctionClass: Communication Interface Class */
+  0x02,                         /* bFunctionSubClass: Abstract Control Model */
+  0x01,                         /* bFunctionProtocol: Common AT commands */
+  0x00,                         /* iFunction */
+
+  /* CDC Interface Descriptor, as in the CDC class */
+  0x09,                         /* bLength */
+  USB_DESC_TYPE_INTERFACE,      /* bDescriptorType */
+  0x00,                         /* bInterfaceNumber */
+  0x00,                         /* bAlternateSetting */
+  0x01,                         /* bNumEndpoints */
+  0x02,                         /* bInterfaceClass: Communication Interface Class */
+  0x02,                         /* bInterfaceSubClass: Abstract Control Model */
+  0x01,                         /* bInterfaceProtocol: Common AT commands */
+  0x00,                         /* iInterface */
+
+  /* Header Functional Descriptor */
+  0x05,                         /* bLength */
+  0x24,                         /* bDescriptorType: CS_INTERFACE */
+  0x00,                         /* bDescriptorSubtype: Header Func Desc */
+  0x10,                         /* bcdCDC: spec release number */
+  0x01,
+
+  /* Call Management Functional Descriptor */
+  0x05,                         /* bFunctionLength */
+  0x24,                         /* bDescriptorType: CS_INTERFACE */
+  0x01,                         /* bDescriptorSubtype: Call Management Func Desc */
+  0x00,                         /* bmCapabilities: D0+D1 */
+  0x01,                         /* bDataInterface */
+
+  /* ACM Functional Descriptor */
+  0x04,                         /* bFunctionLength */
+  0x24,                         /* bDescriptorType: CS_INTERFACE */
+  0x02,                         /* bDescriptorSubtype: Abstract Control Management desc */
+  0x02,                         /* bmCapabilities */
+
+  /* Union Functional Descriptor */
+  0x05,                         /* bFunctionLength */
+  0x24,                         /* bDescriptorType: CS_INTERFACE */
+  0x06,                         /* bDescriptorSubtype: Union func desc */
+  0x00,                         /* bMasterInterface: Communication class interface */
+  0x01,                         /* bSlaveInterface0: Data Class Interface */
+
+  /* Command Endpoint Descriptor */
+  0x07,                         /* bLength */
+  USB_DESC_TYPE_ENDPOINT,       /* bDescriptorType */
+  CDC_CMD_EP,                   /* bEndpointAddress */
+  0x03,                         /* bmAttributes: Interrupt */
+  LOBYTE(CDC_CMD_PACKET_SIZE),  /* wMaxPacketSize */
+  HIBYTE(CDC_CMD_PACKET_SIZE),
+  0x10,                         /* bInterval */
+
+  /* Data Class Interface Descriptor */
+  0x09,                         /* bLength */
+  USB_DESC_TYPE_INTERFACE,      /* bDescriptorType */
+  0x01,                         /* bInterfaceNumber */
+  0x00,                         /* bAlternateSetting */
+  0x02,                         /* bNumEndpoints */
+  0x0A,                         /* bInterfaceClass: CDC */
+  0x00,                         /* bInterfaceSubClass */
+  0x00,                         /* bInterfaceProtocol */
+  0x00,                         /* iInterface */
+
+  /* OUT Endpoint Descriptor */
+  0x07,                         /* bLength */
+  USB_DESC_TYPE_ENDPOINT,       /* bDescriptorType */
+  CDC_OUT_EP,                   /* bEndpointAddress */
+  0x02,                         /* bmAttributes: Bulk */
+  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize */
+  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
+  0x00,                         /* bInterval: ignored for Bulk transfer */
+
+  /* IN Endpoint Descriptor */
+  0x07,                         /* bLength */
+  USB_DESC_TYPE_ENDPOINT,       /* bDescriptorType */
+  CDC_IN_EP,                    /* bEndpointAddress */
+  0x02,                         /* bmAttributes: Bulk */
+  LOBYTE(CDC_DATA_FS_MAX_PACKET_SIZE), /* wMaxPacketSize */
+  HIBYTE(CDC_DATA_FS_MAX_PACKET_SIZE),
+  0x00,                         /* bInterval: ignored for Bulk transfer */
+
+  /* HID Interface Descriptor */
+  0x09,                         /* bLength */
+  USB_DESC_TYPE_INTERFACE,      /* bDescriptorType */
+  USBD_HID_INTERFACE,           /* bInterfaceNumber */
+  0x00,                         /* bAlternateSetting */
+  0x01,                         /* bNumEndpoints */
+  0x03,                         /* bInterfaceClass: HID */
+  0x00,                         /* bInterfaceSubClass: no boot, there are report IDs */
+  0x00,                         /* nInterfaceProtocol */
+  0x00,                         /* iInterface */
+
+  /* HID Descriptor, at USBD_HID_DESC_OFFSET */
+  USBD_HID_DESC_SIZE,           /* bLength */
+  USBD_HID_DESCRIPTOR_TYPE,     /* bDescriptorType */
+  0x11,                         /* bcdHID: 1.11 */
+  0x01,
+  0x00,                         /* bCountryCode */
+  0x01,                         /* bNumDescriptors */
+  USBD_HID_REPORT_DESC_TYPE,    /* bDescriptorType */
+  LOBYTE(USBD_HID_REPORT_DESC_SIZE), /* wItemLength */
+  HIBYTE(USBD_HID_REPORT_DESC_SIZE),
+
+  /* HID IN Endpoint Descriptor */
+  0x07,                         /* bLength */
+  USB_DESC_TYPE_ENDPOINT,       /* bDescriptorType */
+  USBD_HID_EPIN_ADDR,           /* bEndpointAddress */
+  0x03,                         /* bmAttributes: Interrupt */
+  LOBYTE(USBD_HID_EPIN_SIZE),   /* wMaxPacketSize */
+  HIBYTE(USBD_HID_EPIN_SIZE),
+  USBD_HID_INTERVAL_MS,         /* bInterval */
+};
+
+__ALIGN_BEGIN static uint8_t USBD_HID_ReportDesc[USBD_HID_REPORT_DESC_SIZE] __ALIGN_END =
+{
+  0x05, 0x01,                   /* Usage Page (Generic Desktop) */
+  0x09, 0x06,                   /* Usage (Keyboard) */
+  0xA1, 0x01,                   /* Collection (Application) */
+  0x85, USBD_HID_REPORT_KEYBOARD, /* Report ID */
+  0x05, 0x07,                   /*   Usage Page (Keyboard) */
+  0x19, 0xE0,                   /*   Usage Minimum (Left Control) */
+  0x29, 0xE7,                   /*   Usage Maximum (Right GUI) */
+  0x15, 0x00,                   /*   Logical Minimum (0) */
+  0x25, 0x01,                   /*   Logical Maximum (1) */
+  0x75, 0x01,                   /*   Report Size (1) */
+  0x95, 0x08,                   /*   Report Count (8) */
+  0x81, 0x02,                   /*   Input (Data, Variable, Absolute): modifiers */
+  0x75, 0x08,                   /*   Report Size (8) */
+  0x95, 0x01,                   /*   Report Count (1) */
+  0x81, 0x01,                   /*   Input (Constant): reserved */
+  0x19, 0x00,                   /*   Usage Minimum (0) */
+  0x2A, 0xFF, 0x00,             /*   Usage Maximum (255) */
+  0x26, 0xFF, 0x00,             /*   Logical Maximum (255) */
+  0x95, 0x06,                   /*   Report Count (6) */
+  0x81, 0x00,                   /*   Input (Data, Array): keys */
+  0xC0,                         /* End Collection */
+
+  0x05, 0x0C,                   /* Usage Page (Consumer) */
+  0x09, 0x01,                   /* Usage (Consumer Control) */
+  0xA1, 0x01,                   /* Collection (Application) */
+  0x85, USBD_HID_REPORT_CONSUMER, /* Report ID */
+  0x19, 0x00,                   /*   Usage Minimum (0) */
+  0x2A, 0xFF, 0x03,             /*   Usage Maximum (1023) */
+  0x15, 0x00,                   /*   Logical Minimum (0) */
+  0x26, 0xFF, 0x03,             /*   Logical Maximum (1023) */
+  0x75, 0x10,                   /*   Report Size (16) */
+  0x95, 0x01,                   /*   Report Count (1) */
+  0x81, 0x00,                   /*   Input (Data, Array) */
+  0xC0,                         /* End Collection */
+
+  0x06, 0x00, 0xFF,             /* Usage Page (Vendor 0xFF00) */
+  0x09, 0x01,                   /* Usage (1) */
+  0xA1, 0x01,                   /* Collection (Application) */
+  0x15, 0x00,                   /*   Logical Minimum (0) */
+  0x26, 0xFF, 0x00,             /*   Logical Maximum (255) */
+  0x75, 0x08,                   /*   Report Size (8) */
+  0x85, USBD_HID_REPORT_KEYMAP, /*   Report ID */
+  0x09, 0x02,                   /*   Usage (2) */
+  0x95, HID_KEYS_KEYMAP_SIZE,   /*   Report Count */
+  0xB1, 0x02,                   /*   Feature (Data, Variable, Absolute) */
+  0x85, USBD_HID_REPORT_LATENCY, /*  Report ID */
+  0x09, 0x03,                   /*   Usage (3) */
+  0x95, HID_KEYS_LATENCY_SIZE,  /*   Report Count */
+  0xB1, 0x02,                   /*   Feature (Data, Variable, Absolute) */
+  0xC0,                         /* End Collection */
+};
+
+static uint8_t USBD_HID_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req) {
+  uint16_t len;
+  switch(req->bmRequest & USB_REQ_TYPE_MASK) {
+  case USB_REQ_TYPE_CLASS:
+    switch(req->bRequest) {
+    case USBD_HID_REQ_SET_PROTOCOL:
+      hid.protocol = LOBYTE(req->wValue);
+      break;
+
+    case USBD_HID_REQ_GET_PROTOCOL:
+      USBD_CtlSendData(pdev, &hid.protocol, 1);
+      break;
+
+    // Reports are only sent on a change, the idle rate is kept for the host
+    case USBD_HID_REQ_SET_IDLE:
+      hid.idle = HIBYTE(req->wValue);
+      break;
+
+    case USBD_HID_REQ_GET_IDLE:
+      USBD_CtlSendData(pdev, &hid.idle, 1);
+      break;
+
+    case USBD_HID_REQ_GET_REPORT:
+      len = 0;
+      if(HIBYTE(req->wValue) == USBD_HID_REPORT_TYPE_FEATURE) {
+        hid.control[0] = LOBYTE(req->wValue);
+        len = hid_keys_get_feature(hid.control[0], hid.control + 1, sizeof(hid.control) - 1);
+      }
+      if(len == 0) {
+        USBD_CtlError(pdev, req);
+        return USBD_FAIL;
+      }
+      USBD_CtlSendData(pdev, hid.control, MIN(len + 1, req->wLength));
+      break;
+
+    case USBD_HID_REQ_SET_REPORT:
+      if(HIBYTE(req->wValue) != USBD_HID_REPORT_TYPE_FEATURE ||
+         req->wLength == 0 || req->wLength > sizeof(hid.control)) {
+        USBD_CtlError(pdev, req);
+        return USBD_FAIL;
+      }
+      hid.set_report_id = LOBYTE(req->wValue);
+      hid.set_report_length = req->wLength;
+      USBD_CtlPrepareRx(pdev, hid.control, req->wLength);
+      break;
+
+    default:
+      USBD_CtlError(pdev, req);
+      return USBD_FAIL;
+    }
+    break;
+
+  case USB_REQ_TYPE_STANDARD:
+    switch(req->bRequest) {
+    case USB_REQ_GET_DESCRIPTOR:
+      if(HIBYTE(req->wValue) == USBD_HID_REPORT_DESC_TYPE) {
+        len = MIN(USBD_HID_REPORT_DESC_SIZE, req->wLength);
+        USBD_CtlSendData(pdev, USBD_HID_ReportDesc, len);
+      }
+      else if(HIBYTE(req->wValue) == USBD_HID_DESCRIPTOR_TYPE) {
+        len = MIN(USBD_HID_DESC_SIZE, req->wLength);
+        USBD_CtlSendData(pdev, USBD_Composite_CfgFSDesc + USBD_HID_DESC_OFFSET, len);
+      }
+      else {
+        USBD_CtlError(pdev, req);
+        return USBD_FAIL;
+      }
+      break;
+
+    case USB_REQ_GET_INTERFACE:
+      USBD_CtlSendData(pdev, &hid.alt_setting, 1);
+      break;
+
+    case USB_REQ_SET_INTERFACE:
+      hid.alt_setting = LOBYTE(req->wValue);
+      break;
+    }
+    break;
+  }
+  return USBD_OK;
+}
+
+static uint8_t USBD_Composite_Init(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
+  uint8_t ret = USBD_CDC.Init(pdev, cfgidx);
+  USBD_LL_OpenEP(pdev, USBD_HID_EPIN_ADDR, USBD_EP_TYPE_INTR, USBD_HID_EPIN_SIZE);
+  hid.busy = 0;
+  hid.protocol = 1;
+  hid.idle = 0;
+  hid.alt_setting = 0;
+  hid.set_report_id = 0;
+  hid_keys_reset();
+  return ret;
+}
+
+static uint8_t USBD_Composite_DeInit(USBD_HandleTypeDef *pdev, uint8_t cfgidx) {
+  USBD_LL_CloseEP(pdev, USBD_HID_EPIN_ADDR);
+  hid.busy = 0;
+  return USBD_CDC.DeInit(pdev, cfgidx);
+}
+
+static uint8_t USBD_Composite_Setup(USBD_HandleTypeDef *pdev, USBD_SetupReqTypedef *req) {
+  if((req->bmRequest & USB_REQ_RECIPIENT_MASK) == USB_REQ_RECIPIENT_INTERFACE &&
+     LOBYTE(req->wIndex) == USBD_HID_INTERFACE) {
+    return USBD_HID_Setup(pdev, req);
+  }
+  return USBD_CDC.Setup(pdev, req);
+}
+
+static uint8_t USBD_Composite_EP0_RxReady(USBD_HandleTypeDef *pdev) {
+  if(hid.set_report_id != 0) {
+    // The report ID comes first in the data too
+    if(hid.set_report_length > 1 && hid.control[0] == hid.set_report_id) {
+      hid_keys_set_feature(hid.set_report_id, hid.control + 1, hid.set_report_length - 1);
+    }
+    hid.set_report_id = 0;
+    return USBD_OK;
+  }
+  return USBD_CDC.EP0_RxReady(pdev);
+}
+
+static uint8_t USBD_Composite_DataIn(USBD_HandleTypeDef *pdev, uint8_t epnum) {
+  if(epnum == (USBD_HID_EPIN_ADDR & 0x7F)) {
+    hid.busy = 0;
+    hid_keys_report_sent();
+    return USBD_OK;
+  }
+  return USBD_CDC.DataIn(pdev, epnum);
+}
+
+static uint8_t USBD_Composite_DataOut(USBD_HandleTypeDef *pdev, uint8_t epnum) {
+  return USBD_CDC.DataOut(pdev, epnum);
+}
+
+static uint8_t *USBD_Composite_GetFSCfgDesc(uint16_t *length) {
+  *length = sizeof(USBD_Composite_CfgFSDesc);
+  return USBD_Composite_CfgFSDesc;
+}
+
+static uint8_t *USBD_Composite_GetDeviceQualifierDesc(uint16_t *length) {
+  return USBD_CDC.GetDeviceQualifierDescriptor(length);
+}
+
+USBD_ClassTypeDef USBD_Composite =
+{
+  USBD_Composite_Init,
+  USBD_Composite_DeInit,
+  USBD_Composite_Setup,
+  NULL,                 /* EP0_TxSent */
+  USBD_Composite_EP0_RxReady,
+  USBD_Composite_DataIn,
+  USBD_Composite_DataOut,
+  NULL,                 /* SOF */
+  NULL,
+  NULL,
+  USBD_Composite_GetFSCfgDesc,
+  USBD_Composite_GetFSCfgDesc,
+  USBD_Composite_GetFSCfgDesc,
+  USBD_Composite_GetDeviceQualifierDesc,
+};
+
+uint8_t USBD_HID_Ready(USBD_HandleTypeDef *pdev) {
+  return pdev->dev_state == USBD_STATE_CONFIGURED && !hid.busy;
+}
+
+// The packet memory gets a copy right away, the report is free on return
+uint8_t USBD_HID_SendReport(USBD_HandleTypeDef *pdev, uint8_t *report, uint16_t len) {
+  if(!USBD_HID_Ready(pdev)) {
+    return USBD_BUSY;
+  }
+  hid.busy = 1;
+  USBD_LL_Transmit(pdev, USBD_HID_EPIN_ADDR, report, len);
+  return USBD_OK;
+}
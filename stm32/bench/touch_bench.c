@@ -0,0 +1,416 @@
+// Replays capacitance traces through the touch detection of the badge
+// (Src/touch_scan.c and Src/touch_detect.c, built as they are) on the
+// host, to see what a change to the detection does before flashing it.
+//
+//   make bench
+//   build/touch_bench                 all the synthetic scenarios
+//   build/touch_bench taps holds      some of them
+//   build/touch_bench -w taps.csv taps
+//                                     also write the trace of the scenario
+//   build/touch_bench trace.csv       replay a trace
+//
+// A trace is one acquisition per line:
+//
+//   start_us,channel,group1_value,group2_value[,pressed]
+//
+// pressed is a mask of the buttons really touched then (bit 0 is button 1),
+// it is what the detection is checked against. A trace without it (one
+// dumped from the badge with the debugger) only gives the events found.
+//
+// For each press the report gives whether it was found and how long after
+// the finger landed (start of the first acquisition that said so), and
+// counts presses found where there were none. The CPU cost is the host
+// time spent in touch_scan_process per acquisition, only good to compare
+// two versions of the detection on the same machine.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include "touch_detect.h"
+#include "touch_scan.h"
+
+#define BENCH_MAX_PRESSES       1024
+#define BENCH_MAX_EVENTS        4096
+#define BENCH_START_US          500000   // Let the calibration end first
+#define BENCH_MATCH_GRACE_US    50000    // A press found that late after the release still counts
+#define BENCH_FINGER_RAMP_US    3000     // A finger takes a few ms to land
+
+typedef struct {
+    const char * name;
+    const char * description;
+    uint32_t duration_ms;
+    double noise;           // Standard deviation, in counts
+    double drift;           // Baseline change over the whole trace, fraction
+    uint32_t tap_min_ms;
+    uint32_t tap_max_ms;
+    uint32_t gap_min_ms;
+    uint32_t gap_max_ms;
+} bench_scenario_t;
+
+static const bench_scenario_t scenarios[] = {
+    { "noise", "noisy supply, short presses",      20000, 4.0,   0.00,   80,   200, 300, 1500 },
+    { "drift", "baseline down 15%, slow presses",  60000, 1.0,  -0.15,  150,   300, 500, 2500 },
+    { "taps",  "fast taps",                        20000, 1.0,   0.00,   20,    60, 100,  400 },
+    { "holds", "long holds, past the rebase time", 60000, 1.0,   0.00, 1500, 12000, 500, 2000 },
+    { "mixed", "everything at once",               60000, 2.5,   0.08,   20,  5000, 100, 1500 },
+};
+
+#define BENCH_SCENARIO_COUNT (sizeof(scenarios) / sizeof(scenarios[0]))
+
+typedef struct {
+    uint8_t button;     // 1 to TOUCH_SCAN_BUTTON_COUNT
+    uint32_t start_us;
+    uint32_t end_us;
+} bench_press_t;
+
+typedef struct {
+    uint8_t button;
+    uint8_t pressed;
+    uint32_t start_us;
+} bench_event_t;
+
+typedef struct {
+    touch_scan_sample_t * samples;
+    uint8_t * truth;    // Per sample, NULL when unknown
+    size_t count;
+    size_t capacity;
+    bench_press_t presses[BENCH_MAX_PRESSES];
+    size_t press_count;
+} bench_trace_t;
+
+static bench_event_t events[BENCH_MAX_EVENTS];
+static size_t event_count;
+static uint32_t period_us = 500;
+static uint64_t rng_state = 1;
+
+static uint32_t bench_random(void) {
+    // xorshift64*
+    rng_state ^= rng_state >> 12;
+    rng_state ^= rng_state << 25;
+    rng_state ^= rng_state >> 27;
+    return (rng_state * 2685821657736338717ULL) >> 32;
+}
+
+static uint32_t bench_random_between(uint32_t min, uint32_t max) {
+    return min + bench_random() % (max - min + 1);
+}
+
+static double bench_gaussian(void) {
+    double u1 = (bench_random() + 1.0) / 4294967297.0;
+    double u2 = (bench_random() + 1.0) / 4294967297.0;
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+static void bench_trace_add(bench_trace_t * trace, const touch_scan_sample_t * sample, int truth) {
+    if (trace->count == trace->capacity) {
+        trace->capacity = trace->capacity ? trace->capacity * 2 : 4096;
+        trace->samples = realloc(trace->samples, trace->capacity * sizeof(*trace->samples));
+        trace->truth = realloc(trace->truth, trace->capacity);
+        if (!trace->samples || !trace->truth) {
+            fprintf(stderr, "out of memory\n");
+            exit(1);
+        }
+    }
+    trace->samples[trace->count] = *sample;
+    trace->truth[trace->count] = truth < 0 ? 0 : truth;
+    trace->count++;
+}
+
+static void bench_trace_free(bench_trace_t * trace) {
+    free(trace->samples);
+    free(trace->truth);
+    memset(trace, 0, sizeof(*trace));
+}
+
+static void bench_generate(const bench_scenario_t * scenario, bench_trace_t * trace) {
+    double baseline[TOUCH_SCAN_BUTTON_COUNT];
+    double depth[TOUCH_SCAN_BUTTON_COUNT];
+    uint32_t duration_us = scenario->duration_ms * 1000;
+
+    for (uint8_t i = 0; i < TOUCH_SCAN_BUTTON_COUNT; i++) {
+        // Counts seen on the badge, a finger takes a fifth to a third off
+        baseline[i] = bench_random_between(165, 195);
+        depth[i] = bench_random_between(20, 33) / 100.0;
+    }
+
+    // One pad at a time, like a thumb
+    uint32_t t = BENCH_START_US;
+    while (trace->press_count < BENCH_MAX_PRESSES) {
+        bench_press_t * press = &trace->presses[trace->press_count];
+        press->button = bench_random_between(1, TOUCH_SCAN_BUTTON_COUNT);
+        press->start_us = t;
+        press->end_us = t + bench_random_between(scenario->tap_min_ms, scenario->tap_max_ms) * 1000;
+        if (press->end_us >= duration_us) {
+            break;
+        }
+        trace->press_count++;
+        t = press->end_us + bench_random_between(scenario->gap_min_ms, scenario->gap_max_ms) * 1000;
+    }
+
+    uint8_t channel = 1;
+    for (t = 0; t < duration_us; t += period_us) {
+        uint16_t values[2];
+        uint8_t truth = 0;
+        for (uint8_t group = 0; group < 2; group++) {
+            uint8_t button = channel + group * TOUCH_SCAN_CHANNEL_COUNT + 1;
+            double value = baseline[button - 1] * (1.0 + scenario->drift * t / duration_us);
+            for (size_t i = 0; i < trace->press_count; i++) {
+                const bench_press_t * press = &trace->presses[i];
+                if (press->button != button || t < press->start_us || t >= press->end_us + BENCH_FINGER_RAMP_US) {
+                    continue;
+                }
+                double amount = 1.0;
+                if (t < press->start_us + BENCH_FINGER_RAMP_US) {
+                    amount = (double)(t - press->start_us) / BENCH_FINGER_RAMP_US;
+                }
+                else if (t >= press->end_us) {
+                    amount = 1.0 - (double)(t - press->end_us) / BENCH_FINGER_RAMP_US;
+                }
+                value -= baseline[button - 1] * depth[button - 1] * amount;
+            }
+            value += bench_gaussian() * scenario->noise;
+            values[group] = value < 0 ? 0 : value > 255 ? 255 : (uint16_t)(value + 0.5);
+        }
+        for (size_t i = 0; i < trace->press_count; i++) {
+            const bench_press_t * press = &trace->presses[i];
+            if (t >= press->start_us && t < press->end_us) {
+                truth |= 1 << (press->button - 1);
+            }
+        }
+        touch_scan_sample_t sample = {
+            .channel = channel,
+            .completed = TOUCH_SCAN_GROUP1 | TOUCH_SCAN_GROUP2,
+            .group1_value = values[0],
+            .group2_value = values[1],
+            .start_us = t,
+        };
+        bench_trace_add(trace, &sample, truth);
+        channel = touch_scan_next_channel(channel);
+    }
+}
+
+// Presses from the truth masks of a trace read from a file
+static void bench_presses_from_truth(bench_trace_t * trace) {
+    uint32_t since[TOUCH_SCAN_BUTTON_COUNT];
+    uint8_t previous = 0;
+    for (size_t i = 0; i <= trace->count; i++) {
+        uint8_t truth = i < trace->count ? trace->truth[i] : 0;
+        uint32_t t = i < trace->count ? trace->samples[i].start_us : trace->samples[i - 1].start_us + period_us;
+        for (uint8_t b = 0; b < TOUCH_SCAN_BUTTON_COUNT; b++) {
+            uint8_t mask = 1 << b;
+            if ((truth & mask) && !(previous & mask)) {
+                since[b] = t;
+            }
+            else if (!(truth & mask) && (previous & mask) && trace->press_count < BENCH_MAX_PRESSES) {
+                bench_press_t * press = &trace->presses[trace->press_count++];
+                press->button = b + 1;
+                press->start_us = since[b];
+                press->end_us = t;
+            }
+        }
+        previous = truth;
+    }
+}
+
+// Returns 1 when the trace has the pressed column
+static int bench_read(const char * path, bench_trace_t * trace) {
+    FILE * file = fopen(path, "r");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    char line[128];
+    int has_truth = 1;
+    while (fgets(line, sizeof(line), file)) {
+        if (line[0] == '#' || line[0] == '\n' || line[0] == '\r') {
+            continue;
+        }
+        unsigned long start_us;
+        unsigned channel, group1, group2, truth;
+        int fields = sscanf(line, "%lu,%u,%u,%u,%u", &start_us, &channel, &group1, &group2, &truth);
+        if (fields < 4) {
+            fprintf(stderr, "%s: bad line: %s", path, line);
+            exit(1);
+        }
+        if (fields < 5) {
+            has_truth = 0;
+        }
+        touch_scan_sample_t sample = {
+            .channel = channel,
+            .completed = TOUCH_SCAN_GROUP1 | TOUCH_SCAN_GROUP2,
+            .group1_value = group1,
+            .group2_value = group2,
+            .start_us = start_us,
+        };
+        bench_trace_add(trace, &sample, fields < 5 ? -1 : (int)truth);
+    }
+    fclose(file);
+    if (has_truth && trace->count > 0) {
+        bench_presses_from_truth(trace);
+    }
+    return has_truth;
+}
+
+static void bench_write(const char * path, const bench_trace_t * trace) {
+    FILE * file = fopen(path, "w");
+    if (!file) {
+        perror(path);
+        exit(1);
+    }
+    fprintf(file, "# start_us,channel,group1_value,group2_value,pressed\n");
+    for (size_t i = 0; i < trace->count; i++) {
+        const touch_scan_sample_t * sample = &trace->samples[i];
+        fprintf(file, "%lu,%u,%u,%u,%u\n", (unsigned long)sample->start_us, sample->channel,
+                sample->group1_value, sample->group2_value, trace->truth[i]);
+    }
+    fclose(file);
+}
+
+static void bench_on_button(uint8_t button, uint8_t pressed, uint32_t start_us) {
+    if (event_count < BENCH_MAX_EVENTS) {
+        events[event_count].button = button;
+        events[event_count].pressed = pressed;
+        events[event_count].start_us = start_us;
+        event_count++;
+    }
+}
+
+static int bench_compare_latency(const void * a, const void * b) {
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_run(const char * name, const bench_trace_t * trace, int has_truth) {
+    struct timespec begin, end;
+
+    event_count = 0;
+    touch_detect_init();
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    for (size_t i = 0; i < trace->count; i++) {
+        const touch_scan_sample_t * sample = &trace->samples[i];
+        touch_scan_process(sample, sample->start_us / 1000, bench_on_button);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - begin.tv_sec) * 1e9 + (end.tv_nsec - begin.tv_nsec);
+
+    size_t downs = 0;
+    for (size_t i = 0; i < event_count; i++) {
+        downs += events[i].pressed;
+    }
+    if (!has_truth) {
+        printf("%-12s %8zu samples %6zu presses found %14s %7.1f ns/sample\n",
+               name, trace->count, downs, "", trace->count ? ns / trace->count : 0);
+        return;
+    }
+
+    static uint32_t latencies[BENCH_MAX_PRESSES];
+    uint8_t matched[BENCH_MAX_EVENTS] = { 0 };
+    size_t found = 0;
+    for (size_t p = 0; p < trace->press_count; p++) {
+        const bench_press_t * press = &trace->presses[p];
+        for (size_t i = 0; i < event_count; i++) {
+            const bench_event_t * event = &events[i];
+            if (matched[i] || !event->pressed || event->button != press->button ||
+                event->start_us + period_us * TOUCH_SCAN_CHANNEL_COUNT < press->start_us ||
+                event->start_us > press->end_us + BENCH_MATCH_GRACE_US) {
+                continue;
+            }
+            matched[i] = 1;
+            latencies[found++] = event->start_us > press->start_us ? event->start_us - press->start_us : 0;
+            break;
+        }
+    }
+    size_t false_presses = 0;
+    for (size_t i = 0; i < event_count; i++) {
+        false_presses += events[i].pressed && !matched[i];
+    }
+
+    double mean = 0;
+    for (size_t i = 0; i < found; i++) {
+        mean += latencies[i];
+    }
+    mean = found ? mean / found : 0;
+    qsort(latencies, found, sizeof(latencies[0]), bench_compare_latency);
+    uint32_t p95 = found ? latencies[(found * 95 - 1) / 100] : 0;
+    uint32_t max = found ? latencies[found - 1] : 0;
+
+    printf("%-12s %6zu presses %5zu missed %5zu false   latency ms mean %5.1f p95 %5.1f max %5.1f   %6.1f ns/sample\n",
+           name, trace->press_count, trace->press_count - found, false_presses,
+           mean / 1000, p95 / 1000.0, max / 1000.0, trace->count ? ns / trace->count : 0);
+}
+
+static void bench_usage(void) {
+    fprintf(stderr, "usage: touch_bench [-s seed] [-p period_us] [-w trace.csv] [scenario | trace.csv]...\n\nscenarios:\n");
+    for (size_t i = 0; i < BENCH_SCENARIO_COUNT; i++) {
+        fprintf(stderr, "  %-8s %s\n", scenarios[i].name, scenarios[i].description);
+    }
+    exit(2);
+}
+
+static void bench_scenario(const bench_scenario_t * scenario, const char * write_path) {
+    bench_trace_t * trace = calloc(1, sizeof(*trace));
+    bench_generate(scenario, trace);
+    if (write_path) {
+        bench_write(write_path, trace);
+    }
+    bench_run(scenario->name, trace, 1);
+    bench_trace_free(trace);
+    free(trace);
+}
+
+int main(int argc, char ** argv) {
+    const char * write_path = NULL;
+    uint64_t seed = 1;
+    int ran = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if ((!strcmp(argv[i], "-s") || !strcmp(argv[i], "-p") || !strcmp(argv[i], "-w")) && i + 1 < argc) {
+            if (argv[i][1] == 's') {
+                seed = strtoull(argv[++i], NULL, 0);
+            }
+            else if (argv[i][1] == 'p') {
+                period_us = strtoul(argv[++i], NULL, 0);
+            }
+            else {
+                write_path = argv[++i];
+            }
+            continue;
+        }
+        if (argv[i][0] == '-' || period_us == 0) {
+            bench_usage();
+        }
+
+        rng_state = seed ? seed : 1;
+        const bench_scenario_t * scenario = NULL;
+        for (size_t s = 0; s < BENCH_SCENARIO_COUNT; s++) {
+            if (!strcmp(argv[i], scenarios[s].name)) {
+                scenario = &scenarios[s];
+            }
+        }
+        if (scenario) {
+            bench_scenario(scenario, write_path);
+        }
+        else {
+            bench_trace_t * trace = calloc(1, sizeof(*trace));
+            int has_truth = bench_read(argv[i], trace);
+            bench_run(argv[i], trace, has_truth);
+            bench_trace_free(trace);
+            free(trace);
+        }
+        write_path = NULL;
+        ran = 1;
+    }
+
+    if (!ran) {
+        for (size_t s = 0; s < BENCH_SCENARIO_COUNT; s++) {
+            rng_state = seed ? seed : 1;
+            bench_scenario(&scenarios[s], NULL);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,118 @@
+# Measures what the STM32 USB serial port sustains, with the bench modes of
+# usbd_cdc_if.h. Needs pyserial, and a system that takes any bit rate (the
+# modes are selected with it).
+#
+#   python cdc_bench.py /dev/ttyACM0 sink         host to badge, bytes/s
+#   python cdc_bench.py /dev/ttyACM0 source       badge to host, bytes/s
+#   python cdc_bench.py /dev/ttyACM0 loopback     round trips, percentiles
+#
+# The port is set back to 115200 bit/s on the way out, which takes the
+# badge back to the UART bridge.
+
+import argparse
+import os
+import serial
+import time
+
+# usbd_cdc_if.h
+SINK_BITRATE = 3000001
+SOURCE_BITRATE = 3000002
+LOOPBACK_BITRATE = 3000003
+UART_BITRATE = 115200
+
+PACKET_SIZE = 64
+
+def open_port(name, bitrate):
+    port = serial.Serial(name, UART_BITRATE, timeout=1)
+    port.baudrate = bitrate
+    # The badge switches once it is done with what came before
+    time.sleep(0.1)
+    port.reset_input_buffer()
+    return port
+
+def rate(count, seconds):
+    return "%d B/s" % (count / seconds) if seconds > 0 else "-"
+
+def sink(port, seconds):
+    chunk = bytes(PACKET_SIZE * 16)
+    sent = 0
+    start = time.time()
+    reports = b''
+    while time.time() - start < seconds:
+        port.write(chunk)
+        sent += len(chunk)
+        reports += port.read(port.in_waiting)
+        lines = reports.split(b'\n')
+        reports = lines.pop()
+        for line in lines:
+            print(line.decode('ascii', 'replace').strip())
+    port.flush()
+    elapsed = time.time() - start
+    print("host: sent %d bytes, %s" % (sent, rate(sent, elapsed)))
+
+def source(port, seconds):
+    received = 0
+    errors = 0
+    expected = None
+    start = time.time()
+    while time.time() - start < seconds:
+        data = port.read(max(PACKET_SIZE, port.in_waiting))
+        if expected is None and data:
+            expected = data[0]
+        for byte in bytearray(data):
+            if byte != expected:
+                errors += 1
+            expected = (byte + 1) & 0xFF
+        received += len(data)
+    elapsed = time.time() - start
+    print("host: received %d bytes, %s, %d pattern breaks" % (received, rate(received, elapsed), errors))
+
+def percentile(values, fraction):
+    return values[min(len(values) - 1, int(len(values) * fraction))]
+
+def loopback(port, count, size):
+    round_trips = []
+    errors = 0
+    start = time.time()
+    for _ in range(count):
+        data = os.urandom(size)
+        sent = time.perf_counter()
+        port.write(data)
+        echo = port.read(size)
+        round_trips.append((time.perf_counter() - sent) * 1e6)
+        if echo != data:
+            errors += 1
+    elapsed = time.time() - start
+    round_trips.sort()
+    print("host: %d round trips of %d bytes, %s each way, %d bad" %
+          (count, size, rate(count * size, elapsed), errors))
+    print("round trip: min=%dus p50=%dus p90=%dus p99=%dus max=%dus" %
+          (round_trips[0], percentile(round_trips, 0.5), percentile(round_trips, 0.9),
+           percentile(round_trips, 0.99), round_trips[-1]))
+
+def main():
+    parser = argparse.ArgumentParser(description="Benchmark the badge USB serial port.")
+    parser.add_argument('port')
+    parser.add_argument('mode', choices=['sink', 'source', 'loopback'])
+    parser.add_argument('--seconds', type=float, default=5, help="sink and source duration")
+    parser.add_argument('--count', type=int, default=1000, help="loopback round trips")
+    parser.add_argument('--size', type=int, default=32, help="loopback bytes per round trip")
+    args = parser.parse_args()
+
+    bitrates = {'sink': SINK_BITRATE, 'source': SOURCE_BITRATE, 'loopback': LOOPBACK_BITRATE}
+    port = open_port(args.port, bitrates[args.mode])
+    try:
+        if args.mode == 'sink':
+            sink(port, args.seconds)
+        elif args.mode == 'source':
+            source(port, args.seconds)
+        else:
+            loopback(port, args.count, args.size)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        port.baudrate = UART_BITRATE
+        port.close()
+
+if __name__ == '__main__':
+    main()
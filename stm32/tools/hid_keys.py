@@ -0,0 +1,107 @@
+# Reads and sets the keys of the touch buttons, and reads the key latency,
+# through the feature reports of hid_keys.h. Needs hidapi (pip install hid).
+#
+#   python hid_keys.py show
+#   python hid_keys.py set 3 key 0x4E             button 3 sends page down
+#   python hid_keys.py set 6 key 0x06 --modifiers 0x01   control-c
+#   python hid_keys.py set 1 consumer 0xE9        volume up
+#   python hid_keys.py set 2 none
+#   python hid_keys.py latency [--clear]
+#
+# The keys are lost when the badge resets.
+
+import argparse
+import struct
+import hid
+
+# usbd_desc.c
+VENDOR_ID = 0x0483
+PRODUCT_ID = 0x5740
+
+# usbd_composite.h, hid_keys.h
+REPORT_KEYMAP = 3
+REPORT_LATENCY = 4
+BUTTON_COUNT = 6
+KEYMAP_SIZE = BUTTON_COUNT * 4
+BUCKET_COUNT = 12
+BUCKET_SHIFT = 6
+LATENCY_SIZE = 12 + BUCKET_COUNT * 2
+
+TYPES = ['none', 'key', 'consumer']
+BUTTONS = ['up', 'enter', 'right', 'left', 'down', 'back']
+
+def open_device():
+    devices = hid.enumerate(VENDOR_ID, PRODUCT_ID)
+    if not devices:
+        raise SystemExit("No badge found")
+    # The vendor collection, where a system splits them
+    vendor = [d for d in devices if d['usage_page'] == 0xFF00]
+    device = hid.device()
+    device.open_path((vendor or devices)[0]['path'])
+    return device
+
+def get_feature(device, report_id, size):
+    data = bytes(device.get_feature_report(report_id, size + 1))
+    # Some systems leave the report ID out
+    if len(data) == size + 1:
+        data = data[1:]
+    return data
+
+def read_keymap(device):
+    data = get_feature(device, REPORT_KEYMAP, KEYMAP_SIZE)
+    return [list(struct.unpack_from('<BBH', data, i * 4)) for i in range(BUTTON_COUNT)]
+
+def show(device):
+    for i, (kind, modifiers, usage) in enumerate(read_keymap(device)):
+        print("%d %-6s %-8s modifiers=0x%02X usage=0x%04X" %
+              (i + 1, BUTTONS[i], TYPES[kind], modifiers, usage))
+
+def set_key(device, button, kind, usage, modifiers):
+    keymap = read_keymap(device)
+    keymap[button - 1] = [TYPES.index(kind), modifiers, usage]
+    data = b''.join(struct.pack('<BBH', *entry) for entry in keymap)
+    device.send_feature_report(bytes([REPORT_KEYMAP]) + data)
+    show(device)
+
+def latency(device, clear):
+    data = get_feature(device, REPORT_LATENCY, LATENCY_SIZE)
+    reports, max_us, max_poll_us = struct.unpack_from('<III', data)
+    buckets = struct.unpack_from('<%dH' % BUCKET_COUNT, data, 12)
+    print("reports=%d max=%dus max_poll=%dus" % (reports, max_us, max_poll_us))
+    for i, count in enumerate(buckets):
+        if count == 0:
+            continue
+        bound = 1 << (BUCKET_SHIFT + i)
+        if i == BUCKET_COUNT - 1:
+            print("  >=%dus: %d" % (bound >> 1, count))
+        else:
+            print("  <%dus: %d" % (bound, count))
+    if clear:
+        device.send_feature_report(bytes([REPORT_LATENCY]) + bytes(LATENCY_SIZE))
+
+def main():
+    parser = argparse.ArgumentParser(description="Keys of the badge touch buttons.")
+    commands = parser.add_subparsers(dest='command')
+    commands.add_parser('show')
+    set_parser = commands.add_parser('set')
+    set_parser.add_argument('button', type=int, choices=range(1, BUTTON_COUNT + 1))
+    set_parser.add_argument('type', choices=TYPES)
+    set_parser.add_argument('usage', type=lambda value: int(value, 0), nargs='?', default=0)
+    set_parser.add_argument('--modifiers', type=lambda value: int(value, 0), default=0)
+    latency_parser = commands.add_parser('latency')
+    latency_parser.add_argument('--clear', action='store_true')
+    args = parser.parse_args()
+
+    device = open_device()
+    try:
+        if args.command == 'set':
+            set_key(device, args.button, args.type, args.usage, args.modifiers)
+        elif args.command == 'latency':
+            latency(device, args.clear)
+        else:
+            show(device)
+    finally:
+        device.close()
+
+if __name__ == '__main__':
+    main()
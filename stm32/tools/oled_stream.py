@@ -0,0 +1,199 @@
+# Streams frames to the badge display over the STM32 USB serial port, see
+# display_stream.h (nrf51) for the format. Needs pyserial, and PIL for
+# --image and --animation.
+#
+#   python oled_stream.py /dev/ttyACM0                  bouncing ball demo
+#   python oled_stream.py /dev/ttyACM0 --image sign.png
+#   python oled_stream.py /dev/ttyACM0 --animation loop.gif --fps 20
+#
+# The badge answers once a second with a line like
+#   display n=1234 drop=0 err=0 fps=29.8 link=73% 9120B/s
+# frames shown, frames dropped, decode errors, frames per second on the
+# display, payload use of the link frames and stream bytes per second.
+
+import argparse
+import serial
+import sys
+import threading
+import time
+
+# Panel geometry, see ssd1306.h
+LCD_WIDTH = 128
+LCD_HEIGHT = 64
+LCD_PAGES = LCD_HEIGHT // 8
+
+# usbd_cdc_if.h
+DISPLAY_BITRATE = 2000000
+
+FRAME = 0xD0
+COPY = 0xD1
+FILL = 0xD2
+SHOW = 0xD3
+
+# A new command costs its header, spans closer than this are merged
+MERGE_GAP = 4
+# Shorter runs go in a COPY
+MIN_FILL = 6
+
+def to_pages(pixels, rotation):
+    # pixels[y][x] in logical coordinates, to the display's page layout
+    pages = []
+    for page in range(LCD_PAGES):
+        row = []
+        for column in range(LCD_WIDTH):
+            byte = 0
+            for bit in range(8):
+                px, py = column, page * 8 + bit
+                if rotation == 2:
+                    px, py = LCD_WIDTH - 1 - px, LCD_HEIGHT - 1 - py
+                if pixels[py][px]:
+                    byte |= 1 << bit
+            row.append(byte)
+        pages.append(row)
+    return pages
+
+def changed_spans(old, new):
+    spans = []
+    column = 0
+    while column < LCD_WIDTH:
+        if old is not None and old[column] == new[column]:
+            column += 1
+            continue
+        start = column
+        end = column + 1
+        while end < LCD_WIDTH:
+            gap = 0
+            while end + gap < LCD_WIDTH and old is not None and old[end + gap] == new[end + gap]:
+                gap += 1
+            if end + gap == LCD_WIDTH or gap >= MERGE_GAP:
+                break
+            end += gap + 1
+        spans.append((start, end))
+        column = end
+    return spans
+
+def encode_span(page, start, end, data):
+    out = bytearray()
+    column = start
+    while column < end:
+        run = 1
+        while column + run < end and data[column + run] == data[column]:
+            run += 1
+        if run >= MIN_FILL:
+            out += bytearray([FILL, page, column, run, data[column]])
+            column += run
+            continue
+        # Literal bytes up to the next run worth a FILL
+        literal_end = column + run
+        while literal_end < end:
+            run = 1
+            while literal_end + run < end and data[literal_end + run] == data[literal_end]:
+                run += 1
+            if run >= MIN_FILL:
+                break
+            literal_end += run
+        out += bytearray([COPY, page, column, literal_end - column])
+        out += bytearray(data[column:literal_end])
+        column = literal_end
+    return out
+
+def encode_frame(number, old, new):
+    number &= 0xFFFF
+    out = bytearray([FRAME, number >> 8, number & 0xFF])
+    for page in range(LCD_PAGES):
+        for start, end in changed_spans(old[page] if old else None, new[page]):
+            out += encode_span(page, start, end, new[page])
+    out += bytearray([SHOW, number >> 8, number & 0xFF])
+    return out
+
+def blank():
+    return [[0] * LCD_WIDTH for _ in range(LCD_HEIGHT)]
+
+def demo_frames():
+    x, y, dx, dy, r = 20.0, 20.0, 2.3, 1.7, 6
+    while True:
+        pixels = blank()
+        for j in range(-r, r + 1):
+            for i in range(-r, r + 1):
+                px, py = int(x) + i, int(y) + j
+                if i * i + j * j <= r * r and 0 <= px < LCD_WIDTH and 0 <= py < LCD_HEIGHT:
+                    pixels[py][px] = 1
+        for i in range(LCD_WIDTH):
+            pixels[LCD_HEIGHT - 1][i] = 1
+        yield pixels
+        x += dx
+        y += dy
+        if x < r or x > LCD_WIDTH - 1 - r:
+            dx = -dx
+        if y < r or y > LCD_HEIGHT - 2 - r:
+            dy = -dy
+
+def image_pixels(image):
+    from PIL import Image
+    image = image.convert('L').resize((LCD_WIDTH, LCD_HEIGHT)).convert('1')
+    return [[1 if image.getpixel((x, y)) else 0 for x in range(LCD_WIDTH)]
+            for y in range(LCD_HEIGHT)]
+
+def image_frames(path, loop):
+    from PIL import Image, ImageSequence
+    frames = [image_pixels(frame) for frame in ImageSequence.Iterator(Image.open(path))]
+    while True:
+        for frame in frames:
+            yield frame
+        if not loop:
+            return
+
+def print_reports(port):
+    while True:
+        line = port.readline().decode('ascii', 'replace').strip()
+        if line.startswith('display '):
+            print(line)
+
+def main():
+    parser = argparse.ArgumentParser(description="Stream frames to the badge display.")
+    parser.add_argument('port')
+    parser.add_argument('--image', help="show an image, then keep the port open")
+    parser.add_argument('--animation', help="loop over the frames of an image (GIF)")
+    parser.add_argument('--fps', type=float, default=0, help="frame rate, 0 for as fast as it goes")
+    parser.add_argument('--rotation', type=int, default=2, choices=[0, 2],
+                        help="gfx rotation of the badge firmware")
+    args = parser.parse_args()
+
+    port = serial.Serial(args.port, DISPLAY_BITRATE, timeout=1)
+    reports = threading.Thread(target=print_reports, args=(port,))
+    reports.daemon = True
+    reports.start()
+
+    if args.image:
+        frames = image_frames(args.image, False)
+    elif args.animation:
+        frames = image_frames(args.animation, True)
+    else:
+        frames = demo_frames()
+
+    shown = None
+    number = 0
+    sent = 0
+    start = time.time()
+    try:
+        for pixels in frames:
+            pages = to_pages(pixels, args.rotation)
+            data = encode_frame(number, shown, pages)
+            # Blocks while the badge is busy, the USB endpoint holds back
+            port.write(data)
+            shown = pages
+            number += 1
+            sent += len(data)
+            if args.fps > 0:
+                time.sleep(max(0, start + number / args.fps - time.time()))
+            elapsed = time.time() - start
+            if number % 50 == 0:
+                sys.stderr.write("host: %d frames, %.1f fps, %d B/frame\n" %
+                                 (number, number / elapsed, sent // number))
+        while True:
+            time.sleep(1)
+    except KeyboardInterrupt:
+        pass
+
+if __name__ == '__main__':
+    main()
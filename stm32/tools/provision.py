@@ -0,0 +1,238 @@
+# Writes a content bundle (schedule, logo, badge class) to the nRF flash
+# through the STM32 USB serial port, see nsec_provision.h on the nRF side.
+# Needs pyserial, pillow for a logo, and a system that takes any bit rate
+# (the provisioning is selected with it).
+#
+#   python provision.py bundle.json /dev/ttyACM0 /dev/ttyACM1 ...
+#   python provision.py bundle.json --output bundle.bin
+#
+# The ports are provisioned in parallel. A badge unplugged halfway resumes
+# where it was the next time, one that already has the bundle is skipped.
+# bundle.json:
+#
+#   {
+#     "badge_class": "Speaker",
+#     "logo": "logo.png",
+#     "schedule": [
+#       { "day": "Thursday May 19th",
+#         "talks": [ { "label": "09:00 Keynote", "presenter": "...",
+#                      "description": "..." }, ... ] },
+#       ...
+#     ]
+#   }
+#
+# Every key is optional. The logo is a 1-bit image, at most 128x44. The
+# port is set back to 115200 bit/s on the way out, which takes the badge
+# back to the UART bridge.
+
+import argparse
+import json
+import os
+import serial
+import struct
+import sys
+import threading
+import time
+import zlib
+
+# usbd_cdc_if.h
+PROVISION_BITRATE = 2000001
+UART_BITRATE = 115200
+
+# nsec_provision.h
+BEGIN = 0xB0
+DATA = 0xB1
+COMMIT = 0xB2
+STATUS = 0xB3
+MAGIC = 0x4E535031
+MAX_SIZE = 23 * 1024
+
+BUNDLE_SCHEDULE_DAY = 0x01
+BUNDLE_BITMAP = 0x02
+BUNDLE_BITMAP_LOGO = 0
+BUNDLE_STRING = 0x03
+BUNDLE_STRING_BADGE_CLASS = 0
+
+# menu.h and nsec_conf_schedule.c
+MAX_DAYS = 4
+MAX_TALKS = 32
+LOGO_MAX_WIDTH = 128
+LOGO_MAX_HEIGHT = 44
+BADGE_CLASS_MAX = 9
+
+DATA_CHUNK = 240
+REPLY_TIMEOUT = 2
+ATTEMPTS = 5
+
+def text(value):
+    return value.encode('utf-8') + b'\0'
+
+def entry(kind, index, data):
+    return struct.pack('>BBH', kind, index, len(data)) + data
+
+def logo_entry(path):
+    from PIL import Image
+    image = Image.open(path).convert('1')
+    if image.width > LOGO_MAX_WIDTH or image.height > LOGO_MAX_HEIGHT:
+        raise ValueError("%s: the logo is at most %dx%d" % (path, LOGO_MAX_WIDTH, LOGO_MAX_HEIGHT))
+    # Rows padded to a byte, most significant bit first, as gfx_drawBitmap
+    data = struct.pack('BB', image.width, image.height) + image.tobytes()
+    return entry(BUNDLE_BITMAP, BUNDLE_BITMAP_LOGO, data)
+
+def build_bundle(description, base, badge_class=None):
+    bundle = b''
+    badge_class = badge_class if badge_class is not None else description.get('badge_class')
+    if badge_class is not None:
+        if len(badge_class) > BADGE_CLASS_MAX:
+            raise ValueError("the badge class is at most %d characters" % BADGE_CLASS_MAX)
+        bundle += entry(BUNDLE_STRING, BUNDLE_STRING_BADGE_CLASS, text(badge_class))
+    if 'logo' in description:
+        bundle += logo_entry(os.path.join(base, description['logo']))
+    schedule = description.get('schedule', [])
+    if len(schedule) > MAX_DAYS:
+        raise ValueError("the schedule has at most %d days" % MAX_DAYS)
+    for index, day in enumerate(schedule):
+        talks = day.get('talks', [])
+        if not 0 < len(talks) <= MAX_TALKS:
+            raise ValueError("%s: a day has 1 to %d talks" % (day['day'], MAX_TALKS))
+        data = text(day['day'])
+        for talk in talks:
+            data += text(talk['label']) + text(talk.get('presenter', '')) + text(talk.get('description', ''))
+        bundle += entry(BUNDLE_SCHEDULE_DAY, index, data)
+    if not bundle or len(bundle) > MAX_SIZE:
+        raise ValueError("the bundle is %d bytes, 1 to %d fit" % (len(bundle), MAX_SIZE))
+    return bundle
+
+class Badge(object):
+    def __init__(self, name):
+        self.name = name
+        self.port = serial.Serial(name, UART_BITRATE, timeout=0.1)
+        self.port.baudrate = PROVISION_BITRATE
+        # The badge switches once it is done with what came before, and
+        # tells the nRF to drop anything left of an earlier session
+        time.sleep(0.1)
+        self.port.reset_input_buffer()
+        self.pending = b''
+
+    def close(self):
+        self.port.flush()
+        self.port.baudrate = UART_BITRATE
+        self.port.close()
+
+    # The next "provision <state> <offset> <size>" line, None on timeout
+    def reply(self, timeout=REPLY_TIMEOUT, wait=True):
+        deadline = time.time() + timeout
+        while True:
+            if b'\n' in self.pending:
+                line, self.pending = self.pending.split(b'\n', 1)
+                words = line.decode('ascii', 'replace').split()
+                if len(words) == 4 and words[0] == 'provision':
+                    return words[1], int(words[2]), int(words[3])
+                continue
+            if not wait and not self.port.in_waiting:
+                return None
+            if time.time() > deadline:
+                return None
+            self.pending += self.port.read(max(1, self.port.in_waiting))
+
+    def begin(self, bundle):
+        # A refusal left from the last attempt is no answer to this one
+        self.port.reset_input_buffer()
+        self.pending = b''
+        self.port.write(struct.pack('>BIII', BEGIN, MAGIC, len(bundle), zlib.crc32(bundle) & 0xFFFFFFFF))
+        return self.reply()
+
+    # Stops at the first refusal, the nRF ignores what comes after it
+    def send(self, bundle, offset):
+        while offset < len(bundle):
+            chunk = bundle[offset:offset + DATA_CHUNK]
+            self.port.write(struct.pack('>BIB', DATA, offset, len(chunk)) + chunk)
+            offset += len(chunk)
+            refused = self.reply(wait=False)
+            if refused is not None:
+                return refused
+        self.port.write(struct.pack('B', COMMIT))
+        # The CRC32 of the flash and a write, but the data may still be on
+        # its way
+        return self.reply(timeout=REPLY_TIMEOUT + len(bundle) / 10000.0)
+
+def provision(name, bundle, log):
+    start = time.time()
+    try:
+        badge = Badge(name)
+    except serial.SerialException as error:
+        log(name, "cannot open: %s" % error)
+        return False
+    try:
+        sent = 0
+        for attempt in range(ATTEMPTS):
+            reply = badge.begin(bundle)
+            if reply is None:
+                log(name, "no reply to BEGIN")
+                continue
+            state, offset, size = reply
+            if state == 'done':
+                log(name, "already provisioned" if sent == 0 else
+                    "done, %d bytes in %.1f s" % (sent, time.time() - start))
+                return True
+            if state != 'ready':
+                log(name, "BEGIN refused: %s" % state)
+                return False
+            if offset > 0:
+                log(name, "resuming at %d of %d" % (offset, size))
+            sent += len(bundle) - offset
+            reply = badge.send(bundle, offset)
+            if reply is not None and reply[0] == 'done':
+                log(name, "done, %d bytes in %.1f s" % (sent, time.time() - start))
+                return True
+            log(name, "attempt %d: %s" % (attempt + 1, reply[0] if reply else "no reply to COMMIT"))
+        return False
+    except serial.SerialException as error:
+        log(name, "lost: %s" % error)
+        return False
+    finally:
+        try:
+            badge.close()
+        except serial.SerialException:
+            pass
+
+def main():
+    parser = argparse.ArgumentParser(description="Provision badges with a content bundle.")
+    parser.add_argument('bundle', help="JSON description of the bundle")
+    parser.add_argument('ports', nargs='*')
+    parser.add_argument('--badge-class', help="instead of the one of the description")
+    parser.add_argument('--output', help="write the bundle to a file")
+    args = parser.parse_args()
+
+    with open(args.bundle) as f:
+        description = json.load(f)
+    bundle = build_bundle(description, os.path.dirname(os.path.abspath(args.bundle)), args.badge_class)
+    print("bundle: %d bytes, crc32 %08x" % (len(bundle), zlib.crc32(bundle) & 0xFFFFFFFF))
+    if args.output:
+        with open(args.output, 'wb') as f:
+            f.write(bundle)
+
+    lock = threading.Lock()
+    def log(name, message):
+        with lock:
+            print("%s: %s" % (name, message))
+            sys.stdout.flush()
+
+    results = {}
+    def run(name):
+        results[name] = provision(name, bundle, log)
+    threads = [threading.Thread(target=run, args=(name,)) for name in args.ports]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+
+    failed = [name for name in args.ports if not results.get(name)]
+    if args.ports:
+        print("%d of %d badges provisioned" % (len(args.ports) - len(failed), len(args.ports)))
+    if failed:
+        print("failed: %s" % " ".join(failed))
+        sys.exit(1)
+
+if __name__ == '__main__':
+    main()